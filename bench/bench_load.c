@@ -0,0 +1,735 @@
+/**
+ * @file bench_load.c
+ * @brief HTTP load generator for hyper project
+ *
+ * Every thread drives its share of the connections from one epoll
+ * instance, keeping up to the pipelining depth of requests in flight on
+ * each and cycling through the target paths. Latency is measured from
+ * queueing a request to the end of its response and recorded in a
+ * log-linear histogram, so percentiles stay within 1% at any scale.
+ *
+ * In slow mode the connections instead trickle one header byte per
+ * interval and never finish a request, which is how slowloris holds
+ * server slots.
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <errno.h>
+#include <time.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <sys/epoll.h>
+
+#include "client.h"
+
+/** Maximum requests in flight per connection */
+#define LOAD_MAX_DEPTH 64
+/** Maximum number of target paths */
+#define LOAD_MAX_PATHS 32
+/** Longest request */
+#define LOAD_REQUEST_LEN 512
+/** Longest response head */
+#define LOAD_HEAD_LEN 8192
+/** Receive buffer size */
+#define LOAD_RECV_LEN 65536
+/** Sub-buckets per power of two, 2^7 keeps the error under 1% */
+#define HISTOGRAM_SUB_BITS 7
+/** Powers of two covered, microseconds up to about 12 days */
+#define HISTOGRAM_MAGNITUDES 40
+/** Number of histogram buckets */
+#define HISTOGRAM_BUCKETS ((HISTOGRAM_MAGNITUDES + 1) << HISTOGRAM_SUB_BITS)
+
+/**
+ * @brief Load generator options
+ */
+typedef struct {
+  char host[INET_ADDRSTRLEN];          /**< Server address              */
+  int port;                            /**< Server port                 */
+  int connections;                     /**< Connections in total        */
+  int threads;                         /**< Threads driving them        */
+  int duration;                        /**< Seconds to run              */
+  int depth;                           /**< Pipelined requests          */
+  int keep_alive;                      /**< 0 to reconnect per request  */
+  int slow_ms;                         /**< Slow mode byte interval     */
+  const char* paths[LOAD_MAX_PATHS];   /**< Target paths                */
+  int path_count;                      /**< Number of target paths      */
+} load_options_t;
+
+/**
+ * @brief Log-linear latency histogram
+ */
+typedef struct {
+  uint64_t counts[HISTOGRAM_BUCKETS];  /**< Samples per bucket          */
+  uint64_t total;                      /**< Samples in total            */
+  uint64_t max;                        /**< Largest sample              */
+} histogram_t;
+
+/**
+ * @brief Connection driven by the generator
+ */
+typedef struct {
+  client_t* client;                    /**< Socket helpers              */
+  int connected;                       /**< 0 while connect() pends     */
+  char out[LOAD_MAX_DEPTH * LOAD_REQUEST_LEN]; /**< Requests to send    */
+  size_t out_len;                      /**< Bytes queued                */
+  size_t out_sent;                     /**< Bytes sent                  */
+  int64_t sent_at[LOAD_MAX_DEPTH];     /**< Queue time of each request  */
+  int first;                           /**< Oldest request in flight    */
+  int in_flight;                       /**< Requests awaiting responses */
+  char head[LOAD_HEAD_LEN];            /**< Response head so far        */
+  size_t head_len;                     /**< Bytes in head               */
+  int in_body;                         /**< 1 while skipping a body     */
+  uint64_t body_left;                  /**< Body bytes left             */
+  int status;                          /**< Status of current response  */
+  int closing;                         /**< Server closes after it      */
+  int next_path;                       /**< Path of the next request    */
+  int64_t next_trickle;                /**< Slow mode, next byte time   */
+} load_connection_t;
+
+/**
+ * @brief Per-thread state and results
+ */
+typedef struct {
+  const load_options_t* options;       /**< Options                     */
+  pthread_t thread;                    /**< Thread                      */
+  int epoll_fd;                        /**< Epoll instance              */
+  load_connection_t* connections;      /**< Connections of the thread   */
+  int count;                           /**< Number of connections       */
+  histogram_t histogram;               /**< Latencies, us               */
+  uint64_t responses[6];               /**< Responses by status class   */
+  uint64_t bytes;                      /**< Bytes received              */
+  uint64_t errors;                     /**< Failed connections          */
+  uint64_t connects;                   /**< Connections opened          */
+} load_thread_t;
+
+/**
+ * @brief Gets the monotonic time
+ *
+ * @return int64_t Microseconds since an arbitrary point
+ */
+static int64_t now_us(void) {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (int64_t)now.tv_sec * 1000000 + now.tv_nsec / 1000;
+}
+
+/**
+ * @brief Gets the histogram bucket of a value
+ *
+ * Values below 2^SUB_BITS have a bucket each; above that every power of
+ * two is split into 2^SUB_BITS equal buckets.
+ *
+ * @param value Sample
+ * @return int Bucket index
+ */
+static int histogram_bucket(uint64_t value) {
+  if (value < (1u << HISTOGRAM_SUB_BITS)) {
+    return (int)value;
+  }
+
+  int magnitude = 63 - __builtin_clzll(value) - HISTOGRAM_SUB_BITS + 1;
+  if (magnitude > HISTOGRAM_MAGNITUDES) {
+    return HISTOGRAM_BUCKETS - 1;
+  }
+
+  int sub = (int)(value >> (magnitude - 1)) - (1 << HISTOGRAM_SUB_BITS);
+  return (magnitude << HISTOGRAM_SUB_BITS) + sub;
+}
+
+/**
+ * @brief Gets the largest value of a histogram bucket
+ *
+ * @param bucket Bucket index
+ * @return uint64_t Upper bound of the bucket
+ */
+static uint64_t histogram_value(int bucket) {
+  int magnitude = bucket >> HISTOGRAM_SUB_BITS;
+  if (magnitude == 0) {
+    return (uint64_t)bucket;
+  }
+
+  uint64_t sub = (uint64_t)(bucket & ((1 << HISTOGRAM_SUB_BITS) - 1)) + (1u << HISTOGRAM_SUB_BITS);
+  return ((sub + 1) << (magnitude - 1)) - 1;
+}
+
+/**
+ * @brief Records a sample
+ *
+ * @param histogram Histogram struct
+ * @param value Sample
+ */
+static void histogram_record(histogram_t* histogram, uint64_t value) {
+  histogram->counts[histogram_bucket(value)]++;
+  histogram->total++;
+  if (value > histogram->max) {
+    histogram->max = value;
+  }
+}
+
+/**
+ * @brief Gets the value below which a fraction of samples fall
+ *
+ * @param histogram Histogram struct
+ * @param fraction Fraction of samples, 0 to 1
+ * @return uint64_t Percentile value
+ */
+static uint64_t histogram_percentile(const histogram_t* histogram, double fraction) {
+  uint64_t target = (uint64_t)(fraction * (double)histogram->total + 0.5);
+  if (target == 0) {
+    target = 1;
+  }
+
+  uint64_t seen = 0;
+  for (int i = 0; i < HISTOGRAM_BUCKETS; i++) {
+    seen += histogram->counts[i];
+    if (seen >= target) {
+      uint64_t value = histogram_value(i);
+      return value < histogram->max ? value : histogram->max;
+    }
+  }
+
+  return histogram->max;
+}
+
+/**
+ * @brief Queues requests until the pipeline is full
+ *
+ * @param thread Thread struct
+ * @param connection Connection struct
+ */
+static void queue_requests(load_thread_t* thread, load_connection_t* connection) {
+  const load_options_t* options = thread->options;
+  int depth = options->keep_alive ? options->depth : 1;
+
+  // drop what was already sent
+  if (connection->out_sent == connection->out_len) {
+    connection->out_len = 0;
+    connection->out_sent = 0;
+  }
+
+  int64_t now = now_us();
+  while (connection->in_flight < depth && connection->out_len + LOAD_REQUEST_LEN <= sizeof(connection->out)) {
+    const char* path = options->paths[connection->next_path];
+    connection->next_path = (connection->next_path + 1) % options->path_count;
+
+    int written = snprintf(connection->out + connection->out_len, LOAD_REQUEST_LEN,
+                           "GET /%s HTTP/1.1\r\nHost: %s:%d\r\nUser-Agent: hyper-bench\r\n%s\r\n", path,
+                           options->host, options->port, options->keep_alive ? "" : "Connection: close\r\n");
+    if (written <= 0 || written >= LOAD_REQUEST_LEN) {
+      break;
+    }
+    connection->out_len += (size_t)written;
+
+    int slot = (connection->first + connection->in_flight) % LOAD_MAX_DEPTH;
+    connection->sent_at[slot] = now;
+    connection->in_flight++;
+  }
+}
+
+/**
+ * @brief Opens a connection and queues its first requests
+ *
+ * @param thread Thread struct
+ * @param connection Connection struct
+ * @return int 0 if successful, -1 if error
+ */
+static int open_connection(load_thread_t* thread, load_connection_t* connection) {
+  const load_options_t* options = thread->options;
+
+  // start a non-blocking connect
+  int sock = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+  if (sock == -1) {
+    return -1;
+  }
+
+  struct sockaddr_in address = {0};
+  address.sin_family = AF_INET;
+  address.sin_port = htons((uint16_t)options->port);
+  inet_pton(AF_INET, options->host, &address.sin_addr);
+  if (connect(sock, (struct sockaddr*)&address, sizeof(address)) == -1 && errno != EINPROGRESS) {
+    close(sock);
+    return -1;
+  }
+
+  // wrap it in the server's client helpers
+  client_result_t result;
+  client_cleanup_t cleanup;
+  client_t* client = create_client((char*)options->host, sock, &result, &cleanup);
+  if (result != CLIENT_SUCCESS) {
+    close(sock);
+    return -1;
+  }
+
+  struct epoll_event event = {0};
+  event.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+  event.data.ptr = connection;
+  if (epoll_ctl(thread->epoll_fd, EPOLL_CTL_ADD, sock, &event) == -1) {
+    close_client(client);
+    return -1;
+  }
+
+  // reset state
+  connection->client = client;
+  connection->connected = 0;
+  connection->out_len = 0;
+  connection->out_sent = 0;
+  connection->first = 0;
+  connection->in_flight = 0;
+  connection->head_len = 0;
+  connection->in_body = 0;
+  connection->closing = 0;
+  connection->next_trickle = 0;
+  thread->connects++;
+
+  // slow mode starts a request it never finishes
+  if (options->slow_ms > 0) {
+    connection->out_len = (size_t)snprintf(connection->out, sizeof(connection->out),
+                                           "GET / HTTP/1.1\r\nHost: %s:%d\r\n", options->host, options->port);
+    return 0;
+  }
+
+  queue_requests(thread, connection);
+  return 0;
+}
+
+/**
+ * @brief Closes a connection and opens a new one in its place
+ *
+ * @param thread Thread struct
+ * @param connection Connection struct
+ * @param failed 1 if requests were lost
+ */
+static void reopen_connection(load_thread_t* thread, load_connection_t* connection, int failed) {
+  if (failed) {
+    thread->errors++;
+  }
+
+  if (connection->client != NULL) {
+    close_client(connection->client);
+    connection->client = NULL;
+  }
+
+  if (open_connection(thread, connection) == -1) {
+    thread->errors++;
+  }
+}
+
+/**
+ * @brief Finishes the oldest response of a connection
+ *
+ * @param thread Thread struct
+ * @param connection Connection struct
+ * @return int 1 if the connection must be reopened
+ */
+static int complete_response(load_thread_t* thread, load_connection_t* connection) {
+  int64_t now = now_us();
+
+  // latency of the oldest request
+  if (connection->in_flight > 0) {
+    histogram_record(&thread->histogram, (uint64_t)(now - connection->sent_at[connection->first]));
+    connection->first = (connection->first + 1) % LOAD_MAX_DEPTH;
+    connection->in_flight--;
+  }
+
+  int class = connection->status / 100;
+  thread->responses[class >= 1 && class <= 5 ? class : 0]++;
+
+  // a fresh connection per request, or keep the pipeline full
+  if (!thread->options->keep_alive || connection->closing) {
+    return 1;
+  }
+
+  queue_requests(thread, connection);
+  return 0;
+}
+
+/**
+ * @brief Parses the end of a response head
+ *
+ * @param connection Connection struct
+ */
+static void parse_head(load_connection_t* connection) {
+  connection->status = 0;
+  connection->body_left = 0;
+  connection->head[connection->head_len] = '\0';
+
+  // "HTTP/1.1 200 ..."
+  if (connection->head_len > 12) {
+    connection->status = atoi(connection->head + 9);
+  }
+
+  // find Content-Length and Connection case-insensitively
+  for (char* line = strstr(connection->head, "\r\n"); line != NULL; line = strstr(line + 2, "\r\n")) {
+    if (strncasecmp(line + 2, "Content-Length:", 15) == 0) {
+      connection->body_left = strtoull(line + 17, NULL, 10);
+    } else if (strncasecmp(line + 2, "Connection: close", 17) == 0) {
+      connection->closing = 1;
+    }
+  }
+}
+
+/**
+ * @brief Consumes received bytes, completing responses
+ *
+ * @param thread Thread struct
+ * @param connection Connection struct
+ * @param data Received bytes
+ * @param len Number of bytes
+ * @return int 1 if the connection must be reopened, -1 if the stream is broken
+ */
+static int consume(load_thread_t* thread, load_connection_t* connection, const char* data, size_t len) {
+  while (len > 0) {
+    // skip the body
+    if (connection->in_body) {
+      size_t skip = len < connection->body_left ? len : (size_t)connection->body_left;
+      connection->body_left -= skip;
+      data += skip;
+      len -= skip;
+
+      if (connection->body_left == 0) {
+        connection->in_body = 0;
+        if (complete_response(thread, connection)) {
+          return 1;
+        }
+      }
+      continue;
+    }
+
+    // gather the head, searching only what could end it
+    size_t old_len = connection->head_len;
+    size_t copy = len < LOAD_HEAD_LEN - 1 - old_len ? len : LOAD_HEAD_LEN - 1 - old_len;
+    memcpy(connection->head + old_len, data, copy);
+    connection->head_len += copy;
+
+    size_t from = old_len > 3 ? old_len - 3 : 0;
+    char* end = memmem(connection->head + from, connection->head_len - from, "\r\n\r\n", 4);
+    if (end == NULL) {
+      if (connection->head_len == LOAD_HEAD_LEN - 1) {
+        return -1;
+      }
+      return 0;
+    }
+
+    // what follows the head is body or the next response
+    size_t head_end = (size_t)(end - connection->head) + 4;
+    size_t used = head_end - old_len;
+    connection->head_len = head_end;
+    parse_head(connection);
+    connection->head_len = 0;
+    data += used;
+    len -= used;
+
+    if (connection->body_left > 0) {
+      connection->in_body = 1;
+    } else if (complete_response(thread, connection)) {
+      return 1;
+    }
+  }
+
+  return 0;
+}
+
+/**
+ * @brief Sends queued bytes, all of them or one per interval in slow mode
+ *
+ * @param thread Thread struct
+ * @param connection Connection struct
+ * @return int 0 if successful, -1 if error
+ */
+static int flush_connection(load_thread_t* thread, load_connection_t* connection) {
+  client_result_t result;
+
+  // slow mode dribbles a header line one byte at a time
+  if (thread->options->slow_ms > 0) {
+    int64_t now = now_us();
+    if (now < connection->next_trickle) {
+      return 0;
+    }
+    connection->next_trickle = now + (int64_t)thread->options->slow_ms * 1000;
+
+    if (connection->out_sent == connection->out_len) {
+      memcpy(connection->out, "X-Slow: 1\r\n", 11);
+      connection->out_len = 11;
+      connection->out_sent = 0;
+    }
+
+    send_client(connection->client, connection->out + connection->out_sent, 1, &result);
+    if (result == CLIENT_SUCCESS) {
+      connection->out_sent++;
+    }
+    return result == CLIENT_SUCCESS || result == CLIENT_ERR_AGAIN ? 0 : -1;
+  }
+
+  while (connection->out_sent < connection->out_len) {
+    ssize_t sent = send_client(connection->client, connection->out + connection->out_sent,
+                               connection->out_len - connection->out_sent, &result);
+    if (result == CLIENT_ERR_AGAIN) {
+      return 0;
+    }
+    if (result != CLIENT_SUCCESS) {
+      return -1;
+    }
+    connection->out_sent += (size_t)sent;
+  }
+
+  return 0;
+}
+
+/**
+ * @brief Handles readiness of a connection
+ *
+ * @param thread Thread struct
+ * @param connection Connection struct
+ * @param buff Receive buffer
+ */
+static void drive(load_thread_t* thread, load_connection_t* connection, char* buff) {
+  client_result_t result;
+
+  // connect finished, successfully or not
+  if (!connection->connected) {
+    int error = 0;
+    socklen_t error_len = sizeof(error);
+    getsockopt(connection->client->socket, SOL_SOCKET, SO_ERROR, &error, &error_len);
+    if (error != 0) {
+      reopen_connection(thread, connection, 1);
+      return;
+    }
+    connection->connected = 1;
+  }
+
+  // drain the socket, edge triggered
+  while (1) {
+    ssize_t received = recv_client(connection->client, buff, LOAD_RECV_LEN, &result);
+    if (result == CLIENT_ERR_AGAIN) {
+      break;
+    }
+
+    // closed by the server, an error unless nothing was pending
+    if (result != CLIENT_SUCCESS) {
+      reopen_connection(thread, connection, connection->in_flight > 0 || thread->options->slow_ms > 0);
+      return;
+    }
+
+    thread->bytes += (uint64_t)received;
+    int status = consume(thread, connection, buff, (size_t)received);
+    if (status != 0) {
+      reopen_connection(thread, connection, status == -1);
+      return;
+    }
+  }
+
+  if (flush_connection(thread, connection) == -1) {
+    reopen_connection(thread, connection, 1);
+  }
+}
+
+/**
+ * @brief Runs the connections of a thread until the deadline
+ *
+ * @param argp load_thread_t struct
+ * @return void* NULL
+ */
+static void* run_thread(void* argp) {
+  load_thread_t* thread = (load_thread_t*)argp;
+  const load_options_t* options = thread->options;
+  struct epoll_event events[256];
+  static __thread char buff[LOAD_RECV_LEN];
+
+  // open every connection
+  for (int i = 0; i < thread->count; i++) {
+    thread->connections[i].client = NULL;
+    thread->connections[i].next_path = i % options->path_count;
+    if (open_connection(thread, &thread->connections[i]) == -1) {
+      thread->errors++;
+    }
+  }
+
+  int64_t deadline = now_us() + (int64_t)options->duration * 1000000;
+  while (1) {
+    int64_t now = now_us();
+    if (now >= deadline) {
+      break;
+    }
+
+    // slow mode wakes up for every trickle
+    int timeout = (int)((deadline - now) / 1000) + 1;
+    if (options->slow_ms > 0 && timeout > options->slow_ms) {
+      timeout = options->slow_ms;
+    }
+
+    int ready = epoll_wait(thread->epoll_fd, events, 256, timeout);
+    for (int i = 0; i < ready; i++) {
+      drive(thread, (load_connection_t*)events[i].data.ptr, buff);
+    }
+
+    if (options->slow_ms > 0) {
+      for (int i = 0; i < thread->count; i++) {
+        load_connection_t* connection = &thread->connections[i];
+        if (connection->client != NULL && connection->connected && flush_connection(thread, connection) == -1) {
+          reopen_connection(thread, connection, 1);
+        }
+      }
+    }
+  }
+
+  // close every connection
+  for (int i = 0; i < thread->count; i++) {
+    if (thread->connections[i].client != NULL) {
+      close_client(thread->connections[i].client);
+    }
+  }
+
+  return NULL;
+}
+
+/**
+ * @brief Prints the command line usage
+ *
+ * @param program Name of the program
+ */
+static void usage(const char* program) {
+  fprintf(stderr,
+          "Usage: %s [-c connections] [-t threads] [-d seconds] [-p depth] [-k on|off] [-s slow_ms] "
+          "<host> <port> [path...]\n",
+          program);
+}
+
+/**
+ * @brief Parses the command line
+ *
+ * @param argc Number of arguments
+ * @param argv Arguments
+ * @param options Options to fill
+ * @return int 0 if successful, -1 if error
+ */
+static int parse_options(int argc, char* argv[], load_options_t* options) {
+  memset(options, 0, sizeof(load_options_t));
+  options->connections = 64;
+  options->threads = (int)sysconf(_SC_NPROCESSORS_ONLN);
+  options->duration = 5;
+  options->depth = 1;
+  options->keep_alive = 1;
+
+  int opt;
+  while ((opt = getopt(argc, argv, "c:t:d:p:k:s:")) != -1) {
+    switch (opt) {
+      case 'c': options->connections = atoi(optarg); break;
+      case 't': options->threads = atoi(optarg); break;
+      case 'd': options->duration = atoi(optarg); break;
+      case 'p': options->depth = atoi(optarg); break;
+      case 'k': options->keep_alive = strcmp(optarg, "off") != 0; break;
+      case 's': options->slow_ms = atoi(optarg); break;
+      default: return -1;
+    }
+  }
+
+  if (argc - optind < 2 || options->connections <= 0 || options->threads <= 0 || options->duration <= 0 ||
+      options->depth <= 0 || options->depth > LOAD_MAX_DEPTH || options->slow_ms < 0 ||
+      strlen(argv[optind]) >= INET_ADDRSTRLEN) {
+    return -1;
+  }
+
+  strcpy(options->host, argv[optind]);
+  options->port = atoi(argv[optind + 1]);
+
+  // paths are relative to the docroot, "" requests index.html
+  for (int i = optind + 2; i < argc && options->path_count < LOAD_MAX_PATHS; i++) {
+    options->paths[options->path_count++] = argv[i][0] == '/' ? argv[i] + 1 : argv[i];
+  }
+  if (options->path_count == 0) {
+    options->paths[options->path_count++] = "";
+  }
+
+  if (options->threads > options->connections) {
+    options->threads = options->connections;
+  }
+  return 0;
+}
+
+/**
+ * @brief Main function
+ *
+ * @param argc Number of arguments
+ * @param argv Arguments
+ * @return int 0 if successful, 1 if error
+ */
+int main(int argc, char* argv[]) {
+  load_options_t options;
+  if (parse_options(argc, argv, &options) == -1) {
+    usage(argv[0]);
+    return 1;
+  }
+
+  // split connections across threads
+  load_thread_t* threads = calloc((size_t)options.threads, sizeof(load_thread_t));
+  if (threads == NULL) {
+    return 1;
+  }
+
+  int64_t start = now_us();
+  for (int i = 0; i < options.threads; i++) {
+    load_thread_t* thread = &threads[i];
+    thread->options = &options;
+    thread->count = options.connections / options.threads + (i < options.connections % options.threads);
+    thread->connections = calloc((size_t)thread->count, sizeof(load_connection_t));
+    thread->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (thread->connections == NULL || thread->epoll_fd == -1 ||
+        pthread_create(&thread->thread, NULL, run_thread, thread) != 0) {
+      fprintf(stderr, "Could not start thread %d\n", i);
+      return 1;
+    }
+  }
+
+  // merge results
+  histogram_t* histogram = calloc(1, sizeof(histogram_t));
+  uint64_t responses[6] = {0};
+  uint64_t bytes = 0, errors = 0, connects = 0;
+  for (int i = 0; i < options.threads; i++) {
+    load_thread_t* thread = &threads[i];
+    pthread_join(thread->thread, NULL);
+
+    for (int b = 0; b < HISTOGRAM_BUCKETS; b++) {
+      histogram->counts[b] += thread->histogram.counts[b];
+    }
+    histogram->total += thread->histogram.total;
+    if (thread->histogram.max > histogram->max) {
+      histogram->max = thread->histogram.max;
+    }
+    for (int c = 0; c < 6; c++) {
+      responses[c] += thread->responses[c];
+    }
+    bytes += thread->bytes;
+    errors += thread->errors;
+    connects += thread->connects;
+
+    close(thread->epoll_fd);
+    free(thread->connections);
+  }
+  double elapsed = (double)(now_us() - start) / 1e6;
+
+  // report
+  printf("%d connections, %d threads, depth %d, keep-alive %s%s, %.1fs\n", options.connections, options.threads,
+         options.depth, options.keep_alive ? "on" : "off", options.slow_ms > 0 ? ", slow" : "", elapsed);
+  printf("  requests     %llu (%.0f req/s, %.2f MB/s)\n", (unsigned long long)histogram->total,
+         (double)histogram->total / elapsed, (double)bytes / elapsed / 1e6);
+  printf("  status       2xx %llu  3xx %llu  4xx %llu  5xx %llu  other %llu\n", (unsigned long long)responses[2],
+         (unsigned long long)responses[3], (unsigned long long)responses[4], (unsigned long long)responses[5],
+         (unsigned long long)(responses[0] + responses[1]));
+  printf("  connections  %llu opened, %llu errors\n", (unsigned long long)connects, (unsigned long long)errors);
+  if (histogram->total > 0) {
+    printf("  latency us   p50 %llu  p90 %llu  p99 %llu  p99.9 %llu  max %llu\n",
+           (unsigned long long)histogram_percentile(histogram, 0.50),
+           (unsigned long long)histogram_percentile(histogram, 0.90),
+           (unsigned long long)histogram_percentile(histogram, 0.99),
+           (unsigned long long)histogram_percentile(histogram, 0.999), (unsigned long long)histogram->max);
+  }
+
+  free(histogram);
+  free(threads);
+  return 0;
+}
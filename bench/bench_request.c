@@ -0,0 +1,106 @@
+/**
+ * @file bench_request.c
+ * @brief Microbenchmark of the request parser
+ *
+ * Parses a browser-like request head repeatedly, once as a single buffer
+ * and once fed in small chunks, and reports requests parsed per second.
+ */
+
+#include <stdio.h>
+#include <time.h>
+
+#include "request.h"
+
+/** Number of requests parsed per run */
+#define BENCH_ITERATIONS 2000000
+/** Chunk size of the trickled run */
+#define BENCH_CHUNK 64
+
+/** Request head modelled on a desktop browser */
+static const char bench_request[] =
+  "GET /assets/app.min.js?v=20240101 HTTP/1.1\r\n"
+  "Host: www.example.com\r\n"
+  "Connection: keep-alive\r\n"
+  "User-Agent: Mozilla/5.0 (X11; Linux x86_64) AppleWebKit/537.36 (KHTML, like Gecko) Chrome/120.0 Safari/537.36\r\n"
+  "Accept: text/html,application/xhtml+xml,application/xml;q=0.9,image/avif,image/webp,*/*;q=0.8\r\n"
+  "Accept-Encoding: gzip, deflate, br\r\n"
+  "Accept-Language: en-US,en;q=0.9\r\n"
+  "Cache-Control: max-age=0\r\n"
+  "Referer: https://www.example.com/\r\n"
+  "Sec-Fetch-Dest: script\r\n"
+  "Sec-Fetch-Mode: no-cors\r\n"
+  "Sec-Fetch-Site: same-origin\r\n"
+  "Cookie: session=0123456789abcdef0123456789abcdef; theme=dark; consent=1\r\n"
+  "\r\n";
+
+/**
+ * @brief Gets the monotonic time
+ *
+ * @return double Seconds since an arbitrary point
+ */
+static double now_seconds(void) {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (double)now.tv_sec + (double)now.tv_nsec / 1e9;
+}
+
+/**
+ * @brief Parses the request repeatedly
+ *
+ * @param chunk Bytes made visible per call, 0 for the whole request
+ * @return double Requests parsed per second
+ */
+static double run(size_t chunk) {
+  size_t len = sizeof(bench_request) - 1;
+  request_parser_t parser;
+  request_t request;
+  request_result_t result;
+  size_t checksum = 0;
+
+  double start = now_seconds();
+  for (int i = 0; i < BENCH_ITERATIONS; i++) {
+    init_request_parser(&parser);
+
+    if (chunk == 0) {
+      parse_request(&parser, &request, bench_request, len, &result);
+    } else {
+      for (size_t visible = chunk; ; visible += chunk) {
+        parse_request(&parser, &request, bench_request, visible < len ? visible : len, &result);
+        if (result != REQUEST_INCOMPLETE || visible >= len) {
+          break;
+        }
+      }
+    }
+
+    if (result != REQUEST_SUCCESS) {
+      fprintf(stderr, "bench_request: parse failed (%d)\n", result);
+      exit(1);
+    }
+    checksum += request.header_count;
+  }
+  double elapsed = now_seconds() - start;
+
+  // keep the loop from being optimized away
+  if (checksum == 0) {
+    exit(1);
+  }
+
+  return BENCH_ITERATIONS / elapsed;
+}
+
+/**
+ * @brief Main function
+ *
+ * @return int 0 if successful
+ */
+int main(void) {
+  size_t len = sizeof(bench_request) - 1;
+
+  double whole = run(0);
+  printf("whole buffer   : %10.0f req/s  %7.1f MB/s\n", whole, whole * len / 1e6);
+
+  double chunked = run(BENCH_CHUNK);
+  printf("%3d byte chunks: %10.0f req/s  %7.1f MB/s\n", BENCH_CHUNK, chunked, chunked * len / 1e6);
+
+  return 0;
+}
@@ -0,0 +1,182 @@
+/**
+ * @file bench_scan.c
+ * @brief Benchmark of the scalar and SIMD header scanners
+ *
+ * Parses request heads of roughly 200 B, 1 KB and 8 KB with every scanner
+ * the CPU supports, after checking that all of them agree.
+ */
+
+#include <stdio.h>
+#include <time.h>
+
+#include "request.h"
+#include "scan.h"
+
+/** Bytes parsed per measurement */
+#define BENCH_BYTES (512UL * 1024 * 1024)
+/** Largest request head built */
+#define BENCH_MAX_HEAD 8192
+
+/**
+ * @brief Gets the monotonic time
+ *
+ * @return double Seconds since an arbitrary point
+ */
+static double now_seconds(void) {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (double)now.tv_sec + (double)now.tv_nsec / 1e9;
+}
+
+/**
+ * @brief Builds a request head close to a target size
+ *
+ * Starts like a curl request, adds browser headers and pads with a
+ * cookie the way large real-world heads usually grow.
+ *
+ * @param buff Buffer to fill
+ * @param target Wanted size in bytes
+ * @return size_t Size of the head
+ */
+static size_t build_head(char* buff, size_t target) {
+  static const char* browser_headers[] = {
+    "User-Agent: Mozilla/5.0 (X11; Linux x86_64) AppleWebKit/537.36 (KHTML, like Gecko) Chrome/120.0 Safari/537.36\r\n",
+    "Accept: text/html,application/xhtml+xml,application/xml;q=0.9,image/avif,image/webp,*/*;q=0.8\r\n",
+    "Accept-Encoding: gzip, deflate, br\r\n",
+    "Accept-Language: en-US,en;q=0.9\r\n",
+    "Cache-Control: max-age=0\r\n",
+    "Referer: https://www.example.com/products/category/index.html\r\n",
+    "Sec-Fetch-Dest: document\r\n",
+    "Sec-Fetch-Mode: navigate\r\n",
+    "Sec-Fetch-Site: same-origin\r\n",
+    "Upgrade-Insecure-Requests: 1\r\n",
+  };
+  size_t len = 0;
+
+  len += (size_t)snprintf(buff, BENCH_MAX_HEAD, "GET /index.html HTTP/1.1\r\nHost: www.example.com\r\nConnection: keep-alive\r\n");
+
+  // browser headers while they fit
+  for (size_t i = 0; i < sizeof(browser_headers) / sizeof(browser_headers[0]); i++) {
+    size_t header_len = strlen(browser_headers[i]);
+    if (len + header_len + 2 > target) {
+      break;
+    }
+    memcpy(buff + len, browser_headers[i], header_len);
+    len += header_len;
+  }
+
+  // pad with a cookie
+  if (len + 16 < target) {
+    len += (size_t)snprintf(buff + len, BENCH_MAX_HEAD - len, "Cookie: ");
+    for (size_t i = 0; len + 4 < target; i++) {
+      buff[len++] = "abcdefghij0123456789=;_-"[i % 24];
+    }
+    buff[len++] = '\r';
+    buff[len++] = '\n';
+  }
+
+  buff[len++] = '\r';
+  buff[len++] = '\n';
+  return len;
+}
+
+/**
+ * @brief Checks every kernel agrees with the scalar one on a buffer
+ *
+ * @param buff Bytes to scan
+ * @param len Number of bytes
+ * @return int 0 if they agree, -1 otherwise
+ */
+static int check_kernels(const char* buff, size_t len) {
+  for (size_t offset = 0; offset < len; offset++) {
+    set_scan_impl(SCAN_IMPL_SCALAR);
+    size_t token = scan_token(buff + offset, len - offset);
+    size_t target = scan_target(buff + offset, len - offset);
+    size_t value = scan_value(buff + offset, len - offset);
+
+    for (scan_impl_t impl = SCAN_IMPL_SSE42; impl <= SCAN_IMPL_AVX2; impl++) {
+      if (set_scan_impl(impl) == -1) {
+        continue;
+      }
+      if (scan_token(buff + offset, len - offset) != token || scan_target(buff + offset, len - offset) != target ||
+          scan_value(buff + offset, len - offset) != value) {
+        fprintf(stderr, "bench_scan: %s disagrees at offset %zu\n", scan_impl_name(), offset);
+        return -1;
+      }
+    }
+  }
+
+  return 0;
+}
+
+/**
+ * @brief Parses a head repeatedly with the active kernel
+ *
+ * @param head Request head
+ * @param len Length of the head
+ * @return double Requests parsed per second
+ */
+static double run(const char* head, size_t len) {
+  size_t iterations = BENCH_BYTES / len;
+  request_parser_t parser;
+  request_t request;
+  request_result_t result;
+  size_t checksum = 0;
+
+  double start = now_seconds();
+  for (size_t i = 0; i < iterations; i++) {
+    init_request_parser(&parser);
+    parse_request(&parser, &request, head, len, &result);
+    if (result != REQUEST_SUCCESS) {
+      fprintf(stderr, "bench_scan: parse failed (%d)\n", result);
+      exit(1);
+    }
+    checksum += request.header_count;
+  }
+  double elapsed = now_seconds() - start;
+
+  // keep the loop from being optimized away
+  if (checksum == 0) {
+    exit(1);
+  }
+
+  return (double)iterations / elapsed;
+}
+
+/**
+ * @brief Main function
+ *
+ * @return int 0 if successful, 1 if the kernels disagree
+ */
+int main(void) {
+  static const size_t sizes[] = {200, 1024, 8000};
+  static const scan_impl_t impls[] = {SCAN_IMPL_SCALAR, SCAN_IMPL_SSE42, SCAN_IMPL_AVX2};
+  static char head[BENCH_MAX_HEAD];
+
+  // every byte value, to exercise all class boundaries
+  char all_bytes[512];
+  for (int i = 0; i < 512; i++) {
+    all_bytes[i] = (char)(i * 37 + i / 256);
+  }
+  if (check_kernels(all_bytes, sizeof(all_bytes)) == -1) {
+    return 1;
+  }
+
+  for (size_t s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++) {
+    size_t len = build_head(head, sizes[s]);
+    if (check_kernels(head, len) == -1) {
+      return 1;
+    }
+
+    for (size_t i = 0; i < sizeof(impls) / sizeof(impls[0]); i++) {
+      if (set_scan_impl(impls[i]) == -1) {
+        continue;
+      }
+
+      double rate = run(head, len);
+      printf("%5zu B  %-7s %10.0f req/s  %8.1f MB/s\n", len, scan_impl_name(), rate, rate * (double)len / 1e6);
+    }
+  }
+
+  return 0;
+}
@@ -0,0 +1,50 @@
+#!/bin/sh
+#
+# Runs the load generator against a fresh hyper in a scratch docroot.
+#
+# Usage: bench/scenarios.sh [seconds]
+#
+# HYPER_PORT, HYPER_ARGS and LOAD_ARGS override the port, extra server
+# options and extra load generator options.
+
+set -e
+
+ROOT=$(cd "$(dirname "$0")/.." && pwd)
+DURATION=${1:-5}
+PORT=${HYPER_PORT:-18080}
+DOCROOT=$(mktemp -d)
+
+# small page and a 1 MB file
+head -c 1024 /dev/urandom | base64 > "$DOCROOT/small.html"
+head -c 1048576 /dev/urandom > "$DOCROOT/large.bin"
+
+# start the server from the docroot
+cd "$DOCROOT"
+"$ROOT/bin/hyper" -l error $HYPER_ARGS 127.0.0.1 "$PORT" > "$DOCROOT/hyper.log" 2>&1 &
+SERVER=$!
+trap 'kill $SERVER 2>/dev/null; rm -rf "$DOCROOT"' EXIT INT TERM
+sleep 0.5
+
+LOAD="$ROOT/bin/bench_load -d $DURATION $LOAD_ARGS"
+
+echo "== small file, keep-alive"
+$LOAD -c 64 127.0.0.1 "$PORT" small.html
+
+echo "== small file, pipelined x16"
+$LOAD -c 64 -p 16 127.0.0.1 "$PORT" small.html
+
+echo "== small file, connection per request"
+$LOAD -c 16 -k off 127.0.0.1 "$PORT" small.html
+
+echo "== 1 MB file"
+$LOAD -c 16 127.0.0.1 "$PORT" large.bin
+
+echo "== 404 storm"
+$LOAD -c 64 127.0.0.1 "$PORT" missing-1.html missing-2.html missing-3.html
+
+echo "== slowloris, small file latency with 256 slow connections held open"
+$LOAD -c 256 -t 1 -s 1000 127.0.0.1 "$PORT" > /dev/null &
+SLOW=$!
+sleep 1
+$LOAD -c 16 127.0.0.1 "$PORT" small.html
+wait $SLOW
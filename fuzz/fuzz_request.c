@@ -0,0 +1,259 @@
+/**
+ * @file fuzz_request.c
+ * @brief Fuzz target for the incremental request parser
+ *
+ * Parses each input in one call and again split into chunks whose size
+ * comes from the input, then checks both runs agree, every slice stays
+ * inside the buffer and the SIMD scanners match the scalar one. The body
+ * after a parsed head is decoded both ways too, and has to come out the
+ * same. Builds as
+ * a libFuzzer target, or as a standalone driver with HYPER_FUZZ_STANDALONE
+ * that replays files or random inputs.
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <assert.h>
+
+#include "request.h"
+#include "body.h"
+#include "scan.h"
+
+/** Largest input worth parsing, matches the connection buffer */
+#define FUZZ_MAX_INPUT 8192
+
+/**
+ * @brief Checks a slice lies inside the buffer
+ *
+ * @param slice Slice to check
+ * @param buff Buffer parsed
+ * @param buff_len Length of the buffer
+ */
+static void check_slice(slice_t slice, const char* buff, size_t buff_len) {
+  assert(slice.ptr >= buff);
+  assert(slice.ptr + slice.len <= buff + buff_len);
+}
+
+/**
+ * @brief Checks two slices point at the same offsets
+ *
+ * @param a Slice from the first run
+ * @param a_buff Buffer of the first run
+ * @param b Slice from the second run
+ * @param b_buff Buffer of the second run
+ */
+static void check_same(slice_t a, const char* a_buff, slice_t b, const char* b_buff) {
+  assert(a.ptr - a_buff == b.ptr - b_buff);
+  assert(a.len == b.len);
+}
+
+/**
+ * @brief Checks every scanner kernel agrees with the scalar one
+ *
+ * @param buff Bytes to scan
+ * @param len Number of bytes
+ */
+static void check_kernels(const char* buff, size_t len) {
+  set_scan_impl(SCAN_IMPL_SCALAR);
+  size_t token = scan_token(buff, len);
+  size_t target = scan_target(buff, len);
+  size_t value = scan_value(buff, len);
+
+  for (scan_impl_t impl = SCAN_IMPL_SSE42; impl <= SCAN_IMPL_AVX2; impl++) {
+    if (set_scan_impl(impl) == 0) {
+      assert(scan_token(buff, len) == token);
+      assert(scan_target(buff, len) == target);
+      assert(scan_value(buff, len) == value);
+    }
+  }
+
+  set_scan_impl(SCAN_IMPL_AUTO);
+}
+
+/**
+ * @brief Checks a body decodes the same whole and in pieces
+ *
+ * @param request Parsed request
+ * @param whole Bytes after the head, decoded in place
+ * @param split Copy of them, decoded chunk by chunk
+ * @param len Number of bytes
+ * @param chunk Bytes added per call
+ */
+static void check_body(const request_t* request, char* whole, char* split, size_t len, size_t chunk) {
+  body_reader_t whole_reader;
+  body_result_t whole_result;
+  size_t whole_decoded;
+  init_body_reader(&whole_reader, request, 4096);
+  size_t whole_consumed = decode_body(&whole_reader, whole, len, &whole_decoded, &whole_result);
+  assert(whole_consumed <= len);
+  assert(whole_decoded <= whole_consumed);
+
+  // pieces are decoded where they arrived and gathered at the front
+  body_reader_t split_reader;
+  body_result_t split_result = BODY_SUCCESS;
+  size_t split_decoded = 0;
+  size_t split_consumed = 0;
+  init_body_reader(&split_reader, request, 4096);
+  while (split_consumed < len && !split_reader.done && split_result == BODY_SUCCESS) {
+    size_t piece = len - split_consumed < chunk ? len - split_consumed : chunk;
+    size_t decoded;
+    size_t consumed = decode_body(&split_reader, split + split_consumed, piece, &decoded, &split_result);
+    memmove(split + split_decoded, split + split_consumed, decoded);
+    split_decoded += decoded;
+    split_consumed += consumed;
+  }
+
+  assert(whole_result == split_result);
+  assert(whole_reader.done == split_reader.done);
+  if (whole_result != BODY_SUCCESS) {
+    return;
+  }
+  assert(whole_consumed == split_consumed);
+  assert(whole_decoded == split_decoded);
+  assert(whole_reader.received == whole_decoded);
+  assert(memcmp(whole, split, whole_decoded) == 0);
+}
+
+/**
+ * @brief Runs one input through the parser
+ *
+ * @param data Input bytes
+ * @param size Number of bytes
+ * @return int Always 0
+ */
+int LLVMFuzzerTestOneInput(const uint8_t* data, size_t size) {
+  static char whole[FUZZ_MAX_INPUT];
+  static char split[FUZZ_MAX_INPUT];
+
+  if (size == 0 || size > FUZZ_MAX_INPUT) {
+    return 0;
+  }
+
+  // chunk size is taken from the first byte
+  size_t chunk = (size_t)(data[0] % 32) + 1;
+  memcpy(whole, data, size);
+  memcpy(split, data, size);
+
+  // the vector kernels match the table on arbitrary bytes
+  check_kernels(whole, size);
+  check_kernels(whole + size / 2, size - size / 2);
+
+  // parse in one call
+  request_parser_t whole_parser;
+  request_t whole_request;
+  request_result_t whole_result;
+  init_request_parser(&whole_parser);
+  parse_request(&whole_parser, &whole_request, whole, size, &whole_result);
+
+  // parse as the bytes trickle in
+  request_parser_t split_parser;
+  request_t split_request;
+  request_result_t split_result = REQUEST_INCOMPLETE;
+  init_request_parser(&split_parser);
+  for (size_t len = chunk < size ? chunk : size; ; len = len + chunk < size ? len + chunk : size) {
+    parse_request(&split_parser, &split_request, split, len, &split_result);
+    if (split_result != REQUEST_INCOMPLETE || len == size) {
+      break;
+    }
+  }
+
+  // both runs agree
+  assert(whole_result == split_result);
+  if (whole_result != REQUEST_SUCCESS) {
+    return 0;
+  }
+
+  assert(whole_request.length == split_request.length);
+  assert(whole_request.length <= size);
+  assert(whole_request.header_count == split_request.header_count);
+  assert(whole_request.header_count <= REQUEST_MAX_HEADERS);
+
+  check_slice(whole_request.method, whole, size);
+  check_slice(whole_request.target, whole, size);
+  check_slice(whole_request.path, whole, size);
+  check_slice(whole_request.version, whole, size);
+  check_same(whole_request.method, whole, split_request.method, split);
+  check_same(whole_request.target, whole, split_request.target, split);
+  check_same(whole_request.version, whole, split_request.version, split);
+
+  for (size_t i = 0; i < whole_request.header_count; i++) {
+    check_slice(whole_request.headers[i].name, whole, size);
+    check_slice(whole_request.headers[i].value, whole, size);
+    check_same(whole_request.headers[i].name, whole, split_request.headers[i].name, split);
+    check_same(whole_request.headers[i].value, whole, split_request.headers[i].value, split);
+  }
+
+  // a valid path always fits a file name
+  char file_name[FILE_NAME_LEN];
+  request_file_name(&whole_request, file_name);
+  assert(strlen(file_name) < FILE_NAME_LEN);
+
+  // the rest is body, or the next request
+  assert(!whole_request.chunked || whole_request.content_length == 0);
+  check_body(&whole_request, whole + whole_request.length, split + split_request.length,
+             size - whole_request.length, chunk);
+
+  return 0;
+}
+
+#ifdef HYPER_FUZZ_STANDALONE
+
+/** Seeds mutated by the standalone driver */
+static const char* seeds[] = {
+  "GET / HTTP/1.1\r\nHost: localhost\r\n\r\n",
+  "GET /index.html?q=1 HTTP/1.1\r\nHost: a\r\nConnection: keep-alive, Upgrade\r\nAccept: */*\r\n\r\n",
+  "\r\nGET /a/b/../c HTTP/1.1\r\nX:  \t v \t\r\n\r\nGET / HTTP/1.1\r\n\r\n",
+  "POST / HTTP/1.0\r\nContent-Length: 3\r\n\r\nabc",
+  "POST /up HTTP/1.1\r\nContent-Length: 3\r\n\r\nabcGET / HTTP/1.1\r\n\r\n",
+  "PUT /up HTTP/1.1\r\nTransfer-Encoding: chunked\r\n\r\n5;x=y\r\nhello\r\nA\r\n0123456789\r\n0\r\nT: v\r\n\r\n",
+};
+
+/**
+ * @brief Replays files, or mutates the seeds when none are given
+ *
+ * @param argc Number of arguments
+ * @param argv Files to replay
+ * @return int 0 if every input passed
+ */
+int main(int argc, char* argv[]) {
+  static uint8_t input[FUZZ_MAX_INPUT];
+
+  // replay files
+  if (argc > 1) {
+    for (int i = 1; i < argc; i++) {
+      FILE* file = fopen(argv[i], "rb");
+      if (file == NULL) {
+        perror(argv[i]);
+        return 1;
+      }
+      size_t size = fread(input, 1, sizeof(input), file);
+      fclose(file);
+      LLVMFuzzerTestOneInput(input, size);
+    }
+    return 0;
+  }
+
+  // mutate seeds
+  srand(1);
+  size_t seed_count = sizeof(seeds) / sizeof(seeds[0]);
+  for (int iteration = 0; iteration < 1000000; iteration++) {
+    const char* seed = seeds[iteration % seed_count];
+    size_t size = strlen(seed);
+    memcpy(input, seed, size);
+
+    int mutations = rand() % 4;
+    for (int m = 0; m < mutations; m++) {
+      input[rand() % size] = (uint8_t)rand();
+    }
+    if (rand() % 4 == 0) {
+      size = (size_t)(rand() % (int)size) + 1;
+    }
+
+    LLVMFuzzerTestOneInput(input, size);
+  }
+
+  printf("fuzz_request: 1000000 inputs passed\n");
+  return 0;
+}
+
+#endif
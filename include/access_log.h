@@ -0,0 +1,157 @@
+/**
+ * @file access_log.h
+ * @brief Structured access log for hyper project
+ *
+ * Every worker formats entries into its own buffer and appends the buffer
+ * to the shared log file in one write. The file is rotated by size and by
+ * age; whichever worker notices first renames it and swaps in a new one
+ * while the others keep appending.
+ */
+
+#ifndef HYPER_ACCESS_LOG_H
+#define HYPER_ACCESS_LOG_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <pthread.h>
+
+#include "request.h"
+
+/** Size of the per-worker entry buffer */
+#define ACCESS_LOG_BUFFER_LEN 65536
+/** Longest formatted entry */
+#define ACCESS_LOG_ENTRY_LEN 4096
+/** Milliseconds an entry may wait in a buffer */
+#define ACCESS_LOG_FLUSH_MS 1000
+/** Bytes kept of the request line */
+#define ACCESS_LOG_LINE_LEN 512
+/** Bytes kept of the Referer and User-Agent headers */
+#define ACCESS_LOG_FIELD_LEN 256
+
+/**
+ * @brief Access log formats
+ */
+typedef enum {
+  ACCESS_LOG_COMMON   = 0,             /**< Common Log Format           */
+  ACCESS_LOG_COMBINED = 1,             /**< CLF, Referer and User-Agent */
+  ACCESS_LOG_JSON     = 2              /**< One JSON object per line    */
+} access_log_format_t;
+
+/**
+ * @brief Access log shared by every worker
+ */
+typedef struct {
+  char path[256];                      /**< File, "-" for stdout        */
+  access_log_format_t format;          /**< Entry format                */
+  int fd;                              /**< Current file                */
+  int retired_fd;                      /**< File replaced by rotation   */
+  uint64_t size;                       /**< Bytes in the current file   */
+  uint64_t max_size;                   /**< Rotate above, 0 disables    */
+  int64_t interval;                    /**< Rotate every, s, 0 disables */
+  int64_t next_rotation;               /**< Wall clock of next rotation */
+  pthread_mutex_t rotate_lock;         /**< Held while rotating         */
+} access_log_t;
+
+/**
+ * @brief Per-worker entry buffer
+ */
+typedef struct {
+  char data[ACCESS_LOG_BUFFER_LEN];    /**< Formatted entries           */
+  size_t len;                          /**< Bytes in data               */
+  int64_t last_flush;                  /**< Monotonic ms of last write  */
+  int64_t cached_second;               /**< Second of cached_time       */
+  char cached_time[40];                /**< Formatted timestamp         */
+} access_log_buffer_t;
+
+/**
+ * @brief Request details kept until its response is sent
+ *
+ * The request slices point into the connection buffer, which is reused
+ * before the response finishes, so the logged fields are copied.
+ */
+typedef struct {
+  int64_t start;                       /**< Monotonic us at parse       */
+  int64_t time;                        /**< Wall clock s at parse       */
+  char line[ACCESS_LOG_LINE_LEN];      /**< Request line                */
+  char referer[ACCESS_LOG_FIELD_LEN];  /**< Referer header              */
+  char user_agent[ACCESS_LOG_FIELD_LEN]; /**< User-Agent header         */
+} access_entry_t;
+
+/**
+ * @brief Result of access log operations
+ */
+typedef enum {
+  ACCESS_LOG_SUCCESS     =  0,
+  ACCESS_LOG_ERR_MALLOC  = -1,
+  ACCESS_LOG_ERR_OPEN    = -2,
+  ACCESS_LOG_ERR_PATH    = -3
+} access_log_result_t;
+
+/**
+ * @brief Opens an access log
+ *
+ * @param path File to append to, "-" for stdout
+ * @param format Entry format
+ * @param max_size Bytes after which the file is rotated, 0 disables
+ * @param interval Seconds after which the file is rotated, 0 disables
+ * @param result Result of the operation
+ * @return access_log_t* Pointer to new access log or NULL if error
+ */
+access_log_t* create_access_log(const char* path, access_log_format_t format, uint64_t max_size, int64_t interval,
+                                access_log_result_t* result);
+
+/**
+ * @brief Initializes a per-worker entry buffer
+ *
+ * @param buffer Buffer struct
+ */
+void init_access_log_buffer(access_log_buffer_t* buffer);
+
+/**
+ * @brief Copies the logged fields of a request
+ *
+ * @param entry Entry struct
+ * @param request Parsed request
+ */
+void begin_access_entry(access_entry_t* entry, const request_t* request);
+
+/**
+ * @brief Starts an entry for a request that could not be parsed
+ *
+ * @param entry Entry struct
+ */
+void begin_rejected_entry(access_entry_t* entry);
+
+/**
+ * @brief Formats an entry into the buffer, flushing it when full
+ *
+ * The bytes are those of the body alone, as %b counts them. A response
+ * cut short keeps the status it was sent with, only the bytes show that
+ * less of the body went out than announced.
+ *
+ * @param log Access log
+ * @param buffer Buffer of the calling worker
+ * @param entry Request details
+ * @param host Address of the client
+ * @param status Status code, 0 if no response was sent
+ * @param bytes Body bytes sent
+ */
+void log_access(access_log_t* log, access_log_buffer_t* buffer, const access_entry_t* entry, const char* host,
+                int status, size_t bytes);
+
+/**
+ * @brief Appends the buffer to the log and rotates the log if due
+ *
+ * @param log Access log
+ * @param buffer Buffer of the calling worker
+ */
+void flush_access_log(access_log_t* log, access_log_buffer_t* buffer);
+
+/**
+ * @brief Closes the access log
+ *
+ * @param log Access log
+ */
+void close_access_log(access_log_t* log);
+
+#endif
@@ -0,0 +1,103 @@
+/**
+ * @file admission.h
+ * @brief Connection admission control for hyper project
+ *
+ * Counts open connections in total and per client address. A connection
+ * over the per-address cap is refused whatever the overflow policy, so one
+ * client cannot hold every connection slot. The table only holds addresses
+ * with open connections.
+ */
+
+#ifndef HYPER_ADMISSION_H
+#define HYPER_ADMISSION_H
+
+#include <stddef.h>
+#include <pthread.h>
+
+#include "net.h"
+
+/** Locks guarding the address table */
+#define ADMISSION_SHARDS 64
+/** Hash buckets of each shard */
+#define ADMISSION_BUCKETS 256
+
+/**
+ * @brief Open connections of one client address
+ */
+typedef struct admission_host {
+  char host[INET_ADDRSTRLEN];          /**< Client address              */
+  int count;                           /**< Open connections            */
+  struct admission_host* next;         /**< Next in hash bucket         */
+} admission_host_t;
+
+/**
+ * @brief Shard of the address table
+ */
+typedef struct {
+  pthread_mutex_t lock;                /**< Guards the shard            */
+  admission_host_t* buckets[ADMISSION_BUCKETS]; /**< Hash chains        */
+} admission_shard_t;
+
+/**
+ * @brief Admission control struct
+ */
+typedef struct {
+  int max_connections;                 /**< Open connections allowed, 0 for no limit */
+  int max_per_host;                    /**< Per address, 0 for no limit */
+  int connections;                     /**< Open connections, atomic    */
+  admission_shard_t shards[ADMISSION_SHARDS]; /**< Address table        */
+} admission_t;
+
+/**
+ * @brief Result of admission operations
+ */
+typedef enum {
+  ADMISSION_SUCCESS       =  0,
+  ADMISSION_ERR_MALLOC    = -1,
+  ADMISSION_ERR_FULL      = -2,
+  ADMISSION_ERR_HOST_FULL = -3
+} admission_result_t;
+
+/**
+ * @brief Creates admission control
+ *
+ * @param max_connections Open connections allowed, 0 for no limit
+ * @param max_per_host Open connections allowed per address, 0 for no limit
+ * @param result Result of the operation
+ * @return admission_t* Pointer to new admission control or NULL if error
+ */
+admission_t* create_admission(int max_connections, int max_per_host, admission_result_t* result);
+
+/**
+ * @brief Checks whether another connection would be admitted
+ *
+ * @param admission Admission control struct
+ * @return int 1 if the connection limit is reached
+ */
+int admission_full(admission_t* admission);
+
+/**
+ * @brief Counts a connection if both limits allow it
+ *
+ * @param admission Admission control struct
+ * @param host Client address
+ * @param result Result of the operation
+ */
+void admit_connection(admission_t* admission, const char* host, admission_result_t* result);
+
+/**
+ * @brief Uncounts a connection admitted earlier
+ *
+ * @param admission Admission control struct
+ * @param host Client address
+ */
+void release_connection(admission_t* admission, const char* host);
+
+/**
+ * @brief Frees admission control
+ *
+ * @param admission Admission control struct
+ */
+void close_admission(admission_t* admission);
+
+#endif
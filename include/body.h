@@ -0,0 +1,94 @@
+/**
+ * @file body.h
+ * @brief Request body decoding for hyper project
+ *
+ * A body is decoded in place in the connection's request buffer as its
+ * bytes arrive, so a request never holds more of it than the buffer does
+ * however large the upload. Chunked bodies lose their framing and their
+ * trailers, what is left is the body itself.
+ */
+
+#ifndef HYPER_BODY_H
+#define HYPER_BODY_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "request.h"
+
+/** Longest chunk head written, 16 hex digits and CRLF */
+#define BODY_CHUNK_HEAD_LEN 18
+/** Last chunk of a chunked body without trailers */
+#define BODY_LAST_CHUNK "0\r\n\r\n"
+
+/**
+ * @brief Chunked body scanner states
+ */
+typedef enum {
+  CHUNK_SIZE = 0,
+  CHUNK_EXTENSION,
+  CHUNK_SIZE_LF,
+  CHUNK_DATA,
+  CHUNK_DATA_CR,
+  CHUNK_DATA_LF,
+  CHUNK_TRAILER,
+  CHUNK_TRAILER_LINE,
+  CHUNK_END_LF
+} chunk_state_t;
+
+/**
+ * @brief Body reader struct
+ */
+typedef struct {
+  int chunked;                         /**< 1 if the body is chunked    */
+  uint64_t remaining;                  /**< Bytes left of the body, or of the chunk if chunked */
+  chunk_state_t chunk_state;           /**< Scanner state if chunked    */
+  int chunk_digits;                    /**< Digits of the chunk size    */
+  uint64_t received;                   /**< Body bytes decoded so far   */
+  uint64_t limit;                      /**< Most body bytes accepted    */
+  int done;                            /**< 1 once the body ended       */
+} body_reader_t;
+
+/**
+ * @brief Result of body operations
+ */
+typedef enum {
+  BODY_SUCCESS       =  0,
+  BODY_ERR_MALFORMED = -1,
+  BODY_ERR_TOO_LARGE = -2
+} body_result_t;
+
+/**
+ * @brief Prepares a reader for the body of a request
+ *
+ * @param reader Body reader struct
+ * @param request Parsed request
+ * @param limit Most body bytes accepted
+ */
+void init_body_reader(body_reader_t* reader, const request_t* request, uint64_t limit);
+
+/**
+ * @brief Decodes body bytes in place
+ *
+ * Stops at the end of the body, bytes after it belong to the next request.
+ *
+ * @param reader Body reader struct
+ * @param data Bytes received, the decoded body is moved to their start
+ * @param len Number of bytes
+ * @param decoded Set to the number of body bytes at the start of data
+ * @param result Result of the operation
+ * @return size_t Bytes of data consumed
+ */
+size_t decode_body(body_reader_t* reader, char* data, size_t len, size_t* decoded, body_result_t* result);
+
+/**
+ * @brief Writes the head of a chunk so that it ends where its data starts
+ *
+ * @param end First byte of the chunk data, BODY_CHUNK_HEAD_LEN bytes
+ *        before it must be writable
+ * @param len Length of the chunk data, not 0
+ * @return size_t Length of the head written before end
+ */
+size_t put_chunk_head(char* end, size_t len);
+
+#endif
@@ -8,9 +8,15 @@
 
 #include <stddef.h>
 #include <stdint.h>
+#include <sys/types.h>
+#include <sys/uio.h>
 
 #include "net.h"
 #include "logger.h"
+#include "pool.h"
+
+struct uring_io;
+struct ssl_st;
 
 /**
  * @brief Client connection struct
@@ -18,6 +24,9 @@
 typedef struct {
   char host[INET_ADDRSTRLEN]; /**< Hostname of the client */
   int socket;                 /**< Socket of the client   */
+  struct uring_io* io;        /**< io_uring state or NULL */
+  struct ssl_st* ssl;         /**< TLS session or NULL    */
+  int ktls_send;              /**< 1 if the kernel seals what is sent */
 } client_t;
 
 /**
@@ -28,7 +37,9 @@ typedef enum {
   CLIENT_ERR_MALLOC = -1,
   CLIENT_ERR_ACCEPT = -2,
   CLIENT_ERR_RECV = -3,
-  CLIENT_ERR_SEND = -4
+  CLIENT_ERR_SEND = -4,
+  CLIENT_ERR_AGAIN = -5,
+  CLIENT_ERR_CLOSED = -6
 } client_result_t;
 
 /**
@@ -56,8 +67,11 @@ client_t* create_client(char host[], int client_socket, client_result_t* result,
  * @param buff Request buffer
  * @param buff_len Length of the request
  * @param result Result of the operation
+ * @return ssize_t Number of bytes received or -1 if error
+ * @note result is CLIENT_ERR_AGAIN if a non-blocking socket has no data and
+ *       CLIENT_ERR_CLOSED if the peer closed the connection
  */
-void recv_client(client_t* client, char buff[], size_t buff_len, client_result_t* result);
+ssize_t recv_client(client_t* client, char buff[], size_t buff_len, client_result_t* result);
 
 /**
  * @brief Sends a response to the client
@@ -66,8 +80,51 @@ void recv_client(client_t* client, char buff[], size_t buff_len, client_result_t
  * @param buff Buffer of the response
  * @param buff_len Length of the response
  * @param result Result of the operation
+ * @return ssize_t Number of bytes sent or -1 if error
+ * @note result is CLIENT_ERR_AGAIN if a non-blocking socket would block
+ */
+ssize_t send_client(client_t* client, const char buff[], size_t buff_len, client_result_t* result);
+
+/**
+ * @brief Sends a gathered response to the client
+ *
+ * @param client Client connection struct
+ * @param iov Buffers to send in order
+ * @param iov_count Number of buffers
+ * @param result Result of the operation
+ * @return ssize_t Number of bytes sent or -1 if error
+ * @note result is CLIENT_ERR_AGAIN if a non-blocking socket would block
+ */
+ssize_t writev_client(client_t* client, const struct iovec* iov, int iov_count, client_result_t* result);
+
+/**
+ * @brief Sends part of a file to the client without copying it
+ *
+ * @param client Client connection struct
+ * @param fd File to send from
+ * @param offset Offset to send from, advanced by the bytes sent
+ * @param len Number of bytes to send
+ * @param result Result of the operation
+ * @return ssize_t Number of bytes sent or -1 if error
+ * @note result is CLIENT_ERR_AGAIN if a non-blocking socket would block
+ */
+ssize_t sendfile_client(client_t* client, int fd, off_t* offset, size_t len, client_result_t* result);
+
+/**
+ * @brief Checks whether bytes spliced into the client socket reach the client
+ *
+ * @param client Client connection struct
+ * @return int 1 for cleartext and kTLS sockets, 0 if OpenSSL seals what is sent
+ */
+int can_splice_client(const client_t* client);
+
+/**
+ * @brief Puts the client socket into non-blocking mode
+ *
+ * @param client Client connection struct
+ * @return int 0 if successful, -1 if error
  */
-void send_client(client_t* client, const char buff[], size_t buff_len, client_result_t* result);
+int set_client_nonblocking(client_t* client);
 
 /**
  * @brief Closes a client connection
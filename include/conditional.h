@@ -0,0 +1,114 @@
+/**
+ * @file conditional.h
+ * @brief Validators, conditional and range requests for hyper project
+ *
+ * Files are validated by a strong ETag built from inode, size and
+ * modification time, and by Last-Modified. A request can turn a 200 into
+ * a 304 through If-None-Match or If-Modified-Since, or into a 206 or 416
+ * through Range, guarded by If-Range.
+ */
+
+#ifndef HYPER_CONDITIONAL_H
+#define HYPER_CONDITIONAL_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+#include <sys/types.h>
+
+#include "request.h"
+#include "encoding.h"
+
+/** Longest ETag, quotes included */
+#define ETAG_LEN 64
+/** Length of an IMF-fixdate plus NUL */
+#define HTTP_DATE_LEN 30
+/** Most ranges served in one multipart response */
+#define RANGE_MAX_PARTS 8
+/** Boundary of multipart/byteranges responses */
+#define RANGE_BOUNDARY "hyper-byteranges-5f3c9a1e"
+
+/**
+ * @brief Byte range of a representation
+ */
+typedef struct {
+  size_t offset;                       /**< First byte                  */
+  size_t len;                          /**< Number of bytes             */
+} byte_range_t;
+
+/**
+ * @brief What a request asks for once its preconditions are evaluated
+ */
+typedef enum {
+  SELECT_FULL          = 0,            /**< 200 with the whole body     */
+  SELECT_NOT_MODIFIED  = 1,            /**< 304 without a body          */
+  SELECT_PARTIAL       = 2,            /**< 206 with the ranges         */
+  SELECT_UNSATISFIABLE = 3             /**< 416, no range fits          */
+} selection_t;
+
+/**
+ * @brief Formats the strong ETag of a file
+ *
+ * @param etag Buffer to fill
+ * @param inode Inode of the file
+ * @param size Size of the file
+ * @param mtime Modification time of the file
+ * @param encoding Encoding of the representation, part of the tag
+ */
+void format_etag(char etag[ETAG_LEN], ino_t inode, size_t size, struct timespec mtime, content_encoding_t encoding);
+
+/**
+ * @brief Formats a time as an IMF-fixdate
+ *
+ * @param date Buffer to fill
+ * @param time Seconds since the epoch
+ */
+void format_http_date(char date[HTTP_DATE_LEN], time_t time);
+
+/**
+ * @brief Parses an IMF-fixdate
+ *
+ * @param value Header value
+ * @param time Set to seconds since the epoch
+ * @return int 0 if successful, -1 if the value is not an IMF-fixdate
+ */
+int parse_http_date(slice_t value, time_t* time);
+
+/**
+ * @brief Formats the ETag and Last-Modified header lines
+ *
+ * @param out Buffer to fill
+ * @param out_len Size of the buffer
+ * @param etag ETag of the representation
+ * @param mtime Modification time in seconds
+ * @return int Length of the lines or -1 if they do not fit
+ */
+int format_validators(char* out, size_t out_len, const char* etag, time_t mtime);
+
+/**
+ * @brief Checks if a request carries any precondition or Range header
+ *
+ * @param request Parsed request
+ * @return int 1 if select_representation has work to do, 0 otherwise
+ */
+int is_conditional(const request_t* request);
+
+/**
+ * @brief Evaluates preconditions and Range against a representation
+ *
+ * If-None-Match takes precedence over If-Modified-Since. Range is only
+ * honored when If-Range, if present, still matches; syntactically invalid
+ * ranges and more than RANGE_MAX_PARTS of them are ignored.
+ *
+ * @param request Parsed request
+ * @param etag ETag of the representation
+ * @param mtime Modification time in seconds
+ * @param size Size of the representation
+ * @param ranges Filled with the ranges to send
+ * @param range_count Set to the number of ranges
+ * @return selection_t Response to send
+ */
+selection_t select_representation(const request_t* request, const char* etag, time_t mtime, size_t size,
+                                  byte_range_t ranges[RANGE_MAX_PARTS], int* range_count);
+
+#endif
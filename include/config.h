@@ -0,0 +1,115 @@
+/**
+ * @file config.h
+ * @brief Command line configuration for hyper project
+ */
+
+#ifndef HYPER_CONFIG_H
+#define HYPER_CONFIG_H
+
+#include <stddef.h>
+
+#include "net.h"
+#include "logger.h"
+#include "access_log.h"
+
+#define DEFAULT_KEEPALIVE_TIMEOUT 5
+#define DEFAULT_MAX_REQUESTS 1000
+#define DEFAULT_CACHE_MB 64
+#define DEFAULT_BACKLOG 4096
+#define DEFAULT_COMPRESS_MIN 1024
+#define DEFAULT_DRAIN_TIMEOUT 30
+#define DEFAULT_MAX_CONNECTIONS 16384
+#define DEFAULT_MAX_PER_HOST 1024
+#define DEFAULT_HEADER_TIMEOUT 10
+#define DEFAULT_MIN_SEND_RATE 1024
+#define DEFAULT_UPSTREAM_TIMEOUT 30
+#define DEFAULT_RESPONSE_CACHE_MB 32
+#define DEFAULT_MAX_BODY_KB 1024
+#define CONFIG_MAX_ROUTES 16
+
+/**
+ * @brief Server concurrency modes
+ */
+typedef enum {
+  SERVER_MODE_EPOLL   = 0,
+  SERVER_MODE_THREADS = 1,
+  SERVER_MODE_URING   = 2
+} server_mode_t;
+
+/**
+ * @brief What happens to connections over the connection limit
+ */
+typedef enum {
+  OVERFLOW_QUEUE  = 0,                 /**< Stop accepting, the backlog queues them */
+  OVERFLOW_REJECT = 1                  /**< Accept and answer 503       */
+} overflow_policy_t;
+
+/**
+ * @brief Server configuration struct
+ */
+typedef struct {
+  char host[INET_ADDRSTRLEN];          /**< Hostname to listen on          */
+  int port;                            /**< Port to listen on              */
+  server_mode_t mode;                  /**< Concurrency mode               */
+  int workers;                         /**< Number of epoll worker threads */
+  int keepalive_timeout;               /**< Idle seconds before closing    */
+  int max_requests;                    /**< Requests served per connection */
+  int cache_mb;                        /**< File cache size, 0 disables   */
+  log_level_t log_level;               /**< Most verbose level logged      */
+  const char* log_path;                /**< Log file, NULL for stdout      */
+  const char* access_log_path;         /**< Access log, NULL disables      */
+  access_log_format_t access_log_format; /**< Access log entry format      */
+  int rotate_mb;                       /**< Rotate access log above, MB    */
+  int rotate_secs;                     /**< Rotate access log every, s     */
+  int backlog;                         /**< Pending connections per socket */
+  int reuseport;                       /**< 1 for a listener per worker    */
+  int steer;                           /**< 1 to keep connections on a CPU */
+  int compress_min;                    /**< Smallest file compressed, 0 off */
+  int metrics_port;                    /**< Port of /metrics, 0 disables */
+  int immutable;                       /**< 1 to serve an indexed docroot */
+  int drain_timeout;                   /**< Seconds to finish requests on exit */
+  int max_connections;                 /**< Open connections, 0 for no limit */
+  int max_per_host;                    /**< Per client address, 0 for no limit */
+  overflow_policy_t overflow;          /**< Policy over max_connections */
+  int header_timeout;                  /**< Seconds to receive request headers */
+  int min_send_rate;                   /**< Bytes per second a response must reach */
+  const char* routes[CONFIG_MAX_ROUTES]; /**< Proxied prefixes, prefix=backend,... */
+  int route_count;                     /**< Number of routes           */
+  int upstream_timeout;                /**< Seconds a backend may stay silent */
+  int response_cache_mb;               /**< Proxied response cache size, 0 disables */
+  const char* cache_dir;               /**< Disk tier of the response cache or NULL */
+  int max_body_kb;                     /**< Largest request body, 0 refuses bodies */
+  const char* tls_cert;                /**< PEM certificate chain, NULL for cleartext */
+  const char* tls_key;                 /**< PEM private key, NULL if in tls_cert */
+} config_t;
+
+/**
+ * @brief Result of config operations
+ */
+typedef enum {
+  CONFIG_SUCCESS          =  0,
+  CONFIG_ERR_USAGE        = -1,
+  CONFIG_ERR_INVALID_HOST = -2,
+  CONFIG_ERR_INVALID_PORT = -3,
+  CONFIG_ERR_INVALID_MODE = -4,
+  CONFIG_ERR_INVALID_ARG  = -5
+} config_result_t;
+
+/**
+ * @brief Parses the command line into a config
+ *
+ * @param argc Number of arguments
+ * @param argv Arguments
+ * @param config Config struct to fill
+ * @param result Result of the operation
+ */
+void parse_config(int argc, char* argv[], config_t* config, config_result_t* result);
+
+/**
+ * @brief Logs the command line usage
+ *
+ * @param program Name of the program
+ */
+void log_usage(const char* program);
+
+#endif
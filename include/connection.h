@@ -0,0 +1,153 @@
+/**
+ * @file connection.h
+ * @brief Per-connection state machine for hyper project
+ */
+
+#ifndef HYPER_CONNECTION_H
+#define HYPER_CONNECTION_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "client.h"
+#include "request.h"
+#include "body.h"
+#include "config.h"
+#include "response.h"
+#include "access_log.h"
+#include "trace.h"
+#include "timer_wheel.h"
+
+struct server;
+struct h2_session;
+struct proxy;
+struct upstream_pool;
+
+/** Size of the per-connection request buffer */
+#define CONNECTION_BUFFER_LEN 8192
+/** Milliseconds over which the minimum send rate is measured */
+#define CONNECTION_SEND_WINDOW_MS 10000
+
+/**
+ * @brief Connection states
+ */
+typedef enum {
+  CONNECTION_READING = 0,              /**< Waiting for a full request  */
+  CONNECTION_WRITING = 1,              /**< Sending the response        */
+  CONNECTION_CLOSING = 2,              /**< Done, ready to be closed    */
+  CONNECTION_PROXYING = 3              /**< Relaying a backend's response */
+} connection_state_t;
+
+/**
+ * @brief Connection struct
+ *
+ * Holds everything a request needs between readiness events so a worker
+ * can interleave many connections without a thread per client. Pipelined
+ * requests stay in the request buffer and are answered one at a time, in
+ * order. A request body passes through the same buffer, read by whoever
+ * handles the request or skipped before the next request is parsed.
+ *
+ * Every phase has a deadline: an idle connection has the keep-alive
+ * timeout, a request has the header timeout from its first byte, and a
+ * response has to reach the minimum send rate in every send window.
+ *
+ * A connection that switched to HTTP/2 hands its socket to the session,
+ * which answers every stream like a request of its own. A proxied
+ * request has until the upstream timeout to make progress instead.
+ */
+typedef struct connection {
+  client_t* client;                    /**< Client of the connection    */
+  struct server* server;               /**< Server of the connection    */
+  connection_state_t state;            /**< Current state               */
+  int keep_alive;                      /**< 1 if reused after the reply */
+  int requests_served;                 /**< Requests answered so far    */
+  int64_t deadline;                    /**< End of the phase, monotonic ms */
+  size_t window_sent;                  /**< Bytes sent when the send window began */
+  wheel_timer_t timer;                 /**< Owner's timer at deadline   */
+  uint64_t request_start;              /**< Request parsed, metrics_now() */
+  char* in;                            /**< Pooled request buffer or NULL */
+  size_t in_len;                       /**< Bytes in the request buffer */
+  request_parser_t parser;             /**< Parser of the next request  */
+  request_t request;                   /**< Request being parsed        */
+  body_reader_t body;                  /**< Body of the last request    */
+  response_t response;                 /**< Response being sent         */
+  arena_t arena;                       /**< Memory of the current request */
+  access_log_buffer_t* log_buffer;     /**< Owner's buffer, NULL if off */
+  access_entry_t entry;                /**< Request being answered      */
+  struct h2_session* h2;               /**< HTTP/2 session or NULL      */
+  struct proxy* proxy;                 /**< Proxied exchange or NULL    */
+  struct upstream_pool* upstream_pool; /**< Owner's backend connections or NULL */
+#ifdef HYPER_TRACE
+  trace_t trace;                       /**< Phase timestamps            */
+#endif
+} connection_t;
+
+/**
+ * @brief Result of connection operations
+ */
+typedef enum {
+  CONNECTION_SUCCESS      =  0,
+  CONNECTION_ERR_MALLOC   = -1,
+  CONNECTION_ERR_REJECTED = -2
+} connection_result_t;
+
+/**
+ * @brief Creates a connection for a client
+ *
+ * @param client Client of the connection
+ * @param server Server the client connected to
+ * @param result Result of the operation
+ * @return connection_t* Pointer to new connection or NULL if error
+ * @note A client over the connection limits is sent a 503 and result is
+ *       CONNECTION_ERR_REJECTED, the caller still closes it
+ */
+connection_t* create_connection(client_t* client, struct server* server, connection_result_t* result);
+
+/**
+ * @brief Checks a connection whose deadline may have passed
+ *
+ * A response that sent enough during its send window gets another one.
+ * A proxied request whose backend did not answer in time is answered
+ * with a 504 instead.
+ *
+ * @param connection Connection struct
+ * @param now Current monotonic ms
+ * @return int 1 if the connection missed its deadline and must be closed
+ */
+int connection_expired(connection_t* connection, int64_t now);
+
+/**
+ * @brief Gets the poll events a connection waits for
+ *
+ * @param connection Connection struct
+ * @return short POLLIN, POLLOUT, both, or none while waiting on a backend
+ */
+short connection_events(const connection_t* connection);
+
+/**
+ * @brief Gets the backend socket a proxied request waits on
+ *
+ * @param connection Connection struct
+ * @param events Set to the poll events awaited on it
+ * @return int Backend socket or -1 if none
+ */
+int connection_upstream(const connection_t* connection, short* events);
+
+/**
+ * @brief Advances the connection state machine
+ *
+ * Reads, parses and writes until the socket would block or the connection
+ * is done. On a blocking socket a single call serves the connection.
+ *
+ * @param connection Connection struct
+ */
+void drive_connection(connection_t* connection);
+
+/**
+ * @brief Closes a connection and its client
+ *
+ * @param connection Connection struct
+ */
+void close_connection(connection_t* connection);
+
+#endif
@@ -0,0 +1,155 @@
+/**
+ * @file docroot.h
+ * @brief Immutable, memory-mapped document root index for hyper project
+ *
+ * With -i the document root is walked once at startup. Every regular file
+ * is mmapped and described by a prebuilt cache entry per encoding, and a
+ * perfect hash maps URL paths to files, so serving a file costs no system
+ * call until the response is written.
+ *
+ * SIGHUP builds a new snapshot in the background and swaps it in. Each
+ * thread keeps using the snapshot it holds until it serves its next
+ * request, and a snapshot is unmapped once no thread holds it and no
+ * response still sends from it. Files must not be modified in place
+ * while indexed; replace them and send SIGHUP.
+ */
+
+#ifndef HYPER_DOCROOT_H
+#define HYPER_DOCROOT_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "request.h"
+#include "encoding.h"
+#include "file_cache.h"
+
+/** Largest file compressed when the index is built */
+#define DOCROOT_COMPRESS_MAX (1024 * 1024)
+/** Most files indexed */
+#define DOCROOT_MAX_FILES (1 << 20)
+/** Average keys per hash bucket */
+#define DOCROOT_BUCKET_KEYS 4
+/** Seeds tried per bucket before the build gives up */
+#define DOCROOT_MAX_SEED (1 << 20)
+
+/**
+ * @brief Indexed file
+ */
+typedef struct {
+  const char* path;                    /**< Key, path below the root    */
+  size_t path_len;                     /**< Length of path              */
+  uint64_t hash;                       /**< Hash of path                */
+  int negotiable;                      /**< 1 if encodings are negotiated */
+  file_cache_entry_t* variants[ENCODING_BROTLI + 1]; /**< By encoding, NULL falls back to identity */
+  char* map;                           /**< Mapping of the file or NULL */
+  size_t map_len;                      /**< Length of map               */
+} docroot_file_t;
+
+/**
+ * @brief Snapshot of the document root
+ */
+typedef struct docroot {
+  docroot_file_t* files;               /**< Indexed files               */
+  size_t file_count;                   /**< Number of files             */
+  uint32_t* seeds;                     /**< Displacement of each bucket */
+  size_t bucket_count;                 /**< Number of buckets           */
+  int32_t* slots;                      /**< File index or -1 per slot   */
+  size_t slot_mask;                    /**< Slots minus one, power of two */
+  uint64_t generation;                 /**< Builds before this one      */
+  int refs;                            /**< Holders, guarded by the swap lock */
+} docroot_t;
+
+/**
+ * @brief A thread's hold on a snapshot
+ *
+ * Only the owning thread touches a hold, so counting the responses that
+ * send from its snapshot takes no atomic operation.
+ */
+typedef struct docroot_hold {
+  docroot_t* snapshot;                 /**< Held snapshot               */
+  uint64_t responses;                  /**< Responses sending from it   */
+  int retired;                         /**< 1 once the thread moved on  */
+} docroot_hold_t;
+
+/**
+ * @brief Result of docroot operations
+ */
+typedef enum {
+  DOCROOT_SUCCESS       =  0,
+  DOCROOT_ERR_MALLOC    = -1,
+  DOCROOT_ERR_OPEN      = -2,
+  DOCROOT_ERR_MAP       = -3,
+  DOCROOT_ERR_TOO_LARGE = -4,
+  DOCROOT_ERR_HASH      = -5,
+  DOCROOT_ERR_THREAD    = -6
+} docroot_result_t;
+
+/**
+ * @brief Walks a directory and builds a snapshot of it
+ *
+ * @param root Directory to index
+ * @param compress_min Smallest file compressed, 0 disables
+ * @param result Result of the operation
+ * @return docroot_t* New snapshot or NULL if error
+ */
+docroot_t* build_docroot(const char* root, size_t compress_min, docroot_result_t* result);
+
+/**
+ * @brief Finds a file in a snapshot
+ *
+ * @param snapshot Snapshot to search
+ * @param path Path below the root, empty for index.html
+ * @return const docroot_file_t* File or NULL if missing
+ */
+const docroot_file_t* docroot_find(const docroot_t* snapshot, slice_t path);
+
+/**
+ * @brief Gets the entry to send for an encoding
+ *
+ * @param file Indexed file
+ * @param encoding Encoding the client prefers
+ * @return file_cache_entry_t* Entry in that encoding, identity if there is none
+ */
+file_cache_entry_t* docroot_variant(const docroot_file_t* file, content_encoding_t encoding);
+
+/**
+ * @brief Gets the calling thread's hold on the current snapshot
+ *
+ * Costs one load while the snapshot is unchanged. After a swap the thread
+ * moves to the new snapshot and lets go of the old one once its responses
+ * are done.
+ *
+ * @return docroot_hold_t* Hold or NULL if no snapshot is published
+ */
+docroot_hold_t* docroot_acquire(void);
+
+/**
+ * @brief Keeps a snapshot alive for a response
+ *
+ * @param hold Hold from docroot_acquire
+ */
+void docroot_retain(docroot_hold_t* hold);
+
+/**
+ * @brief Lets go of a snapshot kept for a response, on the same thread
+ *
+ * @param owner docroot_hold_t struct
+ */
+void docroot_release(void* owner);
+
+/**
+ * @brief Builds the first snapshot and rebuilds it on every SIGHUP
+ *
+ * @param root Directory to index
+ * @param compress_min Smallest file compressed, 0 disables
+ * @param result Result of the operation
+ */
+void start_docroot(const char* root, size_t compress_min, docroot_result_t* result);
+
+/**
+ * @brief Stops rebuilding and drops the published snapshot
+ */
+void stop_docroot(void);
+
+#endif
@@ -0,0 +1,93 @@
+/**
+ * @file encoding.h
+ * @brief Content encoding negotiation and compression for hyper project
+ */
+
+#ifndef HYPER_ENCODING_H
+#define HYPER_ENCODING_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "request.h"
+
+/** zlib level of on-the-fly gzip */
+#define ENCODING_GZIP_LEVEL 6
+/** Quality of on-the-fly brotli */
+#define ENCODING_BROTLI_QUALITY 5
+
+/**
+ * @brief Content encodings, in increasing order of preference
+ */
+typedef enum {
+  ENCODING_IDENTITY = 0,               /**< Bytes as stored             */
+  ENCODING_GZIP     = 1,               /**< gzip, RFC 1952              */
+  ENCODING_BROTLI   = 2                /**< Brotli, RFC 7932            */
+} content_encoding_t;
+
+/**
+ * @brief Result of encoding operations
+ */
+typedef enum {
+  ENCODING_SUCCESS    =  0,
+  ENCODING_ERR_MALLOC = -1,
+  ENCODING_ERR_FAILED = -2
+} encoding_result_t;
+
+/**
+ * @brief Picks the preferred encoding the client accepts
+ *
+ * Parses Accept-Encoding, skipping codings with q=0. Brotli is preferred
+ * over gzip whatever the q-values say, since either is acceptable.
+ *
+ * @param request Parsed request
+ * @return content_encoding_t Preferred encoding, identity if none
+ */
+content_encoding_t negotiate_encoding(const request_t* request);
+
+/**
+ * @brief Gets the Content-Encoding token of an encoding
+ *
+ * @param encoding Content encoding
+ * @return const char* Token, NULL for identity
+ */
+const char* encoding_name(content_encoding_t encoding);
+
+/**
+ * @brief Gets the Content-Encoding header line of an encoding
+ *
+ * @param encoding Content encoding
+ * @return const char* Header line with CRLF, empty for identity
+ */
+const char* encoding_header(content_encoding_t encoding);
+
+/**
+ * @brief Gets the file name suffix of precompressed siblings
+ *
+ * @param encoding Content encoding
+ * @return const char* Suffix, empty for identity
+ */
+const char* encoding_suffix(content_encoding_t encoding);
+
+/**
+ * @brief Checks if a file type is worth compressing
+ *
+ * @param path Path of the file
+ * @return int 1 for text types, 0 for already compressed or unknown ones
+ */
+int is_compressible(const char* path);
+
+/**
+ * @brief Compresses a buffer
+ *
+ * @param encoding gzip or brotli
+ * @param data Bytes to compress
+ * @param size Number of bytes
+ * @param out_len Set to the compressed length
+ * @param result Result of the operation
+ * @return char* Compressed bytes to free() or NULL if error
+ */
+char* compress_buffer(content_encoding_t encoding, const char* data, size_t size, size_t* out_len,
+                      encoding_result_t* result);
+
+#endif
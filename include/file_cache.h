@@ -0,0 +1,159 @@
+/**
+ * @file file_cache.h
+ * @brief In-memory static file cache for hyper project
+ */
+
+#ifndef HYPER_FILE_CACHE_H
+#define HYPER_FILE_CACHE_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <time.h>
+
+#include "request.h"
+#include "encoding.h"
+#include "conditional.h"
+
+/** Number of independently locked shards */
+#define FILE_CACHE_SHARDS 16
+/** Hash buckets per shard */
+#define FILE_CACHE_BUCKETS 1024
+/** Largest file whose bytes are kept in memory */
+#define FILE_CACHE_MAX_ENTRY_SIZE (1024 * 1024)
+/** How often an entry is checked against the file system */
+#define FILE_CACHE_CHECK_INTERVAL_MS 1000
+/** Size of the precomputed header block */
+#define FILE_CACHE_HEADER_LEN 384
+/** Size of the precomputed validator and Vary lines */
+#define FILE_CACHE_FIELDS_LEN 192
+
+/**
+ * @brief File cache entry struct
+ *
+ * Entries are reference counted: the shard holds one reference while the
+ * entry is cached and every response sending it holds another, so an
+ * evicted entry stays valid until its last response is done.
+ *
+ * A file has one entry per encoding clients asked for. The variant is
+ * part of the key; the encoding is what the entry actually holds, which
+ * is identity when the file is too small, not worth compressing or did
+ * not shrink.
+ */
+typedef struct file_cache_entry {
+  char path[FILE_NAME_LEN];            /**< Key, path of the file       */
+  content_encoding_t variant;          /**< Key, encoding asked for     */
+  uint64_t hash;                       /**< Hash of path and variant    */
+  content_encoding_t encoding;         /**< Encoding of data            */
+  int sibling;                         /**< 1 if read from path + suffix */
+  char* data;                          /**< Body bytes or NULL if large */
+  size_t size;                         /**< Size of the body            */
+  size_t source_size;                  /**< Size of the file at path    */
+  struct timespec mtime;               /**< Modification time of path   */
+  char etag[ETAG_LEN];                 /**< Strong validator            */
+  char fields[FILE_CACHE_FIELDS_LEN];  /**< ETag, Last-Modified, Vary   */
+  char header[FILE_CACHE_HEADER_LEN];  /**< Keep-alive header block     */
+  size_t header_len;                   /**< Length of header            */
+  char close_header[FILE_CACHE_HEADER_LEN]; /**< Closing header block   */
+  size_t close_header_len;             /**< Length of close_header      */
+  int64_t last_checked;                /**< Last stat, monotonic ms     */
+  int refs;                            /**< References, atomic          */
+  int referenced;                      /**< CLOCK reference bit         */
+  struct file_cache_entry* next;       /**< Next in hash bucket         */
+  struct file_cache_entry* clock_prev; /**< Previous in CLOCK ring      */
+  struct file_cache_entry* clock_next; /**< Next in CLOCK ring          */
+} file_cache_entry_t;
+
+/**
+ * @brief File cache shard struct
+ */
+typedef struct {
+  pthread_mutex_t lock;                /**< Guards the shard            */
+  file_cache_entry_t* buckets[FILE_CACHE_BUCKETS]; /**< Hash chains     */
+  file_cache_entry_t* hand;            /**< CLOCK hand                  */
+  size_t used;                         /**< Bytes held by entries       */
+} file_cache_shard_t;
+
+/**
+ * @brief File cache struct
+ */
+typedef struct {
+  file_cache_shard_t shards[FILE_CACHE_SHARDS]; /**< Shards             */
+  size_t shard_capacity;               /**< Byte budget of each shard   */
+  size_t max_entry_size;               /**< Largest in-memory file      */
+  size_t compress_min;                 /**< Smallest file compressed, 0 never */
+} file_cache_t;
+
+/**
+ * @brief Result of file cache operations
+ */
+typedef enum {
+  FILE_CACHE_SUCCESS       =  0,
+  FILE_CACHE_ERR_MALLOC    = -1,
+  FILE_CACHE_ERR_NOT_FOUND = -2,
+  FILE_CACHE_ERR_READ      = -3
+} file_cache_result_t;
+
+/**
+ * @brief Creates a file cache
+ *
+ * @param capacity Total byte budget, split evenly across shards
+ * @param compress_min Smallest file compressed on the fly, 0 disables
+ * @param result Result of the operation
+ * @return file_cache_t* Pointer to new cache or NULL if error
+ */
+file_cache_t* create_file_cache(size_t capacity, size_t compress_min, file_cache_result_t* result);
+
+/**
+ * @brief Looks up a file, loading it on a miss
+ *
+ * A hit within the check interval costs no system calls. Files larger
+ * than the entry limit are cached without their bytes, so callers must
+ * stream them when data is NULL. A compressed variant is read from a
+ * precompressed sibling when one exists and compressed on load otherwise.
+ *
+ * @param cache File cache struct
+ * @param path Path of the file
+ * @param variant Encoding the client prefers
+ * @param result Result of the operation
+ * @return file_cache_entry_t* Referenced entry or NULL if error
+ */
+file_cache_entry_t* file_cache_get(file_cache_t* cache, const char* path, content_encoding_t variant,
+                                   file_cache_result_t* result);
+
+/**
+ * @brief Drops a reference taken by file_cache_get
+ *
+ * @param entry File cache entry struct
+ */
+void file_cache_release(file_cache_entry_t* entry);
+
+/**
+ * @brief Builds the validator lines and header blocks of an entry
+ *
+ * The blocks stop before the Date line, which end_headers() adds.
+ *
+ * @param entry Entry with path, size, encoding, mtime and etag set
+ * @param negotiable 1 if the file is served in more than one encoding
+ */
+void build_entry_headers(file_cache_entry_t* entry, int negotiable);
+
+/**
+ * @brief Loads files below the working directory into the cache
+ *
+ * Walks the tree and loads files until the cache is full, so a process
+ * taking over from another starts with the hits the old one had.
+ *
+ * @param cache File cache struct
+ * @return size_t Number of files loaded
+ */
+size_t warm_file_cache(file_cache_t* cache);
+
+/**
+ * @brief Frees the cache and every entry it holds
+ *
+ * @param cache File cache struct
+ */
+void close_file_cache(file_cache_t* cache);
+
+#endif
@@ -0,0 +1,182 @@
+/**
+ * @file h2.h
+ * @brief HTTP/2 over cleartext for hyper project
+ *
+ * A connection switches to HTTP/2 when it starts with the client preface
+ * or asks for h2c with Upgrade. Every stream is answered by the same
+ * handler as an HTTP/1.1 request: its headers are rebuilt into a request
+ * head and parsed, and the response it queues is reframed into HEADERS
+ * and DATA frames. File bodies still go out with sendfile(), DATA frames
+ * of all streams take turns and respect both flow control windows.
+ *
+ * Streams are not proxied, so a server with routes stays on HTTP/1.1:
+ * the preface is parsed as a bad request and Upgrade: h2c is ignored.
+ */
+
+#ifndef HYPER_H2_H
+#define HYPER_H2_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "connection.h"
+#include "hpack.h"
+
+/** Client connection preface */
+#define H2_PREFACE "PRI * HTTP/2.0\r\n\r\nSM\r\n\r\n"
+/** Length of the client connection preface */
+#define H2_PREFACE_LEN 24
+/** Length of a frame header */
+#define H2_FRAME_HEADER_LEN 9
+/** Largest frame payload received and sent, the protocol minimum */
+#define H2_MAX_FRAME_LEN 16384
+/** Size of the input buffer, one whole frame */
+#define H2_INPUT_LEN (H2_FRAME_HEADER_LEN + H2_MAX_FRAME_LEN)
+/** Streams a client may have open at once */
+#define H2_MAX_STREAMS 100
+/** Largest header block, CONTINUATION frames included */
+#define H2_MAX_HEADER_BLOCK 16384
+/** Size of the buffer control frames wait in */
+#define H2_CONTROL_LEN 4096
+/** Size of the buffer frame headers and header blocks are built in */
+#define H2_BATCH_LEN 16384
+/** Flow control window before any SETTINGS or WINDOW_UPDATE */
+#define H2_DEFAULT_WINDOW 65535
+/** Largest flow control window */
+#define H2_MAX_WINDOW 0x7fffffff
+
+/**
+ * @brief Stream struct
+ *
+ * The exchange is a connection that never touches the socket: it holds
+ * the request, the response the handler queued and the memory of both.
+ */
+typedef struct h2_stream {
+  uint32_t id;                         /**< Stream identifier           */
+  int64_t window;                      /**< Bytes the client lets us send */
+  int remote_closed;                   /**< Client sent END_STREAM      */
+  int answered;                        /**< Request handled, logged when done */
+  int headers_sent;                    /**< HEADERS frame queued        */
+  int done;                            /**< END_STREAM or RST_STREAM queued */
+  size_t remaining;                    /**< Body bytes left to frame    */
+  char* head;                          /**< Request rebuilt as HTTP/1.1 */
+  size_t head_len;                     /**< Length of the head waiting for END_STREAM */
+  connection_t exchange;               /**< Request and response        */
+  struct h2_stream* next;              /**< Next stream of the session  */
+} h2_stream_t;
+
+/**
+ * @brief Session struct
+ *
+ * Output goes out one batch at a time: pending control frames, then
+ * HEADERS and DATA frames of the streams in turn. A batch is written
+ * like any response and is left untouched until fully sent.
+ */
+typedef struct h2_session {
+  char* in;                            /**< Pooled input buffer or NULL */
+  size_t in_len;                       /**< Bytes in the input buffer   */
+  int preface;                         /**< 1 once the client preface arrived */
+  int settings;                        /**< 1 once the client SETTINGS arrived */
+  hpack_table_t decoder;               /**< Request header table        */
+  hpack_table_t encoder;               /**< Response header table       */
+  uint8_t* block;                      /**< Header block awaiting CONTINUATION */
+  size_t block_len;                    /**< Bytes in block              */
+  uint32_t block_stream;               /**< Stream of the header block  */
+  int block_end_stream;                /**< HEADERS carried END_STREAM  */
+  uint32_t last_stream;                /**< Highest stream opened by the client */
+  int stream_count;                    /**< Streams not yet done        */
+  h2_stream_t* streams;                /**< Streams, oldest first       */
+  h2_stream_t* cursor;                 /**< Stream framed first next batch */
+  int64_t window;                      /**< Connection send window      */
+  int64_t initial_window;              /**< Client's initial stream window */
+  size_t max_frame;                    /**< Largest DATA payload to send */
+  size_t received;                     /**< DATA bytes not yet returned */
+  char control[H2_CONTROL_LEN];        /**< Control frames to send      */
+  size_t control_len;                  /**< Bytes in control            */
+  char frames[H2_BATCH_LEN];           /**< Frame bytes of the batch    */
+  size_t frames_len;                   /**< Bytes in frames             */
+  response_t out;                      /**< Batch being written         */
+  size_t sent;                         /**< Bytes of earlier batches    */
+  int goaway;                          /**< GOAWAY queued, no new streams */
+  int closing;                         /**< Close once the output is sent */
+} h2_session_t;
+
+/**
+ * @brief Result of HTTP/2 operations
+ */
+typedef enum {
+  H2_SUCCESS        =  0,
+  H2_ERR_MALLOC     = -1,
+  H2_ERR_SETTINGS   = -2
+} h2_result_t;
+
+/**
+ * @brief Checks how much of the client preface a buffer holds
+ *
+ * @param buff Start of the connection
+ * @param len Bytes received so far
+ * @return int 1 if the preface is complete, 0 if the bytes so far match
+ *         it, -1 if this is not HTTP/2
+ */
+int match_h2_preface(const char* buff, size_t len);
+
+/**
+ * @brief Checks whether a request asks to upgrade to h2c
+ *
+ * @param request Parsed request
+ * @return int 1 if it has Upgrade: h2c and one HTTP2-Settings header
+ */
+int is_h2_upgrade(const request_t* request);
+
+/**
+ * @brief Switches a connection to HTTP/2
+ *
+ * The unread bytes of the connection buffer move to the session. With an
+ * upgrade request a 101 response is queued first and the request becomes
+ * stream 1, otherwise the buffer starts with the client preface.
+ *
+ * @param connection Connection struct
+ * @param upgrade Upgrade request, consumed from the buffer, or NULL
+ * @param result Result of the operation
+ */
+void start_h2(connection_t* connection, const request_t* upgrade, h2_result_t* result);
+
+/**
+ * @brief Checks whether a session has streams or output in progress
+ *
+ * @param session Session struct
+ * @return int 1 if a response is being sent
+ */
+int h2_busy(const h2_session_t* session);
+
+/**
+ * @brief Checks whether a session waits for the socket to take output
+ *
+ * @param session Session struct
+ * @return int 1 if a batch is partly written
+ */
+int h2_blocked(const h2_session_t* session);
+
+/**
+ * @brief Gets the bytes a session has sent
+ *
+ * @param session Session struct
+ * @return size_t Bytes written to the socket so far
+ */
+size_t h2_sent(const h2_session_t* session);
+
+/**
+ * @brief Reads, answers and writes until the socket would block
+ *
+ * @param connection Connection struct running a session
+ */
+void drive_h2(connection_t* connection);
+
+/**
+ * @brief Frees a session and its streams
+ *
+ * @param session Session struct
+ */
+void close_h2(h2_session_t* session);
+
+#endif
@@ -0,0 +1,107 @@
+/**
+ * @file hpack.h
+ * @brief HPACK header compression for hyper project
+ *
+ * Implements RFC 7541: the static table, a dynamic table per direction
+ * and the Huffman code. Each HTTP/2 connection holds one table to decode
+ * request headers and one to encode response headers.
+ */
+
+#ifndef HYPER_HPACK_H
+#define HYPER_HPACK_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "request.h"
+
+/** Dynamic table size in both directions, the protocol default */
+#define HPACK_TABLE_SIZE 4096
+/** Bytes an entry costs on top of its name and value */
+#define HPACK_ENTRY_OVERHEAD 32
+/** Most entries a table of HPACK_TABLE_SIZE can hold */
+#define HPACK_MAX_ENTRIES (HPACK_TABLE_SIZE / HPACK_ENTRY_OVERHEAD)
+
+/**
+ * @brief Dynamic table struct
+ *
+ * Entries are stored back to back, newest first, so inserting moves the
+ * others up and evicting only shortens the table.
+ */
+typedef struct {
+  char data[HPACK_TABLE_SIZE];         /**< Names and values, newest first */
+  uint16_t name_lens[HPACK_MAX_ENTRIES]; /**< Name length per entry     */
+  uint16_t value_lens[HPACK_MAX_ENTRIES]; /**< Value length per entry   */
+  size_t count;                        /**< Entries in the table        */
+  size_t used;                         /**< Bytes of data in use        */
+  size_t size;                         /**< Size as the protocol counts it */
+  size_t max_size;                     /**< Current size limit          */
+  int update_pending;                  /**< Encoder owes a size update  */
+} hpack_table_t;
+
+/**
+ * @brief Result of HPACK operations
+ */
+typedef enum {
+  HPACK_SUCCESS       =  0,
+  HPACK_ERR_INVALID   = -1,
+  HPACK_ERR_TOO_LARGE = -2
+} hpack_result_t;
+
+/**
+ * @brief Initializes an empty table of HPACK_TABLE_SIZE
+ *
+ * @param table Table struct
+ */
+void init_hpack_table(hpack_table_t* table);
+
+/**
+ * @brief Lowers the size limit of an encoding table
+ *
+ * The next encoded field starts with the size update the peer expects.
+ *
+ * @param table Table struct
+ * @param max_size Size the peer's decoder allows
+ */
+void resize_hpack_table(hpack_table_t* table, size_t max_size);
+
+/**
+ * @brief Decodes a complete header block
+ *
+ * Names and values are copied into out, since entries they came from
+ * may be evicted by later fields of the same block.
+ *
+ * @param table Decoding table, updated by the block
+ * @param block Header block
+ * @param block_len Length of the block
+ * @param fields Filled with the decoded fields in order
+ * @param max_fields Number of entries in fields
+ * @param field_count Set to the number of fields decoded
+ * @param out Buffer the names and values are copied to
+ * @param out_len Size of out
+ * @param result Result of the operation
+ * @note result is HPACK_ERR_TOO_LARGE if the fields do not fit, the table
+ *       is then out of step with the peer and the connection unusable
+ */
+void hpack_decode(hpack_table_t* table, const uint8_t* block, size_t block_len, header_t fields[],
+                  size_t max_fields, size_t* field_count, char* out, size_t out_len, hpack_result_t* result);
+
+/**
+ * @brief Encodes one header field
+ *
+ * Fields found in a table are sent as an index. Others are added to the
+ * table unless their value changes with every response.
+ *
+ * @param table Encoding table, updated by the field
+ * @param name Lowercase field name
+ * @param name_len Length of the name
+ * @param value Field value
+ * @param value_len Length of the value
+ * @param out Buffer to encode into
+ * @param out_len Space left in out
+ * @return size_t Bytes written or 0 if the field does not fit
+ */
+size_t hpack_encode(hpack_table_t* table, const char* name, size_t name_len, const char* value, size_t value_len,
+                    uint8_t* out, size_t out_len);
+
+#endif
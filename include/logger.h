@@ -1,6 +1,11 @@
 /**
  * @file logger.h
  * @brief Logging functionality for hyper project
+ *
+ * log_message() copies its arguments into a fixed-size binary record on
+ * a per-thread ring and returns. A background thread formats the records
+ * and writes them in batches. Records are dropped and counted, never
+ * waited for, when a ring is full.
  */
 
 #ifndef HYPER_LOGGER_H
@@ -10,23 +15,120 @@
 #include <string.h>
 #include <unistd.h>
 #include <stdarg.h>
+#include <stdint.h>
 
 /**
- * @brief Logging levels
+ * @brief Logging levels, from most to least severe
  */
 typedef enum {
-  LOG_INFO  = 0,
-  LOG_ERROR = 1,
+  LOG_ERROR = 0,
+  LOG_INFO  = 1,
   LOG_DEBUG = 2
 } log_level_t;
 
+/** Most verbose level compiled in, e.g. -DLOG_COMPILE_LEVEL=LOG_ERROR */
+#ifndef LOG_COMPILE_LEVEL
+#define LOG_COMPILE_LEVEL LOG_DEBUG
+#endif
+
+/** Maximum number of arguments captured per record */
+#define LOG_MAX_ARGS 8
+/** Bytes of string arguments captured per record */
+#define LOG_STRING_LEN 168
+/** Records per thread ring, a power of two */
+#define LOG_RING_SIZE 512
+/** Milliseconds the writer sleeps when every ring is empty */
+#define LOG_FLUSH_INTERVAL_MS 10
+
+/**
+ * @brief Captured argument
+ */
+typedef union {
+  int64_t i;                           /**< Signed integers       */
+  uint64_t u;                          /**< Unsigned integers     */
+  double d;                            /**< Floating point        */
+  const void* p;                       /**< Pointers              */
+} log_arg_t;
+
+/**
+ * @brief Binary log record
+ *
+ * The format string is the record's format id: it must be a string
+ * literal, only its address is stored. String arguments are copied into
+ * the record, truncated if they do not fit.
+ */
+typedef struct {
+  const char* format;                  /**< Format id             */
+  int64_t timestamp;                   /**< Wall clock, ns        */
+  log_arg_t args[LOG_MAX_ARGS];        /**< Captured arguments    */
+  uint8_t level;                       /**< log_level_t           */
+  uint8_t arg_count;                   /**< Arguments captured    */
+  uint16_t strings_len;                /**< Bytes used in strings */
+  char strings[LOG_STRING_LEN];        /**< String arguments      */
+} log_record_t;
+
+/**
+ * @brief Result of logger operations
+ */
+typedef enum {
+  LOGGER_SUCCESS    =  0,
+  LOGGER_ERR_OPEN   = -1,
+  LOGGER_ERR_THREAD = -2
+} logger_result_t;
+
 /**
  * @brief Logs a formatted message
  *
+ * Levels above LOG_COMPILE_LEVEL compile to nothing.
+ *
+ * @param level Logging level
+ * @param format Format string literal
+ * @param ... Variable arguments to format
+ */
+#define log_message(level, ...)                 \
+  do {                                          \
+    if ((level) <= LOG_COMPILE_LEVEL) {         \
+      log_write((level), __VA_ARGS__);          \
+    }                                           \
+  } while (0)
+
+/**
+ * @brief Records a formatted message, see log_message
+ *
+ * Before start_logger and after stop_logger the message is written
+ * synchronously.
+ *
  * @param level Logging level
- * @param format Format string
+ * @param format Format string literal
  * @param ... Variable arguments to format
  */
-void log_message(log_level_t level, const char* format, ...);
+void log_write(log_level_t level, const char* format, ...) __attribute__((format(printf, 2, 3)));
+
+/**
+ * @brief Sets the most verbose level that is recorded
+ *
+ * @param level Logging level
+ */
+void set_log_level(log_level_t level);
+
+/**
+ * @brief Starts the background writer
+ *
+ * @param path File to append to, or NULL for stdout
+ * @param result Result of the operation
+ */
+void start_logger(const char* path, logger_result_t* result);
+
+/**
+ * @brief Flushes every ring and stops the background writer
+ */
+void stop_logger(void);
+
+/**
+ * @brief Gets the number of records dropped because a ring was full
+ *
+ * @return uint64_t Dropped records
+ */
+uint64_t log_dropped_count(void);
 
-#endif
\ No newline at end of file
+#endif
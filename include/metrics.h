@@ -0,0 +1,145 @@
+/**
+ * @file metrics.h
+ * @brief Per-thread counters, latency histograms and a Prometheus endpoint for hyper project
+ *
+ * Every thread records into its own cache-line aligned shard with plain
+ * loads and stores, so recording costs no atomic read-modify-write and no
+ * lock. Shards are only summed when the endpoint is scraped. The shard of
+ * an exiting thread is folded into a retired total.
+ */
+
+#ifndef HYPER_METRICS_H
+#define HYPER_METRICS_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "request.h"
+#include "client.h"
+
+/** Histogram buckets before +Inf, bucket i counts up to 2^(i + 7) ns */
+#define METRICS_BUCKETS 24
+/** Shift of the upper bound of the first bucket, 128 ns */
+#define METRICS_BUCKET_SHIFT 7
+/** Status codes counted, 100 to 599 */
+#define METRICS_STATUSES 500
+/** request_result_t codes, 0 to REQUEST_ERR_NOT_IMPLEMENTED */
+#define METRICS_REQUEST_RESULTS 11
+/** client_result_t codes, 0 to CLIENT_ERR_CLOSED */
+#define METRICS_CLIENT_RESULTS 7
+/** Size of a scrape response */
+#define METRICS_RESPONSE_LEN 65536
+
+/**
+ * @brief Counters
+ */
+typedef enum {
+  METRIC_CONNECTIONS_OPENED = 0,       /**< Connections created         */
+  METRIC_CONNECTIONS_CLOSED = 1,       /**< Connections closed          */
+  METRIC_REQUESTS           = 2,       /**< Requests parsed and handled */
+  METRIC_BYTES_RECEIVED     = 3,       /**< Bytes read from clients     */
+  METRIC_BYTES_SENT         = 4,       /**< Bytes of finished responses */
+  METRIC_CONNECTIONS_REJECTED = 5,     /**< Refused over a limit        */
+  METRIC_CONNECTIONS_TIMED_OUT = 6,    /**< Closed for missing a deadline */
+  METRIC_UPSTREAM_REQUESTS  = 7,       /**< Requests sent to backends   */
+  METRIC_UPSTREAM_REUSED    = 8,       /**< Sent on a pooled connection */
+  METRIC_UPSTREAM_FAILURES  = 9,       /**< Backend connects, sends or replies that failed */
+  METRIC_CACHE_HITS         = 10,      /**< Proxied requests answered by the response cache */
+  METRIC_CACHE_STALE        = 11,      /**< Of them, answered stale while refreshed */
+  METRIC_CACHE_MISSES       = 12,      /**< Fetched to fill the response cache */
+  METRIC_CACHE_COALESCED    = 13,      /**< Waited for another request's fill */
+  METRIC_TLS_HANDSHAKES     = 14,      /**< TLS handshakes finished     */
+  METRIC_TLS_RESUMED        = 15,      /**< Of them, resumed sessions   */
+  METRIC_TLS_KTLS           = 16,      /**< Of them, sending through kTLS */
+  METRIC_COUNTERS           = 17
+} metric_counter_t;
+
+/**
+ * @brief Latency histograms
+ */
+typedef enum {
+  METRIC_PARSE_TIME    = 0,            /**< Last parse_request() call   */
+  METRIC_HANDLE_TIME   = 1,            /**< handle_request()            */
+  METRIC_RESPONSE_TIME = 2,            /**< Request parsed to last byte */
+  METRIC_HISTOGRAMS    = 3
+} metric_histogram_t;
+
+/**
+ * @brief Result of metrics operations
+ */
+typedef enum {
+  METRICS_SUCCESS      =  0,
+  METRICS_ERR_SOCKET   = -1,
+  METRICS_ERR_BIND     = -2,
+  METRICS_ERR_LISTEN   = -3,
+  METRICS_ERR_THREAD   = -4
+} metrics_result_t;
+
+/**
+ * @brief Gets a monotonic timestamp for latency histograms
+ *
+ * @return uint64_t Nanoseconds
+ */
+uint64_t metrics_now(void);
+
+/**
+ * @brief Adds to a counter of the calling thread
+ *
+ * @param counter Counter
+ * @param n Amount to add
+ */
+void metrics_count(metric_counter_t counter, uint64_t n);
+
+/**
+ * @brief Counts a response by status code
+ *
+ * @param status HTTP status code
+ */
+void metrics_status(int status);
+
+/**
+ * @brief Counts a request that failed to parse
+ *
+ * @param result Result of parse_request
+ */
+void metrics_request_result(request_result_t result);
+
+/**
+ * @brief Counts a failed client operation
+ *
+ * @param result Result of the client operation
+ */
+void metrics_client_result(client_result_t result);
+
+/**
+ * @brief Records a latency in a histogram of the calling thread
+ *
+ * @param histogram Histogram
+ * @param ns Latency in nanoseconds
+ */
+void metrics_observe(metric_histogram_t histogram, uint64_t ns);
+
+/**
+ * @brief Renders every metric in the Prometheus text format
+ *
+ * @param out Buffer to fill
+ * @param out_len Size of the buffer
+ * @return size_t Bytes written, truncated to whole lines if full
+ */
+size_t render_metrics(char* out, size_t out_len);
+
+/**
+ * @brief Starts the endpoint serving GET /metrics on its own port
+ *
+ * @param host Address to listen on
+ * @param port Port to listen on
+ * @param result Result of the operation
+ */
+void start_metrics(const char* host, int port, metrics_result_t* result);
+
+/**
+ * @brief Stops the endpoint
+ */
+void stop_metrics(void);
+
+#endif
@@ -0,0 +1,120 @@
+/**
+ * @file pool.h
+ * @brief Size-classed buffer pool and per-connection arenas for hyper project
+ *
+ * Blocks come in power of two size classes. Freed blocks go to a small
+ * per-thread cache and spill into a global free list per class, so once
+ * the pool has grown to the working set nothing is returned to malloc and
+ * nothing new is taken from it. Counters are kept by each thread and
+ * summed when read, the high water mark is sampled as the pool grows.
+ *
+ * An arena hands out request-scoped memory from pooled chunks and gives
+ * everything back at once when the connection moves on to its next
+ * request.
+ */
+
+#ifndef HYPER_POOL_H
+#define HYPER_POOL_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/** Smallest block, a power of two */
+#define POOL_MIN_BLOCK 64
+/** Number of size classes, the largest block is 64 KB */
+#define POOL_CLASSES 11
+/** Blocks a thread keeps per class before spilling to the global list */
+#define POOL_CACHE_BLOCKS 64
+/** Size of an arena chunk */
+#define ARENA_CHUNK_LEN 4096
+
+/**
+ * @brief Result of pool operations
+ */
+typedef enum {
+  POOL_SUCCESS    =  0,
+  POOL_ERR_MALLOC = -1
+} pool_result_t;
+
+/**
+ * @brief Counters of a size class
+ */
+typedef struct {
+  size_t size;                         /**< Block size, 0 for oversize  */
+  uint64_t in_use;                     /**< Blocks handed out           */
+  uint64_t high_water;                 /**< Most blocks seen handed out, sampled */
+  uint64_t misses;                     /**< Blocks taken from malloc    */
+} pool_stats_t;
+
+/**
+ * @brief Request-scoped allocator backed by pooled chunks
+ */
+typedef struct {
+  char* chunk;                         /**< First chunk, NULL if unused */
+  size_t used;                         /**< Bytes used in the chunk     */
+  void* extra;                         /**< Further chunks, newest first */
+} arena_t;
+
+/**
+ * @brief Takes a block of at least size bytes from the pool
+ *
+ * @param size Bytes needed
+ * @param result Result of the operation
+ * @return void* Block or NULL if error
+ * @note Sizes above the largest class are passed to malloc
+ */
+void* pool_alloc(size_t size, pool_result_t* result);
+
+/**
+ * @brief Returns a block to the pool
+ *
+ * @param block Block from pool_alloc or NULL
+ * @param size Size passed to pool_alloc
+ */
+void pool_free(void* block, size_t size);
+
+/**
+ * @brief Reads the counters of every size class
+ *
+ * @param out POOL_CLASSES + 1 entries, the last one counts oversize blocks
+ */
+void get_pool_stats(pool_stats_t out[]);
+
+/**
+ * @brief Logs the counters of every size class in use
+ */
+void log_pool_stats(void);
+
+/**
+ * @brief Initializes an empty arena
+ *
+ * @param arena Arena struct
+ */
+void init_arena(arena_t* arena);
+
+/**
+ * @brief Allocates request-scoped memory
+ *
+ * @param arena Arena struct
+ * @param size Bytes needed
+ * @param result Result of the operation
+ * @return void* Memory aligned to 16 bytes or NULL if error
+ */
+void* arena_alloc(arena_t* arena, size_t size, pool_result_t* result);
+
+/**
+ * @brief Frees everything allocated since the last reset
+ *
+ * @param arena Arena struct
+ * @note The first chunk is kept for the next request
+ */
+void reset_arena(arena_t* arena);
+
+/**
+ * @brief Returns every chunk of the arena to the pool
+ *
+ * @param arena Arena struct
+ */
+void release_arena(arena_t* arena);
+
+#endif
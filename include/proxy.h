@@ -0,0 +1,191 @@
+/**
+ * @file proxy.h
+ * @brief Reverse proxy exchanges for hyper project
+ *
+ * A request whose target matches a route is rewritten without its
+ * hop-by-hop headers and sent to a backend over a pooled keep-alive
+ * connection. The response head is rewritten the same way and queued on
+ * the client connection, then the body is relayed as it arrives: moved
+ * through a pipe with splice() when its length is known up front or ends
+ * with both connections, copied through a buffer when it is chunked or the
+ * sockets are served by a ring.
+ *
+ * A request body is decoded as it arrives and streamed after the head,
+ * through the same buffer, chunked again if it came chunked. A response
+ * whose body ends with the backend connection is chunked for a client
+ * connection that stays open.
+ *
+ * A backend that cannot be reached or fails before answering is retried
+ * on another one, and the client gets a 502 once every attempt failed.
+ * A POST the backend may have seen, and a request whose body was partly
+ * sent, are not retried.
+ *
+ * With a response cache, a request is answered from it when it can be.
+ * A miss fetches through the buffer so that a cacheable body is stored
+ * as it is relayed, and a request whose key is already being fetched
+ * waits for that fill instead of going to the backend too.
+ */
+
+#ifndef HYPER_PROXY_H
+#define HYPER_PROXY_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "body.h"
+#include "connection.h"
+#include "upstream.h"
+#include "response_cache.h"
+
+/** Backends tried per request, stale pooled connections not counted */
+#define PROXY_ATTEMPTS 3
+/** Size of the buffer a response head and copied body bytes go through */
+#define PROXY_BUFFER_LEN 16384
+/** Bytes moved per splice() */
+#define PROXY_SPLICE_LEN 65536
+
+/**
+ * @brief Proxy phases
+ */
+typedef enum {
+  PROXY_COALESCED = 0,                 /**< Waiting for another request's fill */
+  PROXY_SENDING   = 1,                 /**< Writing the request head    */
+  PROXY_UPLOAD    = 2,                 /**< Relaying the request body   */
+  PROXY_WAITING   = 3,                 /**< Reading the response head   */
+  PROXY_HEAD      = 4,                 /**< Writing the rewritten head  */
+  PROXY_BODY      = 5,                 /**< Relaying the rest of the body */
+  PROXY_DONE      = 6                  /**< Last body byte relayed      */
+} proxy_phase_t;
+
+/**
+ * @brief How the end of a response body is found
+ */
+typedef enum {
+  FRAMING_NONE    = 0,                 /**< No body                     */
+  FRAMING_LENGTH  = 1,                 /**< Content-Length bytes        */
+  FRAMING_CHUNKED = 2,                 /**< Chunked, up to the last chunk */
+  FRAMING_CLOSE   = 3                  /**< Until the backend closes    */
+} proxy_framing_t;
+
+/**
+ * @brief Proxy struct
+ *
+ * Lives in the connection arena for one exchange. The response written to
+ * the client is the connection's own, so relayed body bytes are added to
+ * its sent count and logged with it.
+ */
+typedef struct proxy {
+  upstream_pool_t* pool;               /**< Pool of the connection's owner */
+  const upstream_route_t* route;       /**< Route the target matched    */
+  upstream_conn_t* upstream;           /**< Backend connection or NULL  */
+  int reused;                          /**< upstream came from the pool */
+  int attempts;                        /**< Backends tried so far       */
+  proxy_phase_t phase;                 /**< Current phase               */
+  char* request;                       /**< Rewritten request head      */
+  size_t request_len;                  /**< Length of the request head  */
+  size_t request_sent;                 /**< Bytes of it sent            */
+  char* buffer;                        /**< Request body, then head and copied body bytes */
+  size_t buffer_len;                   /**< Bytes in the buffer         */
+  size_t buffer_sent;                  /**< Body bytes of it relayed    */
+  size_t pipe_len;                     /**< Bytes waiting in the pipe   */
+  proxy_framing_t framing;             /**< How the body ends           */
+  uint64_t remaining;                  /**< Body bytes left with FRAMING_LENGTH */
+  chunk_state_t chunk_state;           /**< Scanner state with FRAMING_CHUNKED */
+  uint64_t chunk_left;                 /**< Data bytes left in the chunk */
+  int chunk_digits;                    /**< Digits of the chunk size    */
+  int body_done;                       /**< Last body byte read         */
+  int chunk_out;                       /**< 1 if a body ending with the backend is chunked for the client */
+  int idempotent;                      /**< Request may be sent again once seen */
+  int head_only;                       /**< 1 for HEAD, the response has no body */
+  int body_taken;                      /**< 1 once request body bytes were taken from the client */
+  size_t continue_left;                /**< Bytes of a 100 Continue left for the client */
+  int reusable;                        /**< Backend keeps the connection */
+  short client_events;                 /**< Poll events awaited on the client */
+  short upstream_events;               /**< Poll events awaited on the backend */
+  response_cache_t* cache;             /**< Response cache or NULL      */
+  request_t* cached;                   /**< Rewritten request, parsed for the cache */
+  response_cache_entry_t* fill;        /**< Entry the response is stored in or NULL */
+  int64_t wait_until;                  /**< Monotonic ms a coalesced request stops waiting */
+} proxy_t;
+
+/**
+ * @brief Result of proxy operations
+ */
+typedef enum {
+  PROXY_SUCCESS    =  0,
+  PROXY_ERR_AGAIN  = -1,
+  PROXY_ERR_FAILED = -2,
+  PROXY_ERR_BROKEN = -3
+} proxy_result_t;
+
+/**
+ * @brief Starts forwarding a request to a backend of its route
+ *
+ * @param connection Connection struct
+ * @param request Parsed request, copied before it is consumed
+ * @param route Route the target matched
+ * @return int 0 if successful, -1 if error
+ * @note A request answered from the cache, and a connection without a
+ *       pool, a stream of an HTTP/2 session, or a request no backend could
+ *       be reached for, which are answered with a 502 unless cached, leave
+ *       connection->proxy NULL
+ */
+int start_proxy(connection_t* connection, const request_t* request, const upstream_route_t* route);
+
+/**
+ * @brief Relays the exchange until a socket would block or it ends
+ *
+ * @param connection Connection struct with a proxy
+ * @param result Result of the operation
+ * @note On anything but PROXY_ERR_AGAIN the backend connection is given
+ *       back and connection->proxy is NULL. PROXY_SUCCESS leaves the
+ *       relayed response to be finished like any other, PROXY_ERR_FAILED
+ *       means nothing reached the client yet and PROXY_ERR_BROKEN that the
+ *       response was cut short.
+ */
+void drive_proxy(connection_t* connection, proxy_result_t* result);
+
+/**
+ * @brief Gets the backend socket and the poll events it waits for
+ *
+ * @param proxy Proxy struct
+ * @param events Set to POLLIN, POLLOUT or 0
+ * @return int Socket of the backend connection or -1 if none
+ */
+int proxy_socket(const proxy_t* proxy, short* events);
+
+/**
+ * @brief Checks whether the exchange waits for another request's fill
+ *
+ * Nothing wakes it, the caller drives it again every RESPONSE_CACHE_WAIT_MS.
+ *
+ * @param proxy Proxy struct
+ * @return int 1 while coalesced
+ */
+int proxy_coalesced(const proxy_t* proxy);
+
+/**
+ * @brief Checks whether the exchange waits on the request body
+ *
+ * @param proxy Proxy struct
+ * @return int 1 while the body is relayed to the backend
+ */
+int proxy_uploading(const proxy_t* proxy);
+
+/**
+ * @brief Checks whether the client was sent anything yet
+ *
+ * @param proxy Proxy struct
+ * @return int 1 once the response head was queued
+ */
+int proxy_answered(const proxy_t* proxy);
+
+/**
+ * @brief Ends an exchange early and gives back its backend connection
+ *
+ * @param connection Connection struct with a proxy
+ * @param failed 1 to count it against the backend
+ */
+void abort_proxy(connection_t* connection, int failed);
+
+#endif
@@ -6,6 +6,7 @@
 #ifndef HYPER_REQUEST_H
 #define HYPER_REQUEST_H
 
+#include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
@@ -14,70 +15,188 @@
 
 #define HTTP_VERSION_PATTERN "HTTP/"
 
-#define METHOD_LEN 8
-#define VERSION_LEN 8
 #define FILE_NAME_LEN 256
+#define REQUEST_MAX_HEADERS 32
+
+/**
+ * @brief Slice of a request buffer
+ */
+typedef struct {
+  const char* ptr;                     /**< First byte       */
+  size_t len;                          /**< Number of bytes  */
+} slice_t;
+
+/**
+ * @brief Header struct
+ */
+typedef struct {
+  slice_t name;                        /**< Header name      */
+  slice_t value;                       /**< Trimmed value    */
+} header_t;
 
 /**
  * @brief Request struct
+ *
+ * Every field points into the buffer the request was parsed from, so the
+ * buffer must stay in place until the request is handled. The body is not
+ * part of the request, only how it is framed.
  */
 typedef struct {
-  char method[METHOD_LEN];             /**< Method    */
-  char version[VERSION_LEN];           /**< Version   */
-  char file_name[FILE_NAME_LEN];       /**< File name */
+  slice_t method;                      /**< Method                      */
+  slice_t target;                      /**< Request target              */
+  slice_t path;                        /**< Target without / and query  */
+  slice_t version;                     /**< Version, e.g. "1.1"         */
+  header_t headers[REQUEST_MAX_HEADERS]; /**< Headers in order          */
+  size_t header_count;                 /**< Number of headers           */
+  size_t length;                       /**< Bytes of the request head   */
+  int keep_alive;                      /**< 1 if the connection persists */
+  uint64_t content_length;             /**< Body bytes announced, 0 if none or chunked */
+  int chunked;                         /**< 1 if the body is chunked    */
 } request_t;
 
+/**
+ * @brief Parser states
+ */
+typedef enum {
+  PARSER_METHOD = 0,
+  PARSER_TARGET,
+  PARSER_VERSION,
+  PARSER_REQUEST_LINE_LF,
+  PARSER_HEADER_START,
+  PARSER_HEADER_NAME,
+  PARSER_HEADER_VALUE_START,
+  PARSER_HEADER_VALUE,
+  PARSER_HEADER_LF,
+  PARSER_HEADERS_END_LF,
+  PARSER_DONE
+} parser_state_t;
+
+/**
+ * @brief Incremental request parser struct
+ *
+ * Holds where parsing stopped so each call only looks at bytes that
+ * arrived since the last one, whatever the chunk boundaries.
+ */
+typedef struct {
+  parser_state_t state;                /**< Current state               */
+  size_t offset;                       /**< Next byte to look at        */
+  size_t mark;                         /**< Start of the current token  */
+} request_parser_t;
+
 /**
  * @brief Result of request operations
  */
 typedef enum {
   REQUEST_SUCCESS             =  0,
-  REQUEST_ERR_MALLOC          = -1,
+  REQUEST_INCOMPLETE          = -1,
   REQUEST_ERR_INVALID_METHOD  = -2,
   REQUEST_ERR_INVALID_VERSION = -3,
-  REQUEST_ERR_INVALID_FILE    = -4
+  REQUEST_ERR_INVALID_FILE    = -4,
+  REQUEST_ERR_MALFORMED       = -5,
+  REQUEST_ERR_TOO_MANY_HEADERS = -6,
+  REQUEST_ERR_URI_TOO_LONG    = -7,
+  REQUEST_ERR_HEADERS_TOO_LARGE = -8,
+  REQUEST_ERR_BODY_TOO_LARGE  = -9,
+  REQUEST_ERR_NOT_IMPLEMENTED = -10
 } request_result_t;
 
-/**
- * @brief Request cleanup struct
- */
-typedef struct {
-  int request_allocated;
-  void* request;
-} request_cleanup_t;
-
 /**
  * @brief Checks if a method is valid
  *
- * @param method Method string
+ * Any token is a method. Whether it is allowed depends on what serves the
+ * target, files answer GET and HEAD while proxied routes forward the rest.
+ *
+ * @param method Method slice
  * @return int 0 if valid, -1 if error
  */
-int is_valid_method(char method[METHOD_LEN]);
+int is_valid_method(slice_t method);
 
 /**
  * @brief Checks if a version is valid
  *
- * @param version Version string
+ * @param version Version slice
  * @return int 0 if valid, -1 if error
  */
-int is_valid_version(char version[VERSION_LEN]);
+int is_valid_version(slice_t version);
 
 /**
  * @brief Checks if a file path is valid
  *
- * @param file_name File name string
+ * Only the shape of the path is checked, so no system call is made.
+ * Whether the file exists is decided when it is served.
+ *
+ * @param path Path slice, without the leading slash
  * @return int 0 if valid, -1 if error
  */
-int is_valid_file(char file_name[FILE_NAME_LEN]);
+int is_valid_file(slice_t path);
+
+/**
+ * @brief Checks if a path has a dot-segment
+ *
+ * A segment of "." or ".." counts with its dots percent-encoded too, as
+ * a backend may decode them before it resolves the path.
+ *
+ * @param path Path slice, without the leading slash
+ * @return int 1 if it has a dot-segment, 0 otherwise
+ */
+int has_dot_segment(slice_t path);
 
 /**
- * @brief Parses a request
+ * @brief Compares a slice to a string, ignoring case
+ *
+ * @param slice Slice to compare
+ * @param str NUL-terminated string
+ * @return int 1 if equal, 0 otherwise
+ */
+int slice_equals(slice_t slice, const char* str);
+
+/**
+ * @brief Finds a header by name
+ *
+ * @param request Parsed request
+ * @param name Header name, matched case-insensitively
+ * @return const header_t* First matching header or NULL if missing
+ */
+const header_t* find_header(const request_t* request, const char* name);
+
+/**
+ * @brief Checks if a header lists a token
+ *
+ * @param request Parsed request
+ * @param name Header name, matched case-insensitively
+ * @param token Token to look for, matched case-insensitively
+ * @return int 1 if the header contains the token, 0 otherwise
+ */
+int header_has_token(const request_t* request, const char* name, const char* token);
+
+/**
+ * @brief Copies the requested file path into a NUL-terminated buffer
+ *
+ * @param request Parsed request
+ * @param file_name Buffer to fill, defaults to index.html
+ */
+void request_file_name(const request_t* request, char file_name[FILE_NAME_LEN]);
+
+/**
+ * @brief Resets a parser for a new request
+ *
+ * @param parser Parser struct
+ */
+void init_request_parser(request_parser_t* parser);
+
+/**
+ * @brief Parses a request incrementally
+ *
+ * Call again with the same buffer, grown by newly received bytes, while
+ * the result is REQUEST_INCOMPLETE. Nothing is allocated or copied.
  *
- * @param raw_request Raw request string
+ * @param parser Parser struct
+ * @param request Request to fill
+ * @param buff Buffer holding the request from its first byte
+ * @param buff_len Number of valid bytes in the buffer
  * @param result Result of the operation
- * @param cleanup Cleanup struct
- * @return request_t* Parsed request or NULL if error
  */
-request_t* parse_request(const char raw_request[], request_result_t* result, request_cleanup_t* cleanup);
+void parse_request(request_parser_t* parser, request_t* request, const char buff[], size_t buff_len,
+                   request_result_t* result);
 
-#endif
\ No newline at end of file
+#endif
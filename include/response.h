@@ -0,0 +1,177 @@
+/**
+ * @file response.h
+ * @brief Zero-copy response writing for hyper project
+ */
+
+#ifndef HYPER_RESPONSE_H
+#define HYPER_RESPONSE_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#include "client.h"
+#include "pool.h"
+
+/** Maximum number of segments in one response */
+#define RESPONSE_MAX_SEGMENTS 20
+/** Size of the response header buffer */
+#define RESPONSE_HEADER_LEN 1024
+
+/**
+ * @brief Response segment types
+ */
+typedef enum {
+  SEGMENT_MEMORY = 0,                  /**< Bytes already in memory     */
+  SEGMENT_FILE   = 1                   /**< Byte range of an open file  */
+} segment_type_t;
+
+/**
+ * @brief Response segment struct
+ */
+typedef struct {
+  segment_type_t type;                 /**< Type of the segment         */
+  const char* data;                    /**< Memory of a memory segment  */
+  int fd;                              /**< File of a file segment      */
+  off_t offset;                        /**< Next file offset to send    */
+  size_t len;                          /**< Bytes left to send          */
+} response_segment_t;
+
+/**
+ * @brief Response struct
+ *
+ * A response is an ordered list of memory and file segments. Consecutive
+ * memory segments go out in one writev() and file segments are streamed
+ * with sendfile(), so the body never passes through user space.
+ */
+typedef struct {
+  arena_t* arena;                      /**< Memory of the headers       */
+  char* header;                        /**< Status line and headers     */
+  size_t header_len;                   /**< Length of the headers       */
+  response_segment_t segments[RESPONSE_MAX_SEGMENTS]; /**< Segments     */
+  int segment_count;                   /**< Number of segments          */
+  int current;                         /**< First unfinished segment    */
+  int fd;                              /**< File owned by the response  */
+  void (*release)(void*);              /**< Called on reset if set      */
+  void* owner;                         /**< Argument of release         */
+  int status;                          /**< Status code, 0 if none      */
+  size_t sent;                         /**< Bytes sent so far           */
+  size_t body_offset;                  /**< Bytes of the head, sent before the body */
+} response_t;
+
+/**
+ * @brief Result of response operations
+ */
+typedef enum {
+  RESPONSE_SUCCESS       =  0,
+  RESPONSE_ERR_AGAIN     = -1,
+  RESPONSE_ERR_SEND      = -2,
+  RESPONSE_ERR_FULL      = -3
+} response_result_t;
+
+/**
+ * @brief Initializes an empty response
+ *
+ * @param response Response struct
+ * @param arena Arena the headers are allocated from
+ */
+void init_response(response_t* response, arena_t* arena);
+
+/**
+ * @brief Releases what the response owns and empties it
+ *
+ * @param response Response struct
+ */
+void reset_response(response_t* response);
+
+/**
+ * @brief Appends bytes to the response headers
+ *
+ * @param response Response struct
+ * @param data Bytes to copy
+ * @param len Number of bytes
+ * @return int 0 if successful, -1 if the headers do not fit
+ */
+int append_header_bytes(response_t* response, const char* data, size_t len);
+
+/**
+ * @brief Appends a string to the response headers
+ *
+ * @param response Response struct
+ * @param str NUL-terminated string
+ * @return int 0 if successful, -1 if the headers do not fit
+ */
+int append_header_string(response_t* response, const char* str);
+
+/**
+ * @brief Appends a decimal number to the response headers
+ *
+ * @param response Response struct
+ * @param value Number to write
+ * @return int 0 if successful, -1 if the headers do not fit
+ */
+int append_header_number(response_t* response, uint64_t value);
+
+/**
+ * @brief Appends the Date line and the blank line, then queues the headers
+ *
+ * Segments queued before hold the lines in front of these, so static
+ * header blocks are sent as they are, in the same writev().
+ *
+ * @param response Response struct
+ * @param result Result of the operation
+ */
+void end_headers(response_t* response, response_result_t* result);
+
+/**
+ * @brief Counts the body bytes sent so far
+ *
+ * @param response Response struct
+ * @return size_t Bytes sent past the head, 0 if it was not sent whole
+ */
+size_t body_sent(const response_t* response);
+
+/**
+ * @brief Drops the segments queued after the headers
+ *
+ * Answers HEAD with the headers of the response GET would get, the
+ * Content-Length included. What the response owns is still released on
+ * reset.
+ *
+ * @param response Response struct with its headers ended
+ */
+void drop_body(response_t* response);
+
+/**
+ * @brief Queues a memory segment
+ *
+ * @param response Response struct
+ * @param data Bytes to send, must outlive the response
+ * @param len Number of bytes
+ * @param result Result of the operation
+ */
+void add_memory_segment(response_t* response, const char* data, size_t len, response_result_t* result);
+
+/**
+ * @brief Queues a file segment
+ *
+ * @param response Response struct
+ * @param fd Open file to send from
+ * @param offset Offset of the first byte
+ * @param len Number of bytes
+ * @param result Result of the operation
+ */
+void add_file_segment(response_t* response, int fd, off_t offset, size_t len, response_result_t* result);
+
+/**
+ * @brief Sends as much of the response as the socket accepts
+ *
+ * @param client Client to send to
+ * @param response Response struct
+ * @param result Result of the operation
+ * @note result is RESPONSE_ERR_AGAIN if a non-blocking socket would block
+ *       before the response was fully sent
+ */
+void write_response(client_t* client, response_t* response, response_result_t* result);
+
+#endif
@@ -0,0 +1,221 @@
+/**
+ * @file response_cache.h
+ * @brief Shared cache of proxied responses for hyper project
+ *
+ * Responses a backend marks cacheable with max-age or s-maxage are kept
+ * under their method and target, one entry per combination of the
+ * request headers their Vary names. Entries live in memory and, when a
+ * cache directory is given, move to unlinked files there once evicted,
+ * from where their bodies are sent with sendfile().
+ *
+ * Concurrent misses of one key are coalesced: the first request fetches
+ * the response while the others wait for it to be stored. A stale entry
+ * within its stale-while-revalidate window is refetched by one request
+ * while the others are still answered from it.
+ */
+
+#ifndef HYPER_RESPONSE_CACHE_H
+#define HYPER_RESPONSE_CACHE_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <pthread.h>
+
+#include "request.h"
+#include "response.h"
+
+/** Number of independently locked shards */
+#define RESPONSE_CACHE_SHARDS 16
+/** Hash buckets per shard */
+#define RESPONSE_CACHE_BUCKETS 1024
+/** Largest body kept */
+#define RESPONSE_CACHE_MAX_ENTRY_SIZE (1024 * 1024)
+/** Longest stored head, it is sent as it is over HTTP/2 too */
+#define RESPONSE_CACHE_HEAD_LEN RESPONSE_HEADER_LEN
+/** Milliseconds between looks of a request waiting for another one's fill */
+#define RESPONSE_CACHE_WAIT_MS 10
+/** Milliseconds an uncacheable response sends its key straight to the backend */
+#define RESPONSE_CACHE_PASS_MS 5000
+/** Disk tier budget as a multiple of the memory budget */
+#define RESPONSE_CACHE_DISK_RATIO 8
+/** Smallest body worth a file of the disk tier */
+#define RESPONSE_CACHE_DISK_MIN 16384
+/** Files of the disk tier per shard, each holds a descriptor */
+#define RESPONSE_CACHE_DISK_ENTRIES 32
+
+/**
+ * @brief Response cache entry struct
+ *
+ * Entries are reference counted like those of the file cache. An entry
+ * being filled is linked as a placeholder only to make requests for the
+ * same key wait, it is relinked with its final cost once complete.
+ */
+typedef struct response_cache_entry {
+  char* key;                           /**< Method, space and target    */
+  size_t key_len;                      /**< Length of the key           */
+  uint64_t hash;                       /**< Hash of the key             */
+  char* vary;                          /**< "name:value\n" per Vary name, NULL if none */
+  size_t vary_len;                     /**< Length of vary              */
+  char* head;                          /**< Status line and stored headers */
+  size_t head_len;                     /**< Length of the head          */
+  char* body;                          /**< Body bytes, NULL on disk    */
+  size_t body_len;                     /**< Length of the body          */
+  size_t filled;                       /**< Body bytes stored so far    */
+  int fd;                              /**< Body file on disk or -1     */
+  int64_t stored;                      /**< Monotonic ms the response arrived */
+  int64_t age;                         /**< Age in seconds it arrived with */
+  int64_t expires;                     /**< Monotonic ms it turns stale */
+  int64_t stale_until;                 /**< Monotonic ms it may be served stale until */
+  int pass;                            /**< 1 for a marker of an uncacheable response */
+  int filling;                         /**< 1 while its response is fetched */
+  int refreshing;                      /**< 1 while a request refetches it */
+  struct response_cache_entry* replaces; /**< Stale entry a refetch replaces or NULL */
+  int linked;                          /**< 1 while in a shard          */
+  int disk;                            /**< 1 if in the disk ring       */
+  size_t cost;                         /**< Bytes charged to the shard  */
+  int refs;                            /**< References, atomic          */
+  int referenced;                      /**< CLOCK reference bit         */
+  struct response_cache_entry* next;   /**< Next in hash bucket         */
+  struct response_cache_entry* clock_prev; /**< Previous in CLOCK ring  */
+  struct response_cache_entry* clock_next; /**< Next in CLOCK ring      */
+  struct response_cache_entry* evicted; /**< Next entry to move to disk */
+} response_cache_entry_t;
+
+/**
+ * @brief Response cache shard struct
+ */
+typedef struct {
+  pthread_mutex_t lock;                /**< Guards the shard            */
+  response_cache_entry_t* buckets[RESPONSE_CACHE_BUCKETS]; /**< Hash chains */
+  response_cache_entry_t* hand;        /**< CLOCK hand of memory entries */
+  response_cache_entry_t* disk_hand;   /**< CLOCK hand of disk entries  */
+  size_t used;                         /**< Bytes held in memory        */
+  size_t disk_used;                    /**< Bytes held on disk          */
+  int disk_count;                      /**< Entries on disk             */
+} response_cache_shard_t;
+
+/**
+ * @brief Response cache struct
+ */
+typedef struct {
+  response_cache_shard_t shards[RESPONSE_CACHE_SHARDS]; /**< Shards     */
+  size_t shard_capacity;               /**< Memory budget of each shard */
+  size_t disk_capacity;                /**< Disk budget of each shard, 0 without a directory */
+  size_t max_entry_size;               /**< Largest body kept           */
+  int dir_fd;                          /**< Directory of the disk tier or -1 */
+} response_cache_t;
+
+/**
+ * @brief Outcomes of a lookup
+ */
+typedef enum {
+  RESPONSE_CACHE_HIT    = 0,           /**< Fresh entry, serve it       */
+  RESPONSE_CACHE_STALE  = 1,           /**< Stale entry being refetched, serve it */
+  RESPONSE_CACHE_FILL   = 2,           /**< Fetch the response into the entry */
+  RESPONSE_CACHE_WAIT   = 3,           /**< Another request fetches it, look again */
+  RESPONSE_CACHE_BYPASS = 4            /**< Fetch the response, nothing is stored */
+} response_cache_lookup_t;
+
+/**
+ * @brief Result of response cache operations
+ */
+typedef enum {
+  RESPONSE_CACHE_SUCCESS    =  0,
+  RESPONSE_CACHE_ERR_MALLOC = -1,
+  RESPONSE_CACHE_ERR_DISK   = -2
+} response_cache_result_t;
+
+/**
+ * @brief Creates a response cache
+ *
+ * @param capacity Memory budget, split evenly across shards
+ * @param dir Directory of the disk tier or NULL for none
+ * @param result Result of the operation
+ * @return response_cache_t* Pointer to new cache or NULL if error
+ */
+response_cache_t* create_response_cache(size_t capacity, const char* dir, response_cache_result_t* result);
+
+/**
+ * @brief Looks up the response to a request
+ *
+ * Only GET requests without credentials or a body are cached. Requests
+ * asking for no-cache are fetched and replace what is cached without
+ * waiting for others, conditional and range requests are answered from
+ * an entry but never fill one.
+ *
+ * @param cache Response cache struct
+ * @param request Request as sent to the backend
+ * @param fill 0 if the caller cannot fetch, which turns FILL and WAIT into BYPASS
+ * @param lookup Set to the outcome
+ * @return response_cache_entry_t* Referenced entry for HIT, STALE and FILL,
+ *         NULL otherwise
+ */
+response_cache_entry_t* response_cache_lookup(response_cache_t* cache, const request_t* request, int fill,
+                                              response_cache_lookup_t* lookup);
+
+/**
+ * @brief Decides from the response head whether a fill is stored
+ *
+ * @param cache Response cache struct
+ * @param entry Entry returned with RESPONSE_CACHE_FILL
+ * @param request Request as sent to the backend
+ * @param head Response head as received, blank line included
+ * @param head_len Length of the head
+ * @param status Status code of the response
+ * @param body_len Length of the body, -1 if not known up front
+ * @return int 0 if the body is to be appended, -1 if the response is not
+ *         cacheable
+ */
+int response_cache_begin(response_cache_t* cache, response_cache_entry_t* entry, const request_t* request,
+                         const char* head, size_t head_len, int status, int64_t body_len);
+
+/**
+ * @brief Appends body bytes to an entry being filled
+ *
+ * @param entry Entry accepted by response_cache_begin
+ * @param data Body bytes
+ * @param len Number of bytes
+ */
+void response_cache_append(response_cache_entry_t* entry, const char* data, size_t len);
+
+/**
+ * @brief Ends a fill and drops the reference taken by the lookup
+ *
+ * A complete entry replaces the ones it was fetched for, an uncacheable
+ * response leaves a marker sending its key to the backend for a while,
+ * and anything else is dropped so that a waiting request fetches again.
+ *
+ * @param cache Response cache struct
+ * @param entry Entry returned with RESPONSE_CACHE_FILL
+ * @param complete 1 if the whole body arrived
+ */
+void response_cache_finish(response_cache_t* cache, response_cache_entry_t* entry, int complete);
+
+/**
+ * @brief Queues a cached response
+ *
+ * The response holds a reference to the entry until it is reset.
+ *
+ * @param entry Entry returned with RESPONSE_CACHE_HIT or RESPONSE_CACHE_STALE
+ * @param response Response to queue it on
+ * @param keep_alive 1 if the connection stays open
+ * @param result Result of the operation
+ */
+void queue_cached_response(response_cache_entry_t* entry, response_t* response, int keep_alive,
+                           response_result_t* result);
+
+/**
+ * @brief Drops a reference taken by response_cache_lookup
+ *
+ * @param entry Response cache entry struct
+ */
+void response_cache_release(response_cache_entry_t* entry);
+
+/**
+ * @brief Frees the cache and every entry it holds
+ *
+ * @param cache Response cache struct
+ */
+void close_response_cache(response_cache_t* cache);
+
+#endif
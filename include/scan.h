@@ -0,0 +1,72 @@
+/**
+ * @file scan.h
+ * @brief Vectorized byte class scanning for hyper project
+ */
+
+#ifndef HYPER_SCAN_H
+#define HYPER_SCAN_H
+
+#include <stddef.h>
+
+/**
+ * @brief Scanner implementations
+ */
+typedef enum {
+  SCAN_IMPL_AUTO   = 0,                /**< Best the CPU supports        */
+  SCAN_IMPL_SCALAR = 1,                /**< Table lookup per byte        */
+  SCAN_IMPL_SSE42  = 2,                /**< 16 bytes per step, PCMPESTRI */
+  SCAN_IMPL_AVX2   = 3                 /**< 32 bytes per step            */
+} scan_impl_t;
+
+/**
+ * @brief Selects the scanner implementation
+ *
+ * Called with SCAN_IMPL_AUTO at startup, which picks the widest kernel
+ * cpuid reports. Benchmarks may force a specific one.
+ *
+ * @param impl Implementation to use
+ * @return int 0 if successful, -1 if the CPU lacks it
+ */
+int set_scan_impl(scan_impl_t impl);
+
+/**
+ * @brief Gets the name of the active scanner implementation
+ *
+ * @return const char* Name of the implementation
+ */
+const char* scan_impl_name(void);
+
+/**
+ * @brief Counts leading token (tchar) bytes
+ *
+ * Stops at the first delimiter, such as a space or a colon.
+ *
+ * @param buff Bytes to scan
+ * @param len Number of bytes
+ * @return size_t Length of the run
+ */
+size_t scan_token(const char* buff, size_t len);
+
+/**
+ * @brief Counts leading visible ASCII bytes
+ *
+ * Used for request targets and versions, stops at a space or CR.
+ *
+ * @param buff Bytes to scan
+ * @param len Number of bytes
+ * @return size_t Length of the run
+ */
+size_t scan_target(const char* buff, size_t len);
+
+/**
+ * @brief Counts leading field value bytes
+ *
+ * Accepts visible bytes, obs-text, space and tab, stops at CR.
+ *
+ * @param buff Bytes to scan
+ * @param len Number of bytes
+ * @return size_t Length of the run
+ */
+size_t scan_value(const char* buff, size_t len);
+
+#endif
@@ -10,24 +10,49 @@
 #include <stdint.h>
 #include <pthread.h>
 #include <fcntl.h>
+#include <sys/stat.h>
 
 #include "net.h"
 #include "logger.h"
 #include "client.h"
 #include "request.h"
+#include "connection.h"
+#include "config.h"
+#include "file_cache.h"
+#include "access_log.h"
+#include "admission.h"
+#include "upstream.h"
+#include "response_cache.h"
+#include "tls.h"
 
-/** Maximum number of concurrent clients */
-#define MAX_CLIENTS 5
-#define MAX_RESPONSE_LENGTH 65536
-#define MAX_FILE_LENGTH 32768
+/** Most listening sockets of one server */
+#define SERVER_MAX_LISTENERS 256
+/** Milliseconds a draining server keeps connections waiting for a request */
+#define SERVER_DRAIN_GRACE_MS 1000
+/** Listening sockets handed to a new process, comma separated */
+#define SERVER_LISTEN_FDS_ENV "HYPER_LISTEN_FDS"
 
 /**
  * @brief Server struct
  */
-typedef struct {
+typedef struct server {
   char host[INET_ADDRSTRLEN];          /**< Hostname of the server */
   int port;                            /**< Port of the server     */
   int socket;                          /**< Socket of the server   */
+  const config_t* config;              /**< Server configuration   */
+  file_cache_t* cache;                 /**< Static file cache      */
+  access_log_t* access_log;            /**< Access log or NULL     */
+  admission_t* admission;              /**< Connection limits      */
+  upstream_t* upstream;                /**< Proxied routes or NULL */
+  response_cache_t* response_cache;    /**< Cache of proxied responses or NULL */
+  tls_t* tls;                          /**< TLS context or NULL for cleartext */
+  int listeners[SERVER_MAX_LISTENERS]; /**< Listening sockets, socket first */
+  int listener_count;                  /**< Number of listeners    */
+  int inherited;                       /**< Listeners taken over from the previous process */
+  int wake_fd;                         /**< Readable once draining, never read */
+  int draining;                        /**< 1 once told to stop accepting, atomic */
+  int64_t drain_deadline;              /**< Monotonic ms when draining ends */
+  int active_threads;                  /**< Connection threads running, atomic */
 } server_t;
 
 /**
@@ -41,6 +66,11 @@ typedef enum {
   SERVER_ERR_BIND = -4,
   SERVER_ERR_LISTEN = -5,
   SERVER_ERR_ACCEPT = -6,
+  SERVER_ERR_AGAIN = -7,
+  SERVER_ERR_FCNTL = -8,
+  SERVER_ERR_BPF = -9,
+  SERVER_ERR_EVENTFD = -10,
+  SERVER_ERR_INHERIT = -11,
 } server_result_t;
 
 /**
@@ -55,13 +85,18 @@ typedef struct {
 /**
  * @brief Creates a server and returns it
  *
+ * If SERVER_LISTEN_FDS_ENV names listening sockets left open by the
+ * previous process, the server takes them over instead of binding, so
+ * connections queued on them are never refused.
+ *
  * @param host Hostname of the server
  * @param port Port of the server
+ * @param reuseport 1 to let more listeners bind the same address
  * @param result Result of the operation
  * @param cleanup Cleanup struct
  * @return server_t* Pointer to new server or NULL if error
  */
-server_t* create_server(char host[], int port, server_result_t* result, server_cleanup_t* cleanup);
+server_t* create_server(char host[], int port, int reuseport, server_result_t* result, server_cleanup_t* cleanup);
 
 /**
  * @brief Listens for connections on the server
@@ -71,13 +106,62 @@ server_t* create_server(char host[], int port, server_result_t* result, server_c
  */
 int listen_server(server_t* server);
 
+/**
+ * @brief Puts the server socket into non-blocking mode
+ *
+ * @param server server_t struct
+ * @return int 0 if successful, -1 if error
+ */
+int set_server_nonblocking(server_t* server);
+
+/**
+ * @brief Opens another listener on the server address
+ *
+ * The listener joins the SO_REUSEPORT group of the server socket, so the
+ * kernel spreads new connections across the group instead of queueing
+ * them all on one socket. Inherited listeners are handed out first.
+ *
+ * @param server server_t struct
+ * @param result Result of the operation
+ * @return int Non-blocking listening socket or -1 if error
+ */
+int open_listener(server_t* server, server_result_t* result);
+
+/**
+ * @brief Steers each connection to the listener of the CPU receiving it
+ *
+ * Attaches a classic BPF program to the SO_REUSEPORT group returning the
+ * receiving CPU modulo the group size. With listener i served by a worker
+ * pinned to CPU i, a connection is handled where its packets arrive.
+ *
+ * @param server server_t struct
+ * @param listeners Number of listeners in the group
+ * @param result Result of the operation
+ */
+void steer_listeners(server_t* server, int listeners, server_result_t* result);
+
 /**
  * @brief Accepts a connection on the server and appends to clients
  *
  * @param server server_t struct
+ * @param listener Listening socket to accept from
+ * @param flags SOCK_NONBLOCK and SOCK_CLOEXEC for the client socket
+ * @param result Result of the operation
+ * @return client_t* Pointer to new client or NULL if error
+ * @note result is SERVER_ERR_AGAIN if a non-blocking server has no pending
+ *       connection
+ */
+client_t* accept_client(server_t* server, int listener, int flags, server_result_t* result);
+
+/**
+ * @brief Creates a client for a socket accepted elsewhere
+ *
+ * @param client_socket Accepted socket
+ * @param result Result of the operation
  * @return client_t* Pointer to new client or NULL if error
+ * @note The socket is closed if the client cannot be created
  */
- client_t* accept_client(server_t* server);
+client_t* adopt_client(int client_socket, server_result_t* result);
 
 /**
  * @brief Creates handler threads
@@ -91,7 +175,10 @@ int handle_client(server_t* server, client_t* client);
 /**
  * @brief Handles client requests and responds accordingly in a thread
  *
- * @param argp client_t struct
+ * The client socket is non-blocking, so the thread can give up on a client
+ * that misses the deadline of its phase.
+ *
+ * @param argp connection_t struct
  * @return void* NULL
  */
 void* handle_client_thread(void* argp);
@@ -99,11 +186,31 @@ void* handle_client_thread(void* argp);
 /**
  * @brief Handles a request from a client
  *
- * @param client client_t struct
+ * Queues the headers and the file as response segments on the connection,
+ * which sends them once the socket is writable. Cached files are sent from
+ * memory, others are never read into user space. Text files are sent
+ * compressed to clients that accept it, and validators and Range turn the
+ * response into a 304, 206 or 416. Targets under a proxied route are
+ * forwarded to its backends instead, bodies and all. Files only answer
+ * GET, and the connection skips any body they leave unread.
+ *
+ * @param connection connection_t struct
  * @param request request_t struct
  * @return int 0 if successful, -1 if error
  */
-int handle_request(client_t* client, request_t* request);
+int handle_request(connection_t* connection, request_t* request);
+
+/**
+ * @brief Stops accepting and lets open connections finish
+ *
+ * Every worker watches wake_fd, so writing it once wakes all of them.
+ * Connections waiting for a request are closed after SERVER_DRAIN_GRACE_MS,
+ * the others are answered with Connection: close until the deadline passes.
+ *
+ * @param server server_t struct
+ * @param timeout Seconds connections are given to finish
+ */
+void drain_server(server_t* server, int timeout);
 
 /**
  * @brief Closes the server
@@ -0,0 +1,80 @@
+/**
+ * @file status.h
+ * @brief Preformatted error responses and the cached Date header for hyper project
+ *
+ * Error responses are static byte buffers, so rejecting a request costs
+ * one writev() of memory that is never formatted. The Date line is
+ * formatted once a second by a clock thread and copied into responses.
+ */
+
+#ifndef HYPER_STATUS_H
+#define HYPER_STATUS_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "request.h"
+#include "response.h"
+
+/** Length of "Date: " + IMF-fixdate + CRLF */
+#define STATUS_DATE_LINE_LEN 37
+
+/**
+ * @brief Result of status operations
+ */
+typedef enum {
+  STATUS_SUCCESS    =  0,
+  STATUS_ERR_THREAD = -1
+} status_result_t;
+
+/**
+ * @brief Maps a failed parse to the status that answers it
+ *
+ * @param result Parse result other than success or incomplete
+ * @return int 400, 405, 413, 414, 431, 501 or 505
+ */
+int request_result_status(request_result_t result);
+
+/**
+ * @brief Queues a preformatted error response
+ *
+ * @param response Empty response struct
+ * @param status 400, 404, 405, 413, 414, 431, 501, 502, 503, 504 or 505
+ * @param keep_alive 0 to add Connection: close
+ * @param result Result of the operation
+ */
+void queue_status(response_t* response, int status, int keep_alive, response_result_t* result);
+
+/**
+ * @brief Sends a preformatted error response and nothing more
+ *
+ * For clients refused before they get a connection. One writev() that
+ * is not retried, a client that cannot take it at once loses it. A TLS
+ * client is refused before its handshake ends, so nothing is sent to it
+ * and it is only closed.
+ *
+ * @param client Client to send to
+ * @param status 400, 404, 405, 413, 414, 431, 501, 502, 503, 504 or 505
+ */
+void send_status(client_t* client, int status);
+
+/**
+ * @brief Copies the current Date line
+ *
+ * @param line Filled with "Date: ...\r\n", not NUL-terminated
+ */
+void copy_date_line(char line[STATUS_DATE_LINE_LEN]);
+
+/**
+ * @brief Formats the Date line and starts refreshing it every second
+ *
+ * @param result Result of the operation
+ */
+void start_clock(status_result_t* result);
+
+/**
+ * @brief Stops refreshing the Date line
+ */
+void stop_clock(void);
+
+#endif
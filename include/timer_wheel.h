@@ -0,0 +1,94 @@
+/**
+ * @file timer_wheel.h
+ * @brief Hashed timer wheel for hyper project
+ *
+ * Timers hash into one of TIMER_WHEEL_SLOTS lists by the tick they expire
+ * in, so scheduling and cancelling cost O(1) however many are pending.
+ * Timers further out than one turn of the wheel wait in their slot until
+ * their turn comes around. A wheel belongs to one thread and takes no
+ * locks.
+ */
+
+#ifndef HYPER_TIMER_WHEEL_H
+#define HYPER_TIMER_WHEEL_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/** Milliseconds per tick, timers fire up to one tick late */
+#define TIMER_WHEEL_TICK_MS 100
+/** Slots in the wheel, a power of two */
+#define TIMER_WHEEL_SLOTS 512
+
+/**
+ * @brief Timer embedded in its owner
+ */
+typedef struct wheel_timer {
+  int64_t expires;                     /**< Monotonic ms it fires at    */
+  void* owner;                         /**< Returned when it fires      */
+  int slot;                            /**< Slot or -1 if not scheduled */
+  struct wheel_timer* prev;            /**< Previous in slot            */
+  struct wheel_timer* next;            /**< Next in slot or expired list */
+} wheel_timer_t;
+
+/**
+ * @brief Timer wheel struct
+ */
+typedef struct {
+  wheel_timer_t* slots[TIMER_WHEEL_SLOTS]; /**< Timers by expiry tick   */
+  int64_t tick;                        /**< Next tick to expire         */
+  size_t count;                        /**< Scheduled timers            */
+} timer_wheel_t;
+
+/**
+ * @brief Initializes an empty wheel
+ *
+ * @param wheel Timer wheel struct
+ * @param now Current monotonic ms
+ */
+void init_timer_wheel(timer_wheel_t* wheel, int64_t now);
+
+/**
+ * @brief Initializes a timer that is not scheduled
+ *
+ * @param timer Timer struct
+ * @param owner Returned with the timer when it fires
+ */
+void init_wheel_timer(wheel_timer_t* timer, void* owner);
+
+/**
+ * @brief Schedules a timer, moving it if it is already scheduled
+ *
+ * @param wheel Timer wheel struct
+ * @param timer Timer struct
+ * @param expires Monotonic ms to fire at
+ */
+void schedule_timer(timer_wheel_t* wheel, wheel_timer_t* timer, int64_t expires);
+
+/**
+ * @brief Unschedules a timer, if it is scheduled
+ *
+ * @param wheel Timer wheel struct
+ * @param timer Timer struct
+ */
+void cancel_timer(timer_wheel_t* wheel, wheel_timer_t* timer);
+
+/**
+ * @brief Unschedules every timer that expired
+ *
+ * @param wheel Timer wheel struct
+ * @param now Current monotonic ms
+ * @return wheel_timer_t* Expired timers linked through next, NULL if none
+ */
+wheel_timer_t* expire_timers(timer_wheel_t* wheel, int64_t now);
+
+/**
+ * @brief Gets the time until expire_timers() has work
+ *
+ * @param wheel Timer wheel struct
+ * @param now Current monotonic ms
+ * @return int Milliseconds to wait or -1 if the wheel is empty
+ */
+int next_timer_timeout(timer_wheel_t* wheel, int64_t now);
+
+#endif
@@ -0,0 +1,138 @@
+/**
+ * @file tls.h
+ * @brief TLS termination for hyper project
+ *
+ * Clients of a TLS server get an OpenSSL session when they are accepted.
+ * The handshake is driven by the first receives, nothing is sent before it
+ * ends. Once it has, OpenSSL hands the send keys to the kernel (kTLS)
+ * where it can, and writev_client() and sendfile_client() go straight to
+ * the socket again, file bodies included. Without kTLS responses are
+ * sealed by OpenSSL a record at a time. Receives always pass through
+ * OpenSSL, which still sees alerts and post-handshake messages.
+ *
+ * Clients served by TLS keep using the client_t API: like on a
+ * non-blocking socket, CLIENT_ERR_AGAIN means the call is repeated with
+ * the same bytes once the socket is ready, which is also what OpenSSL
+ * needs to finish a record it started.
+ *
+ * Every worker shares one context, so a session resumes wherever its
+ * client lands, from a ticket or from the shared session cache.
+ */
+
+#ifndef HYPER_TLS_H
+#define HYPER_TLS_H
+
+#include <stddef.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+#include "client.h"
+
+/** Largest plaintext of one record, what a send without kTLS seals at once */
+#define TLS_RECORD_LEN 16384
+/** Sessions kept in the shared session cache */
+#define TLS_SESSION_CACHE_SIZE 20480
+/** Seconds a session can be resumed */
+#define TLS_SESSION_TIMEOUT 7200
+/** Tickets issued after a full handshake */
+#define TLS_TICKETS 2
+
+/**
+ * @brief TLS context shared by every worker
+ */
+typedef struct tls tls_t;
+
+/**
+ * @brief Result of TLS operations
+ */
+typedef enum {
+  TLS_SUCCESS      =  0,
+  TLS_ERR_MALLOC   = -1,
+  TLS_ERR_CERT     = -2,
+  TLS_ERR_KEY      = -3,
+  TLS_ERR_SETUP    = -4
+} tls_result_t;
+
+/**
+ * @brief Creates the TLS context of a server
+ *
+ * Offers TLS 1.3 and 1.2, http/1.1 and optionally h2 by ALPN, session
+ * tickets and a server-side session cache, and kTLS once a handshake ends.
+ *
+ * @param cert_path PEM certificate chain, leaf first
+ * @param key_path PEM private key, NULL if it follows the chain in cert_path
+ * @param h2 1 to offer h2 ahead of http/1.1
+ * @param result Result of the operation
+ * @return tls_t* Pointer to new context or NULL if error
+ */
+tls_t* create_tls(const char* cert_path, const char* key_path, int h2, tls_result_t* result);
+
+/**
+ * @brief Serves a client through TLS
+ *
+ * @param tls TLS context of the server
+ * @param client Accepted client, non-blocking socket
+ * @param result Result of the operation
+ */
+void tls_attach_client(tls_t* tls, client_t* client, tls_result_t* result);
+
+/**
+ * @brief Closes the TLS context
+ *
+ * @param tls TLS context
+ * @note Clients still attached keep a reference and stay usable
+ */
+void close_tls(tls_t* tls);
+
+/**
+ * @brief Receives through TLS, see recv_client
+ *
+ * Drives the handshake until it ends, then decrypts records.
+ *
+ * @param client Client served by TLS
+ * @param buff Buffer of the request
+ * @param buff_len Length of the buffer
+ * @param result Result of the operation
+ * @return ssize_t Number of bytes received or -1 if error
+ */
+ssize_t tls_recv(client_t* client, char buff[], size_t buff_len, client_result_t* result);
+
+/**
+ * @brief Sends through OpenSSL, see writev_client
+ *
+ * Small buffers are gathered into one record, a buffer of a record or
+ * more is sealed in place.
+ *
+ * @param client Client served by TLS without kTLS
+ * @param iov Buffers to send in order
+ * @param iov_count Number of buffers
+ * @param result Result of the operation
+ * @return ssize_t Number of bytes sent or -1 if error
+ */
+ssize_t tls_writev(client_t* client, const struct iovec* iov, int iov_count, client_result_t* result);
+
+/**
+ * @brief Sends part of a file through OpenSSL, see sendfile_client
+ *
+ * Reads one record of the file and seals it.
+ *
+ * @param client Client served by TLS without kTLS
+ * @param fd File to send from
+ * @param offset Offset to send from, advanced by the bytes sent
+ * @param len Number of bytes to send
+ * @param result Result of the operation
+ * @return ssize_t Number of bytes sent or -1 if error
+ */
+ssize_t tls_sendfile(client_t* client, int fd, off_t* offset, size_t len, client_result_t* result);
+
+/**
+ * @brief Ends the TLS session of a client
+ *
+ * Sends close_notify if the session is still sound, without waiting for
+ * the peer's.
+ *
+ * @param client Client served by TLS
+ */
+void tls_close_client(client_t* client);
+
+#endif
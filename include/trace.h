@@ -0,0 +1,140 @@
+/**
+ * @file trace.h
+ * @brief Sampled per-phase request tracing for hyper project
+ *
+ * Compiled in with -DHYPER_TRACE (make hyper-trace), otherwise every
+ * TRACE_* macro expands to nothing and connections carry no trace state.
+ *
+ * One request in TRACE_SAMPLE_RATE is timestamped at each phase boundary
+ * with the TSC, or CLOCK_MONOTONIC_RAW where there is none. Finished spans
+ * go to a per-thread ring and per-phase histograms. SIGUSR1 writes the
+ * recent spans as Chrome trace-event JSON and logs the histograms.
+ */
+
+#ifndef HYPER_TRACE_H
+#define HYPER_TRACE_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+
+/** Requests per sampled request, e.g. -DTRACE_SAMPLE_RATE=1 traces all */
+#ifndef TRACE_SAMPLE_RATE
+#define TRACE_SAMPLE_RATE 64
+#endif
+
+/** Directory the SIGUSR1 dumps are written to */
+#ifndef TRACE_DIR
+#define TRACE_DIR "/tmp"
+#endif
+
+/** Spans kept per thread, a power of two */
+#define TRACE_RING_SIZE 4096
+/** Histogram buckets, bucket i counts up to 2^i ns */
+#define TRACE_BUCKETS 40
+
+/**
+ * @brief Timestamps of a request, in the order they are taken
+ */
+typedef enum {
+  TRACE_START  = 0,                    /**< Accepted or previous reply sent */
+  TRACE_RECV   = 1,                    /**< First bytes of the request      */
+  TRACE_READ   = 2,                    /**< Last bytes, parse begins        */
+  TRACE_PARSE  = 3,                    /**< Parsed and path validated       */
+  TRACE_OPEN   = 4,                    /**< File opened or found in cache   */
+  TRACE_QUEUE  = 5,                    /**< Response queued                 */
+  TRACE_SENT   = 6,                    /**< Last byte sent                  */
+  TRACE_STAMPS = 7
+} trace_stamp_t;
+
+/** Phases, the intervals between consecutive stamps */
+#define TRACE_PHASES (TRACE_STAMPS - 1)
+
+/**
+ * @brief Trace state of a connection
+ */
+typedef struct {
+  int active;                          /**< 1 once the request began    */
+  int sampled;                         /**< 1 if the request is traced  */
+  uint64_t receiving;                  /**< Last recv started, in ticks */
+  uint64_t stamps[TRACE_STAMPS];       /**< Timestamps, in ticks        */
+} trace_t;
+
+/**
+ * @brief Result of trace operations
+ */
+typedef enum {
+  TRACE_SUCCESS    =  0,
+  TRACE_ERR_PIPE   = -1,
+  TRACE_ERR_SIGNAL = -2,
+  TRACE_ERR_THREAD = -3
+} trace_result_t;
+
+#ifdef HYPER_TRACE
+
+/**
+ * @brief Gets the current time in ticks
+ *
+ * @return uint64_t TSC value, or CLOCK_MONOTONIC_RAW nanoseconds
+ */
+static inline uint64_t trace_now(void) {
+#if defined(__x86_64__) || defined(__i386__)
+  return __builtin_ia32_rdtsc();
+#else
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC_RAW, &now);
+  return (uint64_t)now.tv_sec * 1000000000ULL + (uint64_t)now.tv_nsec;
+#endif
+}
+
+/**
+ * @brief Initializes the trace state of a new connection
+ *
+ * @param trace Trace state
+ */
+void trace_connection(trace_t* trace);
+
+/**
+ * @brief Begins the span of the next request, sampling one in TRACE_SAMPLE_RATE
+ *
+ * @param trace Trace state
+ * @param received When the first bytes of the request were asked for
+ */
+void trace_begin(trace_t* trace, uint64_t received);
+
+/**
+ * @brief Ends the span of the current request and records it if sampled
+ *
+ * @param trace Trace state
+ */
+void trace_end(trace_t* trace);
+
+/**
+ * @brief Calibrates the clock and starts the SIGUSR1 dump thread
+ *
+ * @param result Result of the operation
+ */
+void start_trace(trace_result_t* result);
+
+/**
+ * @brief Stops the dump thread
+ */
+void stop_trace(void);
+
+#define TRACE_CONNECTION(trace) trace_connection(trace)
+#define TRACE_RECEIVING(trace) ((trace)->receiving = trace_now())
+#define TRACE_BEGIN(trace, received) do { if (!(trace)->active) trace_begin(trace, received); } while (0)
+#define TRACE_MARK(trace, stamp) do { if ((trace)->sampled) (trace)->stamps[stamp] = trace_now(); } while (0)
+#define TRACE_END(trace) trace_end(trace)
+
+#else
+
+#define TRACE_CONNECTION(trace) ((void)0)
+#define TRACE_RECEIVING(trace) ((void)0)
+#define TRACE_BEGIN(trace, received) ((void)0)
+#define TRACE_MARK(trace, stamp) ((void)0)
+#define TRACE_END(trace) ((void)0)
+
+#endif
+
+#endif
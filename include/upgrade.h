@@ -0,0 +1,50 @@
+/**
+ * @file upgrade.h
+ * @brief Graceful shutdown and binary upgrades for hyper project
+ *
+ * SIGTERM and SIGQUIT drain the server: it stops accepting, closes idle
+ * keep-alive connections, answers requests already underway with
+ * Connection: close and exits once they are done or the drain timeout
+ * passes.
+ *
+ * SIGUSR2 starts the binary at argv[0] again with the listening sockets
+ * left open and named in SERVER_LISTEN_FDS_ENV. Both processes accept on
+ * the same sockets while the new one warms its caches, then the new one
+ * sends SIGQUIT to the old one, so no connection is refused along the way.
+ * If the new binary fails to start, the old one keeps serving.
+ */
+
+#ifndef HYPER_UPGRADE_H
+#define HYPER_UPGRADE_H
+
+#include "server.h"
+
+/** Process the new binary tells to drain once it serves */
+#define UPGRADE_PID_ENV "HYPER_UPGRADE_PID"
+
+/**
+ * @brief Result of upgrade operations
+ */
+typedef enum {
+  UPGRADE_SUCCESS    =  0,
+  UPGRADE_ERR_THREAD = -1
+} upgrade_result_t;
+
+/**
+ * @brief Handles drain and upgrade signals for a serving server
+ *
+ * Called once the server is ready for traffic. If this process was started
+ * by an upgrade, the process that started it is told to drain.
+ *
+ * @param server Server accepting clients
+ * @param argv Arguments the process was started with
+ * @param result Result of the operation
+ */
+void start_upgrade(server_t* server, char* argv[], upgrade_result_t* result);
+
+/**
+ * @brief Stops handling drain and upgrade signals
+ */
+void stop_upgrade(void);
+
+#endif
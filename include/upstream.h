@@ -0,0 +1,199 @@
+/**
+ * @file upstream.h
+ * @brief Backends of proxied path prefixes for hyper project
+ *
+ * Each route forwards a path prefix to one or more backends, TCP or UNIX
+ * socket. A backend is chosen by the power of two choices over the
+ * exchanges in progress on every worker, skipping backends that failed
+ * UPSTREAM_MAX_FAILS times in a row until UPSTREAM_DOWN_MS have passed.
+ *
+ * Every worker keeps its own pool of idle keep-alive connections to each
+ * backend, so taking one needs no lock. A pooled connection is watched by
+ * its worker's epoll instance or ring only while an exchange uses it.
+ */
+
+#ifndef HYPER_UPSTREAM_H
+#define HYPER_UPSTREAM_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/un.h>
+
+#include "client.h"
+#include "config.h"
+#include "request.h"
+#include "uring.h"
+
+/** Backends of all routes together */
+#define UPSTREAM_MAX_BACKENDS 64
+/** Longest route prefix */
+#define UPSTREAM_PREFIX_LEN 256
+/** Longest backend name, host:port or unix:path */
+#define UPSTREAM_NAME_LEN 128
+/** Idle connections a pool keeps per backend */
+#define UPSTREAM_POOL_SIZE 32
+/** Milliseconds an idle connection is trusted, below common backend keep-alive timeouts */
+#define UPSTREAM_IDLE_MS 4000
+/** Consecutive failures that take a backend down */
+#define UPSTREAM_MAX_FAILS 3
+/** Milliseconds a down backend is skipped */
+#define UPSTREAM_DOWN_MS 10000
+
+/**
+ * @brief Backend struct
+ *
+ * The counters are shared by every worker and updated atomically.
+ */
+typedef struct {
+  char name[UPSTREAM_NAME_LEN];        /**< host:port or unix:path      */
+  struct sockaddr_storage addr;        /**< Address to connect to       */
+  socklen_t addr_len;                  /**< Length of addr              */
+  int active;                          /**< Exchanges in progress       */
+  int failures;                        /**< Failures since the last success */
+  int64_t down_until;                  /**< Monotonic ms it is skipped until */
+} upstream_backend_t;
+
+/**
+ * @brief Route struct
+ */
+typedef struct {
+  char prefix[UPSTREAM_PREFIX_LEN];    /**< Path prefix                 */
+  size_t prefix_len;                   /**< Length of the prefix        */
+  int first;                           /**< Index of the first backend  */
+  int count;                           /**< Number of backends          */
+} upstream_route_t;
+
+/**
+ * @brief Routes and backends of the server
+ */
+typedef struct {
+  upstream_route_t routes[CONFIG_MAX_ROUTES]; /**< Routes, matched in order */
+  int route_count;                     /**< Number of routes            */
+  upstream_backend_t backends[UPSTREAM_MAX_BACKENDS]; /**< Backends of all routes */
+  int backend_count;                   /**< Number of backends          */
+} upstream_t;
+
+/**
+ * @brief Connection to a backend
+ */
+typedef struct upstream_conn {
+  client_t* client;                    /**< Socket, through the ring if the pool has one */
+  upstream_backend_t* backend;         /**< Backend connected to        */
+  int pipe[2];                         /**< Splice pipe, created on first use */
+  int64_t idle_since;                  /**< Monotonic ms it was pooled  */
+  struct upstream_conn* next;          /**< Next idle connection        */
+} upstream_conn_t;
+
+/**
+ * @brief Idle connections of one worker
+ */
+typedef struct upstream_pool {
+  upstream_t* upstream;                /**< Routes and backends         */
+  int epoll_fd;                        /**< Worker's epoll instance or -1 */
+  uring_t* ring;                       /**< Worker's ring or NULL       */
+  upstream_conn_t* idle[UPSTREAM_MAX_BACKENDS]; /**< Idle, newest first */
+  int idle_count[UPSTREAM_MAX_BACKENDS]; /**< Idle per backend          */
+} upstream_pool_t;
+
+/**
+ * @brief Result of upstream operations
+ */
+typedef enum {
+  UPSTREAM_SUCCESS         =  0,
+  UPSTREAM_ERR_MALLOC      = -1,
+  UPSTREAM_ERR_ROUTE       = -2,
+  UPSTREAM_ERR_CONNECT     = -3,
+  UPSTREAM_ERR_WATCH       = -4
+} upstream_result_t;
+
+/**
+ * @brief Creates the routes from their specifications
+ *
+ * @param specs "prefix=backend[,backend...]", a backend being host:port
+ *        or unix:path
+ * @param count Number of specifications
+ * @param result Result of the operation
+ * @return upstream_t* Pointer to new routes or NULL if error
+ */
+upstream_t* create_upstream(const char* specs[], int count, upstream_result_t* result);
+
+/**
+ * @brief Finds the route of a request target
+ *
+ * @param upstream Routes struct
+ * @param target Request target
+ * @return const upstream_route_t* First route whose prefix matches whole
+ *         path segments, NULL if the target is served from files
+ */
+const upstream_route_t* match_route(const upstream_t* upstream, slice_t target);
+
+/**
+ * @brief Chooses a backend of a route
+ *
+ * @param upstream Routes struct
+ * @param route Route struct
+ * @param avoid Backend that just failed or NULL
+ * @return upstream_backend_t* Less busy of two healthy backends, any if
+ *         none is healthy
+ */
+upstream_backend_t* pick_backend(upstream_t* upstream, const upstream_route_t* route, upstream_backend_t* avoid);
+
+/**
+ * @brief Records the outcome of an exchange with a backend
+ *
+ * @param backend Backend struct
+ * @param success 1 if it answered, 0 if it failed
+ */
+void report_backend(upstream_backend_t* backend, int success);
+
+/**
+ * @brief Creates the pool of a worker
+ *
+ * @param upstream Routes struct
+ * @param epoll_fd Epoll instance the connections are watched by or -1
+ * @param ring Ring the connections are served by or NULL
+ * @param result Result of the operation
+ * @return upstream_pool_t* Pointer to new pool or NULL if error
+ */
+upstream_pool_t* create_upstream_pool(upstream_t* upstream, int epoll_fd, uring_t* ring, upstream_result_t* result);
+
+/**
+ * @brief Takes an idle connection to a backend or opens one
+ *
+ * The connection is watched for its owner until released. A new one may
+ * still be connecting, the first send waits for it.
+ *
+ * @param pool Pool of the worker
+ * @param backend Backend struct
+ * @param owner Owner given to the worker's events
+ * @param reused Set to 1 if the connection was pooled
+ * @param result Result of the operation
+ * @return upstream_conn_t* Connection or NULL if error
+ */
+upstream_conn_t* acquire_upstream(upstream_pool_t* pool, upstream_backend_t* backend, void* owner, int* reused,
+                                  upstream_result_t* result);
+
+/**
+ * @brief Gives back a connection after an exchange
+ *
+ * @param pool Pool of the worker
+ * @param conn Connection struct
+ * @param reusable 1 if the exchange ended cleanly on a keep-alive connection
+ */
+void release_upstream(upstream_pool_t* pool, upstream_conn_t* conn, int reusable);
+
+/**
+ * @brief Closes the idle connections and frees the pool
+ *
+ * @param pool Pool of the worker
+ */
+void close_upstream_pool(upstream_pool_t* pool);
+
+/**
+ * @brief Frees the routes
+ *
+ * @param upstream Routes struct
+ */
+void close_upstream(upstream_t* upstream);
+
+#endif
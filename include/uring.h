@@ -0,0 +1,217 @@
+/**
+ * @file uring.h
+ * @brief io_uring I/O engine for hyper project
+ *
+ * A worker owns one ring. A multishot accept on the listener produces
+ * client sockets, each is registered in the ring's file table and gets a
+ * multishot recv that fills buffers from a provided buffer ring. Sends
+ * are sendmsg and file bodies are spliced through a per-client pipe.
+ *
+ * Clients served by a ring keep using the client_t API: recv_client(),
+ * writev_client() and sendfile_client() submit operations and report
+ * CLIENT_ERR_AGAIN until they complete, exactly like a non-blocking
+ * socket would, and the worker drives the connection again when the
+ * completion arrives.
+ */
+
+#ifndef HYPER_URING_H
+#define HYPER_URING_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+#include "client.h"
+
+/** Submission queue entries */
+#define URING_ENTRIES 1024
+/** Completion queue entries */
+#define URING_CQ_ENTRIES 8192
+/** Provided receive buffers, a power of two */
+#define URING_BUFFERS 512
+/** Size of a provided receive buffer */
+#define URING_BUFFER_LEN 4096
+/** Registered file table size, slot 0 is the listener */
+#define URING_MAX_FILES 8192
+/** Buffers gathered into one sendmsg */
+#define URING_MAX_IOV 16
+/** Bytes spliced through the pipe per operation */
+#define URING_SPLICE_LEN 65536
+
+/**
+ * @brief io_uring instance of a worker
+ */
+typedef struct uring uring_t;
+
+/**
+ * @brief io_uring state of a client
+ */
+typedef struct uring_io uring_io_t;
+
+/**
+ * @brief Result of io_uring operations
+ */
+typedef enum {
+  URING_SUCCESS      =  0,
+  URING_ERR_MALLOC   = -1,
+  URING_ERR_SETUP    = -2,
+  URING_ERR_MMAP     = -3,
+  URING_ERR_REGISTER = -4,
+  URING_ERR_FULL     = -5
+} uring_result_t;
+
+/**
+ * @brief Kinds of events returned to the worker
+ */
+typedef enum {
+  URING_EVENT_ACCEPT = 0,              /**< New client socket in fd     */
+  URING_EVENT_READY  = 1,              /**< Owner can make progress     */
+  URING_EVENT_WAKE   = 2               /**< Watched descriptor readable */
+} uring_event_type_t;
+
+/**
+ * @brief Event returned to the worker
+ */
+typedef struct {
+  uring_event_type_t type;             /**< Kind of event               */
+  int fd;                              /**< Accepted socket             */
+  void* owner;                         /**< Owner of a ready client     */
+} uring_event_t;
+
+/**
+ * @brief Creates a ring accepting on a listener
+ *
+ * A multishot accept takes the whole backlog at once. One-shot accepts
+ * let the worker stop after any client, leaving the rest queued.
+ *
+ * @param listener Listening socket
+ * @param oneshot 1 to accept one client at a time
+ * @param result Result of the operation
+ * @return uring_t* Pointer to new ring or NULL if error
+ */
+uring_t* create_uring(int listener, int oneshot, uring_result_t* result);
+
+/**
+ * @brief Binds the ring to the calling thread
+ *
+ * @param ring Ring of the worker
+ * @return int 0 if successful, -1 if error
+ * @note Must be called by the thread that waits on the ring
+ */
+int uring_enable(uring_t* ring);
+
+/**
+ * @brief Queues a one-shot poll producing a URING_EVENT_WAKE event
+ *
+ * @param ring Ring of the worker
+ * @param fd Descriptor to wait for input on
+ */
+void uring_watch(uring_t* ring, int fd);
+
+/**
+ * @brief Cancels the accept until uring_resume_accept
+ *
+ * @param ring Ring of the worker
+ * @note Clients already accepted may still be returned afterwards
+ */
+void uring_stop_accept(uring_t* ring);
+
+/**
+ * @brief Accepts again after uring_stop_accept
+ *
+ * @param ring Ring of the worker
+ */
+void uring_resume_accept(uring_t* ring);
+
+/**
+ * @brief Serves a client through the ring
+ *
+ * @param ring Ring of the worker
+ * @param client Accepted client, blocking socket
+ * @param owner Returned in URING_EVENT_READY events for the client
+ * @param result Result of the operation
+ */
+void uring_attach_client(uring_t* ring, client_t* client, void* owner, uring_result_t* result);
+
+/**
+ * @brief Submits queued operations and waits for completions
+ *
+ * @param ring Ring of the worker
+ * @param timeout Milliseconds to wait, -1 for no limit
+ * @return int 0 if successful, -1 if error
+ */
+int uring_wait(uring_t* ring, int timeout);
+
+/**
+ * @brief Consumes completions until one produces an event
+ *
+ * @param ring Ring of the worker
+ * @param event Filled with the event
+ * @return int 1 if an event was returned, 0 if none is left
+ * @note Events are produced one at a time, so an owner closed while
+ *       handling an event never shows up in a later one
+ */
+int uring_next_event(uring_t* ring, uring_event_t* event);
+
+/**
+ * @brief Closes the ring
+ *
+ * @param ring Ring of the worker
+ */
+void close_uring(uring_t* ring);
+
+/**
+ * @brief Receives through the ring, see recv_client
+ *
+ * @param client Client served by a ring
+ * @param buff Buffer of the request
+ * @param buff_len Length of the buffer
+ * @param result Result of the operation
+ * @return ssize_t Number of bytes received or -1 if error
+ */
+ssize_t uring_recv(client_t* client, char buff[], size_t buff_len, client_result_t* result);
+
+/**
+ * @brief Sends through the ring, see writev_client
+ *
+ * The first call submits a sendmsg and reports CLIENT_ERR_AGAIN, the call
+ * after its completion returns the bytes sent. The buffers must stay
+ * unchanged in between, which they do since nothing advances on AGAIN.
+ *
+ * @param client Client served by a ring
+ * @param iov Buffers to send in order
+ * @param iov_count Number of buffers
+ * @param result Result of the operation
+ * @return ssize_t Number of bytes sent or -1 if error
+ */
+ssize_t uring_writev(client_t* client, const struct iovec* iov, int iov_count, client_result_t* result);
+
+/**
+ * @brief Splices a file through the ring, see sendfile_client
+ *
+ * @param client Client served by a ring
+ * @param fd File to send from
+ * @param offset Offset to send from, advanced by the bytes sent
+ * @param len Number of bytes to send
+ * @param result Result of the operation
+ * @return ssize_t Number of bytes sent or -1 if error
+ */
+ssize_t uring_sendfile(client_t* client, int fd, off_t* offset, size_t len, client_result_t* result);
+
+/**
+ * @brief Changes the owner events of a client are reported to
+ *
+ * @param client Client served by a ring
+ * @param owner New owner, NULL to drop its events
+ */
+void uring_set_owner(client_t* client, void* owner);
+
+/**
+ * @brief Cancels the operations of a client and frees it once they end
+ *
+ * @param client Client served by a ring
+ */
+void uring_close_client(client_t* client);
+
+#endif
@@ -0,0 +1,100 @@
+/**
+ * @file worker.h
+ * @brief Epoll worker pool for hyper project
+ */
+
+#ifndef HYPER_WORKER_H
+#define HYPER_WORKER_H
+
+#include <pthread.h>
+
+#include "server.h"
+#include "connection.h"
+#include "uring.h"
+#include "timer_wheel.h"
+
+/** Maximum number of events handled per epoll_wait call */
+#define WORKER_MAX_EVENTS 256
+/** Milliseconds between checks whether a full server can accept again */
+#define WORKER_PAUSE_CHECK_MS 100
+
+/**
+ * @brief Worker struct
+ */
+typedef struct {
+  int id;                              /**< Index of the worker          */
+  pthread_t thread;                    /**< Thread running the worker    */
+  int epoll_fd;                        /**< Epoll instance of the worker */
+  int listener;                        /**< Socket the worker accepts on */
+  int cpu;                             /**< CPU to pin to, -1 if none    */
+  server_t* server;                    /**< Server accepting clients     */
+  timer_wheel_t wheel;                 /**< Deadlines of the connections */
+  access_log_buffer_t* log_buffer;     /**< Access log entries or NULL   */
+  uring_t* ring;                       /**< io_uring instance or NULL    */
+  upstream_pool_t* upstream_pool;      /**< Backend connections or NULL  */
+  int draining;                        /**< 1 once it stopped accepting  */
+  int paused;                          /**< 1 while the server is full   */
+} worker_t;
+
+/**
+ * @brief Worker pool struct
+ */
+typedef struct {
+  worker_t* workers;                   /**< Workers of the pool          */
+  int count;                           /**< Number of workers            */
+} worker_pool_t;
+
+/**
+ * @brief Result of worker operations
+ */
+typedef enum {
+  WORKER_SUCCESS    =  0,
+  WORKER_ERR_MALLOC = -1,
+  WORKER_ERR_EPOLL  = -2,
+  WORKER_ERR_THREAD = -3,
+  WORKER_ERR_LISTEN = -4
+} worker_result_t;
+
+/**
+ * @brief Creates a pool of epoll workers sharing the server socket
+ *
+ * Each worker owns an epoll instance that watches a listening socket and
+ * every connection the worker accepted, so a connection is only ever
+ * touched by one thread. Workers share the server socket, or with
+ * reuseport each gets its own listener in the SO_REUSEPORT group of the
+ * server socket and is pinned to a CPU. In uring mode a worker drives
+ * its listener and connections through an io_uring instance instead,
+ * falling back to epoll if the kernel cannot set one up. Every worker
+ * also watches the server's wake_fd and drains once it becomes readable.
+ *
+ * @param server Server to accept clients from
+ * @param count Number of workers
+ * @param result Result of the operation
+ * @return worker_pool_t* Pointer to new pool or NULL if error
+ */
+worker_pool_t* create_worker_pool(server_t* server, int count, worker_result_t* result);
+
+/**
+ * @brief Starts the workers and waits for them to exit
+ *
+ * @param pool Worker pool struct
+ * @param result Result of the operation
+ */
+void run_worker_pool(worker_pool_t* pool, worker_result_t* result);
+
+/**
+ * @brief Runs the event loop of a worker
+ *
+ * @param argp worker_t struct
+ * @return void* NULL
+ */
+void* worker_thread(void* argp);
+
+/**
+ * @brief Closes the workers and frees the pool
+ *
+ * @param pool Worker pool struct
+ */
+void close_worker_pool(worker_pool_t* pool);
+
+#endif
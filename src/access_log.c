@@ -0,0 +1,415 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#include <time.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <unistd.h>
+
+#include "access_log.h"
+
+/**
+ * @brief Gets a clock in microseconds
+ *
+ * @param clock_id Clock to read
+ * @return int64_t Microseconds
+ */
+static int64_t clock_us(clockid_t clock_id) {
+  struct timespec now;
+  clock_gettime(clock_id, &now);
+  return (int64_t)now.tv_sec * 1000000 + now.tv_nsec / 1000;
+}
+
+/**
+ * @brief Opens an access log
+ *
+ * @param path File to append to, "-" for stdout
+ * @param format Entry format
+ * @param max_size Bytes after which the file is rotated, 0 disables
+ * @param interval Seconds after which the file is rotated, 0 disables
+ * @param result Result of the operation
+ * @return access_log_t* Pointer to new access log or NULL if error
+ */
+access_log_t* create_access_log(const char* path, access_log_format_t format, uint64_t max_size, int64_t interval,
+                                access_log_result_t* result) {
+  // initialize result
+  *result = ACCESS_LOG_SUCCESS;
+
+  // leave room for the rotation suffix
+  if (strlen(path) >= sizeof(((access_log_t*)0)->path) - 32) {
+    *result = ACCESS_LOG_ERR_PATH;
+    return NULL;
+  }
+
+  // initialize log
+  access_log_t* log = malloc(sizeof(access_log_t));
+  if (log == NULL) {
+    *result = ACCESS_LOG_ERR_MALLOC;
+    return NULL;
+  }
+  strcpy(log->path, path);
+  log->format = format;
+  log->retired_fd = -1;
+  log->size = 0;
+  log->max_size = max_size;
+  log->interval = interval;
+  log->next_rotation = interval > 0 ? time(NULL) + interval : 0;
+  pthread_mutex_init(&log->rotate_lock, NULL);
+
+  // stdout is never rotated
+  if (strcmp(path, "-") == 0) {
+    log->fd = 1;
+    log->max_size = 0;
+    log->interval = 0;
+    log->next_rotation = 0;
+    return log;
+  }
+
+  // append, so concurrent writes never overwrite each other
+  log->fd = open(path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+  if (log->fd == -1) {
+    pthread_mutex_destroy(&log->rotate_lock);
+    free(log);
+    *result = ACCESS_LOG_ERR_OPEN;
+    return NULL;
+  }
+
+  // count what an earlier run left
+  off_t existing = lseek(log->fd, 0, SEEK_END);
+  log->size = existing > 0 ? (uint64_t)existing : 0;
+
+  return log;
+}
+
+/**
+ * @brief Initializes a per-worker entry buffer
+ *
+ * @param buffer Buffer struct
+ */
+void init_access_log_buffer(access_log_buffer_t* buffer) {
+  buffer->len = 0;
+  buffer->last_flush = clock_us(CLOCK_MONOTONIC) / 1000;
+  buffer->cached_second = -1;
+  buffer->cached_time[0] = '\0';
+}
+
+/**
+ * @brief Copies a header value, truncating it to fit
+ *
+ * @param out Destination
+ * @param out_len Size of the destination
+ * @param header Header or NULL
+ */
+static void copy_field(char* out, size_t out_len, const header_t* header) {
+  size_t len = 0;
+  if (header != NULL) {
+    len = header->value.len < out_len - 1 ? header->value.len : out_len - 1;
+    memcpy(out, header->value.ptr, len);
+  }
+  out[len] = '\0';
+}
+
+/**
+ * @brief Copies the logged fields of a request
+ *
+ * @param entry Entry struct
+ * @param request Parsed request
+ */
+void begin_access_entry(access_entry_t* entry, const request_t* request) {
+  entry->start = clock_us(CLOCK_MONOTONIC);
+  entry->time = time(NULL);
+
+  // request line as the client sent it
+  snprintf(entry->line, sizeof(entry->line), "%.*s %.*s HTTP/%.*s", (int)request->method.len, request->method.ptr,
+           (int)request->target.len, request->target.ptr, (int)request->version.len, request->version.ptr);
+
+  copy_field(entry->referer, sizeof(entry->referer), find_header(request, "Referer"));
+  copy_field(entry->user_agent, sizeof(entry->user_agent), find_header(request, "User-Agent"));
+}
+
+/**
+ * @brief Starts an entry for a request that could not be parsed
+ *
+ * @param entry Entry struct
+ */
+void begin_rejected_entry(access_entry_t* entry) {
+  entry->start = clock_us(CLOCK_MONOTONIC);
+  entry->time = time(NULL);
+
+  // the request line may be cut short or not be text
+  strcpy(entry->line, "-");
+  entry->referer[0] = '\0';
+  entry->user_agent[0] = '\0';
+}
+
+/**
+ * @brief Appends a string, escaping what would break the format
+ *
+ * Quotes, backslashes and non-printable bytes are escaped, \xHH in log
+ * formats and \u00HH in JSON, so a client cannot forge entries.
+ *
+ * @param out Output buffer
+ * @param len Bytes in out, updated
+ * @param out_len Size of out
+ * @param str String to append
+ * @param json 1 to escape for JSON
+ */
+static void append_escaped(char* out, size_t* len, size_t out_len, const char* str, int json) {
+  static const char hex[] = "0123456789abcdef";
+  size_t pos = *len;
+
+  for (const unsigned char* p = (const unsigned char*)str; *p != '\0'; p++) {
+    // keep room for the longest escape and the terminator
+    if (pos + 7 >= out_len) {
+      break;
+    }
+
+    if (*p == '"' || *p == '\\') {
+      out[pos++] = '\\';
+      out[pos++] = (char)*p;
+    } else if (*p < 0x20 || *p >= 0x7f) {
+      out[pos++] = '\\';
+      if (json) {
+        memcpy(out + pos, "u00", 3);
+        pos += 3;
+      } else {
+        out[pos++] = 'x';
+      }
+      out[pos++] = hex[*p >> 4];
+      out[pos++] = hex[*p & 0xf];
+    } else {
+      out[pos++] = (char)*p;
+    }
+  }
+
+  out[pos] = '\0';
+  *len = pos;
+}
+
+/**
+ * @brief Appends formatted text
+ *
+ * @param out Output buffer
+ * @param len Bytes in out, updated
+ * @param out_len Size of out
+ * @param format Format string
+ * @param ... Variable arguments to format
+ */
+static void append_format(char* out, size_t* len, size_t out_len, const char* format, ...)
+    __attribute__((format(printf, 4, 5)));
+
+static void append_format(char* out, size_t* len, size_t out_len, const char* format, ...) {
+  va_list vargs;
+  va_start(vargs, format);
+  int written = vsnprintf(out + *len, out_len - *len, format, vargs);
+  va_end(vargs);
+
+  if (written > 0) {
+    *len += (size_t)written < out_len - *len ? (size_t)written : out_len - 1 - *len;
+  }
+}
+
+/**
+ * @brief Gets the entry timestamp, formatting it once per second
+ *
+ * @param log Access log
+ * @param buffer Buffer of the calling worker
+ * @param time Wall clock seconds
+ * @return const char* Formatted timestamp
+ */
+static const char* format_time(access_log_t* log, access_log_buffer_t* buffer, int64_t time) {
+  if (buffer->cached_second != time) {
+    time_t seconds = (time_t)time;
+    struct tm utc;
+    gmtime_r(&seconds, &utc);
+
+    const char* format = log->format == ACCESS_LOG_JSON ? "%Y-%m-%dT%H:%M:%SZ" : "%d/%b/%Y:%H:%M:%S +0000";
+    strftime(buffer->cached_time, sizeof(buffer->cached_time), format, &utc);
+    buffer->cached_second = time;
+  }
+
+  return buffer->cached_time;
+}
+
+/**
+ * @brief Formats an entry into the buffer, flushing it when full
+ *
+ * The bytes are those of the body alone, as %b counts them. A response
+ * cut short keeps the status it was sent with, only the bytes show that
+ * less of the body went out than announced.
+ *
+ * @param log Access log
+ * @param buffer Buffer of the calling worker
+ * @param entry Request details
+ * @param host Address of the client
+ * @param status Status code, 0 if no response was sent
+ * @param bytes Body bytes sent
+ */
+void log_access(access_log_t* log, access_log_buffer_t* buffer, const access_entry_t* entry, const char* host,
+                int status, size_t bytes) {
+  // make sure the longest entry fits
+  if (ACCESS_LOG_BUFFER_LEN - buffer->len < ACCESS_LOG_ENTRY_LEN) {
+    flush_access_log(log, buffer);
+  }
+
+  char* out = buffer->data + buffer->len;
+  size_t len = 0;
+  const char* time = format_time(log, buffer, entry->time);
+
+  if (log->format == ACCESS_LOG_JSON) {
+    append_format(out, &len, ACCESS_LOG_ENTRY_LEN, "{\"time\":\"%s\",\"remote\":\"%s\",\"request\":\"", time, host);
+    append_escaped(out, &len, ACCESS_LOG_ENTRY_LEN, entry->line, 1);
+    if (status != 0) {
+      append_format(out, &len, ACCESS_LOG_ENTRY_LEN, "\",\"status\":%d", status);
+    } else {
+      append_format(out, &len, ACCESS_LOG_ENTRY_LEN, "\",\"status\":null");
+    }
+    append_format(out, &len, ACCESS_LOG_ENTRY_LEN, ",\"bytes\":%zu,\"duration_us\":%lld,\"referer\":\"", bytes,
+                  (long long)(clock_us(CLOCK_MONOTONIC) - entry->start));
+    append_escaped(out, &len, ACCESS_LOG_ENTRY_LEN, entry->referer, 1);
+    append_format(out, &len, ACCESS_LOG_ENTRY_LEN, "\",\"user_agent\":\"");
+    append_escaped(out, &len, ACCESS_LOG_ENTRY_LEN, entry->user_agent, 1);
+    append_format(out, &len, ACCESS_LOG_ENTRY_LEN, "\"}\n");
+  } else {
+    // host ident authuser [date] "request" status bytes
+    append_format(out, &len, ACCESS_LOG_ENTRY_LEN, "%s - - [%s] \"", host, time);
+    append_escaped(out, &len, ACCESS_LOG_ENTRY_LEN, entry->line, 0);
+    if (status != 0) {
+      append_format(out, &len, ACCESS_LOG_ENTRY_LEN, "\" %d ", status);
+    } else {
+      append_format(out, &len, ACCESS_LOG_ENTRY_LEN, "\" - ");
+    }
+    if (bytes != 0) {
+      append_format(out, &len, ACCESS_LOG_ENTRY_LEN, "%zu", bytes);
+    } else {
+      append_format(out, &len, ACCESS_LOG_ENTRY_LEN, "-");
+    }
+
+    // "referer" "user agent"
+    if (log->format == ACCESS_LOG_COMBINED) {
+      append_format(out, &len, ACCESS_LOG_ENTRY_LEN, " \"");
+      append_escaped(out, &len, ACCESS_LOG_ENTRY_LEN, entry->referer[0] != '\0' ? entry->referer : "-", 0);
+      append_format(out, &len, ACCESS_LOG_ENTRY_LEN, "\" \"");
+      append_escaped(out, &len, ACCESS_LOG_ENTRY_LEN, entry->user_agent[0] != '\0' ? entry->user_agent : "-", 0);
+      append_format(out, &len, ACCESS_LOG_ENTRY_LEN, "\"");
+    }
+    append_format(out, &len, ACCESS_LOG_ENTRY_LEN, "\n");
+  }
+
+  // a truncated entry still ends its line
+  out[len - 1] = '\n';
+  buffer->len += len;
+}
+
+/**
+ * @brief Replaces the log file with a new one
+ *
+ * The old file is renamed with a timestamp suffix. Workers that loaded
+ * the old descriptor just before the swap may still be appending to it,
+ * so it is only closed at the next rotation.
+ *
+ * @param log Access log
+ * @param now Wall clock seconds
+ */
+static void rotate_access_log(access_log_t* log, int64_t now) {
+  // one rotation at a time, the others keep appending
+  if (pthread_mutex_trylock(&log->rotate_lock) != 0) {
+    return;
+  }
+
+  // another worker may have rotated since the check
+  uint64_t size = __atomic_load_n(&log->size, __ATOMIC_RELAXED);
+  int64_t next_rotation = __atomic_load_n(&log->next_rotation, __ATOMIC_RELAXED);
+  if (!(log->max_size > 0 && size >= log->max_size) && !(log->interval > 0 && now >= next_rotation)) {
+    pthread_mutex_unlock(&log->rotate_lock);
+    return;
+  }
+
+  // name the old file after the rotation time
+  char rotated[sizeof(log->path) + 64];
+  char stamp[32];
+  time_t seconds = (time_t)now;
+  struct tm utc;
+  gmtime_r(&seconds, &utc);
+  strftime(stamp, sizeof(stamp), "%Y%m%d-%H%M%S", &utc);
+  snprintf(rotated, sizeof(rotated), "%s.%s", log->path, stamp);
+  for (int i = 1; access(rotated, F_OK) == 0 && i < 100; i++) {
+    snprintf(rotated, sizeof(rotated), "%s.%s.%d", log->path, stamp, i);
+  }
+
+  // rename first so the new file can take the name
+  if (rename(log->path, rotated) == 0) {
+    int fd = open(log->path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+    if (fd != -1) {
+      if (log->retired_fd != -1) {
+        close(log->retired_fd);
+      }
+      log->retired_fd = __atomic_exchange_n(&log->fd, fd, __ATOMIC_ACQ_REL);
+      __atomic_store_n(&log->size, 0, __ATOMIC_RELAXED);
+    }
+  }
+
+  if (log->interval > 0) {
+    __atomic_store_n(&log->next_rotation, now + log->interval, __ATOMIC_RELAXED);
+  }
+  pthread_mutex_unlock(&log->rotate_lock);
+}
+
+/**
+ * @brief Appends the buffer to the log and rotates the log if due
+ *
+ * @param log Access log
+ * @param buffer Buffer of the calling worker
+ */
+void flush_access_log(access_log_t* log, access_log_buffer_t* buffer) {
+  buffer->last_flush = clock_us(CLOCK_MONOTONIC) / 1000;
+  if (buffer->len == 0) {
+    return;
+  }
+
+  // one append for the whole buffer
+  int fd = __atomic_load_n(&log->fd, __ATOMIC_ACQUIRE);
+  size_t written = 0;
+  while (written < buffer->len) {
+    ssize_t n = write(fd, buffer->data + written, buffer->len - written);
+    if (n == -1) {
+      if (errno == EINTR) {
+        continue;
+      }
+      break;
+    }
+    written += (size_t)n;
+  }
+  buffer->len = 0;
+
+  // rotate by size or age
+  uint64_t size = __atomic_add_fetch(&log->size, written, __ATOMIC_RELAXED);
+  if (log->max_size > 0 && size >= log->max_size) {
+    rotate_access_log(log, time(NULL));
+  } else if (log->interval > 0) {
+    int64_t now = time(NULL);
+    if (now >= __atomic_load_n(&log->next_rotation, __ATOMIC_RELAXED)) {
+      rotate_access_log(log, now);
+    }
+  }
+}
+
+/**
+ * @brief Closes the access log
+ *
+ * @param log Access log
+ */
+void close_access_log(access_log_t* log) {
+  // close files
+  if (log->fd != 1) {
+    close(log->fd);
+  }
+  if (log->retired_fd != -1) {
+    close(log->retired_fd);
+  }
+
+  // free log
+  pthread_mutex_destroy(&log->rotate_lock);
+  free(log);
+}
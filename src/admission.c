@@ -0,0 +1,164 @@
+#include <stdio.h>
+
+#include "admission.h"
+
+/**
+ * @brief Hashes a client address
+ *
+ * @param host Client address
+ * @return uint64_t FNV-1a hash
+ */
+static uint64_t hash_host(const char* host) {
+  uint64_t hash = 14695981039346656037ULL;
+  for (const char* c = host; *c != '\0'; c++) {
+    hash ^= (uint64_t)(unsigned char)*c;
+    hash *= 1099511628211ULL;
+  }
+  return hash;
+}
+
+/**
+ * @brief Creates admission control
+ *
+ * @param max_connections Open connections allowed, 0 for no limit
+ * @param max_per_host Open connections allowed per address, 0 for no limit
+ * @param result Result of the operation
+ * @return admission_t* Pointer to new admission control or NULL if error
+ */
+admission_t* create_admission(int max_connections, int max_per_host, admission_result_t* result) {
+  // initialize result
+  *result = ADMISSION_SUCCESS;
+
+  admission_t* admission = calloc(1, sizeof(admission_t));
+  if (admission == NULL) {
+    *result = ADMISSION_ERR_MALLOC;
+    return NULL;
+  }
+
+  admission->max_connections = max_connections;
+  admission->max_per_host = max_per_host;
+  for (int i = 0; i < ADMISSION_SHARDS; i++) {
+    pthread_mutex_init(&admission->shards[i].lock, NULL);
+  }
+
+  return admission;
+}
+
+/**
+ * @brief Checks whether another connection would be admitted
+ *
+ * @param admission Admission control struct
+ * @return int 1 if the connection limit is reached
+ */
+int admission_full(admission_t* admission) {
+  return admission->max_connections > 0 &&
+         __atomic_load_n(&admission->connections, __ATOMIC_RELAXED) >= admission->max_connections;
+}
+
+/**
+ * @brief Counts a connection if both limits allow it
+ *
+ * @param admission Admission control struct
+ * @param host Client address
+ * @param result Result of the operation
+ */
+void admit_connection(admission_t* admission, const char* host, admission_result_t* result) {
+  // initialize result
+  *result = ADMISSION_SUCCESS;
+
+  // take a slot, giving it back if there was none
+  int connections = __atomic_add_fetch(&admission->connections, 1, __ATOMIC_RELAXED);
+  if (admission->max_connections > 0 && connections > admission->max_connections) {
+    __atomic_sub_fetch(&admission->connections, 1, __ATOMIC_RELAXED);
+    *result = ADMISSION_ERR_FULL;
+    return;
+  }
+
+  if (admission->max_per_host == 0) {
+    return;
+  }
+
+  // find or add the address
+  uint64_t hash = hash_host(host);
+  admission_shard_t* shard = &admission->shards[hash % ADMISSION_SHARDS];
+  admission_host_t** bucket = &shard->buckets[(hash / ADMISSION_SHARDS) % ADMISSION_BUCKETS];
+
+  pthread_mutex_lock(&shard->lock);
+  admission_host_t* entry = *bucket;
+  while (entry != NULL && strcmp(entry->host, host) != 0) {
+    entry = entry->next;
+  }
+  if (entry == NULL) {
+    entry = malloc(sizeof(admission_host_t));
+    if (entry != NULL) {
+      strncpy(entry->host, host, INET_ADDRSTRLEN - 1);
+      entry->host[INET_ADDRSTRLEN - 1] = '\0';
+      entry->count = 0;
+      entry->next = *bucket;
+      *bucket = entry;
+    }
+  }
+
+  if (entry == NULL || entry->count >= admission->max_per_host) {
+    *result = entry == NULL ? ADMISSION_ERR_MALLOC : ADMISSION_ERR_HOST_FULL;
+  } else {
+    entry->count++;
+  }
+  pthread_mutex_unlock(&shard->lock);
+
+  if (*result != ADMISSION_SUCCESS) {
+    __atomic_sub_fetch(&admission->connections, 1, __ATOMIC_RELAXED);
+  }
+}
+
+/**
+ * @brief Uncounts a connection admitted earlier
+ *
+ * @param admission Admission control struct
+ * @param host Client address
+ */
+void release_connection(admission_t* admission, const char* host) {
+  __atomic_sub_fetch(&admission->connections, 1, __ATOMIC_RELAXED);
+
+  if (admission->max_per_host == 0) {
+    return;
+  }
+
+  // drop the address with its last connection
+  uint64_t hash = hash_host(host);
+  admission_shard_t* shard = &admission->shards[hash % ADMISSION_SHARDS];
+  admission_host_t** link = &shard->buckets[(hash / ADMISSION_SHARDS) % ADMISSION_BUCKETS];
+
+  pthread_mutex_lock(&shard->lock);
+  while (*link != NULL && strcmp((*link)->host, host) != 0) {
+    link = &(*link)->next;
+  }
+  admission_host_t* entry = *link;
+  if (entry != NULL && --entry->count == 0) {
+    *link = entry->next;
+    free(entry);
+  }
+  pthread_mutex_unlock(&shard->lock);
+}
+
+/**
+ * @brief Frees admission control
+ *
+ * @param admission Admission control struct
+ */
+void close_admission(admission_t* admission) {
+  for (int i = 0; i < ADMISSION_SHARDS; i++) {
+    admission_shard_t* shard = &admission->shards[i];
+    for (int j = 0; j < ADMISSION_BUCKETS; j++) {
+      admission_host_t* entry = shard->buckets[j];
+      while (entry != NULL) {
+        admission_host_t* next = entry->next;
+        free(entry);
+        entry = next;
+      }
+    }
+    pthread_mutex_destroy(&shard->lock);
+  }
+
+  free(admission);
+}
@@ -0,0 +1,177 @@
+#include "body.h"
+
+/**
+ * @brief Prepares a reader for the body of a request
+ *
+ * @param reader Body reader struct
+ * @param request Parsed request
+ * @param limit Most body bytes accepted
+ */
+void init_body_reader(body_reader_t* reader, const request_t* request, uint64_t limit) {
+  reader->chunked = request->chunked;
+  reader->remaining = request->chunked ? 0 : request->content_length;
+  reader->chunk_state = CHUNK_SIZE;
+  reader->chunk_digits = 0;
+  reader->received = 0;
+  reader->limit = limit;
+  reader->done = !request->chunked && request->content_length == 0;
+}
+
+/**
+ * @brief Decodes body bytes in place
+ *
+ * Stops at the end of the body, bytes after it belong to the next request.
+ *
+ * @param reader Body reader struct
+ * @param data Bytes received, the decoded body is moved to their start
+ * @param len Number of bytes
+ * @param decoded Set to the number of body bytes at the start of data
+ * @param result Result of the operation
+ * @return size_t Bytes of data consumed
+ */
+size_t decode_body(body_reader_t* reader, char* data, size_t len, size_t* decoded, body_result_t* result) {
+  // initialize result
+  *result = BODY_SUCCESS;
+  *decoded = 0;
+
+  // a length is already in place
+  if (!reader->chunked) {
+    if (reader->remaining > reader->limit - reader->received) {
+      *result = BODY_ERR_TOO_LARGE;
+      return 0;
+    }
+
+    size_t taken = len < reader->remaining ? len : (size_t)reader->remaining;
+    reader->remaining -= taken;
+    reader->received += taken;
+    reader->done = reader->remaining == 0;
+    *decoded = taken;
+    return taken;
+  }
+
+  size_t i = 0;
+  while (i < len && !reader->done) {
+    char c = data[i];
+
+    // whole runs of chunk data at once, moved over the framing before them
+    if (reader->chunk_state == CHUNK_DATA) {
+      size_t run = len - i < reader->remaining ? len - i : (size_t)reader->remaining;
+      memmove(data + *decoded, data + i, run);
+      *decoded += run;
+      reader->remaining -= run;
+      reader->received += run;
+      i += run;
+      if (reader->remaining == 0) {
+        reader->chunk_state = CHUNK_DATA_CR;
+      }
+      continue;
+    }
+
+    switch (reader->chunk_state) {
+      case CHUNK_SIZE:
+        if (c >= '0' && c <= '9') {
+          reader->remaining = reader->remaining * 16 + (uint64_t)(c - '0');
+        } else if ((c | 0x20) >= 'a' && (c | 0x20) <= 'f') {
+          reader->remaining = reader->remaining * 16 + (uint64_t)((c | 0x20) - 'a' + 10);
+        } else if (reader->chunk_digits > 0 && (c == ';' || c == ' ' || c == '\t')) {
+          reader->chunk_state = CHUNK_EXTENSION;
+          break;
+        } else if (reader->chunk_digits > 0 && c == '\r') {
+          reader->chunk_state = CHUNK_SIZE_LF;
+          break;
+        } else {
+          *result = BODY_ERR_MALFORMED;
+          return i;
+        }
+        if (++reader->chunk_digits > 15) {
+          *result = BODY_ERR_MALFORMED;
+          return i;
+        }
+        break;
+
+      case CHUNK_EXTENSION:
+        if (c == '\r') {
+          reader->chunk_state = CHUNK_SIZE_LF;
+        }
+        break;
+
+      case CHUNK_SIZE_LF:
+        if (c != '\n') {
+          *result = BODY_ERR_MALFORMED;
+          return i;
+        }
+
+        // a chunk over the limit is refused before any of it is read
+        if (reader->remaining > reader->limit - reader->received) {
+          *result = BODY_ERR_TOO_LARGE;
+          return i;
+        }
+        reader->chunk_state = reader->remaining > 0 ? CHUNK_DATA : CHUNK_TRAILER;
+        break;
+
+      case CHUNK_DATA_CR:
+        if (c != '\r') {
+          *result = BODY_ERR_MALFORMED;
+          return i;
+        }
+        reader->chunk_state = CHUNK_DATA_LF;
+        break;
+
+      case CHUNK_DATA_LF:
+        if (c != '\n') {
+          *result = BODY_ERR_MALFORMED;
+          return i;
+        }
+        reader->chunk_state = CHUNK_SIZE;
+        reader->chunk_digits = 0;
+        break;
+
+      case CHUNK_TRAILER:
+        reader->chunk_state = c == '\r' ? CHUNK_END_LF : CHUNK_TRAILER_LINE;
+        break;
+
+      case CHUNK_TRAILER_LINE:
+        if (c == '\n') {
+          reader->chunk_state = CHUNK_TRAILER;
+        }
+        break;
+
+      case CHUNK_END_LF:
+        if (c != '\n') {
+          *result = BODY_ERR_MALFORMED;
+          return i;
+        }
+        reader->done = 1;
+        break;
+
+      default:
+        break;
+    }
+    i++;
+  }
+
+  return i;
+}
+
+/**
+ * @brief Writes the head of a chunk so that it ends where its data starts
+ *
+ * @param end First byte of the chunk data, BODY_CHUNK_HEAD_LEN bytes
+ *        before it must be writable
+ * @param len Length of the chunk data, not 0
+ * @return size_t Length of the head written before end
+ */
+size_t put_chunk_head(char* end, size_t len) {
+  static const char digits[] = "0123456789abcdef";
+  char* head = end - 2;
+
+  // hex digits backwards from the CRLF
+  head[0] = '\r';
+  head[1] = '\n';
+  do {
+    *--head = digits[len & 0xf];
+    len >>= 4;
+  } while (len > 0);
+
+  return (size_t)(end - head);
+}
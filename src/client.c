@@ -1,6 +1,10 @@
 #include <stdio.h>
+#include <fcntl.h>
+#include <sys/sendfile.h>
 
 #include "client.h"
+#include "uring.h"
+#include "tls.h"
 
 /**
  * @brief Creates a client connection
@@ -19,7 +23,8 @@ client_t* create_client(char host[], int client_socket, client_result_t* result,
   cleanup->client_allocated = 0;
 
   // initialize client
-  client_t* c = malloc(sizeof(client_t));
+  pool_result_t pool_result;
+  client_t* c = pool_alloc(sizeof(client_t), &pool_result);
   if (c == NULL) {
     *result = CLIENT_ERR_MALLOC;
     return NULL;
@@ -29,6 +34,9 @@ client_t* create_client(char host[], int client_socket, client_result_t* result,
   // set host and socket
   strncpy(c->host, host, INET_ADDRSTRLEN);
   c->socket = client_socket;
+  c->io = NULL;
+  c->ssl = NULL;
+  c->ktls_send = 0;
 
   // return client
   return c;
@@ -41,15 +49,37 @@ client_t* create_client(char host[], int client_socket, client_result_t* result,
  * @param buff Buffer of the request
  * @param buff_len Length of the request
  * @param result Result of the operation
+ * @return ssize_t Number of bytes received or -1 if error
+ * @note result is CLIENT_ERR_AGAIN if a non-blocking socket has no data and
+ *       CLIENT_ERR_CLOSED if the peer closed the connection
  */
-void recv_client(client_t* client, char buff[], size_t buff_len, client_result_t* result) {
+ssize_t recv_client(client_t* client, char buff[], size_t buff_len, client_result_t* result) {
   // initialize result
   *result = CLIENT_SUCCESS;
 
+  // served by a ring
+  if (client->io != NULL) {
+    return uring_recv(client, buff, buff_len, result);
+  }
+
+  // decrypted by OpenSSL
+  if (client->ssl != NULL) {
+    return tls_recv(client, buff, buff_len, result);
+  }
+
   // receive message
-  if (recv(client->socket, buff, buff_len, 0) == -1) {
-    *result = CLIENT_ERR_RECV;
+  ssize_t received = recv(client->socket, buff, buff_len, 0);
+  if (received == -1) {
+    *result = (errno == EAGAIN || errno == EWOULDBLOCK) ? CLIENT_ERR_AGAIN : CLIENT_ERR_RECV;
+    return -1;
   }
+
+  // peer closed the connection
+  if (received == 0) {
+    *result = CLIENT_ERR_CLOSED;
+  }
+
+  return received;
 }
 
 /**
@@ -59,15 +89,133 @@ void recv_client(client_t* client, char buff[], size_t buff_len, client_result_t
  * @param buff Buffer of the response
  * @param buff_len Length of the response
  * @param result Result of the operation
+ * @return ssize_t Number of bytes sent or -1 if error
+ * @note result is CLIENT_ERR_AGAIN if a non-blocking socket would block
  */
-void send_client(client_t* client, const char buff[], size_t buff_len, client_result_t* result) {
+ssize_t send_client(client_t* client, const char buff[], size_t buff_len, client_result_t* result) {
   // initialize result
   *result = CLIENT_SUCCESS;
 
+  // served by a ring
+  if (client->io != NULL) {
+    struct iovec iov = { (void*)buff, buff_len };
+    return uring_writev(client, &iov, 1, result);
+  }
+
+  // sealed by OpenSSL unless the kernel took the keys
+  if (client->ssl != NULL && !client->ktls_send) {
+    struct iovec iov = { (void*)buff, buff_len };
+    return tls_writev(client, &iov, 1, result);
+  }
+
   // send message
-  if (send(client->socket, buff, buff_len, 0) == -1) {
+  ssize_t sent = send(client->socket, buff, buff_len, MSG_NOSIGNAL);
+  if (sent == -1) {
+    *result = (errno == EAGAIN || errno == EWOULDBLOCK) ? CLIENT_ERR_AGAIN : CLIENT_ERR_SEND;
+  }
+
+  return sent;
+}
+
+/**
+ * @brief Sends a gathered response to the client
+ *
+ * @param client Client connection struct
+ * @param iov Buffers to send in order
+ * @param iov_count Number of buffers
+ * @param result Result of the operation
+ * @return ssize_t Number of bytes sent or -1 if error
+ * @note result is CLIENT_ERR_AGAIN if a non-blocking socket would block
+ */
+ssize_t writev_client(client_t* client, const struct iovec* iov, int iov_count, client_result_t* result) {
+  // initialize result
+  *result = CLIENT_SUCCESS;
+
+  // served by a ring
+  if (client->io != NULL) {
+    return uring_writev(client, iov, iov_count, result);
+  }
+
+  // sealed by OpenSSL unless the kernel took the keys
+  if (client->ssl != NULL && !client->ktls_send) {
+    return tls_writev(client, iov, iov_count, result);
+  }
+
+  // send buffers in one call
+  ssize_t sent = writev(client->socket, iov, iov_count);
+  if (sent == -1) {
+    *result = (errno == EAGAIN || errno == EWOULDBLOCK) ? CLIENT_ERR_AGAIN : CLIENT_ERR_SEND;
+  }
+
+  return sent;
+}
+
+/**
+ * @brief Sends part of a file to the client without copying it
+ *
+ * @param client Client connection struct
+ * @param fd File to send from
+ * @param offset Offset to send from, advanced by the bytes sent
+ * @param len Number of bytes to send
+ * @param result Result of the operation
+ * @return ssize_t Number of bytes sent or -1 if error
+ * @note result is CLIENT_ERR_AGAIN if a non-blocking socket would block
+ */
+ssize_t sendfile_client(client_t* client, int fd, off_t* offset, size_t len, client_result_t* result) {
+  // initialize result
+  *result = CLIENT_SUCCESS;
+
+  // served by a ring
+  if (client->io != NULL) {
+    return uring_sendfile(client, fd, offset, len, result);
+  }
+
+  // without kTLS the file has to pass through OpenSSL
+  if (client->ssl != NULL && !client->ktls_send) {
+    return tls_sendfile(client, fd, offset, len, result);
+  }
+
+  // send straight from the page cache, sealed by the kernel under kTLS
+  ssize_t sent = sendfile(client->socket, fd, offset, len);
+  if (sent == -1) {
+    *result = (errno == EAGAIN || errno == EWOULDBLOCK) ? CLIENT_ERR_AGAIN : CLIENT_ERR_SEND;
+  } else if (sent == 0 && len > 0) {
+    // the file shrank underneath us
     *result = CLIENT_ERR_SEND;
   }
+
+  return sent;
+}
+
+/**
+ * @brief Checks whether bytes spliced into the client socket reach the client
+ *
+ * @param client Client connection struct
+ * @return int 1 for cleartext and kTLS sockets, 0 if OpenSSL seals what is sent
+ */
+int can_splice_client(const client_t* client) {
+  return client->ssl == NULL || client->ktls_send;
+}
+
+/**
+ * @brief Puts the client socket into non-blocking mode
+ *
+ * @param client Client connection struct
+ * @return int 0 if successful, -1 if error
+ */
+int set_client_nonblocking(client_t* client) {
+  // get current flags
+  int flags = fcntl(client->socket, F_GETFL, 0);
+  if (flags == -1) {
+    return -1;
+  }
+
+  // add non-blocking flag
+  if (fcntl(client->socket, F_SETFL, flags | O_NONBLOCK) == -1) {
+    return -1;
+  }
+
+  return 0;
 }
 
 /**
@@ -76,9 +224,20 @@ void send_client(client_t* client, const char buff[], size_t buff_len, client_re
  * @param client Client connection struct
  */
 void close_client(client_t* client) {
+  // the ring frees the client once its operations end
+  if (client->io != NULL) {
+    uring_close_client(client);
+    return;
+  }
+
+  // end the TLS session before its socket
+  if (client->ssl != NULL) {
+    tls_close_client(client);
+  }
+
   // close socket
   close(client->socket);
 
   // free client
-  free(client);
+  pool_free(client, sizeof(client_t));
 }
\ No newline at end of file
@@ -0,0 +1,370 @@
+#include <stdio.h>
+#include <strings.h>
+
+#include "conditional.h"
+
+/** Month names of IMF-fixdates */
+static const char* months[] = { "Jan", "Feb", "Mar", "Apr", "May", "Jun", "Jul", "Aug", "Sep", "Oct", "Nov", "Dec" };
+
+/**
+ * @brief Formats the strong ETag of a file
+ *
+ * @param etag Buffer to fill
+ * @param inode Inode of the file
+ * @param size Size of the file
+ * @param mtime Modification time of the file
+ * @param encoding Encoding of the representation, part of the tag
+ */
+void format_etag(char etag[ETAG_LEN], ino_t inode, size_t size, struct timespec mtime, content_encoding_t encoding) {
+  const char* name = encoding_name(encoding);
+  snprintf(etag, ETAG_LEN, "\"%llx-%zx-%llx%s%s\"", (unsigned long long)inode, size,
+           (unsigned long long)mtime.tv_sec * 1000000000ULL + (unsigned long long)mtime.tv_nsec, name != NULL ? "-" : "",
+           name != NULL ? name : "");
+}
+
+/**
+ * @brief Formats a time as an IMF-fixdate
+ *
+ * @param date Buffer to fill
+ * @param time Seconds since the epoch
+ */
+void format_http_date(char date[HTTP_DATE_LEN], time_t time) {
+  struct tm tm;
+  gmtime_r(&time, &tm);
+
+  // the C locale spells the names as IMF-fixdate wants them
+  if (strftime(date, HTTP_DATE_LEN, "%a, %d %b %Y %H:%M:%S GMT", &tm) == 0) {
+    date[0] = '\0';
+  }
+}
+
+/**
+ * @brief Parses a fixed number of digits
+ *
+ * @param digits First digit
+ * @param count Number of digits
+ * @param value Set to the number
+ * @return int 0 if successful, -1 if a character is not a digit
+ */
+static int parse_digits(const char* digits, int count, int* value) {
+  *value = 0;
+  for (int i = 0; i < count; i++) {
+    if (digits[i] < '0' || digits[i] > '9') {
+      return -1;
+    }
+    *value = *value * 10 + (digits[i] - '0');
+  }
+
+  return 0;
+}
+
+/**
+ * @brief Parses an IMF-fixdate
+ *
+ * @param value Header value
+ * @param time Set to seconds since the epoch
+ * @return int 0 if successful, -1 if the value is not an IMF-fixdate
+ */
+int parse_http_date(slice_t value, time_t* time) {
+  // "Sun, 06 Nov 1994 08:49:37 GMT", the obsolete formats are not accepted
+  const char* d = value.ptr;
+  if (value.len != HTTP_DATE_LEN - 1 || d[3] != ',' || d[4] != ' ' || d[7] != ' ' || d[11] != ' ' || d[16] != ' ' ||
+      d[19] != ':' || d[22] != ':' || memcmp(d + 25, " GMT", 4) != 0) {
+    return -1;
+  }
+
+  struct tm tm;
+  memset(&tm, 0, sizeof(tm));
+  int year;
+  if (parse_digits(d + 5, 2, &tm.tm_mday) == -1 || parse_digits(d + 12, 4, &year) == -1 ||
+      parse_digits(d + 17, 2, &tm.tm_hour) == -1 || parse_digits(d + 20, 2, &tm.tm_min) == -1 ||
+      parse_digits(d + 23, 2, &tm.tm_sec) == -1) {
+    return -1;
+  }
+  tm.tm_year = year - 1900;
+
+  tm.tm_mon = -1;
+  for (int i = 0; i < 12; i++) {
+    if (memcmp(d + 8, months[i], 3) == 0) {
+      tm.tm_mon = i;
+      break;
+    }
+  }
+  if (tm.tm_mon == -1) {
+    return -1;
+  }
+
+  *time = timegm(&tm);
+  return *time == (time_t)-1 ? -1 : 0;
+}
+
+/**
+ * @brief Formats the ETag and Last-Modified header lines
+ *
+ * @param out Buffer to fill
+ * @param out_len Size of the buffer
+ * @param etag ETag of the representation
+ * @param mtime Modification time in seconds
+ * @return int Length of the lines or -1 if they do not fit
+ */
+int format_validators(char* out, size_t out_len, const char* etag, time_t mtime) {
+  char date[HTTP_DATE_LEN];
+  format_http_date(date, mtime);
+
+  int len = snprintf(out, out_len, "ETag: %s\r\nLast-Modified: %s\r\n", etag, date);
+  if (len < 0 || (size_t)len >= out_len) {
+    return -1;
+  }
+
+  return len;
+}
+
+/**
+ * @brief Checks if a request carries any precondition or Range header
+ *
+ * @param request Parsed request
+ * @return int 1 if select_representation has work to do, 0 otherwise
+ */
+int is_conditional(const request_t* request) {
+  for (size_t i = 0; i < request->header_count; i++) {
+    slice_t name = request->headers[i].name;
+    if (slice_equals(name, "If-None-Match") || slice_equals(name, "If-Modified-Since") ||
+        slice_equals(name, "Range")) {
+      return 1;
+    }
+  }
+
+  return 0;
+}
+
+/**
+ * @brief Checks if an If-None-Match list contains an ETag
+ *
+ * @param value Header value
+ * @param etag ETag of the representation
+ * @return int 1 if it matches, 0 otherwise
+ * @note Uses the weak comparison, W/ prefixes are ignored
+ */
+static int etag_list_matches(slice_t value, const char* etag) {
+  size_t etag_len = strlen(etag);
+  const char* p = value.ptr;
+  const char* end = p + value.len;
+
+  while (p < end) {
+    while (p < end && (*p == ' ' || *p == '\t' || *p == ',')) {
+      p++;
+    }
+    if (p == end) {
+      break;
+    }
+
+    // any current representation
+    if (*p == '*') {
+      return 1;
+    }
+
+    if (end - p > 2 && p[0] == 'W' && p[1] == '/') {
+      p += 2;
+    }
+
+    // a quoted tag runs to its closing quote
+    const char* tag_end = p;
+    if (*p == '"') {
+      tag_end = memchr(p + 1, '"', (size_t)(end - p - 1));
+      if (tag_end == NULL) {
+        return 0;
+      }
+      tag_end++;
+    } else {
+      while (tag_end < end && *tag_end != ',') {
+        tag_end++;
+      }
+    }
+
+    if ((size_t)(tag_end - p) == etag_len && memcmp(p, etag, etag_len) == 0) {
+      return 1;
+    }
+
+    p = tag_end;
+  }
+
+  return 0;
+}
+
+/**
+ * @brief Checks if If-Range still names the representation
+ *
+ * @param value Header value
+ * @param etag ETag of the representation
+ * @param mtime Modification time in seconds
+ * @return int 1 if the ranges may be served, 0 to send the full body
+ */
+static int if_range_matches(slice_t value, const char* etag, time_t mtime) {
+  // strong comparison, a weak tag never matches
+  if (value.len > 0 && value.ptr[0] == '"') {
+    return value.len == strlen(etag) && memcmp(value.ptr, etag, value.len) == 0;
+  }
+
+  time_t date;
+  return parse_http_date(value, &date) == 0 && date == mtime;
+}
+
+/**
+ * @brief Parses a decimal byte position
+ *
+ * @param p First digit, advanced past the number
+ * @param end End of the input
+ * @param value Set to the number
+ * @return int 0 if successful, -1 if there is no number or it overflows
+ */
+static int parse_position(const char** p, const char* end, size_t* value) {
+  const char* start = *p;
+  *value = 0;
+  while (*p < end && **p >= '0' && **p <= '9') {
+    if (*value > (SIZE_MAX - 9) / 10) {
+      return -1;
+    }
+    *value = *value * 10 + (size_t)(**p - '0');
+    (*p)++;
+  }
+
+  return *p == start ? -1 : 0;
+}
+
+/**
+ * @brief Parses a Range header
+ *
+ * @param value Header value
+ * @param size Size of the representation
+ * @param ranges Filled with the satisfiable ranges
+ * @param range_count Set to the number of satisfiable ranges
+ * @return int 0 if successful, -1 if the header must be ignored
+ */
+static int parse_ranges(slice_t value, size_t size, byte_range_t ranges[RANGE_MAX_PARTS], int* range_count) {
+  const char* p = value.ptr;
+  const char* end = p + value.len;
+  *range_count = 0;
+
+  // only byte ranges exist
+  if (value.len < 6 || strncasecmp(p, "bytes=", 6) != 0) {
+    return -1;
+  }
+  p += 6;
+
+  int specs = 0;
+  while (p < end) {
+    while (p < end && (*p == ' ' || *p == '\t' || *p == ',')) {
+      p++;
+    }
+    if (p == end) {
+      break;
+    }
+
+    // too many parts are not worth the work
+    if (++specs > RANGE_MAX_PARTS) {
+      return -1;
+    }
+
+    size_t first;
+    size_t last;
+    if (*p == '-') {
+      // suffix, the last n bytes
+      p++;
+      size_t suffix;
+      if (parse_position(&p, end, &suffix) == -1) {
+        return -1;
+      }
+      if (suffix == 0 || size == 0) {
+        continue;
+      }
+      first = suffix >= size ? 0 : size - suffix;
+      last = size - 1;
+    } else {
+      if (parse_position(&p, end, &first) == -1 || p == end || *p != '-') {
+        return -1;
+      }
+      p++;
+
+      // an open range runs to the end
+      last = SIZE_MAX;
+      if (p < end && *p >= '0' && *p <= '9' && parse_position(&p, end, &last) == -1) {
+        return -1;
+      }
+      if (last < first) {
+        return -1;
+      }
+
+      if (first >= size) {
+        continue;
+      }
+      if (last >= size) {
+        last = size - 1;
+      }
+    }
+
+    // whitespace and a comma end a spec
+    while (p < end && (*p == ' ' || *p == '\t')) {
+      p++;
+    }
+    if (p < end && *p != ',') {
+      return -1;
+    }
+
+    ranges[*range_count].offset = first;
+    ranges[*range_count].len = last - first + 1;
+    (*range_count)++;
+  }
+
+  return specs == 0 ? -1 : 0;
+}
+
+/**
+ * @brief Evaluates preconditions and Range against a representation
+ *
+ * If-None-Match takes precedence over If-Modified-Since. Range is only
+ * honored when If-Range, if present, still matches; syntactically invalid
+ * ranges and more than RANGE_MAX_PARTS of them are ignored.
+ *
+ * @param request Parsed request
+ * @param etag ETag of the representation
+ * @param mtime Modification time in seconds
+ * @param size Size of the representation
+ * @param ranges Filled with the ranges to send
+ * @param range_count Set to the number of ranges
+ * @return selection_t Response to send
+ */
+selection_t select_representation(const request_t* request, const char* etag, time_t mtime, size_t size,
+                                  byte_range_t ranges[RANGE_MAX_PARTS], int* range_count) {
+  *range_count = 0;
+
+  // revalidation
+  const header_t* header = find_header(request, "If-None-Match");
+  if (header != NULL) {
+    if (etag_list_matches(header->value, etag)) {
+      return SELECT_NOT_MODIFIED;
+    }
+  } else if ((header = find_header(request, "If-Modified-Since")) != NULL) {
+    time_t since;
+    if (parse_http_date(header->value, &since) == 0 && mtime <= since) {
+      return SELECT_NOT_MODIFIED;
+    }
+  }
+
+  // partial content
+  header = find_header(request, "Range");
+  if (header == NULL) {
+    return SELECT_FULL;
+  }
+
+  const header_t* if_range = find_header(request, "If-Range");
+  if (if_range != NULL && !if_range_matches(if_range->value, etag, mtime)) {
+    return SELECT_FULL;
+  }
+
+  if (parse_ranges(header->value, size, ranges, range_count) == -1) {
+    *range_count = 0;
+    return SELECT_FULL;
+  }
+
+  return *range_count > 0 ? SELECT_PARTIAL : SELECT_UNSATISFIABLE;
+}
@@ -0,0 +1,306 @@
+#include <getopt.h>
+
+#include "config.h"
+#include "logger.h"
+
+/**
+ * @brief Parses a positive integer option
+ *
+ * @param arg Option argument
+ * @param value Parsed value
+ * @return int 0 if valid, -1 if error
+ */
+static int parse_positive(const char* arg, int* value) {
+  // parse number
+  char* end;
+  long parsed = strtol(arg, &end, 10);
+  if (*arg == '\0' || *end != '\0' || parsed <= 0 || parsed > 1000000) {
+    return -1;
+  }
+
+  *value = (int)parsed;
+  return 0;
+}
+
+/**
+ * @brief Parses the command line into a config
+ *
+ * @param argc Number of arguments
+ * @param argv Arguments
+ * @param config Config struct to fill
+ * @param result Result of the operation
+ */
+void parse_config(int argc, char* argv[], config_t* config, config_result_t* result) {
+  // initialize result
+  *result = CONFIG_SUCCESS;
+
+  // initialize defaults
+  memset(config, 0, sizeof(config_t));
+  config->mode = SERVER_MODE_EPOLL;
+  config->workers = (int)sysconf(_SC_NPROCESSORS_ONLN);
+  if (config->workers <= 0) {
+    config->workers = 1;
+  }
+  config->keepalive_timeout = DEFAULT_KEEPALIVE_TIMEOUT;
+  config->max_requests = DEFAULT_MAX_REQUESTS;
+  config->cache_mb = DEFAULT_CACHE_MB;
+  config->log_level = LOG_INFO;
+  config->log_path = NULL;
+  config->access_log_path = NULL;
+  config->access_log_format = ACCESS_LOG_COMBINED;
+  config->rotate_mb = 0;
+  config->rotate_secs = 0;
+  config->backlog = DEFAULT_BACKLOG;
+  config->reuseport = 0;
+  config->steer = 0;
+  config->compress_min = DEFAULT_COMPRESS_MIN;
+  config->drain_timeout = DEFAULT_DRAIN_TIMEOUT;
+  config->max_connections = DEFAULT_MAX_CONNECTIONS;
+  config->max_per_host = DEFAULT_MAX_PER_HOST;
+  config->overflow = OVERFLOW_QUEUE;
+  config->header_timeout = DEFAULT_HEADER_TIMEOUT;
+  config->min_send_rate = DEFAULT_MIN_SEND_RATE;
+  config->route_count = 0;
+  config->upstream_timeout = DEFAULT_UPSTREAM_TIMEOUT;
+  config->response_cache_mb = DEFAULT_RESPONSE_CACHE_MB;
+  config->cache_dir = NULL;
+  config->max_body_kb = DEFAULT_MAX_BODY_KB;
+  config->tls_cert = NULL;
+  config->tls_key = NULL;
+  config->metrics_port = 0;
+  config->immutable = 0;
+
+  // parse options
+  int opt;
+  while ((opt = getopt(argc, argv, "m:w:k:r:c:l:o:a:f:s:t:b:z:M:D:C:I:O:H:W:U:T:R:d:B:E:K:iPS")) != -1) {
+    switch (opt) {
+      case 'm':
+        if (strcmp(optarg, "epoll") == 0) {
+          config->mode = SERVER_MODE_EPOLL;
+        } else if (strcmp(optarg, "threads") == 0) {
+          config->mode = SERVER_MODE_THREADS;
+        } else if (strcmp(optarg, "uring") == 0) {
+          config->mode = SERVER_MODE_URING;
+        } else {
+          *result = CONFIG_ERR_INVALID_MODE;
+          return;
+        }
+        break;
+      case 'w':
+        if (parse_positive(optarg, &config->workers) == -1) {
+          *result = CONFIG_ERR_INVALID_ARG;
+          return;
+        }
+        break;
+      case 'k':
+        if (parse_positive(optarg, &config->keepalive_timeout) == -1) {
+          *result = CONFIG_ERR_INVALID_ARG;
+          return;
+        }
+        break;
+      case 'r':
+        if (parse_positive(optarg, &config->max_requests) == -1) {
+          *result = CONFIG_ERR_INVALID_ARG;
+          return;
+        }
+        break;
+      case 'c':
+        if (strcmp(optarg, "0") == 0) {
+          config->cache_mb = 0;
+        } else if (parse_positive(optarg, &config->cache_mb) == -1) {
+          *result = CONFIG_ERR_INVALID_ARG;
+          return;
+        }
+        break;
+      case 'l':
+        if (strcmp(optarg, "error") == 0) {
+          config->log_level = LOG_ERROR;
+        } else if (strcmp(optarg, "info") == 0) {
+          config->log_level = LOG_INFO;
+        } else if (strcmp(optarg, "debug") == 0) {
+          config->log_level = LOG_DEBUG;
+        } else {
+          *result = CONFIG_ERR_INVALID_ARG;
+          return;
+        }
+        break;
+      case 'o':
+        config->log_path = optarg;
+        break;
+      case 'a':
+        config->access_log_path = optarg;
+        break;
+      case 'f':
+        if (strcmp(optarg, "common") == 0) {
+          config->access_log_format = ACCESS_LOG_COMMON;
+        } else if (strcmp(optarg, "combined") == 0) {
+          config->access_log_format = ACCESS_LOG_COMBINED;
+        } else if (strcmp(optarg, "json") == 0) {
+          config->access_log_format = ACCESS_LOG_JSON;
+        } else {
+          *result = CONFIG_ERR_INVALID_ARG;
+          return;
+        }
+        break;
+      case 's':
+        if (parse_positive(optarg, &config->rotate_mb) == -1) {
+          *result = CONFIG_ERR_INVALID_ARG;
+          return;
+        }
+        break;
+      case 't':
+        if (parse_positive(optarg, &config->rotate_secs) == -1) {
+          *result = CONFIG_ERR_INVALID_ARG;
+          return;
+        }
+        break;
+      case 'b':
+        if (parse_positive(optarg, &config->backlog) == -1) {
+          *result = CONFIG_ERR_INVALID_ARG;
+          return;
+        }
+        break;
+      case 'z':
+        if (strcmp(optarg, "0") == 0) {
+          config->compress_min = 0;
+        } else if (parse_positive(optarg, &config->compress_min) == -1) {
+          *result = CONFIG_ERR_INVALID_ARG;
+          return;
+        }
+        break;
+      case 'M':
+        if (parse_positive(optarg, &config->metrics_port) == -1 || config->metrics_port > 65535) {
+          *result = CONFIG_ERR_INVALID_ARG;
+          return;
+        }
+        break;
+      case 'D':
+        if (parse_positive(optarg, &config->drain_timeout) == -1) {
+          *result = CONFIG_ERR_INVALID_ARG;
+          return;
+        }
+        break;
+      case 'C':
+        if (strcmp(optarg, "0") == 0) {
+          config->max_connections = 0;
+        } else if (parse_positive(optarg, &config->max_connections) == -1) {
+          *result = CONFIG_ERR_INVALID_ARG;
+          return;
+        }
+        break;
+      case 'I':
+        if (strcmp(optarg, "0") == 0) {
+          config->max_per_host = 0;
+        } else if (parse_positive(optarg, &config->max_per_host) == -1) {
+          *result = CONFIG_ERR_INVALID_ARG;
+          return;
+        }
+        break;
+      case 'O':
+        if (strcmp(optarg, "queue") == 0) {
+          config->overflow = OVERFLOW_QUEUE;
+        } else if (strcmp(optarg, "reject") == 0) {
+          config->overflow = OVERFLOW_REJECT;
+        } else {
+          *result = CONFIG_ERR_INVALID_ARG;
+          return;
+        }
+        break;
+      case 'H':
+        if (parse_positive(optarg, &config->header_timeout) == -1) {
+          *result = CONFIG_ERR_INVALID_ARG;
+          return;
+        }
+        break;
+      case 'W':
+        if (strcmp(optarg, "0") == 0) {
+          config->min_send_rate = 0;
+        } else if (parse_positive(optarg, &config->min_send_rate) == -1) {
+          *result = CONFIG_ERR_INVALID_ARG;
+          return;
+        }
+        break;
+      case 'U':
+        if (config->route_count == CONFIG_MAX_ROUTES) {
+          *result = CONFIG_ERR_INVALID_ARG;
+          return;
+        }
+        config->routes[config->route_count++] = optarg;
+        break;
+      case 'T':
+        if (parse_positive(optarg, &config->upstream_timeout) == -1) {
+          *result = CONFIG_ERR_INVALID_ARG;
+          return;
+        }
+        break;
+      case 'R':
+        if (strcmp(optarg, "0") == 0) {
+          config->response_cache_mb = 0;
+        } else if (parse_positive(optarg, &config->response_cache_mb) == -1) {
+          *result = CONFIG_ERR_INVALID_ARG;
+          return;
+        }
+        break;
+      case 'd':
+        config->cache_dir = optarg;
+        break;
+      case 'B':
+        if (strcmp(optarg, "0") == 0) {
+          config->max_body_kb = 0;
+        } else if (parse_positive(optarg, &config->max_body_kb) == -1) {
+          *result = CONFIG_ERR_INVALID_ARG;
+          return;
+        }
+        break;
+      case 'E':
+        config->tls_cert = optarg;
+        break;
+      case 'K':
+        config->tls_key = optarg;
+        break;
+      case 'i':
+        config->immutable = 1;
+        break;
+      case 'P':
+        config->reuseport = 1;
+        break;
+      case 'S':
+        // steering only exists between per-worker listeners
+        config->reuseport = 1;
+        config->steer = 1;
+        break;
+      default:
+        *result = CONFIG_ERR_USAGE;
+        return;
+    }
+  }
+
+  // check positional arguments
+  if (argc - optind < 2) {
+    *result = CONFIG_ERR_USAGE;
+    return;
+  }
+
+  // get host
+  if (strlen(argv[optind]) >= INET_ADDRSTRLEN) {
+    *result = CONFIG_ERR_INVALID_HOST;
+    return;
+  }
+  strncpy(config->host, argv[optind], INET_ADDRSTRLEN);
+
+  // get port
+  config->port = atoi(argv[optind + 1]);
+  if (config->port <= 0 || config->port > 65535) {
+    *result = CONFIG_ERR_INVALID_PORT;
+    return;
+  }
+}
+
+/**
+ * @brief Logs the command line usage
+ *
+ * @param program Name of the program
+ */
+void log_usage(const char* program) {
+  log_message(LOG_ERROR, "Usage: %s [-m epoll|threads|uring] [-w workers] [-k keepalive_secs] [-r max_requests] [-c cache_mb] [-l error|info|debug] [-o log_file] [-a access_log] [-f common|combined|json] [-s rotate_mb] [-t rotate_secs] [-b backlog] [-z compress_min_bytes] [-M metrics_port] [-D drain_secs] [-C max_connections] [-I max_per_ip] [-O queue|reject] [-H header_secs] [-W min_send_bytes_per_sec] [-U prefix=host:port|unix:path,...] [-T upstream_secs] [-R response_cache_mb] [-d cache_dir] [-B max_body_kb] [-E tls_cert] [-K tls_key] [-i] [-P] [-S] <host> <port>\n", program);
+}
@@ -0,0 +1,617 @@
+#include <stdio.h>
+#include <time.h>
+#include <poll.h>
+
+#include "connection.h"
+#include "h2.h"
+#include "proxy.h"
+#include "server.h"
+#include "metrics.h"
+#include "status.h"
+
+/**
+ * @brief Gets the monotonic time
+ *
+ * @return int64_t Milliseconds since an arbitrary point
+ */
+static int64_t now_ms(void) {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (int64_t)now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+/**
+ * @brief Gets the bytes the connection has sent in its current response
+ *
+ * @param connection Connection struct
+ * @return size_t Bytes sent, of the whole session for HTTP/2
+ */
+static size_t bytes_sent(const connection_t* connection) {
+  return connection->h2 != NULL ? h2_sent(connection->h2) : connection->response.sent;
+}
+
+/**
+ * @brief Gets the bytes a proxied request has moved either way
+ *
+ * @param connection Connection struct
+ * @return size_t Bytes sent of the response and received of the body
+ */
+static size_t bytes_relayed(const connection_t* connection) {
+  return bytes_sent(connection) + (size_t)connection->body.received;
+}
+
+/**
+ * @brief Sets the deadline of the phase the connection just entered
+ *
+ * @param connection Connection struct
+ */
+static void start_phase(connection_t* connection) {
+  const config_t* config = connection->server->config;
+  int64_t now = now_ms();
+
+  if (connection->state == CONNECTION_WRITING) {
+    // the response is measured one send window at a time
+    connection->window_sent = bytes_sent(connection);
+    connection->deadline = now + CONNECTION_SEND_WINDOW_MS;
+  } else if (connection->state == CONNECTION_PROXYING && proxy_coalesced(connection->proxy)) {
+    // nothing signals a finished fill, look for it again shortly
+    connection->deadline = now + RESPONSE_CACHE_WAIT_MS;
+  } else if (connection->state == CONNECTION_PROXYING) {
+    // a backend has to answer, then keep the bodies moving
+    connection->window_sent = bytes_relayed(connection);
+    connection->deadline = now + (int64_t)config->upstream_timeout * 1000;
+  } else if (connection->in_len > 0) {
+    // the request started, its headers are due
+    connection->deadline = now + (int64_t)config->header_timeout * 1000;
+  } else {
+    connection->deadline = now + (int64_t)config->keepalive_timeout * 1000;
+  }
+}
+
+/**
+ * @brief Creates a connection for a client
+ *
+ * @param client Client of the connection
+ * @param server Server the client connected to
+ * @param result Result of the operation
+ * @return connection_t* Pointer to new connection or NULL if error
+ */
+connection_t* create_connection(client_t* client, struct server* server, connection_result_t* result) {
+  // initialize result
+  *result = CONNECTION_SUCCESS;
+
+  // refuse clients over the limits, a TLS one without a 503, the caller closes them
+  admission_result_t admission_result;
+  admit_connection(server->admission, client->host, &admission_result);
+  if (admission_result != ADMISSION_SUCCESS) {
+    metrics_count(METRIC_CONNECTIONS_REJECTED, 1);
+    send_status(client, 503);
+    *result = CONNECTION_ERR_REJECTED;
+    return NULL;
+  }
+
+  // initialize connection
+  pool_result_t pool_result;
+  connection_t* connection = pool_alloc(sizeof(connection_t), &pool_result);
+  if (connection == NULL) {
+    release_connection(server->admission, client->host);
+    *result = CONNECTION_ERR_MALLOC;
+    return NULL;
+  }
+
+  // set client and initial state
+  connection->client = client;
+  connection->server = server;
+  connection->state = CONNECTION_READING;
+  connection->keep_alive = 1;
+  connection->requests_served = 0;
+  connection->window_sent = 0;
+  init_wheel_timer(&connection->timer, connection);
+  connection->request_start = 0;
+  connection->in = NULL;
+  connection->in_len = 0;
+  init_request_parser(&connection->parser);
+  connection->body.done = 1;
+  init_arena(&connection->arena);
+  init_response(&connection->response, &connection->arena);
+  connection->log_buffer = NULL;
+  connection->h2 = NULL;
+  connection->proxy = NULL;
+  connection->upstream_pool = NULL;
+  TRACE_CONNECTION(&connection->trace);
+  metrics_count(METRIC_CONNECTIONS_OPENED, 1);
+  start_phase(connection);
+
+  return connection;
+}
+
+/**
+ * @brief Checks a connection whose deadline may have passed
+ *
+ * A response that sent enough during its send window gets another one.
+ * A proxied request whose backend did not answer in time is answered
+ * with a 504 instead, one waiting for another request's fill looks again.
+ *
+ * @param connection Connection struct
+ * @param now Current monotonic ms
+ * @return int 1 if the connection missed its deadline and must be closed
+ */
+int connection_expired(connection_t* connection, int64_t now) {
+  if (now < connection->deadline) {
+    return 0;
+  }
+
+  // a coalesced request polls the cache
+  if (connection->state == CONNECTION_PROXYING && proxy_coalesced(connection->proxy)) {
+    drive_connection(connection);
+    if (connection->state == CONNECTION_PROXYING && proxy_coalesced(connection->proxy)) {
+      start_phase(connection);
+    }
+    return connection->state == CONNECTION_CLOSING;
+  }
+
+  // relayed bodies only have to keep moving
+  if (connection->state == CONNECTION_PROXYING) {
+    if (bytes_relayed(connection) > connection->window_sent) {
+      start_phase(connection);
+      return 0;
+    }
+
+    // nothing reached the client yet, so it can still be told, unless it stopped sending its body
+    if (!proxy_answered(connection->proxy) && !proxy_uploading(connection->proxy)) {
+      response_result_t result;
+      abort_proxy(connection, 1);
+      queue_status(&connection->response, 504, connection->keep_alive, &result);
+      connection->state = result == RESPONSE_SUCCESS ? CONNECTION_WRITING : CONNECTION_CLOSING;
+      if (connection->state == CONNECTION_WRITING) {
+        start_phase(connection);
+        drive_connection(connection);
+      }
+      return connection->state == CONNECTION_CLOSING;
+    }
+  }
+
+  // a response lives on while the client keeps reading, a rate of 0 only asks for progress
+  if (connection->state == CONNECTION_WRITING) {
+    size_t required = (size_t)connection->server->config->min_send_rate * CONNECTION_SEND_WINDOW_MS / 1000;
+    if (bytes_sent(connection) - connection->window_sent >= (required > 0 ? required : 1)) {
+      connection->window_sent = bytes_sent(connection);
+      connection->deadline = now + CONNECTION_SEND_WINDOW_MS;
+      return 0;
+    }
+  }
+
+  // idle connections expire, the rest were too slow
+  if (connection->state != CONNECTION_READING || connection->in_len > 0) {
+    metrics_count(METRIC_CONNECTIONS_TIMED_OUT, 1);
+  }
+  return 1;
+}
+
+/**
+ * @brief Records the current request and its response in the access log
+ *
+ * @param connection Connection struct
+ */
+static void log_connection(connection_t* connection) {
+  if (connection->log_buffer == NULL) {
+    return;
+  }
+
+  log_access(connection->server->access_log, connection->log_buffer, &connection->entry, connection->client->host,
+             connection->response.status, body_sent(&connection->response));
+}
+
+/**
+ * @brief Answers a request that could not be parsed and closes after it
+ *
+ * The parser cannot find where the next request starts, so the
+ * connection ends once the error response is sent.
+ *
+ * @param connection Connection struct
+ * @param request_result Failed parse result
+ */
+static void reject_request(connection_t* connection, request_result_t request_result) {
+  response_result_t result;
+
+  metrics_request_result(request_result);
+  connection->request_start = metrics_now();
+  if (connection->log_buffer != NULL) {
+    begin_rejected_entry(&connection->entry);
+  }
+
+  connection->keep_alive = 0;
+  connection->in_len = 0;
+  queue_status(&connection->response, request_result_status(request_result), 0, &result);
+  if (result != RESPONSE_SUCCESS) {
+    reset_response(&connection->response);
+    reset_arena(&connection->arena);
+    connection->state = CONNECTION_CLOSING;
+    return;
+  }
+
+  connection->state = CONNECTION_WRITING;
+  start_phase(connection);
+}
+
+/**
+ * @brief Skips what is buffered of a body nobody read
+ *
+ * @param connection Connection struct
+ * @return int 1 once the body is skipped, 0 if more is needed or it is
+ *         malformed, which closes the connection
+ */
+static int skip_body(connection_t* connection) {
+  size_t decoded;
+  body_result_t result;
+
+  size_t consumed = decode_body(&connection->body, connection->in, connection->in_len, &decoded, &result);
+  if (result != BODY_SUCCESS) {
+    connection->state = CONNECTION_CLOSING;
+    return 0;
+  }
+
+  connection->in_len -= consumed;
+  memmove(connection->in, connection->in + consumed, connection->in_len);
+  return connection->body.done;
+}
+
+/**
+ * @brief Parses and handles a buffered request if one is complete
+ *
+ * @param connection Connection struct
+ * @return int 1 if a request was handled, 0 if more data is needed
+ */
+static int process_connection(connection_t* connection) {
+  request_t* request = &connection->request;
+  request_result_t request_result;
+
+  // nothing buffered
+  if (connection->in_len == 0) {
+    return 0;
+  }
+
+  // the last request's body comes first
+  if (!connection->body.done && (!skip_body(connection) || connection->in_len == 0)) {
+    return connection->state == CONNECTION_CLOSING;
+  }
+
+  // a connection may open with the HTTP/2 preface instead, unless streams would reach routes they cannot proxy
+  h2_result_t h2_result;
+  int h2c = connection->server->upstream == NULL;
+  if (h2c && connection->requests_served == 0) {
+    int preface = match_h2_preface(connection->in, connection->in_len);
+    if (preface == 0) {
+      return 0;
+    }
+    if (preface == 1) {
+      start_h2(connection, NULL, &h2_result);
+      if (h2_result != H2_SUCCESS) {
+        connection->state = CONNECTION_CLOSING;
+      }
+      return 1;
+    }
+  }
+
+  // resume parsing where the last call stopped
+  // pipelined requests begin without a read
+  TRACE_BEGIN(&connection->trace, trace_now());
+  TRACE_MARK(&connection->trace, TRACE_READ);
+  uint64_t start = metrics_now();
+  parse_request(&connection->parser, request, connection->in, connection->in_len, &request_result);
+  if (request_result == REQUEST_INCOMPLETE) {
+    // a full buffer without a complete request can never succeed
+    if (connection->in_len == CONNECTION_BUFFER_LEN) {
+      reject_request(connection, connection->parser.state <= PARSER_VERSION ? REQUEST_ERR_URI_TOO_LONG
+                                                                            : REQUEST_ERR_HEADERS_TOO_LARGE);
+      return 1;
+    }
+
+    return 0;
+  }
+
+  connection->request_start = metrics_now();
+  metrics_observe(METRIC_PARSE_TIME, connection->request_start - start);
+  TRACE_MARK(&connection->trace, TRACE_PARSE);
+  if (request_result != REQUEST_SUCCESS) {
+    reject_request(connection, request_result);
+    return 1;
+  }
+
+  // the body is read as it arrives, one announced over the limit is refused up front
+  uint64_t max_body = (uint64_t)connection->server->config->max_body_kb * 1024;
+  if (request->content_length > max_body) {
+    reject_request(connection, REQUEST_ERR_BODY_TOO_LARGE);
+    return 1;
+  }
+  init_body_reader(&connection->body, request, max_body);
+
+  // an h2c upgrade is answered on stream 1, a bad one as HTTP/1.1, one with a body or over TLS is not taken
+  if (h2c && connection->body.done && connection->client->ssl == NULL && is_h2_upgrade(request)) {
+    start_h2(connection, request, &h2_result);
+    if (h2_result == H2_SUCCESS) {
+      return 1;
+    }
+  }
+
+  // keep what the access log needs before the request is consumed
+  if (connection->log_buffer != NULL) {
+    begin_access_entry(&connection->entry, request);
+  }
+
+  // decide whether the connection survives this response, never while draining
+  connection->requests_served++;
+  connection->keep_alive = request->keep_alive && connection->requests_served < connection->server->config->max_requests &&
+                           !__atomic_load_n(&connection->server->draining, __ATOMIC_RELAXED);
+
+  // build response while the request slices are still valid
+  metrics_count(METRIC_REQUESTS, 1);
+  int handled = handle_request(connection, request);
+  metrics_observe(METRIC_HANDLE_TIME, metrics_now() - connection->request_start);
+  TRACE_MARK(&connection->trace, TRACE_QUEUE);
+  if (handled == -1) {
+    log_connection(connection);
+    reset_response(&connection->response);
+    reset_arena(&connection->arena);
+    connection->state = CONNECTION_CLOSING;
+  } else {
+    connection->state = connection->proxy != NULL ? CONNECTION_PROXYING : CONNECTION_WRITING;
+    start_phase(connection);
+  }
+
+  // consume the request, keeping any pipelined bytes
+  connection->in_len -= request->length;
+  memmove(connection->in, connection->in + request->length, connection->in_len);
+  init_request_parser(&connection->parser);
+
+  return 1;
+}
+
+/**
+ * @brief Reads available bytes into the request buffer
+ *
+ * @param connection Connection struct
+ * @return int 1 if bytes were read, 0 if the socket would block
+ */
+static int read_connection(connection_t* connection) {
+  client_result_t result;
+
+  // take a buffer only while a request is arriving
+  if (connection->in == NULL) {
+    pool_result_t pool_result;
+    connection->in = pool_alloc(CONNECTION_BUFFER_LEN, &pool_result);
+    if (connection->in == NULL) {
+      connection->state = CONNECTION_CLOSING;
+      return 1;
+    }
+  }
+
+  // receive into the free part of the buffer
+  TRACE_RECEIVING(&connection->trace);
+  ssize_t received = recv_client(connection->client, connection->in + connection->in_len,
+                                 CONNECTION_BUFFER_LEN - connection->in_len, &result);
+  if (result == CLIENT_ERR_AGAIN) {
+    // idle connections hold no buffer
+    if (connection->in_len == 0) {
+      pool_free(connection->in, CONNECTION_BUFFER_LEN);
+      connection->in = NULL;
+    }
+    return 0;
+  }
+
+  // closed or failed
+  if (result != CLIENT_SUCCESS) {
+    metrics_client_result(result);
+    connection->state = CONNECTION_CLOSING;
+    return 1;
+  }
+
+  size_t buffered = connection->in_len;
+  if (buffered == 0) {
+    TRACE_BEGIN(&connection->trace, connection->trace.receiving);
+  }
+  connection->in_len += (size_t)received;
+  metrics_count(METRIC_BYTES_RECEIVED, (uint64_t)received);
+
+  // the first bytes of a request start its header deadline
+  if (buffered == 0) {
+    start_phase(connection);
+  }
+  return 1;
+}
+
+/**
+ * @brief Writes as much of the pending response as the socket accepts
+ *
+ * @param connection Connection struct
+ * @return int 1 if the response was finished, 0 if the socket would block
+ */
+static int write_connection(connection_t* connection) {
+  response_result_t result;
+
+  // send the remaining response
+  write_response(connection->client, &connection->response, &result);
+  if (result == RESPONSE_ERR_AGAIN) {
+    return 0;
+  }
+
+  // count and log the exchange, then release the file behind the response
+  metrics_count(METRIC_BYTES_SENT, connection->response.sent);
+  if (result == RESPONSE_SUCCESS) {
+    TRACE_END(&connection->trace);
+    metrics_status(connection->response.status);
+    metrics_observe(METRIC_RESPONSE_TIME, metrics_now() - connection->request_start);
+  }
+  log_connection(connection);
+  reset_response(&connection->response);
+  reset_arena(&connection->arena);
+
+  if (result != RESPONSE_SUCCESS) {
+    connection->state = CONNECTION_CLOSING;
+    return 1;
+  }
+
+  // wait for the next request or finish
+  connection->state = connection->keep_alive ? CONNECTION_READING : CONNECTION_CLOSING;
+  if (connection->state == CONNECTION_READING) {
+    start_phase(connection);
+  }
+  return 1;
+}
+
+/**
+ * @brief Relays a proxied response as far as the sockets allow
+ *
+ * A relayed response is finished like one of our own, a backend that
+ * failed before it answered gets the client a 502 instead.
+ *
+ * @param connection Connection struct
+ * @return int 1 if the exchange ended, 0 if a socket would block
+ */
+static int proxy_connection(connection_t* connection) {
+  proxy_result_t result;
+
+  // a coalesced request that is sent after all gets the backend's time
+  int coalesced = proxy_coalesced(connection->proxy);
+  drive_proxy(connection, &result);
+  if (result == PROXY_ERR_AGAIN) {
+    if (coalesced && !proxy_coalesced(connection->proxy)) {
+      start_phase(connection);
+    }
+    return 0;
+  }
+
+  if (result == PROXY_ERR_FAILED) {
+    response_result_t response_result;
+    queue_status(&connection->response, 502, connection->keep_alive, &response_result);
+    if (response_result != RESPONSE_SUCCESS) {
+      result = PROXY_ERR_BROKEN;
+    }
+  }
+
+  // the client already has part of the response, only closing tells it
+  if (result == PROXY_ERR_BROKEN) {
+    metrics_count(METRIC_BYTES_SENT, connection->response.sent);
+    log_connection(connection);
+    reset_response(&connection->response);
+    reset_arena(&connection->arena);
+    connection->state = CONNECTION_CLOSING;
+    return 1;
+  }
+
+  connection->state = CONNECTION_WRITING;
+  start_phase(connection);
+  return 1;
+}
+
+/**
+ * @brief Advances an HTTP/2 session, reading and writing at once
+ *
+ * The connection is writing while any stream is open, so its deadline is
+ * the minimum send rate, and reading in between.
+ *
+ * @param connection Connection struct
+ */
+static void drive_session(connection_t* connection) {
+  drive_h2(connection);
+  if (connection->state == CONNECTION_CLOSING) {
+    return;
+  }
+
+  connection_state_t state = h2_busy(connection->h2) ? CONNECTION_WRITING : CONNECTION_READING;
+  if (state != connection->state) {
+    connection->state = state;
+    start_phase(connection);
+  }
+}
+
+/**
+ * @brief Gets the poll events a connection waits for
+ *
+ * @param connection Connection struct
+ * @return short POLLIN, POLLOUT, both, or none while waiting on a backend
+ */
+short connection_events(const connection_t* connection) {
+  // a session always reads, it writes while a batch is unsent
+  if (connection->h2 != NULL) {
+    return h2_blocked(connection->h2) ? POLLIN | POLLOUT : POLLIN;
+  }
+  if (connection->proxy != NULL) {
+    return connection->proxy->client_events;
+  }
+  return connection->state == CONNECTION_WRITING ? POLLOUT : POLLIN;
+}
+
+/**
+ * @brief Gets the backend socket a proxied request waits on
+ *
+ * @param connection Connection struct
+ * @param events Set to the poll events awaited on it
+ * @return int Backend socket or -1 if none
+ */
+int connection_upstream(const connection_t* connection, short* events) {
+  *events = 0;
+  return connection->proxy != NULL ? proxy_socket(connection->proxy, events) : -1;
+}
+
+/**
+ * @brief Advances the connection state machine
+ *
+ * Reads, parses and writes until the socket would block or the connection
+ * is done. On a blocking socket a single call serves the connection.
+ *
+ * @param connection Connection struct
+ */
+void drive_connection(connection_t* connection) {
+  while (connection->state != CONNECTION_CLOSING) {
+    if (connection->h2 != NULL) {
+      drive_session(connection);
+      return;
+    }
+
+    if (connection->state == CONNECTION_WRITING) {
+      // flush the response
+      if (!write_connection(connection)) {
+        return;
+      }
+    } else if (connection->state == CONNECTION_PROXYING) {
+      // wait for the backend or the client
+      if (!proxy_connection(connection)) {
+        return;
+      }
+    } else if (!process_connection(connection)) {
+      // need more of the request
+      if (!read_connection(connection)) {
+        return;
+      }
+    }
+  }
+}
+
+/**
+ * @brief Closes a connection and its client
+ *
+ * @param connection Connection struct
+ */
+void close_connection(connection_t* connection) {
+  // an unfinished exchange cannot leave its backend connection reusable
+  if (connection->proxy != NULL) {
+    abort_proxy(connection, 0);
+  }
+
+  // release any unfinished response
+  reset_response(&connection->response);
+  release_arena(&connection->arena);
+  pool_free(connection->in, CONNECTION_BUFFER_LEN);
+  if (connection->h2 != NULL) {
+    close_h2(connection->h2);
+  }
+  metrics_count(METRIC_CONNECTIONS_CLOSED, 1);
+  release_connection(connection->server->admission, connection->client->host);
+
+  // close client
+  close_client(connection->client);
+
+  // free connection
+  pool_free(connection, sizeof(connection_t));
+}
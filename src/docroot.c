@@ -0,0 +1,792 @@
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <signal.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "net.h"
+#include "logger.h"
+#include "docroot.h"
+
+/**
+ * @brief Files collected while walking the root
+ */
+typedef struct {
+  int root_fd;                         /**< Directory being indexed     */
+  docroot_file_t* files;               /**< Files found so far          */
+  struct stat* stats;                  /**< Status of each file         */
+  size_t count;                        /**< Number of files             */
+  size_t capacity;                     /**< Room in files and stats     */
+} docroot_walk_t;
+
+/** Body of empty files, entries with NULL data would be streamed */
+static char empty_body[1];
+
+static pthread_mutex_t swap_lock = PTHREAD_MUTEX_INITIALIZER;
+static docroot_t* current = NULL;
+static pthread_key_t hold_key;
+static pthread_once_t hold_key_once = PTHREAD_ONCE_INIT;
+static __thread docroot_hold_t* thread_hold = NULL;
+static const char* docroot_root = NULL;
+static size_t docroot_compress_min = 0;
+static int signal_pipe[2] = { -1, -1 };
+static pthread_t reload_thread;
+static int docroot_running = 0;
+
+/**
+ * @brief Hashes a path with FNV-1a
+ *
+ * @param path Path to hash
+ * @param len Length of path
+ * @return uint64_t Hash of the path
+ */
+static uint64_t hash_key(const char* path, size_t len) {
+  uint64_t hash = 14695981039346656037ULL;
+  for (size_t i = 0; i < len; i++) {
+    hash ^= (unsigned char)path[i];
+    hash *= 1099511628211ULL;
+  }
+  return hash;
+}
+
+/**
+ * @brief Derives a well mixed value from a hash and a seed
+ *
+ * @param hash Hash of the key
+ * @param seed Displacement seed, 0 picks the bucket
+ * @return uint64_t Mixed value
+ */
+static uint64_t mix_key(uint64_t hash, uint32_t seed) {
+  uint64_t x = hash + (uint64_t)seed * 0x9E3779B97F4A7C15ULL;
+  x ^= x >> 33;
+  x *= 0xff51afd7ed558ccdULL;
+  x ^= x >> 33;
+  x *= 0xc4ceb9fe1a85ec53ULL;
+  x ^= x >> 33;
+  return x;
+}
+
+/**
+ * @brief Frees a snapshot, its entries and its mappings
+ *
+ * @param snapshot Snapshot to free
+ */
+static void free_docroot(docroot_t* snapshot) {
+  for (size_t i = 0; i < snapshot->file_count; i++) {
+    docroot_file_t* file = &snapshot->files[i];
+
+    // compressed bytes are owned, sibling bytes belong to the sibling's mapping
+    for (int v = 0; v <= ENCODING_BROTLI; v++) {
+      file_cache_entry_t* entry = file->variants[v];
+      if (entry == NULL) {
+        continue;
+      }
+      if (v != ENCODING_IDENTITY && !entry->sibling) {
+        free(entry->data);
+      }
+      free(entry);
+    }
+
+    if (file->map != NULL) {
+      munmap(file->map, file->map_len);
+    }
+    free((char*)file->path);
+  }
+
+  free(snapshot->files);
+  free(snapshot->seeds);
+  free(snapshot->slots);
+  free(snapshot);
+}
+
+/**
+ * @brief Records a regular file found by the walk
+ *
+ * @param walk Walk state
+ * @param path Path below the root
+ * @param file_stat Status of the file
+ * @param result Result of the operation
+ * @return int 0 if successful, -1 if error
+ */
+static int add_file(docroot_walk_t* walk, const char* path, const struct stat* file_stat, docroot_result_t* result) {
+  if (walk->count == DOCROOT_MAX_FILES) {
+    *result = DOCROOT_ERR_TOO_LARGE;
+    return -1;
+  }
+
+  // grow both arrays together
+  if (walk->count == walk->capacity) {
+    size_t capacity = walk->capacity > 0 ? walk->capacity * 2 : 64;
+    docroot_file_t* files = realloc(walk->files, capacity * sizeof(docroot_file_t));
+    if (files == NULL) {
+      *result = DOCROOT_ERR_MALLOC;
+      return -1;
+    }
+    walk->files = files;
+    struct stat* stats = realloc(walk->stats, capacity * sizeof(struct stat));
+    if (stats == NULL) {
+      *result = DOCROOT_ERR_MALLOC;
+      return -1;
+    }
+    walk->stats = stats;
+    walk->capacity = capacity;
+  }
+
+  docroot_file_t* file = &walk->files[walk->count];
+  memset(file, 0, sizeof(docroot_file_t));
+  file->path = strdup(path);
+  if (file->path == NULL) {
+    *result = DOCROOT_ERR_MALLOC;
+    return -1;
+  }
+  file->path_len = strlen(path);
+  file->hash = hash_key(file->path, file->path_len);
+  walk->stats[walk->count] = *file_stat;
+  walk->count++;
+
+  return 0;
+}
+
+/**
+ * @brief Collects the regular files of a directory and its subdirectories
+ *
+ * Symbolic links to files are followed, links to directories are not so a
+ * loop cannot make the walk endless.
+ *
+ * @param walk Walk state
+ * @param directory Directory below the root, empty for the root itself
+ * @param result Result of the operation
+ * @return int 0 if successful, -1 if error
+ */
+static int walk_directory(docroot_walk_t* walk, const char* directory, docroot_result_t* result) {
+  int dir_fd = openat(walk->root_fd, directory[0] != '\0' ? directory : ".", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  if (dir_fd == -1) {
+    *result = DOCROOT_ERR_OPEN;
+    return -1;
+  }
+  DIR* dir = fdopendir(dir_fd);
+  if (dir == NULL) {
+    close(dir_fd);
+    *result = DOCROOT_ERR_OPEN;
+    return -1;
+  }
+
+  struct dirent* dirent;
+  while ((dirent = readdir(dir)) != NULL) {
+    if (strcmp(dirent->d_name, ".") == 0 || strcmp(dirent->d_name, "..") == 0) {
+      continue;
+    }
+
+    // paths that could never be requested are skipped
+    char path[FILE_NAME_LEN];
+    int len = snprintf(path, sizeof(path), "%s%s%s", directory, directory[0] != '\0' ? "/" : "", dirent->d_name);
+    if (len < 0 || (size_t)len >= sizeof(path)) {
+      continue;
+    }
+
+    struct stat link_stat;
+    struct stat file_stat;
+    if (fstatat(dir_fd, dirent->d_name, &link_stat, AT_SYMLINK_NOFOLLOW) == -1 ||
+        fstatat(dir_fd, dirent->d_name, &file_stat, 0) == -1) {
+      continue;
+    }
+
+    if (S_ISDIR(link_stat.st_mode)) {
+      if (walk_directory(walk, path, result) == -1) {
+        closedir(dir);
+        return -1;
+      }
+    } else if (S_ISREG(file_stat.st_mode)) {
+      if (add_file(walk, path, &file_stat, result) == -1) {
+        closedir(dir);
+        return -1;
+      }
+    }
+  }
+
+  closedir(dir);
+  return 0;
+}
+
+/**
+ * @brief Maps a file and builds its identity entry
+ *
+ * @param walk Walk state
+ * @param index Index of the file
+ * @param negotiable 1 if the file is served in more than one encoding
+ * @param result Result of the operation
+ * @return int 0 if successful, -1 if error
+ */
+static int map_file(docroot_walk_t* walk, size_t index, int negotiable, docroot_result_t* result) {
+  docroot_file_t* file = &walk->files[index];
+  struct stat* file_stat = &walk->stats[index];
+
+  // read everything now so the first request does not fault it in
+  char* data = empty_body;
+  if (file_stat->st_size > 0) {
+    int fd = openat(walk->root_fd, file->path, O_RDONLY | O_CLOEXEC);
+    if (fd == -1) {
+      *result = DOCROOT_ERR_OPEN;
+      return -1;
+    }
+    data = mmap(NULL, (size_t)file_stat->st_size, PROT_READ, MAP_PRIVATE | MAP_POPULATE, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED) {
+      *result = DOCROOT_ERR_MAP;
+      return -1;
+    }
+    file->map = data;
+    file->map_len = (size_t)file_stat->st_size;
+  }
+
+  file_cache_entry_t* entry = calloc(1, sizeof(file_cache_entry_t));
+  if (entry == NULL) {
+    *result = DOCROOT_ERR_MALLOC;
+    return -1;
+  }
+  strncpy(entry->path, file->path, FILE_NAME_LEN - 1);
+  entry->variant = ENCODING_IDENTITY;
+  entry->encoding = ENCODING_IDENTITY;
+  entry->data = data;
+  entry->size = (size_t)file_stat->st_size;
+  entry->source_size = entry->size;
+  entry->mtime = file_stat->st_mtim;
+  entry->refs = 1;
+  format_etag(entry->etag, file_stat->st_ino, entry->source_size, entry->mtime, ENCODING_IDENTITY);
+  build_entry_headers(entry, negotiable);
+
+  file->negotiable = negotiable;
+  file->variants[ENCODING_IDENTITY] = entry;
+  return 0;
+}
+
+/**
+ * @brief Builds a compressed entry from a sibling or by compressing the file
+ *
+ * @param snapshot Snapshot with its index built
+ * @param file File to add the variant to
+ * @param file_stat Status of the file
+ * @param encoding Encoding of the variant
+ * @param compress_min Smallest file compressed, 0 disables
+ * @param result Result of the operation
+ * @return int 0 if successful or there is no worthwhile variant, -1 if error
+ */
+static int add_variant(docroot_t* snapshot, docroot_file_t* file, const struct stat* file_stat,
+                       content_encoding_t encoding, size_t compress_min, docroot_result_t* result) {
+  file_cache_entry_t* identity = file->variants[ENCODING_IDENTITY];
+
+  // a precompressed sibling is already mapped
+  char sibling_path[FILE_NAME_LEN + 8];
+  snprintf(sibling_path, sizeof(sibling_path), "%s%s", file->path, encoding_suffix(encoding));
+  const docroot_file_t* sibling = docroot_find(snapshot, (slice_t){ sibling_path, strlen(sibling_path) });
+
+  char* data = NULL;
+  size_t size = 0;
+  if (sibling != NULL) {
+    data = sibling->variants[ENCODING_IDENTITY]->data;
+    size = sibling->variants[ENCODING_IDENTITY]->size;
+  } else if (compress_min > 0 && identity->size >= compress_min && identity->size <= DOCROOT_COMPRESS_MAX) {
+    encoding_result_t encoding_result;
+    data = compress_buffer(encoding, identity->data, identity->size, &size, &encoding_result);
+    if (data == NULL) {
+      return 0;
+    }
+
+    // keep the original when compression does not pay off
+    if (size >= identity->size) {
+      free(data);
+      return 0;
+    }
+  } else {
+    return 0;
+  }
+
+  file_cache_entry_t* entry = calloc(1, sizeof(file_cache_entry_t));
+  if (entry == NULL) {
+    if (sibling == NULL) {
+      free(data);
+    }
+    *result = DOCROOT_ERR_MALLOC;
+    return -1;
+  }
+  strncpy(entry->path, file->path, FILE_NAME_LEN - 1);
+  entry->variant = encoding;
+  entry->encoding = encoding;
+  entry->sibling = sibling != NULL;
+  entry->data = data;
+  entry->size = size;
+  entry->source_size = identity->source_size;
+  entry->mtime = identity->mtime;
+  entry->refs = 1;
+  format_etag(entry->etag, file_stat->st_ino, entry->source_size, entry->mtime, encoding);
+  build_entry_headers(entry, 1);
+
+  file->variants[encoding] = entry;
+  return 0;
+}
+
+/**
+ * @brief Orders buckets from the most keys to the fewest
+ *
+ * @param a First bucket, keys in the upper half
+ * @param b Second bucket, keys in the upper half
+ * @return int Comparison result
+ */
+static int compare_buckets(const void* a, const void* b) {
+  uint64_t left = *(const uint64_t*)a >> 32;
+  uint64_t right = *(const uint64_t*)b >> 32;
+  return left < right ? 1 : left > right ? -1 : 0;
+}
+
+/**
+ * @brief Builds the perfect hash of a snapshot
+ *
+ * Hash and displace: keys are split into buckets, and each bucket, the
+ * fullest first, gets the first seed that places all its keys in free
+ * slots. A lookup costs two hashes of the path and one comparison.
+ *
+ * @param snapshot Snapshot with its files set
+ * @param result Result of the operation
+ * @return int 0 if successful, -1 if error
+ */
+static int build_index(docroot_t* snapshot, docroot_result_t* result) {
+  size_t n = snapshot->file_count;
+
+  // at most half the slots are used, so seeds are found quickly
+  size_t slot_count = 2;
+  while (slot_count < n * 2) {
+    slot_count *= 2;
+  }
+  snapshot->slot_mask = slot_count - 1;
+  snapshot->bucket_count = n / DOCROOT_BUCKET_KEYS + 1;
+  snapshot->slots = malloc(slot_count * sizeof(int32_t));
+  snapshot->seeds = calloc(snapshot->bucket_count, sizeof(uint32_t));
+
+  // members of each bucket, contiguous by bucket
+  size_t* starts = calloc(snapshot->bucket_count + 1, sizeof(size_t));
+  uint32_t* members = malloc((n > 0 ? n : 1) * sizeof(uint32_t));
+  uint64_t* order = malloc(snapshot->bucket_count * sizeof(uint64_t));
+  if (snapshot->slots == NULL || snapshot->seeds == NULL || starts == NULL || members == NULL || order == NULL) {
+    free(starts);
+    free(members);
+    free(order);
+    *result = DOCROOT_ERR_MALLOC;
+    return -1;
+  }
+  for (size_t i = 0; i < slot_count; i++) {
+    snapshot->slots[i] = -1;
+  }
+
+  for (size_t i = 0; i < n; i++) {
+    starts[mix_key(snapshot->files[i].hash, 0) % snapshot->bucket_count + 1]++;
+  }
+  for (size_t b = 0; b < snapshot->bucket_count; b++) {
+    starts[b + 1] += starts[b];
+    order[b] = ((starts[b + 1] - starts[b]) << 32) | b;
+  }
+  size_t* fill = calloc(snapshot->bucket_count, sizeof(size_t));
+  if (fill == NULL) {
+    free(starts);
+    free(members);
+    free(order);
+    *result = DOCROOT_ERR_MALLOC;
+    return -1;
+  }
+  for (size_t i = 0; i < n; i++) {
+    size_t b = mix_key(snapshot->files[i].hash, 0) % snapshot->bucket_count;
+    members[starts[b] + fill[b]++] = (uint32_t)i;
+  }
+  free(fill);
+
+  // place the fullest buckets while the table is emptiest
+  qsort(order, snapshot->bucket_count, sizeof(uint64_t), compare_buckets);
+  int status = 0;
+  for (size_t o = 0; o < snapshot->bucket_count && status == 0; o++) {
+    size_t b = order[o] & 0xffffffffULL;
+    size_t first = starts[b];
+    size_t last = starts[b + 1];
+    if (first == last) {
+      continue;
+    }
+
+    uint32_t seed = 1;
+    for (; seed < DOCROOT_MAX_SEED; seed++) {
+      // claim slots, undoing the claims on a collision
+      size_t placed = first;
+      for (; placed < last; placed++) {
+        size_t slot = mix_key(snapshot->files[members[placed]].hash, seed) & snapshot->slot_mask;
+        if (snapshot->slots[slot] != -1) {
+          break;
+        }
+        snapshot->slots[slot] = (int32_t)members[placed];
+      }
+      if (placed == last) {
+        break;
+      }
+      for (size_t undo = first; undo < placed; undo++) {
+        snapshot->slots[mix_key(snapshot->files[members[undo]].hash, seed) & snapshot->slot_mask] = -1;
+      }
+    }
+
+    if (seed == DOCROOT_MAX_SEED) {
+      *result = DOCROOT_ERR_HASH;
+      status = -1;
+    }
+    snapshot->seeds[b] = seed;
+  }
+
+  free(starts);
+  free(members);
+  free(order);
+  return status;
+}
+
+/**
+ * @brief Walks a directory and builds a snapshot of it
+ *
+ * @param root Directory to index
+ * @param compress_min Smallest file compressed, 0 disables
+ * @param result Result of the operation
+ * @return docroot_t* New snapshot or NULL if error
+ */
+docroot_t* build_docroot(const char* root, size_t compress_min, docroot_result_t* result) {
+  // initialize result
+  *result = DOCROOT_SUCCESS;
+
+  docroot_walk_t walk;
+  memset(&walk, 0, sizeof(walk));
+  walk.root_fd = open(root, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  if (walk.root_fd == -1) {
+    *result = DOCROOT_ERR_OPEN;
+    return NULL;
+  }
+
+  docroot_t* snapshot = calloc(1, sizeof(docroot_t));
+  if (snapshot == NULL) {
+    close(walk.root_fd);
+    *result = DOCROOT_ERR_MALLOC;
+    return NULL;
+  }
+
+  // collect, then index before mapping so files can find their siblings
+  int status = walk_directory(&walk, "", result);
+  snapshot->files = walk.files;
+  snapshot->file_count = walk.count;
+  if (status == 0) {
+    status = build_index(snapshot, result);
+  }
+
+  for (size_t i = 0; i < walk.count && status == 0; i++) {
+    int negotiable = compress_min > 0 && is_compressible(walk.files[i].path);
+    status = map_file(&walk, i, negotiable, result);
+  }
+
+  for (size_t i = 0; i < walk.count && status == 0; i++) {
+    if (!walk.files[i].negotiable) {
+      continue;
+    }
+    for (int v = ENCODING_GZIP; v <= ENCODING_BROTLI && status == 0; v++) {
+      status = add_variant(snapshot, &walk.files[i], &walk.stats[i], (content_encoding_t)v, compress_min, result);
+    }
+  }
+
+  close(walk.root_fd);
+  free(walk.stats);
+  if (status == -1) {
+    free_docroot(snapshot);
+    return NULL;
+  }
+
+  return snapshot;
+}
+
+/**
+ * @brief Finds a file in a snapshot
+ *
+ * @param snapshot Snapshot to search
+ * @param path Path below the root, empty for index.html
+ * @return const docroot_file_t* File or NULL if missing
+ */
+const docroot_file_t* docroot_find(const docroot_t* snapshot, slice_t path) {
+  if (path.len == 0) {
+    path = (slice_t){ "index.html", 10 };
+  }
+
+  // bucket, then the slot its seed displaces the key to
+  uint64_t hash = hash_key(path.ptr, path.len);
+  uint32_t seed = snapshot->seeds[mix_key(hash, 0) % snapshot->bucket_count];
+  int32_t index = snapshot->slots[mix_key(hash, seed) & snapshot->slot_mask];
+  if (index == -1) {
+    return NULL;
+  }
+
+  // a missing path lands on some other file
+  const docroot_file_t* file = &snapshot->files[index];
+  if (file->hash != hash || file->path_len != path.len || memcmp(file->path, path.ptr, path.len) != 0) {
+    return NULL;
+  }
+
+  return file;
+}
+
+/**
+ * @brief Gets the entry to send for an encoding
+ *
+ * @param file Indexed file
+ * @param encoding Encoding the client prefers
+ * @return file_cache_entry_t* Entry in that encoding, identity if there is none
+ */
+file_cache_entry_t* docroot_variant(const docroot_file_t* file, content_encoding_t encoding) {
+  if (file->variants[encoding] != NULL) {
+    return file->variants[encoding];
+  }
+
+  // br was preferred, gzip is still better than nothing
+  if (encoding == ENCODING_BROTLI && file->variants[ENCODING_GZIP] != NULL) {
+    return file->variants[ENCODING_GZIP];
+  }
+
+  return file->variants[ENCODING_IDENTITY];
+}
+
+/**
+ * @brief Drops a reference to a snapshot, freeing it with the last one
+ *
+ * @param snapshot Snapshot to let go of
+ */
+static void drop_snapshot(docroot_t* snapshot) {
+  pthread_mutex_lock(&swap_lock);
+  int last = --snapshot->refs == 0;
+  pthread_mutex_unlock(&swap_lock);
+
+  if (last) {
+    free_docroot(snapshot);
+  }
+}
+
+/**
+ * @brief Retires a hold, freeing it once no response sends from it
+ *
+ * @param hold Hold to retire
+ */
+static void retire_hold(docroot_hold_t* hold) {
+  hold->retired = 1;
+  if (hold->responses == 0) {
+    drop_snapshot(hold->snapshot);
+    free(hold);
+  }
+}
+
+/**
+ * @brief Retires the hold of an exiting thread
+ *
+ * @param argp docroot_hold_t struct
+ */
+static void release_thread_hold(void* argp) {
+  retire_hold((docroot_hold_t*)argp);
+}
+
+/**
+ * @brief Creates the thread exit hook for holds
+ */
+static void create_hold_key(void) {
+  pthread_key_create(&hold_key, release_thread_hold);
+}
+
+/**
+ * @brief Gets the calling thread's hold on the current snapshot
+ *
+ * Costs one load while the snapshot is unchanged. After a swap the thread
+ * moves to the new snapshot and lets go of the old one once its responses
+ * are done.
+ *
+ * @return docroot_hold_t* Hold or NULL if no snapshot is published
+ */
+docroot_hold_t* docroot_acquire(void) {
+  docroot_t* snapshot = __atomic_load_n(&current, __ATOMIC_ACQUIRE);
+  if (thread_hold != NULL && thread_hold->snapshot == snapshot) {
+    return thread_hold;
+  }
+
+  // take a reference under the swap lock so the snapshot cannot be freed first
+  docroot_hold_t* hold = malloc(sizeof(docroot_hold_t));
+  if (hold == NULL) {
+    return NULL;
+  }
+  pthread_mutex_lock(&swap_lock);
+  hold->snapshot = current;
+  if (hold->snapshot != NULL) {
+    hold->snapshot->refs++;
+  }
+  pthread_mutex_unlock(&swap_lock);
+  if (hold->snapshot == NULL) {
+    free(hold);
+    return NULL;
+  }
+  hold->responses = 0;
+  hold->retired = 0;
+
+  // the previous snapshot goes once its responses are done
+  if (thread_hold != NULL) {
+    retire_hold(thread_hold);
+  }
+  pthread_once(&hold_key_once, create_hold_key);
+  pthread_setspecific(hold_key, hold);
+  thread_hold = hold;
+
+  return hold;
+}
+
+/**
+ * @brief Keeps a snapshot alive for a response
+ *
+ * @param hold Hold from docroot_acquire
+ */
+void docroot_retain(docroot_hold_t* hold) {
+  hold->responses++;
+}
+
+/**
+ * @brief Lets go of a snapshot kept for a response, on the same thread
+ *
+ * @param owner docroot_hold_t struct
+ */
+void docroot_release(void* owner) {
+  docroot_hold_t* hold = (docroot_hold_t*)owner;
+  hold->responses--;
+  if (hold->retired && hold->responses == 0) {
+    drop_snapshot(hold->snapshot);
+    free(hold);
+  }
+}
+
+/**
+ * @brief Makes a snapshot current and drops the published reference of the last one
+ *
+ * @param snapshot Snapshot to publish or NULL
+ */
+static void publish_docroot(docroot_t* snapshot) {
+  pthread_mutex_lock(&swap_lock);
+  docroot_t* old = current;
+  if (snapshot != NULL) {
+    snapshot->refs = 1;
+    snapshot->generation = old != NULL ? old->generation + 1 : 0;
+  }
+  __atomic_store_n(&current, snapshot, __ATOMIC_RELEASE);
+  pthread_mutex_unlock(&swap_lock);
+
+  if (old != NULL) {
+    drop_snapshot(old);
+  }
+}
+
+/**
+ * @brief Wakes the reload thread, the only async-signal-safe step
+ *
+ * @param signum Signal number
+ */
+static void request_reload(int signum) {
+  (void)signum;
+  int saved = errno;
+  char byte = 'r';
+  if (write(signal_pipe[1], &byte, 1) == -1) {
+    // the pipe is full, a reload is already pending
+  }
+  errno = saved;
+}
+
+/**
+ * @brief Rebuilds the index each time SIGHUP arrives
+ *
+ * @param argp Unused
+ * @return void* NULL
+ */
+static void* run_reloads(void* argp) {
+  (void)argp;
+
+  while (1) {
+    char byte;
+    ssize_t received = read(signal_pipe[0], &byte, 1);
+    if (received == -1 && errno == EINTR) {
+      continue;
+    }
+    if (received != 1 || byte == 'q') {
+      return NULL;
+    }
+
+    // a failed build keeps serving the old snapshot
+    docroot_result_t result;
+    docroot_t* snapshot = build_docroot(docroot_root, docroot_compress_min, &result);
+    if (snapshot == NULL) {
+      log_message(LOG_ERROR, "Could not rebuild document root index (%d)!\n", (int)result);
+      continue;
+    }
+
+    size_t files = snapshot->file_count;
+    publish_docroot(snapshot);
+    log_message(LOG_INFO, "Reindexed document root: %zu files\n", files);
+  }
+}
+
+/**
+ * @brief Builds the first snapshot and rebuilds it on every SIGHUP
+ *
+ * @param root Directory to index
+ * @param compress_min Smallest file compressed, 0 disables
+ * @param result Result of the operation
+ */
+void start_docroot(const char* root, size_t compress_min, docroot_result_t* result) {
+  // initialize result
+  *result = DOCROOT_SUCCESS;
+
+  docroot_root = root;
+  docroot_compress_min = compress_min;
+
+  docroot_t* snapshot = build_docroot(root, compress_min, result);
+  if (snapshot == NULL) {
+    return;
+  }
+  log_message(LOG_INFO, "Indexed document root: %zu files\n", snapshot->file_count);
+  publish_docroot(snapshot);
+
+  // the handler only writes to a pipe
+  if (pipe2(signal_pipe, O_CLOEXEC | O_NONBLOCK) == -1) {
+    *result = DOCROOT_ERR_THREAD;
+    return;
+  }
+  int flags = fcntl(signal_pipe[0], F_GETFL, 0);
+  fcntl(signal_pipe[0], F_SETFL, flags & ~O_NONBLOCK);
+
+  if (pthread_create(&reload_thread, NULL, run_reloads, NULL) != 0) {
+    *result = DOCROOT_ERR_THREAD;
+    return;
+  }
+  docroot_running = 1;
+
+  struct sigaction action;
+  memset(&action, 0, sizeof(action));
+  action.sa_handler = request_reload;
+  action.sa_flags = SA_RESTART;
+  sigemptyset(&action.sa_mask);
+  sigaction(SIGHUP, &action, NULL);
+}
+
+/**
+ * @brief Stops rebuilding and drops the published snapshot
+ */
+void stop_docroot(void) {
+  if (docroot_running) {
+    signal(SIGHUP, SIG_IGN);
+    char byte = 'q';
+    if (write(signal_pipe[1], &byte, 1) == 1) {
+      pthread_join(reload_thread, NULL);
+    }
+    docroot_running = 0;
+  }
+
+  publish_docroot(NULL);
+}
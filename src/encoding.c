@@ -0,0 +1,274 @@
+#include <stdio.h>
+#include <strings.h>
+#include <zlib.h>
+#include <brotli/encode.h>
+
+#include "encoding.h"
+
+/** Extensions of text types worth compressing */
+static const char* compressible_extensions[] = {
+  ".html", ".htm", ".css", ".js", ".mjs", ".json", ".map", ".txt", ".csv", ".xml",
+  ".svg", ".md", ".wasm", ".ico", ".webmanifest", NULL
+};
+
+/**
+ * @brief Checks if a q-value rejects a coding
+ *
+ * @param value First byte after "q="
+ * @param end End of the parameters
+ * @return int 1 if the q-value is zero, 0 otherwise
+ */
+static int is_zero_quality(const char* value, const char* end) {
+  if (value >= end || *value != '0') {
+    return 0;
+  }
+
+  // 0, 0. and 0.000 are all zero
+  for (value++; value < end && *value != ',' && *value != ';' && *value != ' '; value++) {
+    if (*value != '.' && *value != '0') {
+      return 0;
+    }
+  }
+
+  return 1;
+}
+
+/**
+ * @brief Picks the preferred encoding the client accepts
+ *
+ * Parses Accept-Encoding, skipping codings with q=0. Brotli is preferred
+ * over gzip whatever the q-values say, since either is acceptable.
+ *
+ * @param request Parsed request
+ * @return content_encoding_t Preferred encoding, identity if none
+ */
+content_encoding_t negotiate_encoding(const request_t* request) {
+  // -1 unmentioned, 0 rejected, 1 accepted
+  int gzip = -1;
+  int brotli = -1;
+  int any = -1;
+
+  for (size_t i = 0; i < request->header_count; i++) {
+    if (!slice_equals(request->headers[i].name, "Accept-Encoding")) {
+      continue;
+    }
+
+    const char* value = request->headers[i].value.ptr;
+    const char* end = value + request->headers[i].value.len;
+    while (value < end) {
+      // skip separators
+      while (value < end && (*value == ' ' || *value == '\t' || *value == ',')) {
+        value++;
+      }
+
+      // coding name
+      const char* name_end = value;
+      while (name_end < end && *name_end != ',' && *name_end != ';' && *name_end != ' ' && *name_end != '\t') {
+        name_end++;
+      }
+      slice_t name = { value, (size_t)(name_end - value) };
+
+      // parameters, only q matters
+      const char* item_end = name_end;
+      while (item_end < end && *item_end != ',') {
+        item_end++;
+      }
+      int accepted = 1;
+      for (const char* p = name_end; p + 1 < item_end; p++) {
+        if ((p[0] == 'q' || p[0] == 'Q') && p[1] == '=') {
+          accepted = !is_zero_quality(p + 2, item_end);
+          break;
+        }
+      }
+
+      if (slice_equals(name, "br")) {
+        brotli = accepted;
+      } else if (slice_equals(name, "gzip") || slice_equals(name, "x-gzip")) {
+        gzip = accepted;
+      } else if (slice_equals(name, "*")) {
+        any = accepted;
+      }
+
+      value = item_end;
+    }
+  }
+
+  // a wildcard covers the codings not listed
+  if (brotli == 1 || (brotli == -1 && any == 1)) {
+    return ENCODING_BROTLI;
+  }
+  if (gzip == 1 || (gzip == -1 && any == 1)) {
+    return ENCODING_GZIP;
+  }
+
+  return ENCODING_IDENTITY;
+}
+
+/**
+ * @brief Gets the Content-Encoding token of an encoding
+ *
+ * @param encoding Content encoding
+ * @return const char* Token, NULL for identity
+ */
+const char* encoding_name(content_encoding_t encoding) {
+  switch (encoding) {
+    case ENCODING_GZIP:
+      return "gzip";
+    case ENCODING_BROTLI:
+      return "br";
+    default:
+      return NULL;
+  }
+}
+
+/**
+ * @brief Gets the Content-Encoding header line of an encoding
+ *
+ * @param encoding Content encoding
+ * @return const char* Header line with CRLF, empty for identity
+ */
+const char* encoding_header(content_encoding_t encoding) {
+  switch (encoding) {
+    case ENCODING_GZIP:
+      return "Content-Encoding: gzip\r\n";
+    case ENCODING_BROTLI:
+      return "Content-Encoding: br\r\n";
+    default:
+      return "";
+  }
+}
+
+/**
+ * @brief Gets the file name suffix of precompressed siblings
+ *
+ * @param encoding Content encoding
+ * @return const char* Suffix, empty for identity
+ */
+const char* encoding_suffix(content_encoding_t encoding) {
+  switch (encoding) {
+    case ENCODING_GZIP:
+      return ".gz";
+    case ENCODING_BROTLI:
+      return ".br";
+    default:
+      return "";
+  }
+}
+
+/**
+ * @brief Checks if a file type is worth compressing
+ *
+ * @param path Path of the file
+ * @return int 1 for text types, 0 for already compressed or unknown ones
+ */
+int is_compressible(const char* path) {
+  const char* extension = strrchr(path, '.');
+  if (extension == NULL || strchr(extension, '/') != NULL) {
+    return 0;
+  }
+
+  for (int i = 0; compressible_extensions[i] != NULL; i++) {
+    if (strcasecmp(extension, compressible_extensions[i]) == 0) {
+      return 1;
+    }
+  }
+
+  return 0;
+}
+
+/**
+ * @brief Compresses a buffer with gzip
+ *
+ * @param data Bytes to compress
+ * @param size Number of bytes
+ * @param out_len Set to the compressed length
+ * @param result Result of the operation
+ * @return char* Compressed bytes to free() or NULL if error
+ */
+static char* gzip_buffer(const char* data, size_t size, size_t* out_len, encoding_result_t* result) {
+  // 16 added to the window bits selects the gzip wrapper
+  z_stream stream;
+  memset(&stream, 0, sizeof(stream));
+  if (deflateInit2(&stream, ENCODING_GZIP_LEVEL, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+    *result = ENCODING_ERR_FAILED;
+    return NULL;
+  }
+
+  // one call with a worst case sized buffer
+  size_t bound = deflateBound(&stream, (uLong)size);
+  char* out = malloc(bound);
+  if (out == NULL) {
+    deflateEnd(&stream);
+    *result = ENCODING_ERR_MALLOC;
+    return NULL;
+  }
+
+  stream.next_in = (Bytef*)data;
+  stream.avail_in = (uInt)size;
+  stream.next_out = (Bytef*)out;
+  stream.avail_out = (uInt)bound;
+  if (deflate(&stream, Z_FINISH) != Z_STREAM_END) {
+    deflateEnd(&stream);
+    free(out);
+    *result = ENCODING_ERR_FAILED;
+    return NULL;
+  }
+
+  *out_len = stream.total_out;
+  deflateEnd(&stream);
+  return out;
+}
+
+/**
+ * @brief Compresses a buffer with brotli
+ *
+ * @param data Bytes to compress
+ * @param size Number of bytes
+ * @param out_len Set to the compressed length
+ * @param result Result of the operation
+ * @return char* Compressed bytes to free() or NULL if error
+ */
+static char* brotli_buffer(const char* data, size_t size, size_t* out_len, encoding_result_t* result) {
+  size_t bound = BrotliEncoderMaxCompressedSize(size);
+  char* out = malloc(bound > 0 ? bound : 16);
+  if (out == NULL) {
+    *result = ENCODING_ERR_MALLOC;
+    return NULL;
+  }
+
+  *out_len = bound;
+  if (!BrotliEncoderCompress(ENCODING_BROTLI_QUALITY, BROTLI_DEFAULT_WINDOW, BROTLI_MODE_TEXT, size,
+                             (const uint8_t*)data, out_len, (uint8_t*)out)) {
+    free(out);
+    *result = ENCODING_ERR_FAILED;
+    return NULL;
+  }
+
+  return out;
+}
+
+/**
+ * @brief Compresses a buffer
+ *
+ * @param encoding gzip or brotli
+ * @param data Bytes to compress
+ * @param size Number of bytes
+ * @param out_len Set to the compressed length
+ * @param result Result of the operation
+ * @return char* Compressed bytes to free() or NULL if error
+ */
+char* compress_buffer(content_encoding_t encoding, const char* data, size_t size, size_t* out_len,
+                      encoding_result_t* result) {
+  // initialize result
+  *result = ENCODING_SUCCESS;
+
+  switch (encoding) {
+    case ENCODING_GZIP:
+      return gzip_buffer(data, size, out_len, result);
+    case ENCODING_BROTLI:
+      return brotli_buffer(data, size, out_len, result);
+    default:
+      *result = ENCODING_ERR_FAILED;
+      return NULL;
+  }
+}
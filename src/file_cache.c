@@ -0,0 +1,581 @@
+#include <stdio.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <sys/stat.h>
+
+#include "file_cache.h"
+
+/**
+ * @brief Gets the monotonic time
+ *
+ * @return int64_t Milliseconds since an arbitrary point
+ */
+static int64_t cache_now_ms(void) {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (int64_t)now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+/**
+ * @brief Hashes a path and variant with FNV-1a
+ *
+ * @param path Path to hash
+ * @param variant Encoding asked for
+ * @return uint64_t Hash of the key
+ */
+static uint64_t hash_path(const char* path, content_encoding_t variant) {
+  uint64_t hash = 14695981039346656037ULL;
+  for (const unsigned char* c = (const unsigned char*)path; *c != '\0'; c++) {
+    hash ^= *c;
+    hash *= 1099511628211ULL;
+  }
+  hash ^= (uint64_t)variant;
+  hash *= 1099511628211ULL;
+  return hash;
+}
+
+/**
+ * @brief Gets the bytes an entry counts against its shard
+ *
+ * @param entry File cache entry struct
+ * @return size_t Charged bytes
+ */
+static size_t entry_cost(const file_cache_entry_t* entry) {
+  return sizeof(file_cache_entry_t) + (entry->data != NULL ? entry->size : 0);
+}
+
+/**
+ * @brief Creates a file cache
+ *
+ * @param capacity Total byte budget, split evenly across shards
+ * @param compress_min Smallest file compressed on the fly, 0 disables
+ * @param result Result of the operation
+ * @return file_cache_t* Pointer to new cache or NULL if error
+ */
+file_cache_t* create_file_cache(size_t capacity, size_t compress_min, file_cache_result_t* result) {
+  // initialize result
+  *result = FILE_CACHE_SUCCESS;
+
+  // initialize cache
+  file_cache_t* cache = calloc(1, sizeof(file_cache_t));
+  if (cache == NULL) {
+    *result = FILE_CACHE_ERR_MALLOC;
+    return NULL;
+  }
+
+  // split the budget, a file must fit in its shard to be kept in memory
+  cache->shard_capacity = capacity / FILE_CACHE_SHARDS;
+  cache->max_entry_size = FILE_CACHE_MAX_ENTRY_SIZE;
+  if (cache->max_entry_size > cache->shard_capacity / 2) {
+    cache->max_entry_size = cache->shard_capacity / 2;
+  }
+  cache->compress_min = compress_min;
+
+  for (int i = 0; i < FILE_CACHE_SHARDS; i++) {
+    pthread_mutex_init(&cache->shards[i].lock, NULL);
+  }
+
+  return cache;
+}
+
+/**
+ * @brief Frees an entry
+ *
+ * @param entry File cache entry struct
+ */
+static void free_entry(file_cache_entry_t* entry) {
+  free(entry->data);
+  free(entry);
+}
+
+/**
+ * @brief Drops a reference taken by file_cache_get
+ *
+ * @param entry File cache entry struct
+ */
+void file_cache_release(file_cache_entry_t* entry) {
+  if (__atomic_sub_fetch(&entry->refs, 1, __ATOMIC_ACQ_REL) == 0) {
+    free_entry(entry);
+  }
+}
+
+/**
+ * @brief Builds the validator lines and header blocks of an entry
+ *
+ * The blocks stop before the Date line, which end_headers() adds.
+ *
+ * @param entry Entry with path, size, encoding, mtime and etag set
+ * @param negotiable 1 if the file is served in more than one encoding
+ */
+void build_entry_headers(file_cache_entry_t* entry, int negotiable) {
+  // validators, and every variant of a negotiable file says it varies
+  int len = format_validators(entry->fields, sizeof(entry->fields), entry->etag, entry->mtime.tv_sec);
+  if (negotiable) {
+    snprintf(entry->fields + len, sizeof(entry->fields) - (size_t)len, "Vary: Accept-Encoding\r\n");
+  }
+  const char* encoding = encoding_header(entry->encoding);
+
+  len = snprintf(entry->header, sizeof(entry->header), "HTTP/1.1 200 OK\r\nContent-Length: %zu\r\n%s%s",
+                 entry->size, encoding, entry->fields);
+  entry->header_len = (size_t)len;
+
+  len = snprintf(entry->close_header, sizeof(entry->close_header),
+                 "HTTP/1.1 200 OK\r\nContent-Length: %zu\r\n%s%sConnection: close\r\n", entry->size, encoding,
+                 entry->fields);
+  entry->close_header_len = (size_t)len;
+}
+
+/**
+ * @brief Reads a whole file into the entry
+ *
+ * @param fd Open file
+ * @param entry File cache entry struct with size set
+ * @param result Result of the operation
+ * @return int 0 if successful, -1 if error
+ */
+static int read_entry(int fd, file_cache_entry_t* entry, file_cache_result_t* result) {
+  entry->data = malloc(entry->size > 0 ? entry->size : 1);
+  if (entry->data == NULL) {
+    *result = FILE_CACHE_ERR_MALLOC;
+    return -1;
+  }
+
+  size_t loaded = 0;
+  while (loaded < entry->size) {
+    ssize_t bytes = read(fd, entry->data + loaded, entry->size - loaded);
+    if (bytes <= 0) {
+      *result = FILE_CACHE_ERR_READ;
+      return -1;
+    }
+    loaded += (size_t)bytes;
+  }
+
+  return 0;
+}
+
+/**
+ * @brief Opens the precompressed sibling of a file
+ *
+ * @param path Path of the file
+ * @param encoding Encoding of the sibling
+ * @param file_stat Filled with the sibling's status
+ * @return int Open regular file or -1 if there is none
+ */
+static int open_sibling(const char* path, content_encoding_t encoding, struct stat* file_stat) {
+  char sibling[FILE_NAME_LEN + 8];
+  snprintf(sibling, sizeof(sibling), "%s%s", path, encoding_suffix(encoding));
+
+  int fd = open(sibling, O_RDONLY | O_CLOEXEC);
+  if (fd == -1) {
+    return -1;
+  }
+
+  if (fstat(fd, file_stat) == -1 || !S_ISREG(file_stat->st_mode)) {
+    close(fd);
+    return -1;
+  }
+
+  return fd;
+}
+
+/**
+ * @brief Compresses the bytes of an entry in place if that shrinks them
+ *
+ * @param entry File cache entry struct holding the file bytes
+ * @param variant Encoding to compress with
+ */
+static void compress_entry(file_cache_entry_t* entry, content_encoding_t variant) {
+  encoding_result_t encoding_result;
+  size_t compressed_len;
+  char* compressed = compress_buffer(variant, entry->data, entry->size, &compressed_len, &encoding_result);
+  if (compressed == NULL) {
+    return;
+  }
+
+  // keep the original when compression does not pay off
+  if (compressed_len >= entry->size) {
+    free(compressed);
+    return;
+  }
+
+  free(entry->data);
+  entry->data = compressed;
+  entry->size = compressed_len;
+  entry->encoding = variant;
+}
+
+/**
+ * @brief Loads a file into a new entry
+ *
+ * @param cache File cache struct
+ * @param path Path of the file
+ * @param variant Encoding asked for
+ * @param hash Hash of the key
+ * @param result Result of the operation
+ * @return file_cache_entry_t* New entry or NULL if error
+ */
+static file_cache_entry_t* load_entry(file_cache_t* cache, const char* path, content_encoding_t variant, uint64_t hash,
+                                      file_cache_result_t* result) {
+  // open file
+  int fd = open(path, O_RDONLY | O_CLOEXEC);
+  if (fd == -1) {
+    *result = FILE_CACHE_ERR_NOT_FOUND;
+    return NULL;
+  }
+
+  // only regular files are served
+  struct stat file_stat;
+  if (fstat(fd, &file_stat) == -1 || !S_ISREG(file_stat.st_mode)) {
+    close(fd);
+    *result = FILE_CACHE_ERR_NOT_FOUND;
+    return NULL;
+  }
+
+  // initialize entry
+  file_cache_entry_t* entry = calloc(1, sizeof(file_cache_entry_t));
+  if (entry == NULL) {
+    close(fd);
+    *result = FILE_CACHE_ERR_MALLOC;
+    return NULL;
+  }
+  strncpy(entry->path, path, FILE_NAME_LEN - 1);
+  entry->variant = variant;
+  entry->hash = hash;
+  entry->encoding = ENCODING_IDENTITY;
+  entry->size = (size_t)file_stat.st_size;
+  entry->source_size = (size_t)file_stat.st_size;
+  entry->mtime = file_stat.st_mtim;
+  entry->last_checked = cache_now_ms();
+  entry->refs = 1;
+
+  // a precompressed sibling replaces the file
+  if (variant != ENCODING_IDENTITY) {
+    struct stat sibling_stat;
+    int sibling_fd = open_sibling(path, variant, &sibling_stat);
+    if (sibling_fd != -1) {
+      close(fd);
+      fd = sibling_fd;
+      entry->encoding = variant;
+      entry->sibling = 1;
+      entry->size = (size_t)sibling_stat.st_size;
+    }
+  }
+
+  // keep small files in memory, large ones are streamed by the caller
+  if (entry->size <= cache->max_entry_size) {
+    if (read_entry(fd, entry, result) == -1) {
+      close(fd);
+      free_entry(entry);
+      return NULL;
+    }
+
+    // compress what no sibling covered
+    if (entry->encoding != variant && cache->compress_min > 0 && entry->size >= cache->compress_min) {
+      compress_entry(entry, variant);
+    }
+  }
+
+  close(fd);
+  format_etag(entry->etag, file_stat.st_ino, entry->source_size, entry->mtime, entry->encoding);
+  build_entry_headers(entry, cache->compress_min > 0 && is_compressible(entry->path));
+  return entry;
+}
+
+/**
+ * @brief Unlinks an entry from its shard and drops the shard reference
+ *
+ * @param shard File cache shard struct
+ * @param entry File cache entry struct
+ * @note Caller holds the shard lock
+ */
+static void remove_entry(file_cache_shard_t* shard, file_cache_entry_t* entry) {
+  // unlink from the hash chain
+  file_cache_entry_t** link = &shard->buckets[entry->hash % FILE_CACHE_BUCKETS];
+  while (*link != entry) {
+    link = &(*link)->next;
+  }
+  *link = entry->next;
+
+  // unlink from the CLOCK ring
+  if (entry->clock_next == entry) {
+    shard->hand = NULL;
+  } else {
+    entry->clock_prev->clock_next = entry->clock_next;
+    entry->clock_next->clock_prev = entry->clock_prev;
+    if (shard->hand == entry) {
+      shard->hand = entry->clock_next;
+    }
+  }
+
+  shard->used -= entry_cost(entry);
+  file_cache_release(entry);
+}
+
+/**
+ * @brief Evicts entries with the CLOCK algorithm until the shard fits
+ *
+ * @param cache File cache struct
+ * @param shard File cache shard struct
+ * @note Caller holds the shard lock
+ */
+static void evict_entries(file_cache_t* cache, file_cache_shard_t* shard) {
+  while (shard->used > cache->shard_capacity && shard->hand != NULL) {
+    file_cache_entry_t* entry = shard->hand;
+
+    // give recently used entries a second chance
+    if (entry->referenced) {
+      entry->referenced = 0;
+      shard->hand = entry->clock_next;
+      continue;
+    }
+
+    remove_entry(shard, entry);
+  }
+}
+
+/**
+ * @brief Links a new entry into its shard
+ *
+ * @param cache File cache struct
+ * @param shard File cache shard struct
+ * @param entry File cache entry struct
+ * @note Caller holds the shard lock
+ */
+static void insert_entry(file_cache_t* cache, file_cache_shard_t* shard, file_cache_entry_t* entry) {
+  // link into the hash chain
+  file_cache_entry_t** bucket = &shard->buckets[entry->hash % FILE_CACHE_BUCKETS];
+  entry->next = *bucket;
+  *bucket = entry;
+
+  // link behind the hand so it is inspected last
+  if (shard->hand == NULL) {
+    entry->clock_prev = entry;
+    entry->clock_next = entry;
+    shard->hand = entry;
+  } else {
+    entry->clock_next = shard->hand;
+    entry->clock_prev = shard->hand->clock_prev;
+    shard->hand->clock_prev->clock_next = entry;
+    shard->hand->clock_prev = entry;
+  }
+
+  shard->used += entry_cost(entry);
+  evict_entries(cache, shard);
+}
+
+/**
+ * @brief Finds an entry in a shard
+ *
+ * @param shard File cache shard struct
+ * @param path Path of the file
+ * @param variant Encoding asked for
+ * @param hash Hash of the key
+ * @return file_cache_entry_t* Entry or NULL if missing
+ * @note Caller holds the shard lock
+ */
+static file_cache_entry_t* find_entry(file_cache_shard_t* shard, const char* path, content_encoding_t variant,
+                                      uint64_t hash) {
+  for (file_cache_entry_t* entry = shard->buckets[hash % FILE_CACHE_BUCKETS]; entry != NULL; entry = entry->next) {
+    if (entry->hash == hash && entry->variant == variant && strcmp(entry->path, path) == 0) {
+      return entry;
+    }
+  }
+
+  return NULL;
+}
+
+/**
+ * @brief Checks whether the file behind an entry changed
+ *
+ * Siblings are not checked on their own; they are expected to be
+ * regenerated together with the file they compress.
+ *
+ * @param entry File cache entry struct
+ * @return int 1 if the entry is still current, 0 otherwise
+ */
+static int entry_is_current(const file_cache_entry_t* entry) {
+  struct stat file_stat;
+  if (stat(entry->path, &file_stat) == -1) {
+    return 0;
+  }
+
+  return (size_t)file_stat.st_size == entry->source_size && file_stat.st_mtim.tv_sec == entry->mtime.tv_sec &&
+         file_stat.st_mtim.tv_nsec == entry->mtime.tv_nsec;
+}
+
+/**
+ * @brief Looks up a file, loading it on a miss
+ *
+ * A hit within the check interval costs no system calls. Files larger
+ * than the entry limit are cached without their bytes, so callers must
+ * stream them when data is NULL. A compressed variant is read from a
+ * precompressed sibling when one exists and compressed on load otherwise.
+ *
+ * @param cache File cache struct
+ * @param path Path of the file
+ * @param variant Encoding the client prefers
+ * @param result Result of the operation
+ * @return file_cache_entry_t* Referenced entry or NULL if error
+ */
+file_cache_entry_t* file_cache_get(file_cache_t* cache, const char* path, content_encoding_t variant,
+                                   file_cache_result_t* result) {
+  // initialize result
+  *result = FILE_CACHE_SUCCESS;
+
+  uint64_t hash = hash_path(path, variant);
+  file_cache_shard_t* shard = &cache->shards[(hash >> 32) % FILE_CACHE_SHARDS];
+
+  // look up
+  pthread_mutex_lock(&shard->lock);
+  file_cache_entry_t* entry = find_entry(shard, path, variant, hash);
+  if (entry != NULL) {
+    int64_t now = cache_now_ms();
+    int check = now - entry->last_checked >= FILE_CACHE_CHECK_INTERVAL_MS;
+    if (check) {
+      // only one request per interval pays for the stat
+      entry->last_checked = now;
+    }
+
+    entry->referenced = 1;
+    __atomic_add_fetch(&entry->refs, 1, __ATOMIC_RELAXED);
+    pthread_mutex_unlock(&shard->lock);
+
+    if (!check || entry_is_current(entry)) {
+      return entry;
+    }
+
+    // stale, drop it unless someone else already did
+    pthread_mutex_lock(&shard->lock);
+    if (find_entry(shard, path, variant, hash) == entry) {
+      remove_entry(shard, entry);
+    }
+    pthread_mutex_unlock(&shard->lock);
+    file_cache_release(entry);
+  } else {
+    pthread_mutex_unlock(&shard->lock);
+  }
+
+  // load outside the lock so a slow disk only stalls this request
+  file_cache_entry_t* loaded = load_entry(cache, path, variant, hash, result);
+  if (loaded == NULL) {
+    return NULL;
+  }
+
+  // insert unless another thread won the race
+  pthread_mutex_lock(&shard->lock);
+  entry = find_entry(shard, path, variant, hash);
+  if (entry == NULL) {
+    entry = loaded;
+    loaded = NULL;
+    if (entry_cost(entry) <= cache->shard_capacity) {
+      entry->refs++;
+      insert_entry(cache, shard, entry);
+    }
+  } else {
+    __atomic_add_fetch(&entry->refs, 1, __ATOMIC_RELAXED);
+  }
+  entry->referenced = 1;
+  pthread_mutex_unlock(&shard->lock);
+
+  if (loaded != NULL) {
+    file_cache_release(loaded);
+  }
+
+  return entry;
+}
+
+/**
+ * @brief Loads the files below a directory until the budget is spent
+ *
+ * @param cache File cache struct
+ * @param path Directory below the working directory, "" for itself
+ * @param budget Bytes still to load, decreased as files are cached
+ * @return size_t Number of files loaded
+ */
+static size_t warm_directory(file_cache_t* cache, const char* path, size_t* budget) {
+  DIR* dir = opendir(path[0] == '\0' ? "." : path);
+  if (dir == NULL) {
+    return 0;
+  }
+
+  size_t loaded = 0;
+  struct dirent* dirent;
+  while (*budget > 0 && (dirent = readdir(dir)) != NULL) {
+    if (strcmp(dirent->d_name, ".") == 0 || strcmp(dirent->d_name, "..") == 0) {
+      continue;
+    }
+
+    // keys are request paths, relative and without a leading slash
+    char child[FILE_NAME_LEN];
+    int len = snprintf(child, sizeof(child), "%s%s%s", path, path[0] == '\0' ? "" : "/", dirent->d_name);
+    if (len < 0 || (size_t)len >= sizeof(child)) {
+      continue;
+    }
+
+    struct stat file_stat;
+    if (stat(child, &file_stat) == -1) {
+      continue;
+    }
+    if (S_ISDIR(file_stat.st_mode)) {
+      loaded += warm_directory(cache, child, budget);
+      continue;
+    }
+    if (!S_ISREG(file_stat.st_mode)) {
+      continue;
+    }
+
+    // compressible files are asked for in every encoding
+    content_encoding_t variants[] = { ENCODING_IDENTITY, ENCODING_GZIP, ENCODING_BROTLI };
+    int variant_count = cache->compress_min > 0 && is_compressible(child) ? 3 : 1;
+    for (int i = 0; i < variant_count && *budget > 0; i++) {
+      file_cache_result_t result;
+      file_cache_entry_t* entry = file_cache_get(cache, child, variants[i], &result);
+      if (entry == NULL) {
+        continue;
+      }
+
+      size_t cost = entry->data != NULL ? entry->size : 0;
+      *budget = cost < *budget ? *budget - cost : 0;
+      file_cache_release(entry);
+    }
+    loaded++;
+  }
+
+  closedir(dir);
+  return loaded;
+}
+
+/**
+ * @brief Loads files below the working directory into the cache
+ *
+ * Walks the tree and loads files until the cache is full, so a process
+ * taking over from another starts with the hits the old one had.
+ *
+ * @param cache File cache struct
+ * @return size_t Number of files loaded
+ */
+size_t warm_file_cache(file_cache_t* cache) {
+  size_t budget = cache->shard_capacity * FILE_CACHE_SHARDS;
+  return warm_directory(cache, "", &budget);
+}
+
+/**
+ * @brief Frees the cache and every entry it holds
+ *
+ * @param cache File cache struct
+ */
+void close_file_cache(file_cache_t* cache) {
+  for (int i = 0; i < FILE_CACHE_SHARDS; i++) {
+    file_cache_shard_t* shard = &cache->shards[i];
+
+    // drop the shard references
+    pthread_mutex_lock(&shard->lock);
+    while (shard->hand != NULL) {
+      remove_entry(shard, shard->hand);
+    }
+    pthread_mutex_unlock(&shard->lock);
+    pthread_mutex_destroy(&shard->lock);
+  }
+
+  free(cache);
+}
@@ -0,0 +1,1561 @@
+#include <stdio.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+#include "h2.h"
+#include "server.h"
+#include "metrics.h"
+#include "status.h"
+
+/**
+ * @brief Frame types
+ */
+typedef enum {
+  FRAME_DATA          = 0,
+  FRAME_HEADERS       = 1,
+  FRAME_PRIORITY      = 2,
+  FRAME_RST_STREAM    = 3,
+  FRAME_SETTINGS      = 4,
+  FRAME_PUSH_PROMISE  = 5,
+  FRAME_PING          = 6,
+  FRAME_GOAWAY        = 7,
+  FRAME_WINDOW_UPDATE = 8,
+  FRAME_CONTINUATION  = 9
+} frame_type_t;
+
+/** END_STREAM, or ACK on SETTINGS and PING */
+#define FLAG_END_STREAM 0x1
+#define FLAG_ACK 0x1
+/** Header block is complete */
+#define FLAG_END_HEADERS 0x4
+/** Payload starts with a pad length */
+#define FLAG_PADDED 0x8
+/** HEADERS carries priority fields */
+#define FLAG_PRIORITY 0x20
+
+/**
+ * @brief Error codes of RST_STREAM and GOAWAY
+ */
+typedef enum {
+  ERROR_NONE              = 0x0,
+  ERROR_PROTOCOL          = 0x1,
+  ERROR_INTERNAL          = 0x2,
+  ERROR_FLOW_CONTROL      = 0x3,
+  ERROR_STREAM_CLOSED     = 0x5,
+  ERROR_FRAME_SIZE        = 0x6,
+  ERROR_REFUSED_STREAM    = 0x7,
+  ERROR_COMPRESSION       = 0x9,
+  ERROR_ENHANCE_YOUR_CALM = 0xb
+} h2_error_t;
+
+/**
+ * @brief Settings identifiers
+ */
+typedef enum {
+  SETTING_HEADER_TABLE_SIZE      = 0x1,
+  SETTING_ENABLE_PUSH            = 0x2,
+  SETTING_MAX_CONCURRENT_STREAMS = 0x3,
+  SETTING_INITIAL_WINDOW_SIZE    = 0x4,
+  SETTING_MAX_FRAME_SIZE         = 0x5,
+  SETTING_MAX_HEADER_LIST_SIZE   = 0x6
+} h2_setting_t;
+
+/** Answer to an h2c upgrade, sent before any frame */
+static const char switching_protocols[] =
+  "HTTP/1.1 101 Switching Protocols\r\nConnection: Upgrade\r\nUpgrade: h2c\r\n\r\n";
+
+/** Request header fields that only make sense on an HTTP/1.1 connection */
+static const char* connection_fields[] = { "connection", "keep-alive", "proxy-connection", "transfer-encoding",
+                                           "upgrade", NULL };
+
+/**
+ * @brief Reads a 24-bit big-endian number
+ *
+ * @param p First byte
+ * @return uint32_t Number
+ */
+static uint32_t read_u24(const uint8_t* p) {
+  return ((uint32_t)p[0] << 16) | ((uint32_t)p[1] << 8) | p[2];
+}
+
+/**
+ * @brief Reads a 32-bit big-endian number
+ *
+ * @param p First byte
+ * @return uint32_t Number
+ */
+static uint32_t read_u32(const uint8_t* p) {
+  return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) | ((uint32_t)p[2] << 8) | p[3];
+}
+
+/**
+ * @brief Writes a 32-bit big-endian number
+ *
+ * @param p First byte
+ * @param value Number
+ */
+static void write_u32(uint8_t* p, uint32_t value) {
+  p[0] = (uint8_t)(value >> 24);
+  p[1] = (uint8_t)(value >> 16);
+  p[2] = (uint8_t)(value >> 8);
+  p[3] = (uint8_t)value;
+}
+
+/**
+ * @brief Writes a frame header
+ *
+ * @param p Buffer of H2_FRAME_HEADER_LEN bytes
+ * @param length Payload length
+ * @param type Frame type
+ * @param flags Frame flags
+ * @param stream Stream identifier
+ */
+static void write_frame_header(uint8_t* p, size_t length, frame_type_t type, uint8_t flags, uint32_t stream) {
+  p[0] = (uint8_t)(length >> 16);
+  p[1] = (uint8_t)(length >> 8);
+  p[2] = (uint8_t)length;
+  p[3] = (uint8_t)type;
+  p[4] = flags;
+  write_u32(p + 5, stream);
+}
+
+/**
+ * @brief Checks how much of the client preface a buffer holds
+ *
+ * @param buff Start of the connection
+ * @param len Bytes received so far
+ * @return int 1 if the preface is complete, 0 if the bytes so far match
+ *         it, -1 if this is not HTTP/2
+ */
+int match_h2_preface(const char* buff, size_t len) {
+  size_t compared = len < H2_PREFACE_LEN ? len : H2_PREFACE_LEN;
+  if (memcmp(buff, H2_PREFACE, compared) != 0) {
+    return -1;
+  }
+  return len >= H2_PREFACE_LEN ? 1 : 0;
+}
+
+/**
+ * @brief Checks whether a request asks to upgrade to h2c
+ *
+ * @param request Parsed request
+ * @return int 1 if it has Upgrade: h2c and one HTTP2-Settings header
+ */
+int is_h2_upgrade(const request_t* request) {
+  if (!header_has_token(request, "Upgrade", "h2c") || !header_has_token(request, "Connection", "Upgrade")) {
+    return 0;
+  }
+
+  // exactly one settings header
+  int settings = 0;
+  for (size_t i = 0; i < request->header_count; i++) {
+    settings += slice_equals(request->headers[i].name, "HTTP2-Settings");
+  }
+  return settings == 1;
+}
+
+/**
+ * @brief Decodes base64url without padding, as HTTP2-Settings carries it
+ *
+ * @param str Encoded string
+ * @param out Buffer to decode into
+ * @param out_len Size of out
+ * @param len Set to the number of decoded bytes
+ * @return int 0 if successful, -1 if invalid or too long
+ */
+static int decode_base64url(slice_t str, uint8_t* out, size_t out_len, size_t* len) {
+  uint32_t bits = 0;
+  int bit_count = 0;
+  *len = 0;
+
+  for (size_t i = 0; i < str.len; i++) {
+    char c = str.ptr[i];
+    int value;
+    if (c >= 'A' && c <= 'Z') {
+      value = c - 'A';
+    } else if (c >= 'a' && c <= 'z') {
+      value = c - 'a' + 26;
+    } else if (c >= '0' && c <= '9') {
+      value = c - '0' + 52;
+    } else if (c == '-') {
+      value = 62;
+    } else if (c == '_') {
+      value = 63;
+    } else if (c == '=') {
+      break;
+    } else {
+      return -1;
+    }
+
+    bits = (bits << 6) | (uint32_t)value;
+    bit_count += 6;
+    if (bit_count >= 8) {
+      if (*len == out_len) {
+        return -1;
+      }
+      bit_count -= 8;
+      out[(*len)++] = (uint8_t)(bits >> bit_count);
+    }
+  }
+
+  return 0;
+}
+
+/**
+ * @brief Queues a control frame
+ *
+ * @param session Session struct
+ * @param type Frame type
+ * @param flags Frame flags
+ * @param stream Stream identifier
+ * @param payload Frame payload
+ * @param length Payload length
+ * @return int 0 if successful, -1 if the control buffer is full
+ */
+static int queue_frame(h2_session_t* session, frame_type_t type, uint8_t flags, uint32_t stream,
+                       const uint8_t* payload, size_t length) {
+  // a client making us queue this much is not reading
+  if (H2_FRAME_HEADER_LEN + length > H2_CONTROL_LEN - session->control_len) {
+    session->closing = 1;
+    return -1;
+  }
+
+  write_frame_header((uint8_t*)session->control + session->control_len, length, type, flags, stream);
+  if (length > 0) {
+    memcpy(session->control + session->control_len + H2_FRAME_HEADER_LEN, payload, length);
+  }
+  session->control_len += H2_FRAME_HEADER_LEN + length;
+  return 0;
+}
+
+/**
+ * @brief Tells the client no stream after the last one will be answered
+ *
+ * @param session Session struct
+ * @param code Error code
+ */
+static void send_goaway(h2_session_t* session, h2_error_t code) {
+  if (session->goaway) {
+    return;
+  }
+  session->goaway = 1;
+
+  uint8_t payload[8];
+  write_u32(payload, session->last_stream);
+  write_u32(payload + 4, code);
+  queue_frame(session, FRAME_GOAWAY, 0, 0, payload, sizeof(payload));
+}
+
+/**
+ * @brief Ends the session on a connection error
+ *
+ * @param session Session struct
+ * @param code Error code
+ */
+static void fail_session(h2_session_t* session, h2_error_t code) {
+  // pending control frames go first unless the GOAWAY would not fit
+  if (H2_FRAME_HEADER_LEN + 8 > H2_CONTROL_LEN - session->control_len) {
+    session->control_len = 0;
+  }
+  session->goaway = 0;
+  send_goaway(session, code);
+  session->closing = 1;
+}
+
+/**
+ * @brief Finds an open stream
+ *
+ * @param session Session struct
+ * @param id Stream identifier
+ * @return h2_stream_t* Stream or NULL if it is not open
+ */
+static h2_stream_t* find_stream(h2_session_t* session, uint32_t id) {
+  for (h2_stream_t* stream = session->streams; stream != NULL; stream = stream->next) {
+    if (stream->id == id) {
+      return stream->done ? NULL : stream;
+    }
+  }
+  return NULL;
+}
+
+/**
+ * @brief Marks a stream done, it is freed once out of the batch
+ *
+ * @param session Session struct
+ * @param stream Stream struct
+ */
+static void end_stream(h2_session_t* session, h2_stream_t* stream) {
+  if (!stream->done) {
+    stream->done = 1;
+    session->stream_count--;
+  }
+}
+
+/**
+ * @brief Resets a stream
+ *
+ * @param session Session struct
+ * @param id Stream identifier
+ * @param code Error code
+ */
+static void reset_stream(h2_session_t* session, uint32_t id, h2_error_t code) {
+  h2_stream_t* stream = find_stream(session, id);
+  if (stream != NULL) {
+    end_stream(session, stream);
+  }
+
+  uint8_t payload[4];
+  write_u32(payload, code);
+  queue_frame(session, FRAME_RST_STREAM, 0, id, payload, sizeof(payload));
+}
+
+/**
+ * @brief Applies settings from a SETTINGS frame or an upgrade request
+ *
+ * @param session Session struct
+ * @param payload Settings, 6 bytes each
+ * @param length Length of the settings
+ * @return h2_error_t ERROR_NONE or the connection error
+ */
+static h2_error_t apply_settings(h2_session_t* session, const uint8_t* payload, size_t length) {
+  for (size_t i = 0; i + 6 <= length; i += 6) {
+    uint16_t id = (uint16_t)((payload[i] << 8) | payload[i + 1]);
+    uint32_t value = read_u32(payload + i + 2);
+
+    switch (id) {
+      case SETTING_HEADER_TABLE_SIZE:
+        resize_hpack_table(&session->encoder, value);
+        break;
+      case SETTING_ENABLE_PUSH:
+        if (value > 1) {
+          return ERROR_PROTOCOL;
+        }
+        break;
+      case SETTING_INITIAL_WINDOW_SIZE: {
+        if (value > H2_MAX_WINDOW) {
+          return ERROR_FLOW_CONTROL;
+        }
+
+        // open streams move by the difference
+        int64_t delta = (int64_t)value - session->initial_window;
+        for (h2_stream_t* stream = session->streams; stream != NULL; stream = stream->next) {
+          stream->window += delta;
+          if (stream->window > H2_MAX_WINDOW) {
+            return ERROR_FLOW_CONTROL;
+          }
+        }
+        session->initial_window = value;
+        break;
+      }
+      case SETTING_MAX_FRAME_SIZE:
+        if (value < H2_MAX_FRAME_LEN || value > 0xffffff) {
+          return ERROR_PROTOCOL;
+        }
+        session->max_frame = H2_MAX_FRAME_LEN;
+        break;
+      default:
+        // unknown settings are ignored
+        break;
+    }
+  }
+
+  return ERROR_NONE;
+}
+
+/**
+ * @brief Opens a stream of the session
+ *
+ * The exchange shares the client, server and log buffer of the
+ * connection but has its own request, response and arena.
+ *
+ * @param connection Connection running the session
+ * @param id Stream identifier
+ * @return h2_stream_t* New stream or NULL if error
+ */
+static h2_stream_t* create_stream(connection_t* connection, uint32_t id) {
+  h2_session_t* session = connection->h2;
+
+  pool_result_t pool_result;
+  h2_stream_t* stream = pool_alloc(sizeof(h2_stream_t), &pool_result);
+  if (stream == NULL) {
+    return NULL;
+  }
+  stream->head = pool_alloc(CONNECTION_BUFFER_LEN, &pool_result);
+  if (stream->head == NULL) {
+    pool_free(stream, sizeof(h2_stream_t));
+    return NULL;
+  }
+
+  stream->id = id;
+  stream->window = session->initial_window;
+  stream->remote_closed = 0;
+  stream->answered = 0;
+  stream->headers_sent = 0;
+  stream->done = 0;
+  stream->remaining = 0;
+  stream->head_len = 0;
+  stream->next = NULL;
+
+  connection_t* exchange = &stream->exchange;
+  exchange->client = connection->client;
+  exchange->server = connection->server;
+  exchange->state = CONNECTION_WRITING;
+  exchange->keep_alive = 1;
+  exchange->requests_served = 0;
+  exchange->window_sent = 0;
+  init_wheel_timer(&exchange->timer, exchange);
+  exchange->request_start = 0;
+  exchange->in = NULL;
+  exchange->in_len = 0;
+  init_request_parser(&exchange->parser);
+  exchange->body.done = 1;
+  init_arena(&exchange->arena);
+  init_response(&exchange->response, &exchange->arena);
+  exchange->log_buffer = connection->log_buffer;
+  exchange->h2 = NULL;
+  exchange->proxy = NULL;
+  exchange->upstream_pool = NULL;
+  TRACE_CONNECTION(&exchange->trace);
+
+  // streams are framed in the order they were opened
+  h2_stream_t** link = &session->streams;
+  while (*link != NULL) {
+    link = &(*link)->next;
+  }
+  *link = stream;
+  session->stream_count++;
+
+  return stream;
+}
+
+/**
+ * @brief Frees a stream and what its response holds
+ *
+ * @param stream Stream struct
+ */
+static void free_stream(h2_stream_t* stream) {
+  reset_response(&stream->exchange.response);
+  release_arena(&stream->exchange.arena);
+  pool_free(stream->head, CONNECTION_BUFFER_LEN);
+  pool_free(stream, sizeof(h2_stream_t));
+}
+
+/**
+ * @brief Rebuilds a request head from decoded header fields
+ *
+ * @param stream Stream whose head is filled
+ * @param fields Decoded fields
+ * @param count Number of fields
+ * @param len Set to the length of the head
+ * @return request_result_t REQUEST_SUCCESS, REQUEST_ERR_MALFORMED or
+ *         REQUEST_ERR_HEADERS_TOO_LARGE
+ */
+static request_result_t build_request(h2_stream_t* stream, const header_t fields[], size_t count, size_t* len) {
+  slice_t method = { NULL, 0 };
+  slice_t scheme = { NULL, 0 };
+  slice_t path = { NULL, 0 };
+  slice_t authority = { NULL, 0 };
+  int regular = 0;
+  int host = 0;
+
+  // pseudo-header fields come first, exactly once each
+  for (size_t i = 0; i < count; i++) {
+    slice_t name = fields[i].name;
+    slice_t value = fields[i].value;
+    if (name.len == 0 || memchr(value.ptr, '\r', value.len) != NULL || memchr(value.ptr, '\n', value.len) != NULL ||
+        memchr(value.ptr, '\0', value.len) != NULL) {
+      return REQUEST_ERR_MALFORMED;
+    }
+
+    if (name.ptr[0] == ':') {
+      slice_t* pseudo = slice_equals(name, ":method") ? &method : slice_equals(name, ":scheme") ? &scheme :
+                        slice_equals(name, ":path") ? &path : slice_equals(name, ":authority") ? &authority : NULL;
+      if (regular || pseudo == NULL || pseudo->ptr != NULL) {
+        return REQUEST_ERR_MALFORMED;
+      }
+      *pseudo = value;
+      continue;
+    }
+    regular = 1;
+
+    // names are lowercase tokens, connection-specific ones are not allowed
+    for (size_t j = 0; j < name.len; j++) {
+      if ((name.ptr[j] >= 'A' && name.ptr[j] <= 'Z') || name.ptr[j] == ':' || name.ptr[j] <= ' ') {
+        return REQUEST_ERR_MALFORMED;
+      }
+    }
+    for (int j = 0; connection_fields[j] != NULL; j++) {
+      if (slice_equals(name, connection_fields[j])) {
+        return REQUEST_ERR_MALFORMED;
+      }
+    }
+    if (slice_equals(name, "te") && !(value.len == 8 && memcmp(value.ptr, "trailers", 8) == 0)) {
+      return REQUEST_ERR_MALFORMED;
+    }
+    host |= slice_equals(name, "host");
+  }
+  if (method.ptr == NULL || scheme.ptr == NULL || path.len == 0) {
+    return REQUEST_ERR_MALFORMED;
+  }
+
+  // request line, Host from :authority, then the fields
+  char* head = stream->head;
+  int written = snprintf(head, CONNECTION_BUFFER_LEN, "%.*s %.*s HTTP/1.1\r\n", (int)method.len, method.ptr,
+                         (int)path.len, path.ptr);
+  size_t used = (size_t)written;
+  if (written < 0 || used >= CONNECTION_BUFFER_LEN) {
+    return REQUEST_ERR_HEADERS_TOO_LARGE;
+  }
+  if (authority.ptr != NULL && !host) {
+    written = snprintf(head + used, CONNECTION_BUFFER_LEN - used, "Host: %.*s\r\n", (int)authority.len,
+                       authority.ptr);
+    used += (size_t)written;
+    if (written < 0 || used >= CONNECTION_BUFFER_LEN) {
+      return REQUEST_ERR_HEADERS_TOO_LARGE;
+    }
+  }
+  for (size_t i = 0; i < count; i++) {
+    if (fields[i].name.ptr[0] == ':') {
+      continue;
+    }
+    written = snprintf(head + used, CONNECTION_BUFFER_LEN - used, "%.*s: %.*s\r\n", (int)fields[i].name.len,
+                       fields[i].name.ptr, (int)fields[i].value.len, fields[i].value.ptr);
+    used += (size_t)written;
+    if (written < 0 || used >= CONNECTION_BUFFER_LEN) {
+      return REQUEST_ERR_HEADERS_TOO_LARGE;
+    }
+  }
+  if (used + 2 > CONNECTION_BUFFER_LEN) {
+    return REQUEST_ERR_HEADERS_TOO_LARGE;
+  }
+  memcpy(head + used, "\r\n", 2);
+  *len = used + 2;
+
+  return REQUEST_SUCCESS;
+}
+
+/**
+ * @brief Parses the rebuilt request of a stream and queues its response
+ *
+ * @param connection Connection running the session
+ * @param stream Stream struct
+ * @param request_result Result of rebuilding the head
+ * @param len Length of the head
+ */
+static void answer_stream(connection_t* connection, h2_stream_t* stream, request_result_t request_result,
+                          size_t len) {
+  h2_session_t* session = connection->h2;
+  connection_t* exchange = &stream->exchange;
+  request_t* request = &exchange->request;
+
+  // the same checks as any request
+  uint64_t start = metrics_now();
+  if (request_result == REQUEST_SUCCESS) {
+    parse_request(&exchange->parser, request, stream->head, len, &request_result);
+  }
+  exchange->request_start = metrics_now();
+  metrics_observe(METRIC_PARSE_TIME, exchange->request_start - start);
+
+  // a malformed request is a stream error
+  if (request_result == REQUEST_ERR_MALFORMED) {
+    metrics_request_result(request_result);
+    reset_stream(session, stream->id, ERROR_PROTOCOL);
+    return;
+  }
+
+  stream->answered = 1;
+  connection->requests_served++;
+  if (request_result != REQUEST_SUCCESS) {
+    response_result_t result;
+    metrics_request_result(request_result);
+    if (exchange->log_buffer != NULL) {
+      begin_rejected_entry(&exchange->entry);
+    }
+    queue_status(&exchange->response, request_result_status(request_result), 1, &result);
+    if (result != RESPONSE_SUCCESS) {
+      reset_stream(session, stream->id, ERROR_INTERNAL);
+    }
+  } else {
+    // logged as the version it arrived in
+    request->version.ptr = "2.0";
+    if (exchange->log_buffer != NULL) {
+      begin_access_entry(&exchange->entry, request);
+    }
+
+    metrics_count(METRIC_REQUESTS, 1);
+    int handled = handle_request(exchange, request);
+    metrics_observe(METRIC_HANDLE_TIME, metrics_now() - exchange->request_start);
+    if (handled == -1) {
+      reset_stream(session, stream->id, ERROR_INTERNAL);
+    }
+  }
+
+  // the connection has served its share, or the server is going away
+  if (connection->requests_served >= connection->server->config->max_requests ||
+      __atomic_load_n(&connection->server->draining, __ATOMIC_RELAXED)) {
+    send_goaway(session, ERROR_NONE);
+  }
+}
+
+/**
+ * @brief Opens a stream for a complete header block and answers it
+ *
+ * @param connection Connection running the session
+ * @param id Stream identifier
+ * @param block Header block
+ * @param length Length of the block
+ * @param end_stream HEADERS carried END_STREAM
+ */
+static void open_stream(connection_t* connection, uint32_t id, const uint8_t* block, size_t length, int end_stream) {
+  h2_session_t* session = connection->h2;
+
+  // every block updates the table, answered or not
+  header_t fields[REQUEST_MAX_HEADERS * 2];
+  size_t count;
+  char decoded[CONNECTION_BUFFER_LEN];
+  hpack_result_t hpack_result;
+  hpack_decode(&session->decoder, block, length, fields, sizeof(fields) / sizeof(fields[0]), &count, decoded,
+               sizeof(decoded), &hpack_result);
+  if (hpack_result != HPACK_SUCCESS) {
+    fail_session(session, hpack_result == HPACK_ERR_INVALID ? ERROR_COMPRESSION : ERROR_ENHANCE_YOUR_CALM);
+    return;
+  }
+
+  // trailers end an open stream
+  h2_stream_t* stream = find_stream(session, id);
+  if (stream != NULL) {
+    if (stream->remote_closed || !end_stream) {
+      fail_session(session, ERROR_PROTOCOL);
+      return;
+    }
+    stream->remote_closed = 1;
+    if (!stream->answered) {
+      answer_stream(connection, stream, REQUEST_SUCCESS, stream->head_len);
+    }
+    return;
+  }
+
+  // clients open odd streams in increasing order
+  if (id % 2 == 0 || id <= session->last_stream) {
+    fail_session(session, id % 2 == 0 ? ERROR_PROTOCOL : ERROR_STREAM_CLOSED);
+    return;
+  }
+  session->last_stream = id;
+
+  // after GOAWAY new streams are left unanswered
+  if (session->goaway) {
+    return;
+  }
+  if (session->stream_count >= H2_MAX_STREAMS) {
+    reset_stream(session, id, ERROR_REFUSED_STREAM);
+    return;
+  }
+
+  stream = create_stream(connection, id);
+  if (stream == NULL) {
+    reset_stream(session, id, ERROR_REFUSED_STREAM);
+    return;
+  }
+  stream->remote_closed = end_stream;
+
+  // a request is answered at END_STREAM, one that cannot be served right away
+  size_t len = 0;
+  request_result_t request_result = build_request(stream, fields, count, &len);
+  if (end_stream || request_result != REQUEST_SUCCESS) {
+    answer_stream(connection, stream, request_result, len);
+  } else {
+    stream->head_len = len;
+  }
+}
+
+/**
+ * @brief Handles a HEADERS frame
+ *
+ * @param connection Connection running the session
+ * @param flags Frame flags
+ * @param id Stream identifier
+ * @param payload Frame payload
+ * @param length Payload length
+ */
+static void handle_headers(connection_t* connection, uint8_t flags, uint32_t id, const uint8_t* payload,
+                           size_t length) {
+  h2_session_t* session = connection->h2;
+
+  if (id == 0) {
+    fail_session(session, ERROR_PROTOCOL);
+    return;
+  }
+
+  // strip padding and the priority fields nobody uses
+  if (flags & FLAG_PADDED) {
+    if (length == 0 || payload[0] >= length) {
+      fail_session(session, ERROR_PROTOCOL);
+      return;
+    }
+    length -= 1 + payload[0];
+    payload++;
+  }
+  if (flags & FLAG_PRIORITY) {
+    if (length < 5) {
+      fail_session(session, ERROR_FRAME_SIZE);
+      return;
+    }
+    payload += 5;
+    length -= 5;
+  }
+
+  if (flags & FLAG_END_HEADERS) {
+    open_stream(connection, id, payload, length, flags & FLAG_END_STREAM);
+    return;
+  }
+
+  // the rest of the block follows in CONTINUATION frames
+  pool_result_t pool_result;
+  session->block = pool_alloc(H2_MAX_HEADER_BLOCK, &pool_result);
+  if (session->block == NULL) {
+    fail_session(session, ERROR_INTERNAL);
+    return;
+  }
+  memcpy(session->block, payload, length);
+  session->block_len = length;
+  session->block_stream = id;
+  session->block_end_stream = flags & FLAG_END_STREAM;
+}
+
+/**
+ * @brief Handles a CONTINUATION frame
+ *
+ * @param connection Connection running the session
+ * @param flags Frame flags
+ * @param payload Frame payload
+ * @param length Payload length
+ */
+static void handle_continuation(connection_t* connection, uint8_t flags, const uint8_t* payload, size_t length) {
+  h2_session_t* session = connection->h2;
+
+  if (length > H2_MAX_HEADER_BLOCK - session->block_len) {
+    fail_session(session, ERROR_ENHANCE_YOUR_CALM);
+    return;
+  }
+  memcpy(session->block + session->block_len, payload, length);
+  session->block_len += length;
+
+  if (flags & FLAG_END_HEADERS) {
+    uint8_t* block = session->block;
+    session->block = NULL;
+    open_stream(connection, session->block_stream, block, session->block_len, session->block_end_stream);
+    pool_free(block, H2_MAX_HEADER_BLOCK);
+  }
+}
+
+/**
+ * @brief Handles a DATA frame
+ *
+ * Request bodies are refused, so the data is dropped and only the
+ * connection window is given back. A stream is refused with 413 once a
+ * body byte arrives, an empty DATA frame only ends the request.
+ *
+ * @param connection Connection running the session
+ * @param flags Frame flags
+ * @param id Stream identifier
+ * @param length Payload length
+ */
+static void handle_data(connection_t* connection, uint8_t flags, uint32_t id, size_t length) {
+  h2_session_t* session = connection->h2;
+
+  if (id == 0 || id > session->last_stream) {
+    fail_session(session, ERROR_PROTOCOL);
+    return;
+  }
+
+  // padding counts against the window too
+  session->received += length;
+  if (session->received >= H2_DEFAULT_WINDOW / 2) {
+    uint8_t payload[4];
+    write_u32(payload, (uint32_t)session->received);
+    queue_frame(session, FRAME_WINDOW_UPDATE, 0, 0, payload, sizeof(payload));
+    session->received = 0;
+  }
+
+  h2_stream_t* stream = find_stream(session, id);
+  if (stream == NULL) {
+    return;
+  }
+  if (stream->remote_closed) {
+    reset_stream(session, id, ERROR_STREAM_CLOSED);
+    return;
+  }
+  if (!stream->answered && length > 0) {
+    answer_stream(connection, stream, REQUEST_ERR_BODY_TOO_LARGE, 0);
+  }
+  if (flags & FLAG_END_STREAM) {
+    stream->remote_closed = 1;
+    if (!stream->answered) {
+      answer_stream(connection, stream, REQUEST_SUCCESS, stream->head_len);
+    }
+  }
+}
+
+/**
+ * @brief Handles a SETTINGS frame
+ *
+ * @param connection Connection running the session
+ * @param flags Frame flags
+ * @param id Stream identifier
+ * @param payload Frame payload
+ * @param length Payload length
+ */
+static void handle_settings(connection_t* connection, uint8_t flags, uint32_t id, const uint8_t* payload,
+                            size_t length) {
+  h2_session_t* session = connection->h2;
+
+  if (id != 0) {
+    fail_session(session, ERROR_PROTOCOL);
+    return;
+  }
+  if (flags & FLAG_ACK) {
+    if (length != 0) {
+      fail_session(session, ERROR_FRAME_SIZE);
+    }
+    return;
+  }
+  if (length % 6 != 0) {
+    fail_session(session, ERROR_FRAME_SIZE);
+    return;
+  }
+
+  h2_error_t error = apply_settings(session, payload, length);
+  if (error != ERROR_NONE) {
+    fail_session(session, error);
+    return;
+  }
+  session->settings = 1;
+  queue_frame(session, FRAME_SETTINGS, FLAG_ACK, 0, NULL, 0);
+}
+
+/**
+ * @brief Handles a WINDOW_UPDATE frame
+ *
+ * @param connection Connection running the session
+ * @param id Stream identifier
+ * @param payload Frame payload
+ * @param length Payload length
+ */
+static void handle_window_update(connection_t* connection, uint32_t id, const uint8_t* payload, size_t length) {
+  h2_session_t* session = connection->h2;
+
+  if (length != 4) {
+    fail_session(session, ERROR_FRAME_SIZE);
+    return;
+  }
+  uint32_t increment = read_u32(payload) & 0x7fffffff;
+
+  // the connection window
+  if (id == 0) {
+    session->window += increment;
+    if (increment == 0 || session->window > H2_MAX_WINDOW) {
+      fail_session(session, increment == 0 ? ERROR_PROTOCOL : ERROR_FLOW_CONTROL);
+    }
+    return;
+  }
+
+  // a stream window, streams already done are ignored
+  if (id > session->last_stream) {
+    fail_session(session, ERROR_PROTOCOL);
+    return;
+  }
+  h2_stream_t* stream = find_stream(session, id);
+  if (stream == NULL) {
+    return;
+  }
+  stream->window += increment;
+  if (increment == 0 || stream->window > H2_MAX_WINDOW) {
+    reset_stream(session, id, increment == 0 ? ERROR_PROTOCOL : ERROR_FLOW_CONTROL);
+  }
+}
+
+/**
+ * @brief Handles one complete frame
+ *
+ * @param connection Connection running the session
+ * @param type Frame type
+ * @param flags Frame flags
+ * @param id Stream identifier
+ * @param payload Frame payload
+ * @param length Payload length
+ */
+static void handle_frame(connection_t* connection, uint8_t type, uint8_t flags, uint32_t id, const uint8_t* payload,
+                         size_t length) {
+  h2_session_t* session = connection->h2;
+
+  // nothing may come between a header block and its CONTINUATION frames
+  if (session->block != NULL && (type != FRAME_CONTINUATION || id != session->block_stream)) {
+    fail_session(session, ERROR_PROTOCOL);
+    return;
+  }
+
+  // the preface ends with a SETTINGS frame
+  if (!session->settings && type != FRAME_SETTINGS) {
+    fail_session(session, ERROR_PROTOCOL);
+    return;
+  }
+
+  switch (type) {
+    case FRAME_DATA:
+      handle_data(connection, flags, id, length);
+      break;
+    case FRAME_HEADERS:
+      handle_headers(connection, flags, id, payload, length);
+      break;
+    case FRAME_PRIORITY:
+      // priorities are not used, answers take turns
+      if (id == 0 || length != 5) {
+        fail_session(session, id == 0 ? ERROR_PROTOCOL : ERROR_FRAME_SIZE);
+      }
+      break;
+    case FRAME_RST_STREAM: {
+      if (id == 0 || id > session->last_stream || length != 4) {
+        fail_session(session, length != 4 ? ERROR_FRAME_SIZE : ERROR_PROTOCOL);
+        break;
+      }
+      h2_stream_t* stream = find_stream(session, id);
+      if (stream != NULL) {
+        end_stream(session, stream);
+      }
+      break;
+    }
+    case FRAME_SETTINGS:
+      handle_settings(connection, flags, id, payload, length);
+      break;
+    case FRAME_PING:
+      if (id != 0 || length != 8) {
+        fail_session(session, id != 0 ? ERROR_PROTOCOL : ERROR_FRAME_SIZE);
+      } else if (!(flags & FLAG_ACK)) {
+        queue_frame(session, FRAME_PING, FLAG_ACK, 0, payload, length);
+      }
+      break;
+    case FRAME_GOAWAY:
+      // finish what is open, then close
+      session->goaway = 1;
+      break;
+    case FRAME_WINDOW_UPDATE:
+      handle_window_update(connection, id, payload, length);
+      break;
+    case FRAME_CONTINUATION:
+      if (session->block == NULL) {
+        fail_session(session, ERROR_PROTOCOL);
+      } else {
+        handle_continuation(connection, flags, payload, length);
+      }
+      break;
+    case FRAME_PUSH_PROMISE:
+      // only servers push
+      fail_session(session, ERROR_PROTOCOL);
+      break;
+    default:
+      // unknown frame types are ignored
+      break;
+  }
+}
+
+/**
+ * @brief Handles the complete frames in the input buffer
+ *
+ * @param connection Connection running the session
+ */
+static void process_frames(connection_t* connection) {
+  h2_session_t* session = connection->h2;
+  size_t pos = 0;
+
+  if (session->in_len == 0) {
+    return;
+  }
+
+  // the client preface comes first
+  if (!session->preface) {
+    int matched = match_h2_preface(session->in, session->in_len);
+    if (matched == 0) {
+      return;
+    }
+    if (matched == -1) {
+      fail_session(session, ERROR_PROTOCOL);
+      session->in_len = 0;
+      return;
+    }
+    session->preface = 1;
+    pos = H2_PREFACE_LEN;
+  }
+
+  while (!session->closing && session->in_len - pos >= H2_FRAME_HEADER_LEN) {
+    const uint8_t* frame = (const uint8_t*)session->in + pos;
+    size_t length = read_u24(frame);
+    if (length > H2_MAX_FRAME_LEN) {
+      fail_session(session, ERROR_FRAME_SIZE);
+      break;
+    }
+    if (session->in_len - pos < H2_FRAME_HEADER_LEN + length) {
+      break;
+    }
+
+    handle_frame(connection, frame[3], frame[4], read_u32(frame + 5) & 0x7fffffff, frame + H2_FRAME_HEADER_LEN,
+                 length);
+    pos += H2_FRAME_HEADER_LEN + length;
+  }
+
+  // keep a partial frame, nothing more is read once closing
+  if (session->closing) {
+    session->in_len = 0;
+    return;
+  }
+  memmove(session->in, session->in + pos, session->in_len - pos);
+  session->in_len -= pos;
+}
+
+/**
+ * @brief Adds bytes just written to the frame buffer to the batch
+ *
+ * @param session Session struct
+ * @param len Bytes written at frames_len
+ */
+static void commit_frames(h2_session_t* session, size_t len) {
+  response_t* out = &session->out;
+  const char* data = session->frames + session->frames_len;
+  session->frames_len += len;
+
+  // frame bytes back to back go out as one segment
+  response_segment_t* last = out->segment_count > 0 ? &out->segments[out->segment_count - 1] : NULL;
+  if (last != NULL && last->type == SEGMENT_MEMORY && last->data + last->len == data) {
+    last->len += len;
+    return;
+  }
+
+  response_result_t result;
+  add_memory_segment(out, data, len, &result);
+}
+
+/**
+ * @brief Frames the headers of a stream's response
+ *
+ * The handler wrote an HTTP/1.1 head into memory segments. Its status
+ * line and fields are encoded into a HEADERS frame, without the fields
+ * that only make sense on an HTTP/1.1 connection.
+ *
+ * @param session Session struct
+ * @param stream Stream struct
+ * @return int 1 if framed, 0 if the batch has no room or the session
+ *         failed, -1 if the head cannot be framed
+ */
+static int frame_headers(h2_session_t* session, h2_stream_t* stream) {
+  response_t* response = &stream->exchange.response;
+
+  // gather the head, it ends with the segment holding the blank line
+  char head[2 * RESPONSE_HEADER_LEN];
+  size_t head_len = 0;
+  int body = -1;
+  for (int i = 0; i < response->segment_count; i++) {
+    const response_segment_t* segment = &response->segments[i];
+    if (segment->type != SEGMENT_MEMORY || segment->len > sizeof(head) - head_len) {
+      break;
+    }
+    memcpy(head + head_len, segment->data, segment->len);
+    head_len += segment->len;
+    if (head_len >= 4 && memcmp(head + head_len - 4, "\r\n\r\n", 4) == 0) {
+      body = i + 1;
+      break;
+    }
+  }
+  if (body == -1 || head_len < 12 || memcmp(head, "HTTP/1.1 ", 9) != 0) {
+    return -1;
+  }
+
+  // an encoded field never takes more than its line and a few bytes
+  if (H2_FRAME_HEADER_LEN + 2 * head_len > H2_BATCH_LEN - session->frames_len ||
+      session->out.segment_count == RESPONSE_MAX_SEGMENTS) {
+    return 0;
+  }
+
+  // a HEAD request gets the headers only
+  size_t remaining = 0;
+  for (int i = body; i < response->segment_count; i++) {
+    remaining += response->segments[i].len;
+  }
+  if (memcmp(stream->head, "HEAD ", 5) == 0) {
+    remaining = 0;
+  }
+
+  uint8_t* frame = (uint8_t*)session->frames + session->frames_len;
+  uint8_t* block = frame + H2_FRAME_HEADER_LEN;
+  size_t space = H2_BATCH_LEN - session->frames_len - H2_FRAME_HEADER_LEN;
+  size_t length = hpack_encode(&session->encoder, ":status", 7, head + 9, 3, block, space);
+
+  // one field per line after the status line
+  const char* line = memchr(head, '\n', head_len) + 1;
+  const char* end = head + head_len - 2;
+  while (line < end && length > 0) {
+    const char* line_end = memchr(line, '\r', (size_t)(end - line));
+    const char* colon = line_end != NULL ? memchr(line, ':', (size_t)(line_end - line)) : NULL;
+    if (colon == NULL || colon - line > 64) {
+      length = 0;
+      break;
+    }
+
+    char name[64];
+    size_t name_len = (size_t)(colon - line);
+    for (size_t i = 0; i < name_len; i++) {
+      name[i] = (char)(line[i] >= 'A' && line[i] <= 'Z' ? line[i] + 32 : line[i]);
+    }
+    const char* value = colon + 1;
+    while (value < line_end && *value == ' ') {
+      value++;
+    }
+
+    slice_t name_slice = { name, name_len };
+    int skipped = 0;
+    for (int i = 0; connection_fields[i] != NULL; i++) {
+      skipped |= slice_equals(name_slice, connection_fields[i]);
+    }
+    if (!skipped) {
+      size_t field_len = hpack_encode(&session->encoder, name, name_len, value, (size_t)(line_end - value),
+                                      block + length, space - length);
+      length = field_len > 0 ? length + field_len : 0;
+    }
+    line = line_end + 2;
+  }
+  // the table has changed, the client cannot decode what follows
+  if (length == 0) {
+    fail_session(session, ERROR_COMPRESSION);
+    return 0;
+  }
+
+  write_frame_header(frame, length, FRAME_HEADERS, FLAG_END_HEADERS | (remaining == 0 ? FLAG_END_STREAM : 0),
+                     stream->id);
+  commit_frames(session, H2_FRAME_HEADER_LEN + length);
+
+  stream->headers_sent = 1;
+  stream->remaining = remaining;
+  response->current = body;
+  return 1;
+}
+
+/**
+ * @brief Frames the next DATA frame of a stream
+ *
+ * @param session Session struct
+ * @param stream Stream struct
+ * @return int 1 if framed, 0 if a window or the batch has no room
+ */
+static int frame_data(h2_session_t* session, h2_stream_t* stream) {
+  response_t* response = &stream->exchange.response;
+
+  if (H2_FRAME_HEADER_LEN > H2_BATCH_LEN - session->frames_len ||
+      RESPONSE_MAX_SEGMENTS - session->out.segment_count < 2) {
+    return 0;
+  }
+
+  // the segment the body continues in
+  while (response->segments[response->current].len == 0) {
+    response->current++;
+  }
+  response_segment_t* segment = &response->segments[response->current];
+
+  // as much as the segment, the frame size and both windows allow
+  int64_t len = (int64_t)segment->len;
+  if (len > (int64_t)session->max_frame) {
+    len = (int64_t)session->max_frame;
+  }
+  if (len > session->window) {
+    len = session->window;
+  }
+  if (len > stream->window) {
+    len = stream->window;
+  }
+  if (len <= 0) {
+    return 0;
+  }
+
+  stream->remaining -= (size_t)len;
+  write_frame_header((uint8_t*)session->frames + session->frames_len, (size_t)len, FRAME_DATA,
+                     stream->remaining == 0 ? FLAG_END_STREAM : 0, stream->id);
+  commit_frames(session, H2_FRAME_HEADER_LEN);
+
+  // the payload is sent from where the response keeps it
+  response_result_t result;
+  if (segment->type == SEGMENT_MEMORY) {
+    add_memory_segment(&session->out, segment->data, (size_t)len, &result);
+    segment->data += len;
+  } else {
+    add_file_segment(&session->out, segment->fd, segment->offset, (size_t)len, &result);
+    segment->offset += len;
+  }
+  segment->len -= (size_t)len;
+  response->sent += (size_t)len;
+  session->window -= len;
+  stream->window -= len;
+  return 1;
+}
+
+/**
+ * @brief Frames what a stream can send next
+ *
+ * @param session Session struct
+ * @param stream Stream struct
+ * @return int 1 if a frame was added to the batch
+ */
+static int frame_stream(h2_session_t* session, h2_stream_t* stream) {
+  if (stream->done || !stream->answered || session->closing) {
+    return 0;
+  }
+
+  int framed;
+  if (!stream->headers_sent) {
+    framed = frame_headers(session, stream);
+    if (framed == -1) {
+      reset_stream(session, stream->id, ERROR_INTERNAL);
+      return 0;
+    }
+  } else {
+    framed = frame_data(session, stream);
+  }
+
+  // the response is complete, a body the client still sends is not wanted
+  if (framed && stream->remaining == 0) {
+    end_stream(session, stream);
+    if (!stream->remote_closed) {
+      uint8_t payload[4];
+      write_u32(payload, ERROR_NONE);
+      queue_frame(session, FRAME_RST_STREAM, 0, stream->id, payload, sizeof(payload));
+    }
+  }
+  return framed;
+}
+
+/**
+ * @brief Builds the next batch: control frames, then stream frames in turn
+ *
+ * @param session Session struct
+ * @return int 1 if the batch has anything to send
+ */
+static int fill_batch(h2_session_t* session) {
+  if (session->control_len > 0) {
+    memcpy(session->frames, session->control, session->control_len);
+    commit_frames(session, session->control_len);
+    session->control_len = 0;
+  }
+
+  // streams wait for the client's settings, as an upgraded one would not
+  // one frame per stream per round, starting after the last one framed
+  int framed = session->settings;
+  while (framed && session->streams != NULL) {
+    framed = 0;
+    h2_stream_t* stream = session->cursor != NULL ? session->cursor : session->streams;
+    h2_stream_t* first = stream;
+    do {
+      framed |= frame_stream(session, stream);
+      stream = stream->next != NULL ? stream->next : session->streams;
+    } while (stream != first);
+    session->cursor = stream;
+  }
+
+  return session->out.segment_count > 0;
+}
+
+/**
+ * @brief Counts a written batch and frees the streams it finished
+ *
+ * @param connection Connection running the session
+ */
+static void finish_batch(connection_t* connection) {
+  h2_session_t* session = connection->h2;
+
+  if (session->out.segment_count > 0) {
+    metrics_count(METRIC_BYTES_SENT, session->out.sent);
+    session->sent += session->out.sent;
+    reset_response(&session->out);
+    session->frames_len = 0;
+  }
+
+  // nothing sent refers to a done stream any more
+  h2_stream_t** link = &session->streams;
+  while (*link != NULL) {
+    h2_stream_t* stream = *link;
+    if (!stream->done) {
+      link = &stream->next;
+      continue;
+    }
+
+    if (stream->answered) {
+      connection_t* exchange = &stream->exchange;
+      metrics_status(exchange->response.status);
+      metrics_observe(METRIC_RESPONSE_TIME, metrics_now() - exchange->request_start);
+      // the head went out as HEADERS, sent counts DATA payload alone
+      if (exchange->log_buffer != NULL) {
+        log_access(connection->server->access_log, exchange->log_buffer, &exchange->entry,
+                   connection->client->host, exchange->response.status, exchange->response.sent);
+      }
+    }
+
+    *link = stream->next;
+    if (session->cursor == stream) {
+      session->cursor = stream->next;
+    }
+    free_stream(stream);
+  }
+}
+
+/**
+ * @brief Writes batches until the socket would block or nothing is left
+ *
+ * @param connection Connection running the session
+ */
+static void write_h2(connection_t* connection) {
+  h2_session_t* session = connection->h2;
+  response_result_t result;
+
+  while (1) {
+    if (session->out.current == session->out.segment_count) {
+      finish_batch(connection);
+      if (!fill_batch(session)) {
+        // all sent, close if that was the last of it
+        if (session->closing || (session->goaway && session->stream_count == 0)) {
+          connection->state = CONNECTION_CLOSING;
+        }
+        return;
+      }
+    }
+
+    write_response(connection->client, &session->out, &result);
+    if (result == RESPONSE_ERR_AGAIN) {
+      return;
+    }
+    if (result != RESPONSE_SUCCESS) {
+      connection->state = CONNECTION_CLOSING;
+      return;
+    }
+  }
+}
+
+/**
+ * @brief Reads available bytes and handles the frames they complete
+ *
+ * @param connection Connection running the session
+ * @return int 1 if bytes were read, 0 if the socket would block or closed
+ */
+static int read_h2(connection_t* connection) {
+  h2_session_t* session = connection->h2;
+  client_result_t result;
+
+  // idle sessions hold no input buffer
+  if (session->in == NULL) {
+    pool_result_t pool_result;
+    session->in = pool_alloc(H2_INPUT_LEN, &pool_result);
+    if (session->in == NULL) {
+      connection->state = CONNECTION_CLOSING;
+      return 0;
+    }
+  }
+
+  ssize_t received = recv_client(connection->client, session->in + session->in_len, H2_INPUT_LEN - session->in_len,
+                                 &result);
+  if (result == CLIENT_ERR_AGAIN) {
+    if (session->in_len == 0) {
+      pool_free(session->in, H2_INPUT_LEN);
+      session->in = NULL;
+    }
+    return 0;
+  }
+  if (result != CLIENT_SUCCESS) {
+    metrics_client_result(result);
+    connection->state = CONNECTION_CLOSING;
+    return 0;
+  }
+
+  session->in_len += (size_t)received;
+  metrics_count(METRIC_BYTES_RECEIVED, (uint64_t)received);
+  process_frames(connection);
+  return 1;
+}
+
+/**
+ * @brief Switches a connection to HTTP/2
+ *
+ * The unread bytes of the connection buffer move to the session. With an
+ * upgrade request a 101 response is queued first and the request becomes
+ * stream 1, otherwise the buffer starts with the client preface.
+ *
+ * @param connection Connection struct
+ * @param upgrade Upgrade request, consumed from the buffer, or NULL
+ * @param result Result of the operation
+ */
+void start_h2(connection_t* connection, const request_t* upgrade, h2_result_t* result) {
+  // initialize result
+  *result = H2_SUCCESS;
+
+  // the upgrade carries the client settings as base64url
+  uint8_t settings[H2_CONTROL_LEN];
+  size_t settings_len = 0;
+  if (upgrade != NULL) {
+    const header_t* header = find_header(upgrade, "HTTP2-Settings");
+    if (decode_base64url(header->value, settings, sizeof(settings), &settings_len) == -1 || settings_len % 6 != 0) {
+      *result = H2_ERR_SETTINGS;
+      return;
+    }
+  }
+
+  pool_result_t pool_result;
+  h2_session_t* session = pool_alloc(sizeof(h2_session_t), &pool_result);
+  if (session == NULL) {
+    *result = H2_ERR_MALLOC;
+    return;
+  }
+  session->in = NULL;
+  session->in_len = 0;
+  session->preface = 0;
+  session->settings = 0;
+  init_hpack_table(&session->decoder);
+  init_hpack_table(&session->encoder);
+  session->block = NULL;
+  session->block_len = 0;
+  session->last_stream = 0;
+  session->stream_count = 0;
+  session->streams = NULL;
+  session->cursor = NULL;
+  session->window = H2_DEFAULT_WINDOW;
+  session->initial_window = H2_DEFAULT_WINDOW;
+  session->max_frame = H2_MAX_FRAME_LEN;
+  session->received = 0;
+  session->control_len = 0;
+  session->frames_len = 0;
+  init_response(&session->out, NULL);
+  session->sent = 0;
+  session->goaway = 0;
+  session->closing = 0;
+
+  if (upgrade != NULL) {
+    if (apply_settings(session, settings, settings_len) != ERROR_NONE) {
+      pool_free(session, sizeof(h2_session_t));
+      *result = H2_ERR_SETTINGS;
+      return;
+    }
+    memcpy(session->control, switching_protocols, sizeof(switching_protocols) - 1);
+    session->control_len = sizeof(switching_protocols) - 1;
+  }
+
+  // our settings open the server side of the connection
+  uint8_t payload[12];
+  payload[0] = 0;
+  payload[1] = SETTING_MAX_CONCURRENT_STREAMS;
+  write_u32(payload + 2, H2_MAX_STREAMS);
+  payload[6] = 0;
+  payload[7] = SETTING_MAX_HEADER_LIST_SIZE;
+  write_u32(payload + 8, CONNECTION_BUFFER_LEN);
+  queue_frame(session, FRAME_SETTINGS, 0, 0, payload, sizeof(payload));
+  connection->h2 = session;
+
+  // frames are small and batched here, Nagle would hold them for an ACK
+  int opt = 1;
+  setsockopt(connection->client->socket, IPPROTO_TCP, TCP_NODELAY, &opt, sizeof(opt));
+
+  // the upgrade request is answered on stream 1
+  size_t consumed = 0;
+  if (upgrade != NULL) {
+    consumed = upgrade->length;
+    session->last_stream = 1;
+    h2_stream_t* stream = create_stream(connection, 1);
+    if (stream == NULL) {
+      session->closing = 1;
+    } else {
+      stream->remote_closed = 1;
+      memcpy(stream->head, connection->in, consumed);
+      answer_stream(connection, stream, REQUEST_SUCCESS, consumed);
+    }
+  }
+
+  // the rest of the buffer belongs to the session
+  size_t left = connection->in_len - consumed;
+  if (left > 0) {
+    session->in = pool_alloc(H2_INPUT_LEN, &pool_result);
+    if (session->in == NULL) {
+      session->closing = 1;
+    } else {
+      memcpy(session->in, connection->in + consumed, left);
+      session->in_len = left;
+    }
+  }
+  pool_free(connection->in, CONNECTION_BUFFER_LEN);
+  connection->in = NULL;
+  connection->in_len = 0;
+}
+
+/**
+ * @brief Checks whether a session has streams or output in progress
+ *
+ * @param session Session struct
+ * @return int 1 if a response is being sent
+ */
+int h2_busy(const h2_session_t* session) {
+  return session->stream_count > 0 || session->control_len > 0 || h2_blocked(session);
+}
+
+/**
+ * @brief Checks whether a session waits for the socket to take output
+ *
+ * @param session Session struct
+ * @return int 1 if a batch is partly written
+ */
+int h2_blocked(const h2_session_t* session) {
+  return session->out.current < session->out.segment_count;
+}
+
+/**
+ * @brief Gets the bytes a session has sent
+ *
+ * @param session Session struct
+ * @return size_t Bytes written to the socket so far
+ */
+size_t h2_sent(const h2_session_t* session) {
+  return session->sent + session->out.sent;
+}
+
+/**
+ * @brief Reads, answers and writes until the socket would block
+ *
+ * @param connection Connection struct running a session
+ */
+void drive_h2(connection_t* connection) {
+  h2_session_t* session = connection->h2;
+
+  // bytes handed over with the connection
+  process_frames(connection);
+
+  while (connection->state != CONNECTION_CLOSING) {
+    // a draining server answers what is open and no more
+    if (__atomic_load_n(&connection->server->draining, __ATOMIC_RELAXED)) {
+      send_goaway(session, ERROR_NONE);
+    }
+
+    write_h2(connection);
+    if (connection->state == CONNECTION_CLOSING || !read_h2(connection)) {
+      return;
+    }
+  }
+}
+
+/**
+ * @brief Frees a session and its streams
+ *
+ * @param session Session struct
+ */
+void close_h2(h2_session_t* session) {
+  metrics_count(METRIC_BYTES_SENT, session->out.sent);
+  reset_response(&session->out);
+
+  while (session->streams != NULL) {
+    h2_stream_t* stream = session->streams;
+    session->streams = stream->next;
+    free_stream(stream);
+  }
+
+  pool_free(session->in, H2_INPUT_LEN);
+  pool_free(session->block, H2_MAX_HEADER_BLOCK);
+  pool_free(session, sizeof(h2_session_t));
+}
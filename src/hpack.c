@@ -0,0 +1,730 @@
+#include <stdio.h>
+#include <pthread.h>
+
+#include "hpack.h"
+
+/** Longest Huffman code, the one of EOS */
+#define HUFFMAN_MAX_BITS 30
+/** Symbol that may only appear as padding */
+#define HUFFMAN_EOS 256
+
+/**
+ * @brief Entry of the static table
+ */
+typedef struct {
+  const char* name;                    /**< Field name                  */
+  const char* value;                   /**< Field value, often empty    */
+} hpack_static_t;
+
+/** Static table, index 1 first, RFC 7541 Appendix A */
+static const hpack_static_t static_table[] = {
+  { ":authority", "" }, { ":method", "GET" }, { ":method", "POST" }, { ":path", "/" },
+  { ":path", "/index.html" }, { ":scheme", "http" }, { ":scheme", "https" }, { ":status", "200" },
+  { ":status", "204" }, { ":status", "206" }, { ":status", "304" }, { ":status", "400" },
+  { ":status", "404" }, { ":status", "500" }, { "accept-charset", "" }, { "accept-encoding", "gzip, deflate" },
+  { "accept-language", "" }, { "accept-ranges", "" }, { "accept", "" }, { "access-control-allow-origin", "" },
+  { "age", "" }, { "allow", "" }, { "authorization", "" }, { "cache-control", "" },
+  { "content-disposition", "" }, { "content-encoding", "" }, { "content-language", "" }, { "content-length", "" },
+  { "content-location", "" }, { "content-range", "" }, { "content-type", "" }, { "cookie", "" },
+  { "date", "" }, { "etag", "" }, { "expect", "" }, { "expires", "" },
+  { "from", "" }, { "host", "" }, { "if-match", "" }, { "if-modified-since", "" },
+  { "if-none-match", "" }, { "if-range", "" }, { "if-unmodified-since", "" }, { "last-modified", "" },
+  { "link", "" }, { "location", "" }, { "max-forwards", "" }, { "proxy-authenticate", "" },
+  { "proxy-authorization", "" }, { "range", "" }, { "referer", "" }, { "refresh", "" },
+  { "retry-after", "" }, { "server", "" }, { "set-cookie", "" }, { "strict-transport-security", "" },
+  { "transfer-encoding", "" }, { "user-agent", "" }, { "vary", "" }, { "via", "" },
+  { "www-authenticate", "" }
+};
+
+/** Number of static table entries */
+#define STATIC_COUNT (sizeof(static_table) / sizeof(static_table[0]))
+
+/** Fields whose value is specific to one response, never worth an entry */
+static const char* unindexed_names[] = { "content-length", "content-range", "etag", "last-modified", NULL };
+
+/** Huffman codes of the 256 byte values, RFC 7541 Appendix B */
+static const uint32_t huffman_codes[256] = {
+  0x1ff8, 0x7fffd8, 0xfffffe2, 0xfffffe3, 0xfffffe4, 0xfffffe5, 0xfffffe6, 0xfffffe7,
+  0xfffffe8, 0xffffea, 0x3ffffffc, 0xfffffe9, 0xfffffea, 0x3ffffffd, 0xfffffeb, 0xfffffec,
+  0xfffffed, 0xfffffee, 0xfffffef, 0xffffff0, 0xffffff1, 0xffffff2, 0x3ffffffe, 0xffffff3,
+  0xffffff4, 0xffffff5, 0xffffff6, 0xffffff7, 0xffffff8, 0xffffff9, 0xffffffa, 0xffffffb,
+  0x14, 0x3f8, 0x3f9, 0xffa, 0x1ff9, 0x15, 0xf8, 0x7fa,
+  0x3fa, 0x3fb, 0xf9, 0x7fb, 0xfa, 0x16, 0x17, 0x18,
+  0x0, 0x1, 0x2, 0x19, 0x1a, 0x1b, 0x1c, 0x1d,
+  0x1e, 0x1f, 0x5c, 0xfb, 0x7ffc, 0x20, 0xffb, 0x3fc,
+  0x1ffa, 0x21, 0x5d, 0x5e, 0x5f, 0x60, 0x61, 0x62,
+  0x63, 0x64, 0x65, 0x66, 0x67, 0x68, 0x69, 0x6a,
+  0x6b, 0x6c, 0x6d, 0x6e, 0x6f, 0x70, 0x71, 0x72,
+  0xfc, 0x73, 0xfd, 0x1ffb, 0x7fff0, 0x1ffc, 0x3ffc, 0x22,
+  0x7ffd, 0x3, 0x23, 0x4, 0x24, 0x5, 0x25, 0x26,
+  0x27, 0x6, 0x74, 0x75, 0x28, 0x29, 0x2a, 0x7,
+  0x2b, 0x76, 0x2c, 0x8, 0x9, 0x2d, 0x77, 0x78,
+  0x79, 0x7a, 0x7b, 0x7ffe, 0x7fc, 0x3ffd, 0x1ffd, 0xffffffc,
+  0xfffe6, 0x3fffd2, 0xfffe7, 0xfffe8, 0x3fffd3, 0x3fffd4, 0x3fffd5, 0x7fffd9,
+  0x3fffd6, 0x7fffda, 0x7fffdb, 0x7fffdc, 0x7fffdd, 0x7fffde, 0xffffeb, 0x7fffdf,
+  0xffffec, 0xffffed, 0x3fffd7, 0x7fffe0, 0xffffee, 0x7fffe1, 0x7fffe2, 0x7fffe3,
+  0x7fffe4, 0x1fffdc, 0x3fffd8, 0x7fffe5, 0x3fffd9, 0x7fffe6, 0x7fffe7, 0xffffef,
+  0x3fffda, 0x1fffdd, 0xfffe9, 0x3fffdb, 0x3fffdc, 0x7fffe8, 0x7fffe9, 0x1fffde,
+  0x7fffea, 0x3fffdd, 0x3fffde, 0xfffff0, 0x1fffdf, 0x3fffdf, 0x7fffeb, 0x7fffec,
+  0x1fffe0, 0x1fffe1, 0x3fffe0, 0x1fffe2, 0x7fffed, 0x3fffe1, 0x7fffee, 0x7fffef,
+  0xfffea, 0x3fffe2, 0x3fffe3, 0x3fffe4, 0x7ffff0, 0x3fffe5, 0x3fffe6, 0x7ffff1,
+  0x3ffffe0, 0x3ffffe1, 0xfffeb, 0x7fff1, 0x3fffe7, 0x7ffff2, 0x3fffe8, 0x1ffffec,
+  0x3ffffe2, 0x3ffffe3, 0x3ffffe4, 0x7ffffde, 0x7ffffdf, 0x3ffffe5, 0xfffff1, 0x1ffffed,
+  0x7fff2, 0x1fffe3, 0x3ffffe6, 0x7ffffe0, 0x7ffffe1, 0x3ffffe7, 0x7ffffe2, 0xfffff2,
+  0x1fffe4, 0x1fffe5, 0x3ffffe8, 0x3ffffe9, 0xffffffd, 0x7ffffe3, 0x7ffffe4, 0x7ffffe5,
+  0xfffec, 0xfffff3, 0xfffed, 0x1fffe6, 0x3fffe9, 0x1fffe7, 0x1fffe8, 0x7ffff3,
+  0x3fffea, 0x3fffeb, 0x1ffffee, 0x1ffffef, 0xfffff4, 0xfffff5, 0x3ffffea, 0x7ffff4,
+  0x3ffffeb, 0x7ffffe6, 0x3ffffec, 0x3ffffed, 0x7ffffe7, 0x7ffffe8, 0x7ffffe9, 0x7ffffea,
+  0x7ffffeb, 0xffffffe, 0x7ffffec, 0x7ffffed, 0x7ffffee, 0x7ffffef, 0x7fffff0, 0x3ffffee
+};
+
+/** Bit lengths of the Huffman codes */
+static const uint8_t huffman_lengths[256] = {
+  13, 23, 28, 28, 28, 28, 28, 28, 28, 24, 30, 28, 28, 30, 28, 28,
+  28, 28, 28, 28, 28, 28, 30, 28, 28, 28, 28, 28, 28, 28, 28, 28,
+  6, 10, 10, 12, 13, 6, 8, 11, 10, 10, 8, 11, 8, 6, 6, 6,
+  5, 5, 5, 6, 6, 6, 6, 6, 6, 6, 7, 8, 15, 6, 12, 10,
+  13, 6, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7,
+  7, 7, 7, 7, 7, 7, 7, 7, 8, 7, 8, 13, 19, 13, 14, 6,
+  15, 5, 6, 5, 6, 5, 6, 6, 6, 5, 7, 7, 6, 6, 6, 5,
+  6, 7, 6, 5, 5, 6, 7, 7, 7, 7, 7, 15, 11, 14, 13, 28,
+  20, 22, 20, 20, 22, 22, 22, 23, 22, 23, 23, 23, 23, 23, 24, 23,
+  24, 24, 22, 23, 24, 23, 23, 23, 23, 21, 22, 23, 22, 23, 23, 24,
+  22, 21, 20, 22, 22, 23, 23, 21, 23, 22, 22, 24, 21, 22, 23, 23,
+  21, 21, 22, 21, 23, 22, 23, 23, 20, 22, 22, 22, 23, 22, 22, 23,
+  26, 26, 20, 19, 22, 23, 22, 25, 26, 26, 26, 27, 27, 26, 24, 25,
+  19, 21, 26, 27, 27, 26, 27, 24, 21, 21, 26, 26, 28, 27, 27, 27,
+  20, 24, 20, 21, 22, 21, 21, 23, 22, 22, 25, 25, 24, 24, 26, 23,
+  26, 27, 26, 26, 27, 27, 27, 27, 27, 28, 27, 27, 27, 27, 27, 26
+};
+
+/** Canonical decoding tables, built once from the codes */
+static uint32_t huffman_first[HUFFMAN_MAX_BITS + 1];
+static uint16_t huffman_count[HUFFMAN_MAX_BITS + 1];
+static uint16_t huffman_offset[HUFFMAN_MAX_BITS + 1];
+static uint16_t huffman_symbols[HUFFMAN_EOS + 1];
+static pthread_once_t huffman_once = PTHREAD_ONCE_INIT;
+
+/**
+ * @brief Sorts the symbols by code length for canonical decoding
+ *
+ * The code is canonical: codes of one length are consecutive and follow
+ * the symbol order, so a code decodes to the symbol at its distance from
+ * the first code of its length.
+ */
+static void init_huffman(void) {
+  size_t symbols = 0;
+  for (int bits = 1; bits <= HUFFMAN_MAX_BITS; bits++) {
+    huffman_offset[bits] = (uint16_t)symbols;
+    for (int symbol = 0; symbol <= HUFFMAN_EOS; symbol++) {
+      int length = symbol == HUFFMAN_EOS ? HUFFMAN_MAX_BITS : huffman_lengths[symbol];
+      if (length != bits) {
+        continue;
+      }
+
+      uint32_t code = symbol == HUFFMAN_EOS ? 0x3fffffff : huffman_codes[symbol];
+      if (huffman_count[bits] == 0) {
+        huffman_first[bits] = code;
+      }
+      huffman_count[bits]++;
+      huffman_symbols[symbols++] = (uint16_t)symbol;
+    }
+  }
+}
+
+/**
+ * @brief Decodes a Huffman encoded string
+ *
+ * @param src Encoded bytes
+ * @param src_len Number of encoded bytes
+ * @param dst Buffer to decode into
+ * @param dst_len Size of dst
+ * @param result Result of the operation
+ * @return size_t Number of decoded bytes
+ */
+static size_t huffman_decode(const uint8_t* src, size_t src_len, char* dst, size_t dst_len, hpack_result_t* result) {
+  pthread_once(&huffman_once, init_huffman);
+
+  size_t len = 0;
+  uint32_t code = 0;
+  int bits = 0;
+  for (size_t i = 0; i < src_len; i++) {
+    for (int bit = 7; bit >= 0; bit--) {
+      code = (code << 1) | ((src[i] >> bit) & 1);
+      bits++;
+
+      // not a complete code yet
+      if (huffman_count[bits] == 0 || code - huffman_first[bits] >= huffman_count[bits]) {
+        if (bits == HUFFMAN_MAX_BITS) {
+          *result = HPACK_ERR_INVALID;
+          return 0;
+        }
+        continue;
+      }
+
+      // EOS is only allowed as padding
+      uint16_t symbol = huffman_symbols[huffman_offset[bits] + code - huffman_first[bits]];
+      if (symbol == HUFFMAN_EOS) {
+        *result = HPACK_ERR_INVALID;
+        return 0;
+      }
+      if (len == dst_len) {
+        *result = HPACK_ERR_TOO_LARGE;
+        return 0;
+      }
+      dst[len++] = (char)symbol;
+      code = 0;
+      bits = 0;
+    }
+  }
+
+  // padding is a prefix of EOS shorter than a byte, so all ones
+  if (bits > 7 || code != (1u << bits) - 1) {
+    *result = HPACK_ERR_INVALID;
+    return 0;
+  }
+
+  return len;
+}
+
+/**
+ * @brief Counts the bytes a string takes Huffman encoded
+ *
+ * @param str String to measure
+ * @param len Length of the string
+ * @return size_t Encoded length
+ */
+static size_t huffman_length(const char* str, size_t len) {
+  size_t bits = 0;
+  for (size_t i = 0; i < len; i++) {
+    bits += huffman_lengths[(unsigned char)str[i]];
+  }
+  return (bits + 7) / 8;
+}
+
+/**
+ * @brief Huffman encodes a string
+ *
+ * @param str String to encode
+ * @param len Length of the string
+ * @param out Buffer of at least huffman_length() bytes
+ */
+static void huffman_encode(const char* str, size_t len, uint8_t* out) {
+  uint64_t pending = 0;
+  int bits = 0;
+  for (size_t i = 0; i < len; i++) {
+    unsigned char c = (unsigned char)str[i];
+    pending = (pending << huffman_lengths[c]) | huffman_codes[c];
+    bits += huffman_lengths[c];
+    while (bits >= 8) {
+      bits -= 8;
+      *out++ = (uint8_t)(pending >> bits);
+    }
+  }
+
+  // pad with the most significant bits of EOS
+  if (bits > 0) {
+    *out = (uint8_t)((pending << (8 - bits)) | (0xff >> bits));
+  }
+}
+
+/**
+ * @brief Decodes an integer with an N-bit prefix
+ *
+ * @param block Header block
+ * @param block_len Length of the block
+ * @param pos Position of the prefix byte, advanced past the integer
+ * @param prefix Bits of the prefix
+ * @param value Filled with the integer
+ * @return int 0 if successful, -1 if truncated or too large
+ */
+static int decode_integer(const uint8_t* block, size_t block_len, size_t* pos, int prefix, size_t* value) {
+  size_t max = (1u << prefix) - 1;
+  *value = block[(*pos)++] & max;
+  if (*value < max) {
+    return 0;
+  }
+
+  // continuation bytes, 7 bits each, least significant first
+  for (int shift = 0; shift <= 28; shift += 7) {
+    if (*pos == block_len) {
+      return -1;
+    }
+    uint8_t byte = block[(*pos)++];
+    *value += (size_t)(byte & 0x7f) << shift;
+    if (!(byte & 0x80)) {
+      return 0;
+    }
+  }
+
+  return -1;
+}
+
+/**
+ * @brief Encodes an integer with an N-bit prefix
+ *
+ * @param out Buffer to encode into
+ * @param out_len Space left in out
+ * @param prefix Bits of the prefix
+ * @param flags Bits above the prefix in the first byte
+ * @param value Integer to encode
+ * @return size_t Bytes written or 0 if it does not fit
+ */
+static size_t encode_integer(uint8_t* out, size_t out_len, int prefix, uint8_t flags, size_t value) {
+  size_t max = (1u << prefix) - 1;
+  if (out_len == 0) {
+    return 0;
+  }
+  if (value < max) {
+    out[0] = (uint8_t)(flags | value);
+    return 1;
+  }
+
+  out[0] = (uint8_t)(flags | max);
+  value -= max;
+  size_t len = 1;
+  while (value >= 0x80) {
+    if (len == out_len) {
+      return 0;
+    }
+    out[len++] = (uint8_t)(0x80 | (value & 0x7f));
+    value >>= 7;
+  }
+  if (len == out_len) {
+    return 0;
+  }
+  out[len++] = (uint8_t)value;
+  return len;
+}
+
+/**
+ * @brief Decodes a string literal into out
+ *
+ * @param block Header block
+ * @param block_len Length of the block
+ * @param pos Position of the length byte, advanced past the string
+ * @param out Buffer the string is copied to
+ * @param out_len Size of out
+ * @param out_used Bytes of out in use, advanced by the string
+ * @param str Set to the copied string
+ * @param result Result of the operation
+ */
+static void decode_string(const uint8_t* block, size_t block_len, size_t* pos, char* out, size_t out_len,
+                          size_t* out_used, slice_t* str, hpack_result_t* result) {
+  if (*pos == block_len) {
+    *result = HPACK_ERR_INVALID;
+    return;
+  }
+
+  int huffman = (block[*pos] & 0x80) != 0;
+  size_t len;
+  if (decode_integer(block, block_len, pos, 7, &len) == -1 || len > block_len - *pos) {
+    *result = HPACK_ERR_INVALID;
+    return;
+  }
+
+  char* dst = out + *out_used;
+  size_t space = out_len - *out_used;
+  if (huffman) {
+    str->len = huffman_decode(block + *pos, len, dst, space, result);
+    if (*result != HPACK_SUCCESS) {
+      return;
+    }
+  } else {
+    if (len > space) {
+      *result = HPACK_ERR_TOO_LARGE;
+      return;
+    }
+    memcpy(dst, block + *pos, len);
+    str->len = len;
+  }
+
+  str->ptr = dst;
+  *out_used += str->len;
+  *pos += len;
+}
+
+/**
+ * @brief Encodes a string literal, Huffman coded when that is shorter
+ *
+ * @param out Buffer to encode into
+ * @param out_len Space left in out
+ * @param str String to encode
+ * @param len Length of the string
+ * @return size_t Bytes written or 0 if it does not fit
+ */
+static size_t encode_string(uint8_t* out, size_t out_len, const char* str, size_t len) {
+  size_t huffman_len = huffman_length(str, len);
+  int huffman = huffman_len < len;
+  size_t data_len = huffman ? huffman_len : len;
+
+  size_t prefix_len = encode_integer(out, out_len, 7, huffman ? 0x80 : 0, data_len);
+  if (prefix_len == 0 || data_len > out_len - prefix_len) {
+    return 0;
+  }
+
+  if (huffman) {
+    huffman_encode(str, len, out + prefix_len);
+  } else {
+    memcpy(out + prefix_len, str, len);
+  }
+  return prefix_len + data_len;
+}
+
+/**
+ * @brief Initializes an empty table of HPACK_TABLE_SIZE
+ *
+ * @param table Table struct
+ */
+void init_hpack_table(hpack_table_t* table) {
+  table->count = 0;
+  table->used = 0;
+  table->size = 0;
+  table->max_size = HPACK_TABLE_SIZE;
+  table->update_pending = 0;
+}
+
+/**
+ * @brief Evicts the oldest entries until the table fits a size
+ *
+ * @param table Table struct
+ * @param size Size to fit in
+ */
+static void evict_entries(hpack_table_t* table, size_t size) {
+  while (table->count > 0 && table->size > size) {
+    table->count--;
+    size_t entry_len = (size_t)table->name_lens[table->count] + table->value_lens[table->count];
+    table->used -= entry_len;
+    table->size -= entry_len + HPACK_ENTRY_OVERHEAD;
+  }
+}
+
+/**
+ * @brief Adds an entry, evicting the oldest ones to make room
+ *
+ * @param table Table struct
+ * @param name Field name
+ * @param value Field value
+ */
+static void insert_entry(hpack_table_t* table, slice_t name, slice_t value) {
+  size_t entry_size = name.len + value.len + HPACK_ENTRY_OVERHEAD;
+
+  // an entry larger than the table empties it and is not added
+  if (entry_size > table->max_size) {
+    evict_entries(table, 0);
+    return;
+  }
+  evict_entries(table, table->max_size - entry_size);
+
+  // the name and value may live in the table, so keep them before moving it
+  char entry[HPACK_TABLE_SIZE];
+  memcpy(entry, name.ptr, name.len);
+  memcpy(entry + name.len, value.ptr, value.len);
+
+  size_t entry_len = name.len + value.len;
+  memmove(table->data + entry_len, table->data, table->used);
+  memcpy(table->data, entry, entry_len);
+  memmove(table->name_lens + 1, table->name_lens, table->count * sizeof(uint16_t));
+  memmove(table->value_lens + 1, table->value_lens, table->count * sizeof(uint16_t));
+  table->name_lens[0] = (uint16_t)name.len;
+  table->value_lens[0] = (uint16_t)value.len;
+  table->count++;
+  table->used += entry_len;
+  table->size += entry_size;
+}
+
+/**
+ * @brief Looks up an entry of the static or dynamic table
+ *
+ * @param table Dynamic table
+ * @param index Index, 1 based, static entries first
+ * @param name Set to the name
+ * @param value Set to the value
+ * @return int 0 if found, -1 if the index is out of range
+ */
+static int lookup_entry(const hpack_table_t* table, size_t index, slice_t* name, slice_t* value) {
+  if (index == 0) {
+    return -1;
+  }
+
+  if (index <= STATIC_COUNT) {
+    const hpack_static_t* entry = &static_table[index - 1];
+    name->ptr = entry->name;
+    name->len = strlen(entry->name);
+    value->ptr = entry->value;
+    value->len = strlen(entry->value);
+    return 0;
+  }
+
+  // dynamic entries follow, newest first
+  index -= STATIC_COUNT + 1;
+  if (index >= table->count) {
+    return -1;
+  }
+  size_t offset = 0;
+  for (size_t i = 0; i < index; i++) {
+    offset += (size_t)table->name_lens[i] + table->value_lens[i];
+  }
+  name->ptr = table->data + offset;
+  name->len = table->name_lens[index];
+  value->ptr = name->ptr + name->len;
+  value->len = table->value_lens[index];
+  return 0;
+}
+
+/**
+ * @brief Lowers the size limit of an encoding table
+ *
+ * The next encoded field starts with the size update the peer expects.
+ *
+ * @param table Table struct
+ * @param max_size Size the peer's decoder allows
+ */
+void resize_hpack_table(hpack_table_t* table, size_t max_size) {
+  if (max_size > HPACK_TABLE_SIZE) {
+    max_size = HPACK_TABLE_SIZE;
+  }
+  if (max_size == table->max_size) {
+    return;
+  }
+
+  table->max_size = max_size;
+  evict_entries(table, max_size);
+  table->update_pending = 1;
+}
+
+/**
+ * @brief Decodes a complete header block
+ *
+ * Names and values are copied into out, since entries they came from
+ * may be evicted by later fields of the same block.
+ *
+ * @param table Decoding table, updated by the block
+ * @param block Header block
+ * @param block_len Length of the block
+ * @param fields Filled with the decoded fields in order
+ * @param max_fields Number of entries in fields
+ * @param field_count Set to the number of fields decoded
+ * @param out Buffer the names and values are copied to
+ * @param out_len Size of out
+ * @param result Result of the operation
+ * @note result is HPACK_ERR_TOO_LARGE if the fields do not fit, the table
+ *       is then out of step with the peer and the connection unusable
+ */
+void hpack_decode(hpack_table_t* table, const uint8_t* block, size_t block_len, header_t fields[],
+                  size_t max_fields, size_t* field_count, char* out, size_t out_len, hpack_result_t* result) {
+  // initialize result
+  *result = HPACK_SUCCESS;
+  *field_count = 0;
+
+  size_t pos = 0;
+  size_t out_used = 0;
+  while (pos < block_len) {
+    uint8_t first = block[pos];
+    size_t index;
+
+    // dynamic table size update, only before the first field
+    if ((first & 0xe0) == 0x20) {
+      size_t max_size;
+      if (*field_count > 0 || decode_integer(block, block_len, &pos, 5, &max_size) == -1 ||
+          max_size > HPACK_TABLE_SIZE) {
+        *result = HPACK_ERR_INVALID;
+        return;
+      }
+      table->max_size = max_size;
+      evict_entries(table, max_size);
+      continue;
+    }
+
+    if (*field_count == max_fields) {
+      *result = HPACK_ERR_TOO_LARGE;
+      return;
+    }
+    header_t* field = &fields[(*field_count)++];
+
+    // indexed field
+    if (first & 0x80) {
+      slice_t name, value;
+      if (decode_integer(block, block_len, &pos, 7, &index) == -1 ||
+          lookup_entry(table, index, &name, &value) == -1) {
+        *result = HPACK_ERR_INVALID;
+        return;
+      }
+      if (name.len + value.len > out_len - out_used) {
+        *result = HPACK_ERR_TOO_LARGE;
+        return;
+      }
+      memcpy(out + out_used, name.ptr, name.len);
+      memcpy(out + out_used + name.len, value.ptr, value.len);
+      field->name.ptr = out + out_used;
+      field->name.len = name.len;
+      field->value.ptr = out + out_used + name.len;
+      field->value.len = value.len;
+      out_used += name.len + value.len;
+      continue;
+    }
+
+    // literal, with incremental indexing, without or never indexed
+    int indexing = (first & 0xc0) == 0x40;
+    if (decode_integer(block, block_len, &pos, indexing ? 6 : 4, &index) == -1) {
+      *result = HPACK_ERR_INVALID;
+      return;
+    }
+    if (index > 0) {
+      slice_t value;
+      if (lookup_entry(table, index, &field->name, &value) == -1) {
+        *result = HPACK_ERR_INVALID;
+        return;
+      }
+      if (field->name.len > out_len - out_used) {
+        *result = HPACK_ERR_TOO_LARGE;
+        return;
+      }
+      memcpy(out + out_used, field->name.ptr, field->name.len);
+      field->name.ptr = out + out_used;
+      out_used += field->name.len;
+    } else {
+      decode_string(block, block_len, &pos, out, out_len, &out_used, &field->name, result);
+      if (*result != HPACK_SUCCESS) {
+        return;
+      }
+    }
+    decode_string(block, block_len, &pos, out, out_len, &out_used, &field->value, result);
+    if (*result != HPACK_SUCCESS) {
+      return;
+    }
+
+    if (indexing) {
+      insert_entry(table, field->name, field->value);
+    }
+  }
+}
+
+/**
+ * @brief Finds the best table match for a field
+ *
+ * @param table Dynamic table
+ * @param name Field name
+ * @param value Field value
+ * @param exact Set to 1 if name and value match, 0 if only the name
+ * @return size_t Index of the match or 0 if none
+ */
+static size_t find_entry(const hpack_table_t* table, slice_t name, slice_t value, int* exact) {
+  size_t name_index = 0;
+  *exact = 0;
+
+  for (size_t i = 0; i < STATIC_COUNT; i++) {
+    const hpack_static_t* entry = &static_table[i];
+    if (strlen(entry->name) != name.len || memcmp(entry->name, name.ptr, name.len) != 0) {
+      continue;
+    }
+    if (strlen(entry->value) == value.len && memcmp(entry->value, value.ptr, value.len) == 0) {
+      *exact = 1;
+      return i + 1;
+    }
+    if (name_index == 0) {
+      name_index = i + 1;
+    }
+  }
+
+  size_t offset = 0;
+  for (size_t i = 0; i < table->count; i++) {
+    const char* entry_name = table->data + offset;
+    const char* entry_value = entry_name + table->name_lens[i];
+    offset += (size_t)table->name_lens[i] + table->value_lens[i];
+    if (table->name_lens[i] != name.len || memcmp(entry_name, name.ptr, name.len) != 0) {
+      continue;
+    }
+    if (table->value_lens[i] == value.len && memcmp(entry_value, value.ptr, value.len) == 0) {
+      *exact = 1;
+      return STATIC_COUNT + 1 + i;
+    }
+    if (name_index == 0) {
+      name_index = STATIC_COUNT + 1 + i;
+    }
+  }
+
+  return name_index;
+}
+
+/**
+ * @brief Checks whether a field is worth a table entry
+ *
+ * @param name Field name
+ * @return int 1 if the value repeats across responses
+ */
+static int is_indexable(slice_t name) {
+  for (int i = 0; unindexed_names[i] != NULL; i++) {
+    if (strlen(unindexed_names[i]) == name.len && memcmp(unindexed_names[i], name.ptr, name.len) == 0) {
+      return 0;
+    }
+  }
+  return 1;
+}
+
+/**
+ * @brief Encodes one header field
+ *
+ * Fields found in a table are sent as an index. Others are added to the
+ * table unless their value changes with every response.
+ *
+ * @param table Encoding table, updated by the field
+ * @param name Lowercase field name
+ * @param name_len Length of the name
+ * @param value Field value
+ * @param value_len Length of the value
+ * @param out Buffer to encode into
+ * @param out_len Space left in out
+ * @return size_t Bytes written or 0 if the field does not fit
+ */
+size_t hpack_encode(hpack_table_t* table, const char* name, size_t name_len, const char* value, size_t value_len,
+                    uint8_t* out, size_t out_len) {
+  slice_t name_slice = { name, name_len };
+  slice_t value_slice = { value, value_len };
+  size_t len = 0;
+
+  // a lowered limit is announced first
+  if (table->update_pending) {
+    len = encode_integer(out, out_len, 5, 0x20, table->max_size);
+    if (len == 0) {
+      return 0;
+    }
+  }
+
+  int exact;
+  size_t index = find_entry(table, name_slice, value_slice, &exact);
+  if (exact) {
+    size_t field_len = encode_integer(out + len, out_len - len, 7, 0x80, index);
+    if (field_len == 0) {
+      return 0;
+    }
+    table->update_pending = 0;
+    return len + field_len;
+  }
+
+  // literal with an indexed or literal name, then the value
+  int indexing = is_indexable(name_slice) && name_len + value_len + HPACK_ENTRY_OVERHEAD <= table->max_size / 2;
+  size_t field_len = encode_integer(out + len, out_len - len, indexing ? 6 : 4, indexing ? 0x40 : 0, index);
+  if (field_len == 0) {
+    return 0;
+  }
+  len += field_len;
+  if (index == 0) {
+    field_len = encode_string(out + len, out_len - len, name, name_len);
+    if (field_len == 0) {
+      return 0;
+    }
+    len += field_len;
+  }
+  field_len = encode_string(out + len, out_len - len, value, value_len);
+  if (field_len == 0) {
+    return 0;
+  }
+  len += field_len;
+
+  table->update_pending = 0;
+  if (indexing) {
+    insert_entry(table, name_slice, value_slice);
+  }
+  return len;
+}
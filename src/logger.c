@@ -1,31 +1,633 @@
+#include <time.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <pthread.h>
+
 #include "logger.h"
 
+/** Size of the writer's output batch */
+#define LOG_BATCH_LEN 65536
+/** Longest formatted line */
+#define LOG_LINE_LEN 1024
+
 /**
- * @brief Logs a formatted message
+ * @brief Single producer, single consumer ring of records
  *
- * @param level Logging level
+ * The owning thread is the only producer and the writer thread the only
+ * consumer, so head and tail need no locks, only ordered loads and stores.
+ */
+typedef struct log_ring {
+  log_record_t records[LOG_RING_SIZE]; /**< Records                   */
+  uint64_t head __attribute__((aligned(64))); /**< Next slot to fill  */
+  uint64_t dropped;                    /**< Records lost, full ring    */
+  uint64_t tail __attribute__((aligned(64))); /**< Next slot to read  */
+  int closed;                          /**< Owner thread exited        */
+  struct log_ring* next;               /**< Next registered ring       */
+} log_ring_t;
+
+/**
+ * @brief Conversion specification parsed from a format string
+ */
+typedef struct {
+  const char* start;                   /**< The '%'                    */
+  const char* end;                     /**< Past the conversion char   */
+  char conversion;                     /**< Conversion char            */
+  char length;                         /**< 0, 'l', 'L' (ll), 'z', 'j', 't' */
+  int stars;                           /**< '*' width and precision    */
+  int precision;                       /**< Literal precision, -1 if none */
+  int star_precision;                  /**< 1 if the last star is the precision */
+} log_spec_t;
+
+static const char* prefixes[] = {"ERROR", "INFO", "DEBUG"};
+
+static int log_level = LOG_DEBUG;
+static int log_fd = 1;
+static int logger_running = 0;
+static pthread_t writer_thread;
+static pthread_mutex_t rings_lock = PTHREAD_MUTEX_INITIALIZER;
+static log_ring_t* rings = NULL;
+static pthread_key_t ring_key;
+static pthread_once_t ring_key_once = PTHREAD_ONCE_INIT;
+static __thread log_ring_t* thread_ring = NULL;
+static uint64_t retired_dropped = 0;
+
+/**
+ * @brief Finds the next conversion in a format string
+ *
+ * @param format Format string position
+ * @param spec Filled with the conversion
+ * @return int 1 if a conversion was found, 0 at the end of the string
+ */
+static int next_spec(const char* format, log_spec_t* spec) {
+  const char* p = strchr(format, '%');
+  if (p == NULL) {
+    return 0;
+  }
+
+  spec->start = p++;
+  spec->stars = 0;
+  spec->length = 0;
+  spec->precision = -1;
+  spec->star_precision = 0;
+
+  // flags, width and precision
+  while (*p != '\0' && strchr("-+ #0123456789.*'", *p) != NULL) {
+    if (*p == '*') {
+      spec->stars++;
+      spec->star_precision = spec->precision != -1;
+    } else if (*p == '.') {
+      spec->precision = 0;
+    } else if (spec->precision != -1 && *p >= '0' && *p <= '9' && spec->precision < LOG_STRING_LEN) {
+      spec->precision = spec->precision * 10 + (*p - '0');
+    }
+    p++;
+  }
+
+  // length modifier, char and short promote to int
+  while (*p != '\0' && strchr("hlLzjtq", *p) != NULL) {
+    if (*p == 'l') {
+      spec->length = spec->length == 'l' ? 'L' : 'l';
+    } else if (*p == 'z' || *p == 'j' || *p == 't') {
+      spec->length = *p;
+    } else if (*p == 'q' || *p == 'L') {
+      spec->length = 'L';
+    }
+    p++;
+  }
+
+  spec->conversion = *p;
+  spec->end = *p != '\0' ? p + 1 : p;
+  return 1;
+}
+
+/**
+ * @brief Copies a string argument into a record
+ *
+ * Like printf, no more than the precision is read, so a string that is
+ * not NUL-terminated can be logged with %.*s.
+ *
+ * @param record Record being filled
+ * @param str String argument
+ * @param precision Most bytes to read, -1 for the whole string
+ * @return uint64_t Offset of the copy in the record strings
+ */
+static uint64_t capture_string(log_record_t* record, const char* str, int64_t precision) {
+  if (str == NULL) {
+    str = "(null)";
+  }
+
+  // keep one byte for the terminator, an empty string if full
+  size_t available = LOG_STRING_LEN - record->strings_len;
+  if (available == 0) {
+    return LOG_STRING_LEN - 1;
+  }
+
+  size_t limit = available - 1;
+  if (precision >= 0 && (uint64_t)precision < limit) {
+    limit = (size_t)precision;
+  }
+  size_t len = strnlen(str, limit);
+  uint64_t offset = record->strings_len;
+  memcpy(record->strings + offset, str, len);
+  record->strings[offset + len] = '\0';
+  record->strings_len = (uint16_t)(offset + len + 1);
+  return offset;
+}
+
+/**
+ * @brief Captures the arguments a format string consumes
+ *
+ * @param record Record to fill
  * @param format Format string
- * @param ... Variable arguments to format
+ * @param vargs Arguments
+ */
+static void capture_args(log_record_t* record, const char* format, va_list vargs) {
+  log_spec_t spec;
+  record->arg_count = 0;
+  record->strings_len = 0;
+  record->strings[LOG_STRING_LEN - 1] = '\0';
+
+  while (next_spec(format, &spec)) {
+    format = spec.end;
+    if (spec.conversion == '%') {
+      continue;
+    }
+
+    // stop when the record is out of argument slots
+    if (record->arg_count + spec.stars + 1 > LOG_MAX_ARGS) {
+      return;
+    }
+
+    for (int i = 0; i < spec.stars; i++) {
+      record->args[record->arg_count++].i = va_arg(vargs, int);
+    }
+
+    log_arg_t* arg = &record->args[record->arg_count++];
+    switch (spec.conversion) {
+      case 's':
+        // a negative star precision counts as none
+        arg->u = capture_string(record, va_arg(vargs, const char*),
+                                spec.star_precision ? arg[-1].i : spec.precision);
+        break;
+      case 'p':
+        arg->p = va_arg(vargs, const void*);
+        break;
+      case 'f': case 'F': case 'e': case 'E': case 'g': case 'G': case 'a': case 'A':
+        arg->d = va_arg(vargs, double);
+        break;
+      default:
+        // integers, read with the width the caller passed
+        switch (spec.length) {
+          case 'l': arg->i = va_arg(vargs, long); break;
+          case 'L': arg->i = va_arg(vargs, long long); break;
+          case 'z': arg->i = (int64_t)va_arg(vargs, size_t); break;
+          case 'j': arg->i = va_arg(vargs, intmax_t); break;
+          case 't': arg->i = va_arg(vargs, ptrdiff_t); break;
+          default: arg->i = va_arg(vargs, int); break;
+        }
+        break;
+    }
+  }
+}
+
+/**
+ * @brief Formats one conversion with a captured argument
+ *
+ * @param out Output buffer
+ * @param out_len Size of the output buffer
+ * @param spec Conversion to format
+ * @param args First argument of the conversion, stars included
+ * @param record Record holding string arguments
+ * @return int Bytes snprintf wanted to write
+ */
+static int render_spec(char* out, size_t out_len, const log_spec_t* spec, const log_arg_t* args,
+                       const log_record_t* record) {
+  char fmt[32];
+  size_t fmt_len = (size_t)(spec->end - spec->start);
+  if (fmt_len >= sizeof(fmt)) {
+    return snprintf(out, out_len, "%.*s", (int)fmt_len, spec->start);
+  }
+  memcpy(fmt, spec->start, fmt_len);
+  fmt[fmt_len] = '\0';
+
+  // the value follows any star arguments
+  int w = spec->stars > 0 ? (int)args[0].i : 0;
+  int p = spec->stars > 1 ? (int)args[1].i : 0;
+  const log_arg_t* value = &args[spec->stars];
+
+#define RENDER(v)                                                              \
+  (spec->stars == 0 ? snprintf(out, out_len, fmt, v)                           \
+   : spec->stars == 1 ? snprintf(out, out_len, fmt, w, v)                      \
+   : snprintf(out, out_len, fmt, w, p, v))
+
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wformat-nonliteral"
+#pragma GCC diagnostic ignored "-Wformat"
+  switch (spec->conversion) {
+    case 's':
+      return RENDER(record->strings + value->u);
+    case 'p':
+      return RENDER(value->p);
+    case 'f': case 'F': case 'e': case 'E': case 'g': case 'G': case 'a': case 'A':
+      return RENDER(value->d);
+    default:
+      switch (spec->length) {
+        case 'l': return RENDER((long)value->i);
+        case 'L': return RENDER((long long)value->i);
+        case 'z': return RENDER((size_t)value->i);
+        case 'j': return RENDER((intmax_t)value->i);
+        case 't': return RENDER((ptrdiff_t)value->i);
+        default: return RENDER((int)value->i);
+      }
+  }
+#pragma GCC diagnostic pop
+#undef RENDER
+}
+
+/**
+ * @brief Writes the timestamp and level prefix of a line
+ *
+ * @param out Output buffer
+ * @param out_len Size of the output buffer
+ * @param level Logging level
+ * @param timestamp Wall clock, ns
+ * @return size_t Bytes written
+ */
+static size_t render_prefix(char* out, size_t out_len, log_level_t level, int64_t timestamp) {
+  time_t seconds = (time_t)(timestamp / 1000000000);
+  struct tm utc;
+  gmtime_r(&seconds, &utc);
+
+  size_t len = strftime(out, out_len, "%Y-%m-%dT%H:%M:%S", &utc);
+  int written = snprintf(out + len, out_len - len, ".%03dZ [%s] ", (int)(timestamp / 1000000 % 1000),
+                         prefixes[level]);
+  return len + (written > 0 ? (size_t)written : 0);
+}
+
+/**
+ * @brief Formats a record into a line
+ *
+ * @param record Record to format
+ * @param out Output buffer
+ * @param out_len Size of the output buffer
+ * @return size_t Length of the line
+ */
+static size_t render_record(const log_record_t* record, char* out, size_t out_len) {
+  size_t len = render_prefix(out, out_len, (log_level_t)record->level, record->timestamp);
+  const char* format = record->format;
+  int arg = 0;
+  log_spec_t spec;
+
+  while (len < out_len - 1 && next_spec(format, &spec)) {
+    // literal text before the conversion
+    size_t literal = (size_t)(spec.start - format);
+    if (literal > out_len - 1 - len) {
+      literal = out_len - 1 - len;
+    }
+    memcpy(out + len, format, literal);
+    len += literal;
+    format = spec.end;
+
+    // conversions past the captured arguments are printed as is
+    int written;
+    if (spec.conversion == '%') {
+      written = snprintf(out + len, out_len - len, "%%");
+    } else if (arg + spec.stars + 1 > record->arg_count) {
+      written = snprintf(out + len, out_len - len, "%.*s", (int)(spec.end - spec.start), spec.start);
+    } else {
+      written = render_spec(out + len, out_len - len, &spec, &record->args[arg], record);
+      arg += spec.stars + 1;
+    }
+
+    if (written > 0) {
+      len += (size_t)written < out_len - len ? (size_t)written : out_len - 1 - len;
+    }
+  }
+
+  // trailing literal text
+  if (len < out_len - 1) {
+    int written = snprintf(out + len, out_len - len, "%s", format);
+    if (written > 0) {
+      len += (size_t)written < out_len - len ? (size_t)written : out_len - 1 - len;
+    }
+  }
+
+  return len;
+}
+
+/**
+ * @brief Gets the wall clock time
+ *
+ * @return int64_t Nanoseconds since the epoch
+ */
+static int64_t now_ns(void) {
+  struct timespec now;
+  clock_gettime(CLOCK_REALTIME, &now);
+  return (int64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+/**
+ * @brief Writes a whole buffer, retrying partial writes
+ *
+ * @param buff Bytes to write
+ * @param len Number of bytes
+ */
+static void write_all(const char* buff, size_t len) {
+  while (len > 0) {
+    ssize_t written = write(log_fd, buff, len);
+    if (written == -1) {
+      if (errno == EINTR) {
+        continue;
+      }
+      return;
+    }
+    buff += written;
+    len -= (size_t)written;
+  }
+}
+
+/**
+ * @brief Marks the ring of an exiting thread for the writer to free
+ *
+ * @param argp log_ring_t struct
+ */
+static void close_ring(void* argp) {
+  log_ring_t* ring = (log_ring_t*)argp;
+
+  // a message logged later in the thread's exit must not reach the freed ring
+  thread_ring = NULL;
+  __atomic_store_n(&ring->closed, 1, __ATOMIC_RELEASE);
+}
+
+/**
+ * @brief Creates the thread exit hook for rings
  */
-void log_message(log_level_t level, const char* format, ...) {
-  // initialize log message
-  const char* prefixes[] = {"INFO", "ERROR", "DEBUG"};
-  char log_message[16];
-  snprintf(log_message, sizeof(log_message), "[%s] ", prefixes[level]);
+static void create_ring_key(void) {
+  pthread_key_create(&ring_key, close_ring);
+}
+
+/**
+ * @brief Gets the ring of the calling thread, creating it on first use
+ *
+ * @return log_ring_t* Ring or NULL if error
+ */
+static log_ring_t* get_ring(void) {
+  if (thread_ring != NULL) {
+    return thread_ring;
+  }
+
+  log_ring_t* ring = aligned_alloc(64, sizeof(log_ring_t));
+  if (ring == NULL) {
+    return NULL;
+  }
+  ring->head = 0;
+  ring->tail = 0;
+  ring->dropped = 0;
+  ring->closed = 0;
+
+  // register with the writer
+  pthread_once(&ring_key_once, create_ring_key);
+  pthread_setspecific(ring_key, ring);
+  pthread_mutex_lock(&rings_lock);
+  ring->next = rings;
+  rings = ring;
+  pthread_mutex_unlock(&rings_lock);
 
-  // initialize format message and variadic arguments
-  char formatted_message[512 - strlen(log_message)];
+  thread_ring = ring;
+  return ring;
+}
+
+/**
+ * @brief Records a formatted message, see log_message
+ *
+ * Before start_logger and after stop_logger the message is written
+ * synchronously.
+ *
+ * @param level Logging level
+ * @param format Format string literal
+ * @param ... Variable arguments to format
+ */
+void log_write(log_level_t level, const char* format, ...) {
   va_list vargs;
 
-  // format the message with variable arguments
+  // runtime filter
+  if ((int)level > __atomic_load_n(&log_level, __ATOMIC_RELAXED)) {
+    return;
+  }
+
+  // no writer, format in place
+  if (!__atomic_load_n(&logger_running, __ATOMIC_ACQUIRE)) {
+    char line[LOG_LINE_LEN];
+    size_t len = render_prefix(line, sizeof(line), level, now_ns());
+
+    va_start(vargs, format);
+    int written = vsnprintf(line + len, sizeof(line) - len, format, vargs);
+    va_end(vargs);
+
+    if (written > 0) {
+      len += (size_t)written < sizeof(line) - len ? (size_t)written : sizeof(line) - 1 - len;
+    }
+    write_all(line, len);
+    return;
+  }
+
+  log_ring_t* ring = get_ring();
+  if (ring == NULL) {
+    __atomic_add_fetch(&retired_dropped, 1, __ATOMIC_RELAXED);
+    return;
+  }
+
+  // drop rather than wait when the writer is behind
+  uint64_t head = ring->head;
+  if (head - __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE) == LOG_RING_SIZE) {
+    __atomic_store_n(&ring->dropped, ring->dropped + 1, __ATOMIC_RELAXED);
+    return;
+  }
+
+  // fill the record, then publish it
+  log_record_t* record = &ring->records[head & (LOG_RING_SIZE - 1)];
+  record->format = format;
+  record->timestamp = now_ns();
+  record->level = (uint8_t)level;
   va_start(vargs, format);
-  vsnprintf(formatted_message, sizeof(formatted_message), format, vargs);
+  capture_args(record, format, vargs);
   va_end(vargs);
 
-  // format final message with prefix
-  char output_message[512];
-  snprintf(output_message, sizeof(output_message), "%s%s", log_message, formatted_message);
+  __atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+}
+
+/**
+ * @brief Formats every published record and frees rings of exited threads
+ *
+ * @param batch Output batch
+ * @param batch_len Bytes already in the batch, updated
+ * @return size_t Number of records drained
+ */
+static size_t drain_rings(char* batch, size_t* batch_len) {
+  size_t drained = 0;
+
+  pthread_mutex_lock(&rings_lock);
+  log_ring_t** link = &rings;
+  while (*link != NULL) {
+    log_ring_t* ring = *link;
+    int closed = __atomic_load_n(&ring->closed, __ATOMIC_ACQUIRE);
+    uint64_t head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+
+    for (uint64_t tail = ring->tail; tail != head; tail++) {
+      // flush before the batch could overflow
+      if (LOG_BATCH_LEN - *batch_len < LOG_LINE_LEN) {
+        write_all(batch, *batch_len);
+        *batch_len = 0;
+      }
+
+      *batch_len += render_record(&ring->records[tail & (LOG_RING_SIZE - 1)], batch + *batch_len, LOG_LINE_LEN);
+      __atomic_store_n(&ring->tail, tail + 1, __ATOMIC_RELEASE);
+      drained++;
+    }
+
+    // the owner is gone and everything it logged is out
+    if (closed) {
+      __atomic_add_fetch(&retired_dropped, __atomic_load_n(&ring->dropped, __ATOMIC_RELAXED), __ATOMIC_RELAXED);
+      *link = ring->next;
+      free(ring);
+      continue;
+    }
+
+    link = &ring->next;
+  }
+  pthread_mutex_unlock(&rings_lock);
+
+  return drained;
+}
+
+/**
+ * @brief Reports records dropped since the last report
+ *
+ * @param batch Output batch
+ * @param batch_len Bytes already in the batch, updated
+ * @param reported Dropped count already reported, updated
+ */
+static void report_dropped(char* batch, size_t* batch_len, uint64_t* reported) {
+  uint64_t dropped = log_dropped_count();
+  if (dropped == *reported) {
+    return;
+  }
+
+  if (LOG_BATCH_LEN - *batch_len < LOG_LINE_LEN) {
+    write_all(batch, *batch_len);
+    *batch_len = 0;
+  }
+
+  size_t len = render_prefix(batch + *batch_len, LOG_LINE_LEN, LOG_ERROR, now_ns());
+  int written = snprintf(batch + *batch_len + len, LOG_LINE_LEN - len, "Dropped %llu log records\n",
+                         (unsigned long long)(dropped - *reported));
+  *batch_len += len + (written > 0 ? (size_t)written : 0);
+  *reported = dropped;
+}
+
+/**
+ * @brief Formats and writes records in batches until stopped
+ *
+ * @param argp Unused
+ * @return void* NULL
+ */
+static void* run_writer(void* argp) {
+  (void)argp;
+  static char batch[LOG_BATCH_LEN];
+  size_t batch_len = 0;
+  uint64_t reported = 0;
+
+  while (1) {
+    int running = __atomic_load_n(&logger_running, __ATOMIC_ACQUIRE);
+    size_t drained = drain_rings(batch, &batch_len);
+    report_dropped(batch, &batch_len, &reported);
+
+    // one write per pass
+    if (batch_len > 0) {
+      write_all(batch, batch_len);
+      batch_len = 0;
+    }
+
+    if (!running) {
+      break;
+    }
+
+    // idle, let records accumulate
+    if (drained == 0) {
+      struct timespec pause = {0, LOG_FLUSH_INTERVAL_MS * 1000000L};
+      nanosleep(&pause, NULL);
+    }
+  }
+
+  return NULL;
+}
+
+/**
+ * @brief Sets the most verbose level that is recorded
+ *
+ * @param level Logging level
+ */
+void set_log_level(log_level_t level) {
+  __atomic_store_n(&log_level, (int)level, __ATOMIC_RELAXED);
+}
+
+/**
+ * @brief Starts the background writer
+ *
+ * @param path File to append to, or NULL for stdout
+ * @param result Result of the operation
+ */
+void start_logger(const char* path, logger_result_t* result) {
+  // initialize result
+  *result = LOGGER_SUCCESS;
+
+  // open output
+  if (path != NULL) {
+    int fd = open(path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+    if (fd == -1) {
+      *result = LOGGER_ERR_OPEN;
+      return;
+    }
+    log_fd = fd;
+  }
+
+  // start writer
+  __atomic_store_n(&logger_running, 1, __ATOMIC_RELEASE);
+  if (pthread_create(&writer_thread, NULL, run_writer, NULL) != 0) {
+    __atomic_store_n(&logger_running, 0, __ATOMIC_RELEASE);
+    *result = LOGGER_ERR_THREAD;
+  }
+}
+
+/**
+ * @brief Flushes every ring and stops the background writer
+ */
+void stop_logger(void) {
+  if (!__atomic_load_n(&logger_running, __ATOMIC_ACQUIRE)) {
+    return;
+  }
+
+  // the writer drains once more before exiting
+  __atomic_store_n(&logger_running, 0, __ATOMIC_RELEASE);
+  pthread_join(writer_thread, NULL);
+}
+
+/**
+ * @brief Gets the number of records dropped because a ring was full
+ *
+ * @return uint64_t Dropped records
+ */
+uint64_t log_dropped_count(void) {
+  uint64_t dropped = __atomic_load_n(&retired_dropped, __ATOMIC_RELAXED);
+
+  pthread_mutex_lock(&rings_lock);
+  for (log_ring_t* ring = rings; ring != NULL; ring = ring->next) {
+    dropped += __atomic_load_n(&ring->dropped, __ATOMIC_RELAXED);
+  }
+  pthread_mutex_unlock(&rings_lock);
 
-  // write to stdout
-  write(1, output_message, strlen(output_message));
-}
\ No newline at end of file
+  return dropped;
+}
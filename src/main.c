@@ -1,5 +1,133 @@
+#include <signal.h>
+#include <poll.h>
+#include <time.h>
+
 #include "logger.h"
+#include "config.h"
 #include "server.h"
+#include "worker.h"
+#include "metrics.h"
+#include "docroot.h"
+#include "status.h"
+#include "trace.h"
+#include "upgrade.h"
+
+/**
+ * @brief Gets the monotonic time
+ *
+ * @return int64_t Milliseconds since an arbitrary point
+ */
+static int64_t now_ms(void) {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (int64_t)now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+/**
+ * @brief Accepts clients and spawns a thread for each of them
+ *
+ * @param server server_t struct
+ * @param argv Arguments the process was started with
+ * @return int 0 if drained, -1 if error or connection threads outlived the drain
+ */
+static int run_threads(server_t* server, char* argv[]) {
+  // another process may accept from the same socket, never block in accept
+  if (set_server_nonblocking(server) == -1) {
+    return -1;
+  }
+
+  upgrade_result_t upgrade_result;
+  start_upgrade(server, argv, &upgrade_result);
+  if (upgrade_result != UPGRADE_SUCCESS) {
+    log_message(LOG_ERROR, "Could not handle upgrade signals!\n");
+  }
+
+  // accept connections until told to drain
+  struct pollfd fds[2] = { { server->socket, POLLIN, 0 }, { server->wake_fd, POLLIN, 0 } };
+  while (!__atomic_load_n(&server->draining, __ATOMIC_ACQUIRE)) {
+    // when full, leave new connections in the backlog until threads exit
+    if (server->config->overflow == OVERFLOW_QUEUE && admission_full(server->admission)) {
+      poll(&fds[1], 1, WORKER_PAUSE_CHECK_MS);
+      continue;
+    }
+
+    if (poll(fds, 2, -1) == -1 || !(fds[0].revents & POLLIN)) {
+      continue;
+    }
+
+    // accept client, its thread waits on the socket with a deadline
+    server_result_t result;
+    client_t* client = accept_client(server, server->socket, SOCK_NONBLOCK | SOCK_CLOEXEC, &result);
+    if (client == NULL) {
+      continue;
+    }
+
+    // handle client
+    if (handle_client(server, client) == -1) {
+      close_client(client);
+    }
+  }
+
+  // let connection threads finish, idle ones end at their deadline
+  while (__atomic_load_n(&server->active_threads, __ATOMIC_ACQUIRE) > 0 && now_ms() < server->drain_deadline) {
+    struct timespec pause = { 0, 10 * 1000 * 1000 };
+    nanosleep(&pause, NULL);
+  }
+  stop_upgrade();
+
+  int active = __atomic_load_n(&server->active_threads, __ATOMIC_ACQUIRE);
+  if (active > 0) {
+    log_message(LOG_ERROR, "Exiting with %d connections still open\n", active);
+    return -1;
+  }
+  return 0;
+}
+
+/**
+ * @brief Serves clients from a pool of epoll or io_uring workers
+ *
+ * @param server server_t struct
+ * @param config config_t struct
+ * @param argv Arguments the process was started with
+ * @return int 0 if successful, -1 if error
+ */
+static int run_epoll(server_t* server, config_t* config, char* argv[]) {
+  // accept from every worker without blocking
+  if (set_server_nonblocking(server) == -1) {
+    return -1;
+  }
+
+  // OpenSSL reads and writes the sockets itself, which a ring cannot share
+  if (config->mode == SERVER_MODE_URING && server->tls != NULL) {
+    log_message(LOG_ERROR, "TLS is served by epoll workers, not io_uring\n");
+    config->mode = SERVER_MODE_EPOLL;
+  }
+
+  // create workers
+  worker_result_t result;
+  worker_pool_t* pool = create_worker_pool(server, config->workers, &result);
+  if (result != WORKER_SUCCESS) {
+    log_message(LOG_ERROR, "Could not create worker pool!\n");
+    return -1;
+  }
+
+  // every listener is open, upgrades can hand them on
+  upgrade_result_t upgrade_result;
+  start_upgrade(server, argv, &upgrade_result);
+  if (upgrade_result != UPGRADE_SUCCESS) {
+    log_message(LOG_ERROR, "Could not handle upgrade signals!\n");
+  }
+
+  // run workers until they exit
+  log_message(LOG_INFO, "Running %d %s workers%s\n", config->workers,
+              config->mode == SERVER_MODE_URING ? "io_uring" : "epoll",
+              config->reuseport ? " with per-worker listeners" : "");
+  run_worker_pool(pool, &result);
+  stop_upgrade();
+  close_worker_pool(pool);
+
+  return result == WORKER_SUCCESS ? 0 : -1;
+}
 
 /**
  * @brief Main function
@@ -9,34 +137,51 @@
  * @return int 0 if successful, -1 if error
  */
 int main(int argc, char *argv[]) {
-  char host[INET_ADDRSTRLEN];
-  int port;
+  config_t config;
+  config_result_t config_result;
   server_t* server;
   server_result_t server_result;
   server_cleanup_t server_cleanup;
 
-  // print usage if arguments are not enough
-  if (argc < 3) {
-    log_message(LOG_ERROR, "Usage: %s <host> <port>\n", argv[0]);
-    return -1;
+  // parse arguments
+  parse_config(argc, argv, &config, &config_result);
+  switch (config_result) {
+    case CONFIG_SUCCESS:
+      break;
+    case CONFIG_ERR_INVALID_HOST:
+      log_message(LOG_ERROR, "Host is too long!\n");
+      return -1;
+    case CONFIG_ERR_INVALID_PORT:
+      log_message(LOG_ERROR, "Invalid port number!\n");
+      return -1;
+    case CONFIG_ERR_INVALID_MODE:
+      log_message(LOG_ERROR, "Invalid server mode!\n");
+      return -1;
+    default:
+      log_usage(argv[0]);
+      return -1;
   }
 
-  // get host
-  if (strlen(argv[1]) >= INET_ADDRSTRLEN) {
-    log_message(LOG_ERROR, "Host is too long!\n");
+  // start logging in the background
+  logger_result_t logger_result;
+  set_log_level(config.log_level);
+  start_logger(config.log_path, &logger_result);
+  if (logger_result != LOGGER_SUCCESS) {
+    log_message(LOG_ERROR, "Could not start logger!\n");
     return -1;
   }
-  strncpy(host, argv[1], INET_ADDRSTRLEN);
 
-  // get port
-  port = atoi(argv[2]);
-  if (port <= 0 || port > 65535) {
-    log_message(LOG_ERROR, "Invalid port number!\n");
+  // every response carries the Date line the clock keeps current
+  status_result_t status_result;
+  start_clock(&status_result);
+  if (status_result != STATUS_SUCCESS) {
+    log_message(LOG_ERROR, "Could not start clock!\n");
+    stop_logger();
     return -1;
   }
 
   // create server
-  server = create_server(host, port, &server_result, &server_cleanup);
+  server = create_server(config.host, config.port, config.reuseport, &server_result, &server_cleanup);
   if (server_result != SERVER_SUCCESS) {
     log_message(LOG_ERROR, "Could not create server!\n");
 
@@ -48,30 +193,193 @@ int main(int argc, char *argv[]) {
       free(server);
     }
 
+    stop_clock();
+    stop_logger();
     return -1;
   }
 
+  server->config = &config;
+
+  // count connections against the global and per-address limits
+  admission_result_t admission_result;
+  server->admission = create_admission(config.max_connections, config.max_per_host, &admission_result);
+  if (admission_result != ADMISSION_SUCCESS) {
+    log_message(LOG_ERROR, "Could not create admission control!\n");
+    close_server(server);
+    stop_clock();
+    stop_logger();
+    return -1;
+  }
+
+  // forward proxied prefixes to their backends
+  if (config.route_count > 0) {
+    upstream_result_t upstream_result;
+    server->upstream = create_upstream(config.routes, config.route_count, &upstream_result);
+    if (upstream_result != UPSTREAM_SUCCESS) {
+      log_message(LOG_ERROR, "Could not create upstream routes!\n");
+      close_server(server);
+      stop_clock();
+      stop_logger();
+      return -1;
+    }
+  }
+
+  // keep what the backends allow to be reused
+  if (config.route_count > 0 && config.response_cache_mb > 0) {
+    response_cache_result_t response_cache_result;
+    server->response_cache = create_response_cache((size_t)config.response_cache_mb * 1024 * 1024, config.cache_dir,
+                                                   &response_cache_result);
+    if (response_cache_result != RESPONSE_CACHE_SUCCESS) {
+      log_message(LOG_ERROR, "Could not create response cache%s%s!\n", config.cache_dir != NULL ? " in " : "",
+                  config.cache_dir != NULL ? config.cache_dir : "");
+      close_server(server);
+      stop_clock();
+      stop_logger();
+      return -1;
+    }
+  }
+
+  // terminate TLS, h2 only while no route is configured, streams are not proxied
+  if (config.tls_cert != NULL) {
+    tls_result_t tls_result;
+    server->tls = create_tls(config.tls_cert, config.tls_key, config.route_count == 0, &tls_result);
+    if (tls_result != TLS_SUCCESS) {
+      if (tls_result == TLS_ERR_CERT) {
+        log_message(LOG_ERROR, "Could not load TLS certificate %s!\n", config.tls_cert);
+      } else if (tls_result == TLS_ERR_KEY) {
+        log_message(LOG_ERROR, "Could not load TLS key %s!\n", config.tls_key != NULL ? config.tls_key : config.tls_cert);
+      } else {
+        log_message(LOG_ERROR, "Could not create TLS context!\n");
+      }
+      close_server(server);
+      stop_clock();
+      stop_logger();
+      return -1;
+    }
+  }
+
+  // open access log
+  if (config.access_log_path != NULL) {
+    access_log_result_t access_log_result;
+    server->access_log = create_access_log(config.access_log_path, config.access_log_format,
+                                           (uint64_t)config.rotate_mb * 1024 * 1024, config.rotate_secs,
+                                           &access_log_result);
+    if (access_log_result != ACCESS_LOG_SUCCESS) {
+      log_message(LOG_ERROR, "Could not open access log %s!\n", config.access_log_path);
+      close_server(server);
+      stop_clock();
+      stop_logger();
+      return -1;
+    }
+  }
+
+  // create file cache
+  if (config.cache_mb > 0) {
+    file_cache_result_t cache_result;
+    server->cache = create_file_cache((size_t)config.cache_mb * 1024 * 1024, (size_t)config.compress_min, &cache_result);
+    if (cache_result != FILE_CACHE_SUCCESS) {
+      log_message(LOG_ERROR, "Could not create file cache!\n");
+      if (server->access_log != NULL) {
+        close_access_log(server->access_log);
+      }
+      close_server(server);
+      stop_clock();
+      stop_logger();
+      return -1;
+    }
+
+    // the previous process still serves while the cache fills
+    if (server->inherited > 0) {
+      size_t warmed = warm_file_cache(server->cache);
+      log_message(LOG_INFO, "Warmed file cache: %zu files\n", warmed);
+    }
+  }
+
+  // index the document root once, SIGHUP reindexes it
+  if (config.immutable) {
+    docroot_result_t docroot_result;
+    start_docroot(".", (size_t)config.compress_min, &docroot_result);
+    if (docroot_result != DOCROOT_SUCCESS) {
+      log_message(LOG_ERROR, "Could not index document root!\n");
+      stop_docroot();
+      if (server->cache != NULL) {
+        close_file_cache(server->cache);
+      }
+      if (server->access_log != NULL) {
+        close_access_log(server->access_log);
+      }
+      close_server(server);
+      stop_clock();
+      stop_logger();
+      return -1;
+    }
+  }
+
+  // writev() and sendfile() to a closed peer must fail, not kill us
+  signal(SIGPIPE, SIG_IGN);
+
   // listen for connections
   if (listen_server(server) == -1) {
-    close_server(server);
+    stop_clock();
+    stop_logger();
     return -1;
   }
 
-  log_message(LOG_INFO, "Listening on %s:%d\n", host, port);
+  log_message(LOG_INFO, "Listening on %s:%d%s\n", config.host, config.port, server->tls != NULL ? " with TLS" : "");
 
-  // accept connections
-  while (1) {
-    // accept client
-    client_t* client = accept_client(server);
-    if (client == NULL) {
-      continue;
+#ifdef HYPER_TRACE
+  // dump sampled traces on SIGUSR1
+  trace_result_t trace_result;
+  start_trace(&trace_result);
+  if (trace_result != TRACE_SUCCESS) {
+    log_message(LOG_ERROR, "Could not start tracing!\n");
+  } else {
+    log_message(LOG_INFO, "Tracing 1 in %d requests, SIGUSR1 writes them to %s\n", TRACE_SAMPLE_RATE, TRACE_DIR);
+  }
+#endif
+
+  // serve metrics on their own port
+  if (config.metrics_port > 0) {
+    metrics_result_t metrics_result;
+    start_metrics(config.host, config.metrics_port, &metrics_result);
+    if (metrics_result != METRICS_SUCCESS) {
+      log_message(LOG_ERROR, "Could not serve metrics on port %d!\n", config.metrics_port);
+    } else {
+      log_message(LOG_INFO, "Serving metrics on %s:%d\n", config.host, config.metrics_port);
     }
+  }
 
-    // handle client
-    handle_client(server, client);
+  // serve clients
+  int status = 0;
+  if (config.mode != SERVER_MODE_THREADS) {
+    status = run_epoll(server, &config, argv);
+  } else if (run_threads(server, argv) == -1) {
+    // connection threads still use the server, let exit reclaim it
+    stop_clock();
+    stop_logger();
+    return -1;
+  }
+  if (status == 0) {
+    log_message(LOG_INFO, "Drained, exiting\n");
   }
 
   // close server
+  if (server->cache != NULL) {
+    close_file_cache(server->cache);
+  }
+  if (server->access_log != NULL) {
+    close_access_log(server->access_log);
+  }
   close_server(server);
-  return 0;
-}
\ No newline at end of file
+  stop_metrics();
+  if (config.immutable) {
+    stop_docroot();
+  }
+#ifdef HYPER_TRACE
+  stop_trace();
+#endif
+  stop_clock();
+  log_pool_stats();
+  stop_logger();
+  return status;
+}
@@ -0,0 +1,513 @@
+#define _GNU_SOURCE
+
+#include <time.h>
+#include <stdio.h>
+#include <stdarg.h>
+#include <pthread.h>
+
+#include "net.h"
+#include "pool.h"
+#include "logger.h"
+#include "metrics.h"
+
+/**
+ * @brief Metrics of one thread
+ *
+ * Only the owning thread writes a shard, the scraper reads it while
+ * holding shards_lock. The shard is cache-line aligned and padded so two
+ * threads never write the same line.
+ */
+typedef struct metrics_shard {
+  uint64_t counters[METRIC_COUNTERS];  /**< Counters                    */
+  uint64_t request_results[METRICS_REQUEST_RESULTS]; /**< Parse failures by code */
+  uint64_t client_results[METRICS_CLIENT_RESULTS]; /**< Client failures by code */
+  uint64_t statuses[METRICS_STATUSES]; /**< Responses by status - 100   */
+  uint64_t buckets[METRIC_HISTOGRAMS][METRICS_BUCKETS + 1]; /**< Observations, last is +Inf */
+  uint64_t sums[METRIC_HISTOGRAMS];    /**< Sum of observations, ns     */
+  struct metrics_shard* prev;          /**< Previous registered shard   */
+  struct metrics_shard* next;          /**< Next registered shard       */
+} __attribute__((aligned(64))) metrics_shard_t;
+
+/** Names of request_result_t codes by negated value */
+static const char* request_result_names[METRICS_REQUEST_RESULTS] = {
+  "success", "incomplete", "invalid_method", "invalid_version", "invalid_file", "malformed", "too_many_headers",
+  "uri_too_long", "headers_too_large", "body_too_large", "not_implemented"
+};
+
+/** Names of client_result_t codes by negated value */
+static const char* client_result_names[METRICS_CLIENT_RESULTS] = {
+  "success", "malloc", "accept", "recv", "send", "again", "closed"
+};
+
+/** Prometheus names of the counters */
+static const char* counter_names[METRIC_COUNTERS] = {
+  "hyper_connections_opened_total", "hyper_connections_closed_total", "hyper_requests_total",
+  "hyper_received_bytes_total", "hyper_sent_bytes_total", "hyper_connections_rejected_total",
+  "hyper_connections_timed_out_total", "hyper_upstream_requests_total", "hyper_upstream_reused_total",
+  "hyper_upstream_failures_total", "hyper_response_cache_hits_total", "hyper_response_cache_stale_total",
+  "hyper_response_cache_misses_total", "hyper_response_cache_coalesced_total", "hyper_tls_handshakes_total",
+  "hyper_tls_resumed_total", "hyper_tls_ktls_total"
+};
+
+/** Prometheus names of the histograms */
+static const char* histogram_names[METRIC_HISTOGRAMS] = {
+  "hyper_parse_duration_seconds", "hyper_handle_duration_seconds", "hyper_response_duration_seconds"
+};
+
+static pthread_mutex_t shards_lock = PTHREAD_MUTEX_INITIALIZER;
+static metrics_shard_t* shards = NULL;
+static metrics_shard_t retired;
+static pthread_key_t shard_key;
+static pthread_once_t shard_key_once = PTHREAD_ONCE_INIT;
+static __thread metrics_shard_t* thread_shard = NULL;
+static int metrics_listener = -1;
+static int metrics_running = 0;
+static pthread_t metrics_thread;
+
+/**
+ * @brief Adds to a value only the calling thread writes
+ *
+ * A relaxed load and store compile to plain moves, no locked instruction,
+ * and keep the concurrent read of the scraper well defined.
+ *
+ * @param value Value in the shard of the calling thread
+ * @param n Amount to add
+ */
+static inline void bump(uint64_t* value, uint64_t n) {
+  __atomic_store_n(value, __atomic_load_n(value, __ATOMIC_RELAXED) + n, __ATOMIC_RELAXED);
+}
+
+/**
+ * @brief Adds every value of a shard to another
+ *
+ * @param total Shard to add to
+ * @param shard Shard to read
+ */
+static void add_shard(metrics_shard_t* total, metrics_shard_t* shard) {
+  uint64_t* to = (uint64_t*)total;
+  uint64_t* from = (uint64_t*)shard;
+  size_t values = offsetof(metrics_shard_t, prev) / sizeof(uint64_t);
+  for (size_t i = 0; i < values; i++) {
+    to[i] += __atomic_load_n(&from[i], __ATOMIC_RELAXED);
+  }
+}
+
+/**
+ * @brief Folds the shard of an exiting thread into the retired total
+ *
+ * @param argp metrics_shard_t struct
+ */
+static void retire_shard(void* argp) {
+  metrics_shard_t* shard = (metrics_shard_t*)argp;
+
+  pthread_mutex_lock(&shards_lock);
+  add_shard(&retired, shard);
+  if (shard->prev != NULL) {
+    shard->prev->next = shard->next;
+  } else {
+    shards = shard->next;
+  }
+  if (shard->next != NULL) {
+    shard->next->prev = shard->prev;
+  }
+  pthread_mutex_unlock(&shards_lock);
+
+  // a count later in the thread's exit must not reach the freed shard
+  thread_shard = NULL;
+  free(shard);
+}
+
+/**
+ * @brief Creates the thread exit hook for shards
+ */
+static void create_shard_key(void) {
+  pthread_key_create(&shard_key, retire_shard);
+}
+
+/**
+ * @brief Gets the shard of the calling thread, creating it on first use
+ *
+ * @return metrics_shard_t* Shard or NULL if error
+ */
+static metrics_shard_t* get_shard(void) {
+  if (thread_shard != NULL) {
+    return thread_shard;
+  }
+
+  metrics_shard_t* shard = aligned_alloc(64, sizeof(metrics_shard_t));
+  if (shard == NULL) {
+    return NULL;
+  }
+  memset(shard, 0, sizeof(metrics_shard_t));
+
+  // register with the scraper
+  pthread_once(&shard_key_once, create_shard_key);
+  pthread_setspecific(shard_key, shard);
+  pthread_mutex_lock(&shards_lock);
+  shard->next = shards;
+  if (shards != NULL) {
+    shards->prev = shard;
+  }
+  shards = shard;
+  pthread_mutex_unlock(&shards_lock);
+
+  thread_shard = shard;
+  return shard;
+}
+
+/**
+ * @brief Gets a monotonic timestamp for latency histograms
+ *
+ * @return uint64_t Nanoseconds
+ */
+uint64_t metrics_now(void) {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (uint64_t)now.tv_sec * 1000000000ULL + (uint64_t)now.tv_nsec;
+}
+
+/**
+ * @brief Adds to a counter of the calling thread
+ *
+ * @param counter Counter
+ * @param n Amount to add
+ */
+void metrics_count(metric_counter_t counter, uint64_t n) {
+  metrics_shard_t* shard = get_shard();
+  if (shard != NULL) {
+    bump(&shard->counters[counter], n);
+  }
+}
+
+/**
+ * @brief Counts a response by status code
+ *
+ * @param status HTTP status code
+ */
+void metrics_status(int status) {
+  metrics_shard_t* shard = get_shard();
+  if (shard != NULL && status >= 100 && status < 100 + METRICS_STATUSES) {
+    bump(&shard->statuses[status - 100], 1);
+  }
+}
+
+/**
+ * @brief Counts a request that failed to parse
+ *
+ * @param result Result of parse_request
+ */
+void metrics_request_result(request_result_t result) {
+  metrics_shard_t* shard = get_shard();
+  if (shard != NULL && -(int)result >= 0 && -(int)result < METRICS_REQUEST_RESULTS) {
+    bump(&shard->request_results[-(int)result], 1);
+  }
+}
+
+/**
+ * @brief Counts a failed client operation
+ *
+ * @param result Result of the client operation
+ */
+void metrics_client_result(client_result_t result) {
+  metrics_shard_t* shard = get_shard();
+  if (shard != NULL && -(int)result >= 0 && -(int)result < METRICS_CLIENT_RESULTS) {
+    bump(&shard->client_results[-(int)result], 1);
+  }
+}
+
+/**
+ * @brief Records a latency in a histogram of the calling thread
+ *
+ * @param histogram Histogram
+ * @param ns Latency in nanoseconds
+ */
+void metrics_observe(metric_histogram_t histogram, uint64_t ns) {
+  metrics_shard_t* shard = get_shard();
+  if (shard == NULL) {
+    return;
+  }
+
+  // smallest i with ns <= 2^(i + METRICS_BUCKET_SHIFT)
+  int bucket = 0;
+  if (ns > (1ULL << METRICS_BUCKET_SHIFT)) {
+    bucket = 64 - __builtin_clzll(ns - 1) - METRICS_BUCKET_SHIFT;
+    if (bucket > METRICS_BUCKETS) {
+      bucket = METRICS_BUCKETS;
+    }
+  }
+
+  bump(&shard->buckets[histogram][bucket], 1);
+  bump(&shard->sums[histogram], ns);
+}
+
+/**
+ * @brief Appends a formatted line to the scrape response
+ *
+ * @param out Buffer
+ * @param out_len Size of the buffer
+ * @param len Bytes used, only advanced if the whole line fits
+ * @param format Format string
+ * @param ... Variable arguments to format
+ */
+static void append_line(char* out, size_t out_len, size_t* len, const char* format, ...) {
+  va_list vargs;
+  va_start(vargs, format);
+  int written = vsnprintf(out + *len, out_len - *len, format, vargs);
+  va_end(vargs);
+
+  if (written > 0 && (size_t)written < out_len - *len) {
+    *len += (size_t)written;
+  }
+}
+
+/**
+ * @brief Renders every metric in the Prometheus text format
+ *
+ * @param out Buffer to fill
+ * @param out_len Size of the buffer
+ * @return size_t Bytes written, truncated to whole lines if full
+ */
+size_t render_metrics(char* out, size_t out_len) {
+  size_t len = 0;
+
+  // sum every shard, the request path never waits on this
+  metrics_shard_t* total = aligned_alloc(64, sizeof(metrics_shard_t));
+  if (total == NULL) {
+    return 0;
+  }
+  memset(total, 0, sizeof(metrics_shard_t));
+  pthread_mutex_lock(&shards_lock);
+  add_shard(total, &retired);
+  for (metrics_shard_t* shard = shards; shard != NULL; shard = shard->next) {
+    add_shard(total, shard);
+  }
+  pthread_mutex_unlock(&shards_lock);
+
+  // counters
+  for (int i = 0; i < METRIC_COUNTERS; i++) {
+    append_line(out, out_len, &len, "# TYPE %s counter\n%s %llu\n", counter_names[i], counter_names[i],
+                (unsigned long long)total->counters[i]);
+  }
+  append_line(out, out_len, &len, "# TYPE hyper_connections_active gauge\nhyper_connections_active %llu\n",
+              (unsigned long long)(total->counters[METRIC_CONNECTIONS_OPENED] -
+                                   total->counters[METRIC_CONNECTIONS_CLOSED]));
+
+  // breakdowns, only the codes seen
+  append_line(out, out_len, &len, "# TYPE hyper_responses_total counter\n");
+  for (int i = 0; i < METRICS_STATUSES; i++) {
+    if (total->statuses[i] > 0) {
+      append_line(out, out_len, &len, "hyper_responses_total{code=\"%d\"} %llu\n", i + 100,
+                  (unsigned long long)total->statuses[i]);
+    }
+  }
+  append_line(out, out_len, &len, "# TYPE hyper_request_errors_total counter\n");
+  for (int i = 1; i < METRICS_REQUEST_RESULTS; i++) {
+    append_line(out, out_len, &len, "hyper_request_errors_total{result=\"%s\"} %llu\n", request_result_names[i],
+                (unsigned long long)total->request_results[i]);
+  }
+  append_line(out, out_len, &len, "# TYPE hyper_client_errors_total counter\n");
+  for (int i = 1; i < METRICS_CLIENT_RESULTS; i++) {
+    append_line(out, out_len, &len, "hyper_client_errors_total{result=\"%s\"} %llu\n", client_result_names[i],
+                (unsigned long long)total->client_results[i]);
+  }
+
+  // cumulative histograms in seconds
+  for (int h = 0; h < METRIC_HISTOGRAMS; h++) {
+    append_line(out, out_len, &len, "# TYPE %s histogram\n", histogram_names[h]);
+    uint64_t count = 0;
+    for (int i = 0; i < METRICS_BUCKETS; i++) {
+      count += total->buckets[h][i];
+      append_line(out, out_len, &len, "%s_bucket{le=\"%.9g\"} %llu\n", histogram_names[h],
+                  (double)(1ULL << (i + METRICS_BUCKET_SHIFT)) / 1e9, (unsigned long long)count);
+    }
+    count += total->buckets[h][METRICS_BUCKETS];
+    append_line(out, out_len, &len, "%s_bucket{le=\"+Inf\"} %llu\n%s_sum %.9f\n%s_count %llu\n", histogram_names[h],
+                (unsigned long long)count, histogram_names[h], (double)total->sums[h] / 1e9, histogram_names[h],
+                (unsigned long long)count);
+  }
+  free(total);
+
+  // buffer pool, by block size
+  pool_stats_t stats[POOL_CLASSES + 1];
+  get_pool_stats(stats);
+  append_line(out, out_len, &len, "# TYPE hyper_pool_blocks_in_use gauge\n");
+  for (int i = 0; i <= POOL_CLASSES; i++) {
+    append_line(out, out_len, &len, "hyper_pool_blocks_in_use{size=\"%zu\"} %llu\n", stats[i].size,
+                (unsigned long long)stats[i].in_use);
+  }
+  append_line(out, out_len, &len, "# TYPE hyper_pool_blocks_high_water gauge\n");
+  for (int i = 0; i <= POOL_CLASSES; i++) {
+    append_line(out, out_len, &len, "hyper_pool_blocks_high_water{size=\"%zu\"} %llu\n", stats[i].size,
+                (unsigned long long)stats[i].high_water);
+  }
+  append_line(out, out_len, &len, "# TYPE hyper_pool_misses_total counter\n");
+  for (int i = 0; i <= POOL_CLASSES; i++) {
+    append_line(out, out_len, &len, "hyper_pool_misses_total{size=\"%zu\"} %llu\n", stats[i].size,
+                (unsigned long long)stats[i].misses);
+  }
+
+  // logger
+  append_line(out, out_len, &len, "# TYPE hyper_log_dropped_total counter\nhyper_log_dropped_total %llu\n",
+              (unsigned long long)log_dropped_count());
+
+  return len;
+}
+
+/**
+ * @brief Answers one scrape and closes the socket
+ *
+ * @param client_socket Accepted socket
+ * @param buff Response buffer of METRICS_RESPONSE_LEN bytes
+ */
+static void serve_scrape(int client_socket, char* buff) {
+  // a scraper that stalls must not stall the endpoint
+  struct timeval timeout = { 1, 0 };
+  setsockopt(client_socket, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+  setsockopt(client_socket, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+
+  // read the request head, only the request line matters
+  char request[1024];
+  size_t request_len = 0;
+  while (request_len < sizeof(request) - 1) {
+    ssize_t received = recv(client_socket, request + request_len, sizeof(request) - 1 - request_len, 0);
+    if (received <= 0) {
+      break;
+    }
+    request_len += (size_t)received;
+    request[request_len] = '\0';
+    if (strstr(request, "\r\n\r\n") != NULL) {
+      break;
+    }
+  }
+  request[request_len] = '\0';
+
+  // body after a header of known maximum length
+  const size_t header_len = 128;
+  size_t body_len = 0;
+  const char* status = "404 Not Found";
+  const char* type = "text/plain";
+  if (strncmp(request, "GET /metrics ", 13) == 0 || strncmp(request, "GET /metrics?", 13) == 0) {
+    body_len = render_metrics(buff + header_len, METRICS_RESPONSE_LEN - header_len);
+    status = "200 OK";
+    type = "text/plain; version=0.0.4";
+  }
+
+  char header[128];
+  int len = snprintf(header, sizeof(header), "HTTP/1.1 %s\r\nContent-Type: %s\r\nContent-Length: %zu\r\n"
+                     "Connection: close\r\n\r\n", status, type, body_len);
+  if (len < 0 || (size_t)len >= header_len) {
+    return;
+  }
+
+  // header right before the body, one send
+  char* response = buff + header_len - (size_t)len;
+  memcpy(response, header, (size_t)len);
+  size_t remaining = (size_t)len + body_len;
+  while (remaining > 0) {
+    ssize_t sent = send(client_socket, response, remaining, MSG_NOSIGNAL);
+    if (sent <= 0) {
+      return;
+    }
+    response += sent;
+    remaining -= (size_t)sent;
+  }
+}
+
+/**
+ * @brief Accepts and answers scrapes until stop_metrics
+ *
+ * @param argp Unused
+ * @return void* NULL
+ */
+static void* run_metrics(void* argp) {
+  (void)argp;
+
+  char* buff = malloc(METRICS_RESPONSE_LEN);
+  if (buff == NULL) {
+    log_message(LOG_ERROR, "Could not allocate metrics buffer!\n");
+    return NULL;
+  }
+
+  while (__atomic_load_n(&metrics_running, __ATOMIC_ACQUIRE)) {
+    int client_socket = accept4(metrics_listener, NULL, NULL, SOCK_CLOEXEC);
+    if (client_socket == -1) {
+      if (errno == EINTR || errno == ECONNABORTED) {
+        continue;
+      }
+      break;
+    }
+
+    serve_scrape(client_socket, buff);
+    close(client_socket);
+  }
+
+  free(buff);
+  return NULL;
+}
+
+/**
+ * @brief Starts the endpoint serving GET /metrics on its own port
+ *
+ * @param host Address to listen on
+ * @param port Port to listen on
+ * @param result Result of the operation
+ */
+void start_metrics(const char* host, int port, metrics_result_t* result) {
+  // initialize result
+  *result = METRICS_SUCCESS;
+
+  // create socket
+  int listener = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (listener == -1) {
+    *result = METRICS_ERR_SOCKET;
+    return;
+  }
+
+  // an upgrade binds the port while the old process still holds it
+  int opt = 1;
+  setsockopt(listener, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
+  setsockopt(listener, SOL_SOCKET, SO_REUSEPORT, &opt, sizeof(opt));
+
+  // bind and listen
+  struct sockaddr_in addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_addr.s_addr = inet_addr(host);
+  addr.sin_port = htons(port);
+  if (bind(listener, (struct sockaddr*)&addr, sizeof(addr)) == -1) {
+    close(listener);
+    *result = METRICS_ERR_BIND;
+    return;
+  }
+  if (listen(listener, 16) == -1) {
+    close(listener);
+    *result = METRICS_ERR_LISTEN;
+    return;
+  }
+
+  // serve scrapes in the background
+  metrics_listener = listener;
+  __atomic_store_n(&metrics_running, 1, __ATOMIC_RELEASE);
+  if (pthread_create(&metrics_thread, NULL, run_metrics, NULL) != 0) {
+    __atomic_store_n(&metrics_running, 0, __ATOMIC_RELEASE);
+    close(listener);
+    metrics_listener = -1;
+    *result = METRICS_ERR_THREAD;
+  }
+}
+
+/**
+ * @brief Stops the endpoint
+ */
+void stop_metrics(void) {
+  if (!__atomic_load_n(&metrics_running, __ATOMIC_ACQUIRE)) {
+    return;
+  }
+
+  // shutting the listener down wakes the blocked accept
+  __atomic_store_n(&metrics_running, 0, __ATOMIC_RELEASE);
+  shutdown(metrics_listener, SHUT_RDWR);
+  pthread_join(metrics_thread, NULL);
+  close(metrics_listener);
+  metrics_listener = -1;
+}
@@ -0,0 +1,465 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "pool.h"
+#include "logger.h"
+
+/** Alignment of arena allocations */
+#define ARENA_ALIGN 16
+
+/**
+ * @brief Global free list of a size class
+ */
+typedef struct {
+  pthread_mutex_t lock;                /**< Guards head                 */
+  void* head;                          /**< Free blocks, linked         */
+} pool_class_t;
+
+/**
+ * @brief Free blocks and counters of one thread
+ *
+ * Counters are written by their thread alone and summed when read, so
+ * counting costs no locked instruction. A block freed by another thread
+ * than the one that took it leaves one count high and the other low, the
+ * sum stays right.
+ */
+typedef struct pool_cache {
+  void* head[POOL_CLASSES];            /**< Free blocks per class       */
+  int count[POOL_CLASSES];             /**< Blocks per class            */
+  int64_t in_use[POOL_CLASSES + 1];    /**< Blocks taken less blocks returned, oversize last */
+  uint64_t misses[POOL_CLASSES + 1];   /**< Blocks taken from malloc, oversize last */
+  struct pool_cache* next;             /**< Next thread counted         */
+  struct pool_cache* prev;             /**< Previous thread counted     */
+} pool_cache_t;
+
+/**
+ * @brief Header of an arena chunk after the first
+ */
+typedef struct arena_extra {
+  struct arena_extra* next;            /**< Older chunk                 */
+  size_t size;                         /**< Bytes after the header      */
+  size_t used;                         /**< Bytes used after the header */
+  size_t pad;                          /**< Keeps the data aligned      */
+} arena_extra_t;
+
+static pool_class_t classes[POOL_CLASSES];
+static pthread_mutex_t caches_lock = PTHREAD_MUTEX_INITIALIZER;
+static pool_cache_t* caches = NULL;
+static int64_t retired_in_use[POOL_CLASSES + 1];
+static uint64_t retired_misses[POOL_CLASSES + 1];
+static uint64_t high_water[POOL_CLASSES + 1];
+static pthread_once_t pool_once = PTHREAD_ONCE_INIT;
+static pthread_key_t pool_key;
+static __thread pool_cache_t cache;
+static __thread int cache_registered;
+
+/**
+ * @brief Maps a size to its class
+ *
+ * @param size Bytes needed
+ * @return int Class index or -1 if above the largest class
+ */
+static int class_of(size_t size) {
+  size_t block = POOL_MIN_BLOCK;
+  for (int i = 0; i < POOL_CLASSES; i++) {
+    if (size <= block) {
+      return i;
+    }
+    block <<= 1;
+  }
+
+  return -1;
+}
+
+/**
+ * @brief Moves cached blocks of a class to its global list
+ *
+ * @param c Class index
+ * @param keep Blocks to leave in the cache
+ */
+static void spill_cache(int c, int keep) {
+  if (cache.count[c] <= keep) {
+    return;
+  }
+
+  // unlink the blocks past the ones kept
+  void** tail = &cache.head[c];
+  for (int i = 0; i < keep; i++) {
+    tail = (void**)*tail;
+  }
+  void* first = *tail;
+  void* last = first;
+  while (*(void**)last != NULL) {
+    last = *(void**)last;
+  }
+  *tail = NULL;
+  cache.count[c] = keep;
+
+  // splice them onto the global list
+  pthread_mutex_lock(&classes[c].lock);
+  *(void**)last = classes[c].head;
+  classes[c].head = first;
+  pthread_mutex_unlock(&classes[c].lock);
+}
+
+/**
+ * @brief Adds to a counter of the calling thread
+ *
+ * @param value Counter, read by other threads
+ * @param n Amount to add
+ */
+static inline void bump(int64_t* value, int64_t n) {
+  __atomic_store_n(value, __atomic_load_n(value, __ATOMIC_RELAXED) + n, __ATOMIC_RELAXED);
+}
+
+/**
+ * @brief Counts a block taken from malloc by the calling thread
+ *
+ * @param c Class index, POOL_CLASSES for oversize blocks
+ */
+static void count_miss(int c) {
+  __atomic_store_n(&cache.misses[c], __atomic_load_n(&cache.misses[c], __ATOMIC_RELAXED) + 1, __ATOMIC_RELAXED);
+}
+
+/**
+ * @brief Sums the blocks of a class in use, caches_lock held
+ *
+ * @param c Class index, POOL_CLASSES for oversize blocks
+ * @return uint64_t Blocks in use
+ */
+static uint64_t sum_in_use(int c) {
+  int64_t in_use = retired_in_use[c];
+  for (pool_cache_t* counted = caches; counted != NULL; counted = counted->next) {
+    in_use += __atomic_load_n(&counted->in_use[c], __ATOMIC_RELAXED);
+  }
+
+  // a block can be returned before its count is seen
+  return in_use > 0 ? (uint64_t)in_use : 0;
+}
+
+/**
+ * @brief Raises the high water mark of a class to what is in use now
+ *
+ * Only sampled when the pool grows and when it is read, not on every
+ * allocation, so a peak between two samples can be missed.
+ *
+ * @param c Class index, POOL_CLASSES for oversize blocks
+ */
+static void sample_high_water(int c) {
+  pthread_mutex_lock(&caches_lock);
+  uint64_t in_use = sum_in_use(c);
+  if (in_use > high_water[c]) {
+    high_water[c] = in_use;
+  }
+  pthread_mutex_unlock(&caches_lock);
+}
+
+/**
+ * @brief Counts the calling thread and hands its cache back when it exits
+ */
+static void register_cache(void) {
+  pthread_setspecific(pool_key, &cache);
+
+  pthread_mutex_lock(&caches_lock);
+  cache.prev = NULL;
+  cache.next = caches;
+  if (caches != NULL) {
+    caches->prev = &cache;
+  }
+  caches = &cache;
+  pthread_mutex_unlock(&caches_lock);
+
+  cache_registered = 1;
+}
+
+/**
+ * @brief Returns the cache of an exiting thread to the global lists
+ *
+ * @param arg Unused
+ */
+static void drain_cache(void* arg) {
+  (void)arg;
+  for (int c = 0; c < POOL_CLASSES; c++) {
+    spill_cache(c, 0);
+  }
+
+  // fold the counters into the retired totals
+  pthread_mutex_lock(&caches_lock);
+  for (int c = 0; c <= POOL_CLASSES; c++) {
+    retired_in_use[c] += cache.in_use[c];
+    retired_misses[c] += cache.misses[c];
+    cache.in_use[c] = 0;
+    cache.misses[c] = 0;
+  }
+  if (cache.prev != NULL) {
+    cache.prev->next = cache.next;
+  } else {
+    caches = cache.next;
+  }
+  if (cache.next != NULL) {
+    cache.next->prev = cache.prev;
+  }
+  pthread_mutex_unlock(&caches_lock);
+
+  // a block taken or returned later in the thread's exit registers again
+  cache_registered = 0;
+}
+
+/**
+ * @brief Initializes the global lists once
+ */
+static void init_pool(void) {
+  for (int c = 0; c < POOL_CLASSES; c++) {
+    pthread_mutex_init(&classes[c].lock, NULL);
+    classes[c].head = NULL;
+  }
+  pthread_key_create(&pool_key, drain_cache);
+}
+
+/**
+ * @brief Takes a block of at least size bytes from the pool
+ *
+ * @param size Bytes needed
+ * @param result Result of the operation
+ * @return void* Block or NULL if error
+ * @note Sizes above the largest class are passed to malloc
+ */
+void* pool_alloc(size_t size, pool_result_t* result) {
+  // initialize result
+  *result = POOL_SUCCESS;
+
+  pthread_once(&pool_once, init_pool);
+
+  // hand the cache back if the thread exits
+  if (!cache_registered) {
+    register_cache();
+  }
+
+  // too big to pool
+  int c = class_of(size);
+  if (c == -1) {
+    void* block = malloc(size);
+    if (block == NULL) {
+      *result = POOL_ERR_MALLOC;
+      return NULL;
+    }
+    count_miss(POOL_CLASSES);
+    bump(&cache.in_use[POOL_CLASSES], 1);
+    sample_high_water(POOL_CLASSES);
+    return block;
+  }
+
+  // refill the cache from the global list
+  if (cache.head[c] == NULL) {
+    pthread_mutex_lock(&classes[c].lock);
+    while (classes[c].head != NULL && cache.count[c] < POOL_CACHE_BLOCKS / 2) {
+      void* block = classes[c].head;
+      classes[c].head = *(void**)block;
+      *(void**)block = cache.head[c];
+      cache.head[c] = block;
+      cache.count[c]++;
+    }
+    pthread_mutex_unlock(&classes[c].lock);
+  }
+
+  // take a cached block, or grow the pool
+  void* block = cache.head[c];
+  if (block != NULL) {
+    cache.head[c] = *(void**)block;
+    cache.count[c]--;
+  } else {
+    block = malloc((size_t)POOL_MIN_BLOCK << c);
+    if (block == NULL) {
+      *result = POOL_ERR_MALLOC;
+      return NULL;
+    }
+
+    // the pool grows, the peak is sampled on the slow path only
+    count_miss(c);
+    bump(&cache.in_use[c], 1);
+    sample_high_water(c);
+    return block;
+  }
+
+  bump(&cache.in_use[c], 1);
+  return block;
+}
+
+/**
+ * @brief Returns a block to the pool
+ *
+ * @param block Block from pool_alloc or NULL
+ * @param size Size passed to pool_alloc
+ */
+void pool_free(void* block, size_t size) {
+  if (block == NULL) {
+    return;
+  }
+
+  if (!cache_registered) {
+    register_cache();
+  }
+
+  // oversize blocks were never pooled
+  int c = class_of(size);
+  if (c == -1) {
+    bump(&cache.in_use[POOL_CLASSES], -1);
+    free(block);
+    return;
+  }
+
+  // cache the block, spilling half once the cache is full
+  *(void**)block = cache.head[c];
+  cache.head[c] = block;
+  cache.count[c]++;
+  if (cache.count[c] > POOL_CACHE_BLOCKS) {
+    spill_cache(c, POOL_CACHE_BLOCKS / 2);
+  }
+
+  bump(&cache.in_use[c], -1);
+}
+
+/**
+ * @brief Reads the counters of every size class
+ *
+ * @param out POOL_CLASSES + 1 entries, the last one counts oversize blocks
+ */
+void get_pool_stats(pool_stats_t out[]) {
+  pthread_once(&pool_once, init_pool);
+
+  // sum every thread's counters, the peak is sampled on the way
+  pthread_mutex_lock(&caches_lock);
+  for (int c = 0; c <= POOL_CLASSES; c++) {
+    out[c].size = c < POOL_CLASSES ? (size_t)POOL_MIN_BLOCK << c : 0;
+    out[c].in_use = sum_in_use(c);
+    if (out[c].in_use > high_water[c]) {
+      high_water[c] = out[c].in_use;
+    }
+    out[c].high_water = high_water[c];
+    out[c].misses = retired_misses[c];
+    for (pool_cache_t* counted = caches; counted != NULL; counted = counted->next) {
+      out[c].misses += __atomic_load_n(&counted->misses[c], __ATOMIC_RELAXED);
+    }
+  }
+  pthread_mutex_unlock(&caches_lock);
+}
+
+/**
+ * @brief Logs the counters of every size class in use
+ */
+void log_pool_stats(void) {
+  pool_stats_t out[POOL_CLASSES + 1];
+  get_pool_stats(out);
+
+  for (int c = 0; c <= POOL_CLASSES; c++) {
+    if (out[c].misses == 0) {
+      continue;
+    }
+
+    log_message(LOG_INFO, "Pool %6zu B: %llu in use, %llu high water, %llu misses\n", out[c].size,
+                (unsigned long long)out[c].in_use, (unsigned long long)out[c].high_water,
+                (unsigned long long)out[c].misses);
+  }
+}
+
+/**
+ * @brief Initializes an empty arena
+ *
+ * @param arena Arena struct
+ */
+void init_arena(arena_t* arena) {
+  arena->chunk = NULL;
+  arena->used = 0;
+  arena->extra = NULL;
+}
+
+/**
+ * @brief Allocates request-scoped memory
+ *
+ * @param arena Arena struct
+ * @param size Bytes needed
+ * @param result Result of the operation
+ * @return void* Memory aligned to 16 bytes or NULL if error
+ */
+void* arena_alloc(arena_t* arena, size_t size, pool_result_t* result) {
+  // initialize result
+  *result = POOL_SUCCESS;
+
+  size = (size + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1);
+
+  // the first chunk is taken on first use
+  if (arena->chunk == NULL) {
+    arena->chunk = pool_alloc(ARENA_CHUNK_LEN, result);
+    if (arena->chunk == NULL) {
+      return NULL;
+    }
+    arena->used = 0;
+  }
+
+  // bump the first chunk
+  if (arena->extra == NULL && size <= ARENA_CHUNK_LEN - arena->used) {
+    void* memory = arena->chunk + arena->used;
+    arena->used += size;
+    return memory;
+  }
+
+  // then the newest extra chunk
+  arena_extra_t* extra = (arena_extra_t*)arena->extra;
+  if (extra != NULL && size <= extra->size - extra->used) {
+    void* memory = (char*)(extra + 1) + extra->used;
+    extra->used += size;
+    return memory;
+  }
+
+  // add a chunk big enough for the request
+  size_t chunk_len = sizeof(arena_extra_t) + size > ARENA_CHUNK_LEN ? sizeof(arena_extra_t) + size : ARENA_CHUNK_LEN;
+  extra = pool_alloc(chunk_len, result);
+  if (extra == NULL) {
+    return NULL;
+  }
+  extra->next = (arena_extra_t*)arena->extra;
+  extra->size = chunk_len - sizeof(arena_extra_t);
+  extra->used = size;
+  arena->extra = extra;
+
+  return extra + 1;
+}
+
+/**
+ * @brief Returns the extra chunks of an arena to the pool
+ *
+ * @param arena Arena struct
+ */
+static void free_extra(arena_t* arena) {
+  arena_extra_t* extra = (arena_extra_t*)arena->extra;
+  while (extra != NULL) {
+    arena_extra_t* next = extra->next;
+    pool_free(extra, extra->size + sizeof(arena_extra_t));
+    extra = next;
+  }
+  arena->extra = NULL;
+}
+
+/**
+ * @brief Frees everything allocated since the last reset
+ *
+ * @param arena Arena struct
+ * @note The first chunk is kept for the next request
+ */
+void reset_arena(arena_t* arena) {
+  free_extra(arena);
+  arena->used = 0;
+}
+
+/**
+ * @brief Returns every chunk of the arena to the pool
+ *
+ * @param arena Arena struct
+ */
+void release_arena(arena_t* arena) {
+  free_extra(arena);
+  pool_free(arena->chunk, ARENA_CHUNK_LEN);
+  init_arena(arena);
+}
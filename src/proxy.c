@@ -0,0 +1,1323 @@
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <time.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <netinet/tcp.h>
+
+#include "proxy.h"
+#include "server.h"
+#include "metrics.h"
+#include "status.h"
+
+/** Interim response asking a client for the body it holds back */
+static const char continue_line[] = "HTTP/1.1 100 Continue\r\n\r\n";
+
+/** Request headers that only concern one connection */
+static const char* hop_headers[] = {
+  "Connection", "Keep-Alive", "Proxy-Connection", "TE", "Trailer", "Transfer-Encoding", "Upgrade"
+};
+
+/**
+ * @brief Gets the monotonic time
+ *
+ * @return int64_t Milliseconds since an arbitrary point
+ */
+static int64_t now_ms(void) {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (int64_t)now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+/**
+ * @brief Checks whether a comma separated header value lists a token
+ *
+ * @param value Header value
+ * @param token Token to look for
+ * @param token_len Length of the token
+ * @return int 1 if listed, compared ignoring case
+ */
+static int has_token(slice_t value, const char* token, size_t token_len) {
+  size_t i = 0;
+  while (i < value.len) {
+    // skip separators
+    while (i < value.len && (value.ptr[i] == ',' || value.ptr[i] == ' ' || value.ptr[i] == '\t')) {
+      i++;
+    }
+
+    size_t start = i;
+    while (i < value.len && value.ptr[i] != ',') {
+      i++;
+    }
+    size_t end = i;
+    while (end > start && (value.ptr[end - 1] == ' ' || value.ptr[end - 1] == '\t')) {
+      end--;
+    }
+
+    if (end - start == token_len && strncasecmp(value.ptr + start, token, token_len) == 0) {
+      return 1;
+    }
+  }
+  return 0;
+}
+
+/**
+ * @brief Checks whether a request header stays with the client connection
+ *
+ * @param request Parsed request
+ * @param name Header name
+ * @return int 1 if hop-by-hop or named by the Connection header
+ */
+static int is_hop_header(const request_t* request, slice_t name) {
+  for (size_t i = 0; i < sizeof(hop_headers) / sizeof(hop_headers[0]); i++) {
+    if (slice_equals(name, hop_headers[i])) {
+      return 1;
+    }
+  }
+
+  for (size_t i = 0; i < request->header_count; i++) {
+    if (slice_equals(request->headers[i].name, "Connection") &&
+        has_token(request->headers[i].value, name.ptr, name.len)) {
+      return 1;
+    }
+  }
+  return 0;
+}
+
+/**
+ * @brief Appends bytes to a buffer known to be large enough
+ *
+ * @param out Buffer
+ * @param len Bytes in the buffer, advanced
+ * @param data Bytes to append
+ * @param data_len Number of bytes
+ */
+static void append(char* out, size_t* len, const char* data, size_t data_len) {
+  memcpy(out + *len, data, data_len);
+  *len += data_len;
+}
+
+/**
+ * @brief Rewrites a request for a backend in the connection arena
+ *
+ * The request goes out as HTTP/1.1 so the backend connection can be kept,
+ * without hop-by-hop headers and with the client added to X-Forwarded-For.
+ * A chunked body is chunked again on the way, Expect is answered here.
+ *
+ * @param connection Connection struct
+ * @param request Parsed request
+ * @param len Set to the length of the rewritten head
+ * @return char* Rewritten head or NULL if error
+ */
+static char* build_request(connection_t* connection, const request_t* request, size_t* len) {
+  const char* host = connection->client->host;
+  const char* server_host = connection->server->host;
+
+  // every header line grows by at most a space, then the added headers
+  size_t size = request->length + request->header_count + 96 + strlen(host) + strlen(server_host);
+  pool_result_t pool_result;
+  char* out = arena_alloc(&connection->arena, size, &pool_result);
+  if (out == NULL) {
+    return NULL;
+  }
+
+  // request line
+  *len = 0;
+  append(out, len, request->method.ptr, request->method.len);
+  append(out, len, " ", 1);
+  append(out, len, request->target.ptr, request->target.len);
+  append(out, len, " HTTP/1.1\r\n", 11);
+
+  // end-to-end headers
+  int forwarded = 0;
+  int has_host = 0;
+  for (size_t i = 0; i < request->header_count; i++) {
+    const header_t* header = &request->headers[i];
+    if (is_hop_header(request, header->name) || slice_equals(header->name, "Expect")) {
+      continue;
+    }
+
+    append(out, len, header->name.ptr, header->name.len);
+    append(out, len, ": ", 2);
+    append(out, len, header->value.ptr, header->value.len);
+    if (slice_equals(header->name, "X-Forwarded-For") && !forwarded) {
+      append(out, len, ", ", 2);
+      append(out, len, host, strlen(host));
+      forwarded = 1;
+    }
+    append(out, len, "\r\n", 2);
+    has_host |= slice_equals(header->name, "Host");
+  }
+
+  // HTTP/1.1 requires a Host even if the client sent none
+  if (!has_host) {
+    append(out, len, "Host: ", 6);
+    append(out, len, server_host, strlen(server_host));
+    append(out, len, "\r\n", 2);
+  }
+  if (!forwarded) {
+    append(out, len, "X-Forwarded-For: ", 17);
+    append(out, len, host, strlen(host));
+    append(out, len, "\r\n", 2);
+  }
+  if (request->chunked) {
+    append(out, len, "Transfer-Encoding: chunked\r\n", 28);
+  }
+  append(out, len, "\r\n", 2);
+
+  return out;
+}
+
+/**
+ * @brief Counts a failed connect, send or reply against a backend
+ *
+ * @param backend Backend struct
+ */
+static void fail_backend(upstream_backend_t* backend) {
+  metrics_count(METRIC_UPSTREAM_FAILURES, 1);
+  report_backend(backend, 0);
+}
+
+/**
+ * @brief Gets a connection to a backend, trying others while they fail
+ *
+ * @param connection Connection struct
+ * @param proxy Proxy struct
+ * @param backend Backend to try first
+ * @return int 0 if successful, -1 once every attempt failed
+ */
+static int open_upstream(connection_t* connection, proxy_t* proxy, upstream_backend_t* backend) {
+  while (proxy->attempts < PROXY_ATTEMPTS) {
+    upstream_result_t upstream_result;
+    proxy->upstream = acquire_upstream(proxy->pool, backend, connection, &proxy->reused, &upstream_result);
+    if (proxy->upstream != NULL) {
+      metrics_count(METRIC_UPSTREAM_REQUESTS, 1);
+      if (proxy->reused) {
+        metrics_count(METRIC_UPSTREAM_REUSED, 1);
+      }
+
+      // the request is sent from its start
+      proxy->phase = PROXY_SENDING;
+      proxy->request_sent = 0;
+      proxy->buffer_len = 0;
+      return 0;
+    }
+
+    fail_backend(backend);
+    proxy->attempts++;
+    backend = pick_backend(proxy->pool->upstream, proxy->route, backend);
+  }
+  return -1;
+}
+
+/**
+ * @brief Checks whether a method can be repeated without a second effect
+ *
+ * @param method Request method
+ * @return int 1 if idempotent, 0 otherwise
+ */
+static int is_idempotent(slice_t method) {
+  return slice_equals(method, "GET") || slice_equals(method, "HEAD") || slice_equals(method, "PUT") ||
+         slice_equals(method, "DELETE") || slice_equals(method, "OPTIONS") || slice_equals(method, "TRACE");
+}
+
+/**
+ * @brief Checks whether the request can be sent again
+ *
+ * A body is read from the client only once, and a request the backend may
+ * have acted on is only repeated if its method is idempotent.
+ *
+ * @param proxy Proxy struct
+ * @return int 1 if it can be retried
+ */
+static int can_retry(const proxy_t* proxy) {
+  return !proxy->body_taken && (proxy->idempotent || proxy->request_sent == 0);
+}
+
+/**
+ * @brief Drops the backend connection and sends the request again
+ *
+ * @param connection Connection struct
+ * @param proxy Proxy struct
+ * @param stale 1 if a pooled connection turned out to be closed
+ * @return int 0 if successful, -1 once every attempt failed
+ */
+static int retry_proxy(connection_t* connection, proxy_t* proxy, int stale) {
+  upstream_backend_t* backend = proxy->upstream->backend;
+  release_upstream(proxy->pool, proxy->upstream, 0);
+  proxy->upstream = NULL;
+
+  // the backend closing an idle connection says nothing about its health
+  if (stale) {
+    return open_upstream(connection, proxy, backend);
+  }
+
+  fail_backend(backend);
+  if (++proxy->attempts == PROXY_ATTEMPTS) {
+    return -1;
+  }
+  return open_upstream(connection, proxy, pick_backend(proxy->pool->upstream, proxy->route, backend));
+}
+
+/**
+ * @brief Gives back the backend connection and forgets the exchange
+ *
+ * A fill ends with the exchange, stored only if the whole body was relayed.
+ * Whatever is left of the request body is skipped by the connection.
+ *
+ * @param connection Connection struct
+ * @param reusable 1 to pool the backend connection
+ */
+static void end_proxy(connection_t* connection, int reusable) {
+  proxy_t* proxy = connection->proxy;
+
+  if (proxy->upstream != NULL) {
+    release_upstream(proxy->pool, proxy->upstream, reusable);
+    proxy->upstream = NULL;
+  }
+  if (proxy->fill != NULL) {
+    response_cache_finish(proxy->cache, proxy->fill, proxy->phase == PROXY_DONE);
+    proxy->fill = NULL;
+  }
+  if (proxy->buffer != NULL) {
+    pool_free(proxy->buffer, PROXY_BUFFER_LEN);
+    proxy->buffer = NULL;
+  }
+
+  // a client that was never asked for its body may never send it
+  if (proxy->continue_left > 0 && !connection->body.done) {
+    connection->keep_alive = 0;
+  }
+  connection->proxy = NULL;
+}
+
+/**
+ * @brief Parses the rewritten request for the response cache
+ *
+ * The cache keys and varies on what the backend is sent, so a request
+ * looks the same to it however often it is looked up.
+ *
+ * @param connection Connection struct
+ * @param proxy Proxy struct with the rewritten request
+ * @return request_t* Parsed request or NULL if it cannot be cached
+ */
+static request_t* parse_cached(connection_t* connection, proxy_t* proxy) {
+  pool_result_t pool_result;
+  request_t* request = arena_alloc(&connection->arena, sizeof(request_t), &pool_result);
+  if (request == NULL) {
+    return NULL;
+  }
+
+  request_parser_t parser;
+  request_result_t request_result;
+  init_request_parser(&parser);
+  parse_request(&parser, request, proxy->request, proxy->request_len, &request_result);
+  return request_result == REQUEST_SUCCESS ? request : NULL;
+}
+
+/**
+ * @brief Answers the exchange from the response cache if it can
+ *
+ * A miss may leave the exchange holding the entry to fill, or coalesced
+ * when another request is already filling it. Waiting ends when the
+ * backend would have had to answer, and the request is then sent anyway.
+ *
+ * @param connection Connection struct
+ * @param proxy Proxy struct
+ * @return int 1 if answered, 0 to fetch or wait, -1 if error
+ */
+static int consult_cache(connection_t* connection, proxy_t* proxy) {
+  response_cache_lookup_t lookup;
+  response_cache_entry_t* entry = response_cache_lookup(proxy->cache, proxy->cached, proxy->pool != NULL, &lookup);
+
+  if (lookup == RESPONSE_CACHE_HIT || lookup == RESPONSE_CACHE_STALE) {
+    metrics_count(METRIC_CACHE_HITS, 1);
+    if (lookup == RESPONSE_CACHE_STALE) {
+      metrics_count(METRIC_CACHE_STALE, 1);
+    }
+
+    response_result_t result;
+    queue_cached_response(entry, &connection->response, connection->keep_alive, &result);
+    return result == RESPONSE_SUCCESS ? 1 : -1;
+  }
+
+  if (lookup == RESPONSE_CACHE_WAIT && now_ms() < proxy->wait_until) {
+    if (proxy->phase != PROXY_COALESCED) {
+      metrics_count(METRIC_CACHE_COALESCED, 1);
+    }
+    proxy->phase = PROXY_COALESCED;
+    return 0;
+  }
+
+  if (lookup == RESPONSE_CACHE_FILL) {
+    metrics_count(METRIC_CACHE_MISSES, 1);
+    proxy->fill = entry;
+  }
+  proxy->phase = PROXY_SENDING;
+  return 0;
+}
+
+/**
+ * @brief Sends the exchange to a backend of its route
+ *
+ * @param connection Connection struct
+ * @param proxy Proxy struct
+ * @return int 0 if successful, -1 if no backend could be reached
+ */
+static int connect_proxy(connection_t* connection, proxy_t* proxy) {
+  // the body buffer goes back to the pool as soon as the exchange ends
+  pool_result_t pool_result;
+  proxy->buffer = pool_alloc(PROXY_BUFFER_LEN, &pool_result);
+  if (proxy->buffer == NULL) {
+    return -1;
+  }
+
+  if (open_upstream(connection, proxy, pick_backend(proxy->pool->upstream, proxy->route, NULL)) == -1) {
+    return -1;
+  }
+
+  // the body follows the head in pieces as it arrives, Nagle would hold the last one for an ACK
+  int opt = 1;
+  setsockopt(connection->client->socket, IPPROTO_TCP, TCP_NODELAY, &opt, sizeof(opt));
+
+  const char* line_end = memchr(proxy->request, '\r', proxy->request_len);
+  log_message(LOG_DEBUG, "Proxying %.*s to %s for client %s\n", (int)(line_end - proxy->request), proxy->request,
+              proxy->upstream->backend->name, connection->client->host);
+  return 0;
+}
+
+/**
+ * @brief Starts forwarding a request to a backend of its route
+ *
+ * @param connection Connection struct
+ * @param request Parsed request, copied before it is consumed
+ * @param route Route the target matched
+ * @return int 0 if successful, -1 if error
+ * @note A request answered from the cache, and a connection without a
+ *       pool, a stream of an HTTP/2 session, or a request no backend could
+ *       be reached for, which are answered with a 502 unless cached, leave
+ *       connection->proxy NULL
+ */
+int start_proxy(connection_t* connection, const request_t* request, const upstream_route_t* route) {
+  response_cache_t* cache = connection->server->response_cache;
+  response_result_t result;
+
+  // streams of a session share one socket and have no pool to borrow from
+  if (connection->upstream_pool == NULL && cache == NULL) {
+    queue_status(&connection->response, 502, connection->keep_alive, &result);
+    return result == RESPONSE_SUCCESS ? 0 : -1;
+  }
+
+  // the exchange lives as long as the request's memory
+  pool_result_t pool_result;
+  proxy_t* proxy = arena_alloc(&connection->arena, sizeof(proxy_t), &pool_result);
+  if (proxy == NULL) {
+    return -1;
+  }
+  memset(proxy, 0, sizeof(proxy_t));
+  proxy->pool = connection->upstream_pool;
+  proxy->route = route;
+  proxy->phase = PROXY_SENDING;
+  proxy->idempotent = is_idempotent(request->method);
+  proxy->head_only = slice_equals(request->method, "HEAD");
+  if (!connection->body.done && header_has_token(request, "Expect", "100-continue")) {
+    proxy->continue_left = sizeof(continue_line) - 1;
+  }
+  proxy->request = build_request(connection, request, &proxy->request_len);
+  if (proxy->request == NULL) {
+    return -1;
+  }
+
+  // answer from the cache, which may also say to wait for another request
+  if (cache != NULL) {
+    proxy->cached = parse_cached(connection, proxy);
+    proxy->cache = proxy->cached != NULL ? cache : NULL;
+  }
+  if (proxy->cache != NULL) {
+    proxy->wait_until = now_ms() + (int64_t)connection->server->config->upstream_timeout * 1000;
+    int cached = consult_cache(connection, proxy);
+    if (cached != 0) {
+      return cached == 1 ? 0 : -1;
+    }
+  }
+
+  if (proxy->pool == NULL) {
+    queue_status(&connection->response, 502, connection->keep_alive, &result);
+    return result == RESPONSE_SUCCESS ? 0 : -1;
+  }
+  connection->proxy = proxy;
+  if (proxy->phase == PROXY_COALESCED) {
+    return 0;
+  }
+
+  // no backend to send it to
+  if (connect_proxy(connection, proxy) == -1) {
+    end_proxy(connection, 0);
+    queue_status(&connection->response, 502, connection->keep_alive, &result);
+    return result == RESPONSE_SUCCESS ? 0 : -1;
+  }
+
+  return 0;
+}
+
+/**
+ * @brief Records which sockets the exchange waits on
+ *
+ * @param proxy Proxy struct
+ * @param client_events Poll events awaited on the client
+ * @param upstream_events Poll events awaited on the backend
+ * @param result Set to PROXY_ERR_AGAIN
+ */
+static void await(proxy_t* proxy, short client_events, short upstream_events, proxy_result_t* result) {
+  proxy->client_events = client_events;
+  proxy->upstream_events = upstream_events;
+  *result = PROXY_ERR_AGAIN;
+}
+
+/**
+ * @brief Takes the body bytes out of what the backend sent
+ *
+ * Chunked bodies are relayed as they are, the chunk framing is only
+ * followed to find the end of the last chunk and its trailers.
+ *
+ * @param proxy Proxy struct
+ * @param data Bytes received after the head
+ * @param len Number of bytes
+ * @return ssize_t Bytes that belong to the body or -1 if malformed
+ */
+static ssize_t frame_body(proxy_t* proxy, const char* data, size_t len) {
+  size_t i = 0;
+
+  switch (proxy->framing) {
+    case FRAMING_NONE:
+      break;
+
+    case FRAMING_LENGTH:
+      i = len < proxy->remaining ? len : (size_t)proxy->remaining;
+      proxy->remaining -= i;
+      proxy->body_done = proxy->remaining == 0;
+      break;
+
+    case FRAMING_CLOSE:
+      i = len;
+      break;
+
+    case FRAMING_CHUNKED:
+      while (i < len && !proxy->body_done) {
+        char c = data[i];
+
+        // whole runs of chunk data at once
+        if (proxy->chunk_state == CHUNK_DATA) {
+          size_t run = len - i < proxy->chunk_left ? len - i : (size_t)proxy->chunk_left;
+          proxy->chunk_left -= run;
+          i += run;
+          if (proxy->chunk_left == 0) {
+            proxy->chunk_state = CHUNK_DATA_CR;
+          }
+          continue;
+        }
+
+        switch (proxy->chunk_state) {
+          case CHUNK_SIZE:
+            if (c >= '0' && c <= '9') {
+              proxy->chunk_left = proxy->chunk_left * 16 + (uint64_t)(c - '0');
+            } else if ((c | 0x20) >= 'a' && (c | 0x20) <= 'f') {
+              proxy->chunk_left = proxy->chunk_left * 16 + (uint64_t)((c | 0x20) - 'a' + 10);
+            } else if (proxy->chunk_digits > 0 && (c == ';' || c == ' ' || c == '\t')) {
+              proxy->chunk_state = CHUNK_EXTENSION;
+              break;
+            } else if (proxy->chunk_digits > 0 && c == '\r') {
+              proxy->chunk_state = CHUNK_SIZE_LF;
+              break;
+            } else {
+              return -1;
+            }
+            if (++proxy->chunk_digits > 15) {
+              return -1;
+            }
+            break;
+
+          case CHUNK_EXTENSION:
+            if (c == '\r') {
+              proxy->chunk_state = CHUNK_SIZE_LF;
+            }
+            break;
+
+          case CHUNK_SIZE_LF:
+            if (c != '\n') {
+              return -1;
+            }
+            proxy->chunk_state = proxy->chunk_left > 0 ? CHUNK_DATA : CHUNK_TRAILER;
+            break;
+
+          case CHUNK_DATA_CR:
+            if (c != '\r') {
+              return -1;
+            }
+            proxy->chunk_state = CHUNK_DATA_LF;
+            break;
+
+          case CHUNK_DATA_LF:
+            if (c != '\n') {
+              return -1;
+            }
+            proxy->chunk_state = CHUNK_SIZE;
+            proxy->chunk_digits = 0;
+            break;
+
+          case CHUNK_TRAILER:
+            proxy->chunk_state = c == '\r' ? CHUNK_END_LF : CHUNK_TRAILER_LINE;
+            break;
+
+          case CHUNK_TRAILER_LINE:
+            if (c == '\n') {
+              proxy->chunk_state = CHUNK_TRAILER;
+            }
+            break;
+
+          case CHUNK_END_LF:
+            if (c != '\n') {
+              return -1;
+            }
+            proxy->body_done = 1;
+            break;
+
+          default:
+            break;
+        }
+        i++;
+      }
+      break;
+  }
+
+  // bytes past the body mean the backend cannot be trusted with another request
+  if (i < len) {
+    proxy->reusable = 0;
+  }
+  return (ssize_t)i;
+}
+
+/**
+ * @brief Rewrites a response head for the client
+ *
+ * The head is copied into the connection arena as HTTP/1.1 without the
+ * backend's connection headers, the client's own decide whether it stays
+ * open. The body framing and whether the backend connection can be kept
+ * are taken from it.
+ *
+ * @param connection Connection struct
+ * @param proxy Proxy struct
+ * @param head_len Length of the head in the buffer, blank line included
+ * @return int Status code, 0 for an interim response to skip, -1 if invalid
+ */
+static int parse_head(connection_t* connection, proxy_t* proxy, size_t head_len) {
+  const char* buff = proxy->buffer;
+
+  // HTTP/1.x NNN
+  if (head_len < 16 || memcmp(buff, "HTTP/1.", 7) != 0 || (buff[7] != '0' && buff[7] != '1') || buff[8] != ' ' ||
+      buff[9] < '1' || buff[9] > '5' || buff[10] < '0' || buff[10] > '9' || buff[11] < '0' || buff[11] > '9' ||
+      (buff[12] != ' ' && buff[12] != '\r')) {
+    return -1;
+  }
+  int status = (buff[9] - '0') * 100 + (buff[10] - '0') * 10 + (buff[11] - '0');
+  int keep_alive = buff[7] == '1';
+
+  // nothing asked for an upgrade, other interim responses are dropped
+  if (status == 101) {
+    return -1;
+  }
+  if (status < 200) {
+    return 0;
+  }
+
+  pool_result_t pool_result;
+  char* out = arena_alloc(&connection->arena, head_len + 64, &pool_result);
+  if (out == NULL) {
+    return -1;
+  }
+  size_t out_len = 0;
+  const char* line_end = memchr(buff, '\n', head_len);
+  append(out, &out_len, "HTTP/1.1", 8);
+  append(out, &out_len, buff + 8, (size_t)(line_end + 1 - (buff + 8)));
+
+  // copy the end-to-end headers, noting the framing
+  int chunked = 0;
+  int has_length = 0;
+  int encoded = 0;
+  uint64_t length = 0;
+  const char* line = line_end + 1;
+  const char* end = buff + head_len - 2;
+  while (line < end) {
+    line_end = memchr(line, '\n', (size_t)(end - line));
+    if (line_end == NULL) {
+      return -1;
+    }
+    const char* colon = memchr(line, ':', (size_t)(line_end - line));
+    if (colon == NULL || colon == line) {
+      return -1;
+    }
+
+    slice_t name = { line, (size_t)(colon - line) };
+    slice_t value = { colon + 1, (size_t)(line_end - colon - 1) };
+    while (value.len > 0 && (value.ptr[0] == ' ' || value.ptr[0] == '\t')) {
+      value.ptr++;
+      value.len--;
+    }
+    while (value.len > 0 && (value.ptr[value.len - 1] == '\r' || value.ptr[value.len - 1] == ' ' ||
+                             value.ptr[value.len - 1] == '\t')) {
+      value.len--;
+    }
+
+    if (slice_equals(name, "Connection")) {
+      if (has_token(value, "close", 5)) {
+        keep_alive = 0;
+      } else if (has_token(value, "keep-alive", 10)) {
+        keep_alive = 1;
+      }
+    } else if (!slice_equals(name, "Keep-Alive") && !slice_equals(name, "Proxy-Connection")) {
+      if (slice_equals(name, "Transfer-Encoding")) {
+        encoded = 1;
+        chunked = has_token(value, "chunked", 7);
+      } else if (slice_equals(name, "Content-Length")) {
+        // conflicting lengths leave no safe way to find the end
+        uint64_t parsed = 0;
+        for (size_t i = 0; i < value.len; i++) {
+          if (value.ptr[i] < '0' || value.ptr[i] > '9' || i == 18) {
+            return -1;
+          }
+          parsed = parsed * 10 + (uint64_t)(value.ptr[i] - '0');
+        }
+        if (value.len == 0 || (has_length && parsed != length)) {
+          return -1;
+        }
+        has_length = 1;
+        length = parsed;
+      }
+      append(out, &out_len, line, (size_t)(line_end + 1 - line));
+    }
+
+    line = line_end + 1;
+  }
+
+  // a body that ends with the connection is chunked for a client that stays
+  if (status == 204 || status == 304 || proxy->head_only) {
+    proxy->framing = FRAMING_NONE;
+  } else if (chunked) {
+    proxy->framing = FRAMING_CHUNKED;
+  } else if (has_length && !encoded) {
+    proxy->framing = FRAMING_LENGTH;
+    proxy->remaining = length;
+  } else {
+    proxy->framing = FRAMING_CLOSE;
+    proxy->chunk_out = connection->keep_alive;
+    keep_alive = 0;
+  }
+  if (proxy->chunk_out) {
+    append(out, &out_len, "Transfer-Encoding: chunked\r\n", 28);
+  }
+  proxy->body_done = proxy->framing == FRAMING_NONE || (proxy->framing == FRAMING_LENGTH && length == 0);
+  proxy->reusable = keep_alive;
+
+  if (!connection->keep_alive) {
+    append(out, &out_len, "Connection: close\r\n", 19);
+  }
+  append(out, &out_len, "\r\n", 2);
+
+  response_result_t result;
+  add_memory_segment(&connection->response, out, out_len, &result);
+  if (result != RESPONSE_SUCCESS) {
+    return -1;
+  }
+  connection->response.body_offset = out_len;
+  connection->response.status = status;
+  return status;
+}
+
+/**
+ * @brief Looks again for the response another request is fetching
+ *
+ * @param connection Connection struct
+ * @param proxy Proxy struct
+ * @param result Result of the operation
+ */
+static void coalesce(connection_t* connection, proxy_t* proxy, proxy_result_t* result) {
+  int cached = consult_cache(connection, proxy);
+  if (cached == 1) {
+    proxy->phase = PROXY_DONE;
+    return;
+  }
+  if (cached == -1) {
+    *result = PROXY_ERR_BROKEN;
+    return;
+  }
+
+  // nothing to watch, the caller looks again
+  if (proxy->phase == PROXY_COALESCED) {
+    await(proxy, 0, 0, result);
+    return;
+  }
+
+  if (connect_proxy(connection, proxy) == -1) {
+    *result = PROXY_ERR_FAILED;
+  }
+}
+
+/**
+ * @brief Stores the head of a response to be filled if it is cacheable
+ *
+ * @param proxy Proxy struct with the framing of the response
+ * @param head_len Length of the head in the buffer
+ * @param status Status code
+ */
+static void begin_fill(proxy_t* proxy, size_t head_len, int status) {
+  int64_t length = -1;
+  if (proxy->framing == FRAMING_NONE) {
+    length = 0;
+  } else if (proxy->framing == FRAMING_LENGTH) {
+    length = (int64_t)proxy->remaining;
+  }
+
+  // an uncacheable response is relayed as usual, spliced if it can be
+  if (response_cache_begin(proxy->cache, proxy->fill, proxy->cached, proxy->buffer, head_len, status, length) == -1) {
+    response_cache_finish(proxy->cache, proxy->fill, 0);
+    proxy->fill = NULL;
+  }
+}
+
+/**
+ * @brief Sends the rest of the request to the backend
+ *
+ * @param connection Connection struct
+ * @param proxy Proxy struct
+ * @param result Result of the operation
+ */
+static void send_request(connection_t* connection, proxy_t* proxy, proxy_result_t* result) {
+  client_result_t client_result;
+
+  ssize_t sent = send_client(proxy->upstream->client, proxy->request + proxy->request_sent,
+                             proxy->request_len - proxy->request_sent, &client_result);
+  if (client_result == CLIENT_ERR_AGAIN) {
+    await(proxy, 0, POLLOUT, result);
+    return;
+  }
+
+  // refused, or a pooled connection closed meanwhile
+  if (client_result != CLIENT_SUCCESS) {
+    if (!can_retry(proxy)) {
+      fail_backend(proxy->upstream->backend);
+      *result = PROXY_ERR_FAILED;
+    } else if (retry_proxy(connection, proxy, proxy->reused) == -1) {
+      *result = PROXY_ERR_FAILED;
+    }
+    return;
+  }
+
+  proxy->request_sent += (size_t)sent;
+  if (proxy->request_sent == proxy->request_len) {
+    proxy->phase = connection->body.done ? PROXY_WAITING : PROXY_UPLOAD;
+  }
+}
+
+/**
+ * @brief Refuses a request body that turned out malformed or too large
+ *
+ * Nothing is left to find the next request by, so the client connection
+ * closes after the answer and the backend's after the cut short request.
+ *
+ * @param connection Connection struct
+ * @param proxy Proxy struct
+ * @param body_result Result of decoding the body
+ * @param result Result of the operation
+ */
+static void refuse_body(connection_t* connection, proxy_t* proxy, body_result_t body_result, proxy_result_t* result) {
+  response_result_t response_result;
+
+  metrics_request_result(body_result == BODY_ERR_TOO_LARGE ? REQUEST_ERR_BODY_TOO_LARGE : REQUEST_ERR_MALFORMED);
+  connection->keep_alive = 0;
+  connection->in_len = 0;
+  queue_status(&connection->response, body_result == BODY_ERR_TOO_LARGE ? 413 : 400, 0, &response_result);
+  if (response_result != RESPONSE_SUCCESS) {
+    *result = PROXY_ERR_BROKEN;
+    return;
+  }
+  proxy->reusable = 0;
+  proxy->phase = PROXY_DONE;
+}
+
+/**
+ * @brief Relays the request body from the client to the backend
+ *
+ * The body is decoded in the client connection's buffer and staged in
+ * the exchange's, so an upload of any size holds no more memory than the
+ * two. A chunked body goes out as a chunk per staged piece.
+ *
+ * @param connection Connection struct
+ * @param proxy Proxy struct
+ * @param result Result of the operation
+ */
+static void send_body(connection_t* connection, proxy_t* proxy, proxy_result_t* result) {
+  body_reader_t* body = &connection->body;
+  client_result_t client_result;
+
+  while (1) {
+    // send what is staged first
+    if (proxy->buffer_sent < proxy->buffer_len) {
+      ssize_t sent = send_client(proxy->upstream->client, proxy->buffer + proxy->buffer_sent,
+                                 proxy->buffer_len - proxy->buffer_sent, &client_result);
+      if (client_result == CLIENT_ERR_AGAIN) {
+        await(proxy, 0, POLLOUT, result);
+        return;
+      }
+      if (client_result != CLIENT_SUCCESS) {
+        fail_backend(proxy->upstream->backend);
+        *result = PROXY_ERR_FAILED;
+        return;
+      }
+      proxy->buffer_sent += (size_t)sent;
+      continue;
+    }
+
+    // the buffer is the head's again
+    if (body->done) {
+      proxy->buffer_len = 0;
+      proxy->buffer_sent = 0;
+      proxy->phase = PROXY_WAITING;
+      return;
+    }
+
+    // a client holding the body back is asked for it once the backend has the head
+    if (proxy->continue_left > 0 && connection->in_len == 0) {
+      ssize_t sent = send_client(connection->client, continue_line + sizeof(continue_line) - 1 - proxy->continue_left,
+                                 proxy->continue_left, &client_result);
+      if (client_result == CLIENT_ERR_AGAIN) {
+        await(proxy, POLLOUT, 0, result);
+        return;
+      }
+      if (client_result != CLIENT_SUCCESS) {
+        *result = PROXY_ERR_BROKEN;
+        return;
+      }
+      proxy->continue_left -= (size_t)sent;
+      continue;
+    }
+
+    // take more of the body from the client
+    if (connection->in_len == 0) {
+      ssize_t received = recv_client(connection->client, connection->in, CONNECTION_BUFFER_LEN, &client_result);
+      if (client_result == CLIENT_ERR_AGAIN) {
+        await(proxy, POLLIN, 0, result);
+        return;
+      }
+      if (client_result != CLIENT_SUCCESS) {
+        metrics_client_result(client_result);
+        *result = PROXY_ERR_BROKEN;
+        return;
+      }
+      connection->in_len = (size_t)received;
+      metrics_count(METRIC_BYTES_RECEIVED, (uint64_t)received);
+    }
+
+    // decode what fits the buffer behind a chunk head, with room for its CRLF and the last chunk
+    size_t head = body->chunked ? BODY_CHUNK_HEAD_LEN : 0;
+    size_t room = PROXY_BUFFER_LEN - head - 2 - (sizeof(BODY_LAST_CHUNK) - 1);
+    size_t decoded;
+    body_result_t body_result;
+    size_t consumed = decode_body(body, connection->in, connection->in_len < room ? connection->in_len : room,
+                                  &decoded, &body_result);
+    if (body_result != BODY_SUCCESS) {
+      refuse_body(connection, proxy, body_result, result);
+      return;
+    }
+    proxy->body_taken = 1;
+    proxy->continue_left = 0;
+
+    // stage the piece, framed again if chunked
+    char* data = proxy->buffer + head;
+    memcpy(data, connection->in, decoded);
+    connection->in_len -= consumed;
+    memmove(connection->in, connection->in + consumed, connection->in_len);
+    proxy->buffer_sent = head;
+    proxy->buffer_len = head + decoded;
+    if (body->chunked && decoded > 0) {
+      proxy->buffer_sent -= put_chunk_head(data, decoded);
+      append(proxy->buffer, &proxy->buffer_len, "\r\n", 2);
+    }
+    if (body->chunked && body->done) {
+      append(proxy->buffer, &proxy->buffer_len, BODY_LAST_CHUNK, sizeof(BODY_LAST_CHUNK) - 1);
+    }
+  }
+}
+
+/**
+ * @brief Reads the response head and queues it for the client
+ *
+ * @param connection Connection struct
+ * @param proxy Proxy struct
+ * @param result Result of the operation
+ */
+static void read_head(connection_t* connection, proxy_t* proxy, proxy_result_t* result) {
+  upstream_backend_t* backend = proxy->upstream->backend;
+  client_result_t client_result;
+
+  // a head may already be buffered behind an interim response
+  char* head_end = proxy->buffer_len >= 4 ? memmem(proxy->buffer, proxy->buffer_len, "\r\n\r\n", 4) : NULL;
+  if (head_end == NULL) {
+    if (proxy->buffer_len == PROXY_BUFFER_LEN) {
+      fail_backend(backend);
+      *result = PROXY_ERR_FAILED;
+      return;
+    }
+
+    ssize_t received = recv_client(proxy->upstream->client, proxy->buffer + proxy->buffer_len,
+                                   PROXY_BUFFER_LEN - proxy->buffer_len, &client_result);
+    if (client_result == CLIENT_ERR_AGAIN) {
+      await(proxy, 0, POLLIN, result);
+      return;
+    }
+
+    // closed before answering, expected of a pooled connection
+    if (client_result != CLIENT_SUCCESS) {
+      if (proxy->buffer_len > 0 || !can_retry(proxy)) {
+        fail_backend(backend);
+        *result = PROXY_ERR_FAILED;
+      } else if (retry_proxy(connection, proxy, proxy->reused) == -1) {
+        *result = PROXY_ERR_FAILED;
+      }
+      return;
+    }
+
+    proxy->buffer_len += (size_t)received;
+    return;
+  }
+
+  size_t head_len = (size_t)(head_end + 4 - proxy->buffer);
+  int status = parse_head(connection, proxy, head_len);
+  if (status == -1) {
+    fail_backend(backend);
+    *result = PROXY_ERR_FAILED;
+    return;
+  }
+
+  // skip an interim response
+  if (status == 0) {
+    proxy->buffer_len -= head_len;
+    memmove(proxy->buffer, proxy->buffer + head_len, proxy->buffer_len);
+    return;
+  }
+  report_backend(backend, 1);
+  if (proxy->fill != NULL) {
+    begin_fill(proxy, head_len, status);
+  }
+
+  // body bytes that came with the head go out in the same write
+  ssize_t body = frame_body(proxy, proxy->buffer + head_len, proxy->buffer_len - head_len);
+  if (proxy->fill != NULL && body > 0) {
+    response_cache_append(proxy->fill, proxy->buffer + head_len, (size_t)body);
+  }
+  response_result_t response_result = RESPONSE_SUCCESS;
+  if (body > 0 && proxy->chunk_out) {
+    // the chunk head goes over the end of the head, already copied
+    size_t chunk_head = put_chunk_head(proxy->buffer + head_len, (size_t)body);
+    add_memory_segment(&connection->response, proxy->buffer + head_len - chunk_head, chunk_head + (size_t)body,
+                       &response_result);
+    if (response_result == RESPONSE_SUCCESS) {
+      add_memory_segment(&connection->response, "\r\n", 2, &response_result);
+    }
+  } else if (body > 0) {
+    add_memory_segment(&connection->response, proxy->buffer + head_len, (size_t)body, &response_result);
+  }
+  if (body == -1 || response_result != RESPONSE_SUCCESS) {
+    reset_response(&connection->response);
+    *result = PROXY_ERR_FAILED;
+    return;
+  }
+
+  proxy->buffer_len = 0;
+  proxy->buffer_sent = 0;
+  proxy->phase = PROXY_HEAD;
+}
+
+/**
+ * @brief Writes the rewritten head and the body bytes queued with it
+ *
+ * @param connection Connection struct
+ * @param proxy Proxy struct
+ * @param result Result of the operation
+ */
+static void write_head(connection_t* connection, proxy_t* proxy, proxy_result_t* result) {
+  response_result_t response_result;
+
+  write_response(connection->client, &connection->response, &response_result);
+  if (response_result == RESPONSE_ERR_AGAIN) {
+    await(proxy, POLLOUT, 0, result);
+    return;
+  }
+  if (response_result != RESPONSE_SUCCESS) {
+    *result = PROXY_ERR_BROKEN;
+    return;
+  }
+
+  proxy->phase = proxy->body_done ? PROXY_DONE : PROXY_BODY;
+}
+
+/**
+ * @brief Relays body bytes through a pipe without copying them
+ *
+ * @param connection Connection struct
+ * @param proxy Proxy struct
+ * @param result Result of the operation
+ */
+static void splice_body(connection_t* connection, proxy_t* proxy, proxy_result_t* result) {
+  upstream_conn_t* upstream = proxy->upstream;
+
+  while (1) {
+    // drain the pipe into the client first
+    if (proxy->pipe_len > 0) {
+      ssize_t moved = splice(upstream->pipe[0], NULL, connection->client->socket, NULL, proxy->pipe_len,
+                             SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+      if (moved == -1) {
+        if (errno == EAGAIN) {
+          await(proxy, POLLOUT, 0, result);
+        } else {
+          *result = PROXY_ERR_BROKEN;
+        }
+        return;
+      }
+      proxy->pipe_len -= (size_t)moved;
+      connection->response.sent += (size_t)moved;
+      continue;
+    }
+
+    if (proxy->body_done) {
+      proxy->phase = PROXY_DONE;
+      return;
+    }
+
+    // then refill it from the backend
+    size_t want = PROXY_SPLICE_LEN;
+    if (proxy->framing == FRAMING_LENGTH && proxy->remaining < want) {
+      want = (size_t)proxy->remaining;
+    }
+    ssize_t moved = splice(upstream->client->socket, NULL, upstream->pipe[1], NULL, want,
+                           SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+    if (moved == -1 && errno == EAGAIN) {
+      await(proxy, 0, POLLIN, result);
+      return;
+    }
+    if (moved == 0 && proxy->framing == FRAMING_CLOSE) {
+      proxy->body_done = 1;
+      continue;
+    }
+    if (moved <= 0) {
+      fail_backend(upstream->backend);
+      *result = PROXY_ERR_BROKEN;
+      return;
+    }
+
+    proxy->pipe_len = (size_t)moved;
+    if (proxy->framing == FRAMING_LENGTH) {
+      proxy->remaining -= (uint64_t)moved;
+      proxy->body_done = proxy->remaining == 0;
+    }
+  }
+}
+
+/**
+ * @brief Relays body bytes through the buffer
+ *
+ * @param connection Connection struct
+ * @param proxy Proxy struct
+ * @param result Result of the operation
+ */
+static void copy_body(connection_t* connection, proxy_t* proxy, proxy_result_t* result) {
+  upstream_conn_t* upstream = proxy->upstream;
+  client_result_t client_result;
+
+  while (1) {
+    // send what is buffered first
+    if (proxy->buffer_sent < proxy->buffer_len) {
+      ssize_t sent = send_client(connection->client, proxy->buffer + proxy->buffer_sent,
+                                 proxy->buffer_len - proxy->buffer_sent, &client_result);
+      if (client_result == CLIENT_ERR_AGAIN) {
+        await(proxy, POLLOUT, 0, result);
+        return;
+      }
+      if (client_result != CLIENT_SUCCESS) {
+        *result = PROXY_ERR_BROKEN;
+        return;
+      }
+      proxy->buffer_sent += (size_t)sent;
+      connection->response.sent += (size_t)sent;
+      continue;
+    }
+
+    if (proxy->body_done) {
+      proxy->phase = PROXY_DONE;
+      return;
+    }
+
+    // then refill it from the backend, behind room for a chunk head
+    size_t head = proxy->chunk_out ? BODY_CHUNK_HEAD_LEN : 0;
+    char* data = proxy->buffer + head;
+    ssize_t received = recv_client(upstream->client, data, PROXY_BUFFER_LEN - head - (head > 0 ? 2 : 0),
+                                   &client_result);
+    if (client_result == CLIENT_ERR_AGAIN) {
+      await(proxy, 0, POLLIN, result);
+      return;
+    }
+    if (client_result == CLIENT_ERR_CLOSED && proxy->framing == FRAMING_CLOSE) {
+      proxy->body_done = 1;
+      if (proxy->chunk_out) {
+        proxy->buffer_len = 0;
+        proxy->buffer_sent = 0;
+        append(proxy->buffer, &proxy->buffer_len, BODY_LAST_CHUNK, sizeof(BODY_LAST_CHUNK) - 1);
+      }
+      continue;
+    }
+    ssize_t body = client_result == CLIENT_SUCCESS ? frame_body(proxy, data, (size_t)received) : -1;
+    if (body == -1) {
+      fail_backend(upstream->backend);
+      *result = PROXY_ERR_BROKEN;
+      return;
+    }
+
+    if (proxy->fill != NULL) {
+      response_cache_append(proxy->fill, data, (size_t)body);
+    }
+    proxy->buffer_sent = head;
+    proxy->buffer_len = head + (size_t)body;
+    if (proxy->chunk_out) {
+      proxy->buffer_sent -= put_chunk_head(data, (size_t)body);
+      append(proxy->buffer, &proxy->buffer_len, "\r\n", 2);
+    }
+  }
+}
+
+/**
+ * @brief Relays the rest of the body
+ *
+ * A ring owns the receives of its sockets, chunked bodies have to be
+ * scanned or framed and filled ones stored, and OpenSSL has to seal what
+ * a TLS client gets without kTLS, so only bodies of plain sockets with a
+ * known end are spliced.
+ *
+ * @param connection Connection struct
+ * @param proxy Proxy struct
+ * @param result Result of the operation
+ */
+static void relay_body(connection_t* connection, proxy_t* proxy, proxy_result_t* result) {
+  upstream_conn_t* upstream = proxy->upstream;
+
+  if (proxy->pool->ring == NULL && proxy->framing != FRAMING_CHUNKED && !proxy->chunk_out && proxy->fill == NULL &&
+      can_splice_client(connection->client) && (upstream->pipe[0] != -1 || pipe2(upstream->pipe, O_NONBLOCK | O_CLOEXEC) == 0)) {
+    splice_body(connection, proxy, result);
+    return;
+  }
+
+  copy_body(connection, proxy, result);
+}
+
+/**
+ * @brief Relays the exchange until a socket would block or it ends
+ *
+ * @param connection Connection struct with a proxy
+ * @param result Result of the operation
+ * @note On anything but PROXY_ERR_AGAIN the backend connection is given
+ *       back and connection->proxy is NULL. PROXY_SUCCESS leaves the
+ *       relayed response to be finished like any other, PROXY_ERR_FAILED
+ *       means nothing reached the client yet and PROXY_ERR_BROKEN that the
+ *       response was cut short.
+ */
+void drive_proxy(connection_t* connection, proxy_result_t* result) {
+  proxy_t* proxy = connection->proxy;
+
+  // initialize result
+  *result = PROXY_SUCCESS;
+
+  while (proxy->phase != PROXY_DONE && *result == PROXY_SUCCESS) {
+    switch (proxy->phase) {
+      case PROXY_COALESCED:
+        coalesce(connection, proxy, result);
+        break;
+      case PROXY_SENDING:
+        send_request(connection, proxy, result);
+        break;
+      case PROXY_UPLOAD:
+        send_body(connection, proxy, result);
+        break;
+      case PROXY_WAITING:
+        read_head(connection, proxy, result);
+        break;
+      case PROXY_HEAD:
+        write_head(connection, proxy, result);
+        break;
+      default:
+        relay_body(connection, proxy, result);
+        break;
+    }
+  }
+
+  if (*result != PROXY_ERR_AGAIN) {
+    end_proxy(connection, *result == PROXY_SUCCESS && proxy->reusable);
+  }
+}
+
+/**
+ * @brief Gets the backend socket and the poll events it waits for
+ *
+ * @param proxy Proxy struct
+ * @param events Set to POLLIN, POLLOUT or 0
+ * @return int Socket of the backend connection or -1 if none
+ */
+int proxy_socket(const proxy_t* proxy, short* events) {
+  *events = proxy->upstream_events;
+  return proxy->upstream != NULL ? proxy->upstream->client->socket : -1;
+}
+
+/**
+ * @brief Checks whether the exchange waits for another request's fill
+ *
+ * Nothing wakes it, the caller drives it again every RESPONSE_CACHE_WAIT_MS.
+ *
+ * @param proxy Proxy struct
+ * @return int 1 while coalesced
+ */
+int proxy_coalesced(const proxy_t* proxy) {
+  return proxy->phase == PROXY_COALESCED;
+}
+
+/**
+ * @brief Checks whether the exchange waits on the request body
+ *
+ * @param proxy Proxy struct
+ * @return int 1 while the body is relayed to the backend
+ */
+int proxy_uploading(const proxy_t* proxy) {
+  return proxy->phase == PROXY_UPLOAD;
+}
+
+/**
+ * @brief Checks whether the client was sent anything yet
+ *
+ * @param proxy Proxy struct
+ * @return int 1 once the response head was queued
+ */
+int proxy_answered(const proxy_t* proxy) {
+  return proxy->phase >= PROXY_HEAD;
+}
+
+/**
+ * @brief Ends an exchange early and gives back its backend connection
+ *
+ * @param connection Connection struct with a proxy
+ * @param failed 1 to count it against the backend
+ */
+void abort_proxy(connection_t* connection, int failed) {
+  proxy_t* proxy = connection->proxy;
+
+  if (failed && proxy->upstream != NULL) {
+    fail_backend(proxy->upstream->backend);
+  }
+  end_proxy(connection, 0);
+}
@@ -1,29 +1,61 @@
+#include <strings.h>
+
 #include "request.h"
+#include "scan.h"
+
+/**
+ * @brief Makes a slice of a buffer
+ *
+ * @param buff Buffer
+ * @param start Offset of the first byte
+ * @param end Offset past the last byte
+ * @return slice_t Slice of the range
+ */
+static slice_t make_slice(const char* buff, size_t start, size_t end) {
+  slice_t slice;
+  slice.ptr = buff + start;
+  slice.len = end - start;
+  return slice;
+}
+
+/**
+ * @brief Compares a slice to a string, ignoring case
+ *
+ * @param slice Slice to compare
+ * @param str NUL-terminated string
+ * @return int 1 if equal, 0 otherwise
+ */
+int slice_equals(slice_t slice, const char* str) {
+  return strlen(str) == slice.len && strncasecmp(slice.ptr, str, slice.len) == 0;
+}
 
 /**
  * @brief Checks if a method is valid
  *
- * @param method Method string
+ * Any token is a method. Whether it is allowed depends on what serves the
+ * target, files answer GET and HEAD while proxied routes forward the rest.
+ *
+ * @param method Method slice
  * @return int 0 if valid, -1 if error
  */
-int is_valid_method(char method[METHOD_LEN]) {
-  // GET method
-  if (strcmp(method, "GET") == 0) {
-    return 0;
+int is_valid_method(slice_t method) {
+  // a non-empty token
+  if (method.len == 0 || scan_token(method.ptr, method.len) != method.len) {
+    return -1;
   }
 
-  return -1;
+  return 0;
 }
 
 /**
  * @brief Checks if a version is valid
  *
- * @param version Version string
+ * @param version Version slice
  * @return int 0 if valid, -1 if error
  */
-int is_valid_version(char version[VERSION_LEN]) {
+int is_valid_version(slice_t version) {
   // HTTP/1.1 version
-  if (strcmp(version, "1.1") == 0) {
+  if (version.len == 3 && memcmp(version.ptr, "1.1", 3) == 0) {
     return 0;
   }
 
@@ -31,107 +63,446 @@ int is_valid_version(char version[VERSION_LEN]) {
 }
 
 /**
- * @brief Checks if a file name is valid
+ * @brief Checks if a file path is valid
+ *
+ * Only the shape of the path is checked, so no system call is made.
+ * Whether the file exists is decided when it is served.
  *
- * @param file_name File name string
+ * @param path Path slice, without the leading slash
  * @return int 0 if valid, -1 if error
  */
-int is_valid_file(char file_name[FILE_NAME_LEN]) {
-  // check if file exists
-  if (access(file_name, F_OK) == 0) {
-    return 0;
+int is_valid_file(slice_t path) {
+  // must fit a file name and stay inside the document root
+  if (path.len >= FILE_NAME_LEN || (path.len > 0 && path.ptr[0] == '/')) {
+    return -1;
   }
 
-  return -1;
+  // reject parent directory segments
+  size_t segment = 0;
+  for (size_t i = 0; i <= path.len; i++) {
+    if (i == path.len || path.ptr[i] == '/') {
+      if (i - segment == 2 && path.ptr[segment] == '.' && path.ptr[segment + 1] == '.') {
+        return -1;
+      }
+      segment = i + 1;
+    }
+  }
+
+  return 0;
 }
 
 /**
- * @brief Parses a request
+ * @brief Checks if a path has a dot-segment
  *
- * @param raw_request Raw request string
- * @param result Result of the operation
- * @param cleanup Cleanup struct
- * @return request_t* Parsed request or NULL if error
+ * A segment of "." or ".." counts with its dots percent-encoded too, as
+ * a backend may decode them before it resolves the path.
+ *
+ * @param path Path slice, without the leading slash
+ * @return int 1 if it has a dot-segment, 0 otherwise
  */
-request_t* parse_request(const char raw_request[], request_result_t* result, request_cleanup_t* cleanup) {
-  // initialize result
-  *result = REQUEST_SUCCESS;
+int has_dot_segment(slice_t path) {
+  size_t segment = 0;
+  for (size_t i = 0; i <= path.len; i++) {
+    if (i < path.len && path.ptr[i] != '/') {
+      continue;
+    }
 
-  // initialize request
-  request_t* request = malloc(sizeof(request_t));
-  if (request == NULL) {
-    *result = REQUEST_ERR_MALLOC;
-    return NULL;
+    // count the dots, plain or %2e, that make up the whole segment
+    size_t dots = 0;
+    size_t j = segment;
+    while (j < i) {
+      if (path.ptr[j] == '.') {
+        j++;
+      } else if (i - j >= 3 && path.ptr[j] == '%' && path.ptr[j + 1] == '2' &&
+                 (path.ptr[j + 2] == 'e' || path.ptr[j + 2] == 'E')) {
+        j += 3;
+      } else {
+        break;
+      }
+      dots++;
+    }
+    if (j == i && (dots == 1 || dots == 2)) {
+      return 1;
+    }
+
+    segment = i + 1;
   }
 
-  // set cleanup allocation flag
-  cleanup->request_allocated = 1;
-  cleanup->request = request;
+  return 0;
+}
 
-  // initialize method
-  char method[METHOD_LEN] = {0};
+/**
+ * @brief Finds a header by name
+ *
+ * @param request Parsed request
+ * @param name Header name, matched case-insensitively
+ * @return const header_t* First matching header or NULL if missing
+ */
+const header_t* find_header(const request_t* request, const char* name) {
+  for (size_t i = 0; i < request->header_count; i++) {
+    if (slice_equals(request->headers[i].name, name)) {
+      return &request->headers[i];
+    }
+  }
+
+  return NULL;
+}
+
+/**
+ * @brief Checks if a header lists a token
+ *
+ * @param request Parsed request
+ * @param name Header name, matched case-insensitively
+ * @param token Token to look for, matched case-insensitively
+ * @return int 1 if the header contains the token, 0 otherwise
+ */
+int header_has_token(const request_t* request, const char* name, const char* token) {
+  for (size_t i = 0; i < request->header_count; i++) {
+    if (!slice_equals(request->headers[i].name, name)) {
+      continue;
+    }
+
+    // scan comma separated values
+    const char* value = request->headers[i].value.ptr;
+    const char* end = value + request->headers[i].value.len;
+    while (value < end) {
+      while (value < end && (*value == ' ' || *value == '\t' || *value == ',')) {
+        value++;
+      }
+
+      const char* value_end = value;
+      while (value_end < end && *value_end != ',' && *value_end != ' ' && *value_end != '\t') {
+        value_end++;
+      }
+
+      if (slice_equals(make_slice(value, 0, (size_t)(value_end - value)), token)) {
+        return 1;
+      }
 
-  // parse method
-  strncpy(method, raw_request, METHOD_LEN);
-  for (int i = 0; i < METHOD_LEN; i++) {
-    if (method[i] == ' ') {
-      method[i] = '\0';
-      break;
+      value = value_end;
     }
   }
 
-  // check method validity
-  if (is_valid_method(method) == -1) {
-    *result = REQUEST_ERR_INVALID_METHOD;
-    return NULL;
+  return 0;
+}
+
+/**
+ * @brief Copies the requested file path into a NUL-terminated buffer
+ *
+ * @param request Parsed request
+ * @param file_name Buffer to fill, defaults to index.html
+ */
+void request_file_name(const request_t* request, char file_name[FILE_NAME_LEN]) {
+  // default to index.html
+  if (request->path.len == 0) {
+    strncpy(file_name, "index.html", FILE_NAME_LEN);
+    return;
   }
 
-  // set method
-  strncpy(request->method, method, METHOD_LEN);
-  request->method[METHOD_LEN] = '\0';
+  // handle_request checks the path fits before serving a file
+  memcpy(file_name, request->path.ptr, request->path.len);
+  file_name[request->path.len] = '\0';
+}
 
-  // parse version
-  char* version = strstr(raw_request, HTTP_VERSION_PATTERN) + strlen(HTTP_VERSION_PATTERN);
-  for (int i = 0; i < VERSION_LEN; i++) {
-    if (version[i] == '\r') {
-      version[i] = '\0';
-      break;
-    }
+/**
+ * @brief Resets a parser for a new request
+ *
+ * @param parser Parser struct
+ */
+void init_request_parser(request_parser_t* parser) {
+  parser->state = PARSER_METHOD;
+  parser->offset = 0;
+  parser->mark = 0;
+}
+
+/**
+ * @brief Splits the path out of an origin-form target
+ *
+ * The path is not checked as a file name here, a proxied route forwards
+ * any target. Files check it once no route claims the target.
+ *
+ * @param request Request struct
+ * @return request_result_t REQUEST_SUCCESS or REQUEST_ERR_INVALID_FILE
+ */
+static request_result_t split_target(request_t* request) {
+  // only origin-form targets are served
+  if (request->target.len == 0 || request->target.ptr[0] != '/') {
+    return REQUEST_ERR_INVALID_FILE;
   }
 
-  // check version validity
-  if (is_valid_version(version) == -1) {
-    *result = REQUEST_ERR_INVALID_VERSION;
-    return NULL;
+  // drop the leading slash, query and fragment
+  size_t end = 1;
+  while (end < request->target.len && request->target.ptr[end] != '?' && request->target.ptr[end] != '#') {
+    end++;
   }
+  request->path = make_slice(request->target.ptr, 1, end);
 
-  // set version
-  strncpy(request->version, version, VERSION_LEN);
-  request->version[VERSION_LEN] = '\0';
+  return REQUEST_SUCCESS;
+}
 
-  // parse file name
-  char* file_name = strchr(raw_request, '/') + 1;
-  for (int i = 0; i < FILE_NAME_LEN; i++) {
-    if (file_name[i] == ' ') {
-      file_name[i] = '\0';
-      break;
+/**
+ * @brief Finds how the body of a request is framed
+ *
+ * Only chunked is decoded, and a request with both a length and chunked
+ * framing is refused rather than guessed at, since a proxy reading it the
+ * other way would see a second request in the body.
+ *
+ * @param request Request with its headers parsed
+ * @return request_result_t REQUEST_SUCCESS, REQUEST_ERR_MALFORMED,
+ *         REQUEST_ERR_BODY_TOO_LARGE or REQUEST_ERR_NOT_IMPLEMENTED
+ */
+static request_result_t parse_framing(request_t* request) {
+  int has_length = 0;
+  request->content_length = 0;
+  request->chunked = 0;
+
+  for (size_t i = 0; i < request->header_count; i++) {
+    const header_t* header = &request->headers[i];
+
+    if (slice_equals(header->name, "Transfer-Encoding")) {
+      if (request->chunked) {
+        return REQUEST_ERR_MALFORMED;
+      }
+      if (!slice_equals(header->value, "chunked")) {
+        return REQUEST_ERR_NOT_IMPLEMENTED;
+      }
+      request->chunked = 1;
+    } else if (slice_equals(header->name, "Content-Length")) {
+      // repeated lengths have to agree
+      uint64_t length = 0;
+      for (size_t j = 0; j < header->value.len; j++) {
+        char c = header->value.ptr[j];
+        if (c < '0' || c > '9') {
+          return REQUEST_ERR_MALFORMED;
+        }
+        if (j == 18) {
+          return REQUEST_ERR_BODY_TOO_LARGE;
+        }
+        length = length * 10 + (uint64_t)(c - '0');
+      }
+      if (header->value.len == 0 || (has_length && length != request->content_length)) {
+        return REQUEST_ERR_MALFORMED;
+      }
+      has_length = 1;
+      request->content_length = length;
     }
   }
 
-  // default to index.html
-  if (strcmp(file_name, "") == 0) {
-    strncpy(file_name, "index.html", FILE_NAME_LEN);
+  if (request->chunked && has_length) {
+    return REQUEST_ERR_MALFORMED;
   }
+  return REQUEST_SUCCESS;
+}
 
-  // check file name validity
-  if (is_valid_file(file_name) == -1) {
-    *result = REQUEST_ERR_INVALID_FILE;
-    return NULL;
+/**
+ * @brief Parses a request incrementally
+ *
+ * Call again with the same buffer, grown by newly received bytes, while
+ * the result is REQUEST_INCOMPLETE. Nothing is allocated or copied.
+ *
+ * @param parser Parser struct
+ * @param request Request to fill
+ * @param buff Buffer holding the request from its first byte
+ * @param buff_len Number of valid bytes in the buffer
+ * @param result Result of the operation
+ */
+void parse_request(request_parser_t* parser, request_t* request, const char buff[], size_t buff_len,
+                   request_result_t* result) {
+  // initialize result
+  *result = REQUEST_INCOMPLETE;
+
+  // a fresh request starts empty
+  if (parser->state == PARSER_METHOD && parser->offset == parser->mark) {
+    request->header_count = 0;
   }
 
-  // set file_name
-  strncpy(request->file_name, file_name, FILE_NAME_LEN);
-  request->file_name[FILE_NAME_LEN] = '\0';
+  size_t offset = parser->offset;
+  while (offset < buff_len) {
+    char c;
+
+    switch (parser->state) {
+      case PARSER_METHOD:
+        // tolerate empty lines before the request line
+        if (offset == parser->mark && (buff[offset] == '\r' || buff[offset] == '\n')) {
+          parser->mark = ++offset;
+          break;
+        }
+
+        offset += scan_token(buff + offset, buff_len - offset);
+        if (offset == buff_len) {
+          break;
+        }
+
+        if (buff[offset] != ' ' || offset == parser->mark) {
+          *result = REQUEST_ERR_MALFORMED;
+          return;
+        }
+
+        request->method = make_slice(buff, parser->mark, offset);
+        if (is_valid_method(request->method) == -1) {
+          *result = REQUEST_ERR_INVALID_METHOD;
+          return;
+        }
+
+        parser->mark = ++offset;
+        parser->state = PARSER_TARGET;
+        break;
+
+      case PARSER_TARGET:
+        offset += scan_target(buff + offset, buff_len - offset);
+        if (offset == buff_len) {
+          break;
+        }
+
+        if (buff[offset] != ' ' || offset == parser->mark) {
+          *result = REQUEST_ERR_MALFORMED;
+          return;
+        }
+
+        request->target = make_slice(buff, parser->mark, offset);
+        *result = split_target(request);
+        if (*result != REQUEST_SUCCESS) {
+          return;
+        }
+        *result = REQUEST_INCOMPLETE;
 
-  return request;
-}
\ No newline at end of file
+        parser->mark = ++offset;
+        parser->state = PARSER_VERSION;
+        break;
+
+      case PARSER_VERSION:
+        offset += scan_target(buff + offset, buff_len - offset);
+        if (offset == buff_len) {
+          break;
+        }
+
+        if (buff[offset] != '\r') {
+          *result = REQUEST_ERR_MALFORMED;
+          return;
+        }
+
+        // strip and check the protocol name
+        if (offset - parser->mark < strlen(HTTP_VERSION_PATTERN) ||
+            memcmp(buff + parser->mark, HTTP_VERSION_PATTERN, strlen(HTTP_VERSION_PATTERN)) != 0) {
+          *result = REQUEST_ERR_INVALID_VERSION;
+          return;
+        }
+
+        request->version = make_slice(buff, parser->mark + strlen(HTTP_VERSION_PATTERN), offset);
+        if (is_valid_version(request->version) == -1) {
+          *result = REQUEST_ERR_INVALID_VERSION;
+          return;
+        }
+
+        offset++;
+        parser->state = PARSER_REQUEST_LINE_LF;
+        break;
+
+      case PARSER_REQUEST_LINE_LF:
+      case PARSER_HEADER_LF:
+        if (buff[offset] != '\n') {
+          *result = REQUEST_ERR_MALFORMED;
+          return;
+        }
+
+        offset++;
+        parser->state = PARSER_HEADER_START;
+        break;
+
+      case PARSER_HEADER_START:
+        // an empty line ends the headers
+        if (buff[offset] == '\r') {
+          offset++;
+          parser->state = PARSER_HEADERS_END_LF;
+          break;
+        }
+
+        if (request->header_count == REQUEST_MAX_HEADERS) {
+          *result = REQUEST_ERR_TOO_MANY_HEADERS;
+          return;
+        }
+
+        parser->mark = offset;
+        parser->state = PARSER_HEADER_NAME;
+        break;
+
+      case PARSER_HEADER_NAME:
+        offset += scan_token(buff + offset, buff_len - offset);
+        if (offset == buff_len) {
+          break;
+        }
+
+        if (buff[offset] != ':' || offset == parser->mark) {
+          *result = REQUEST_ERR_MALFORMED;
+          return;
+        }
+
+        request->headers[request->header_count].name = make_slice(buff, parser->mark, offset);
+        offset++;
+        parser->state = PARSER_HEADER_VALUE_START;
+        break;
+
+      case PARSER_HEADER_VALUE_START:
+        // skip leading whitespace
+        c = buff[offset];
+        if (c == ' ' || c == '\t') {
+          offset++;
+          break;
+        }
+
+        parser->mark = offset;
+        parser->state = PARSER_HEADER_VALUE;
+        break;
+
+      case PARSER_HEADER_VALUE: {
+        offset += scan_value(buff + offset, buff_len - offset);
+        if (offset == buff_len) {
+          break;
+        }
+
+        if (buff[offset] != '\r') {
+          *result = REQUEST_ERR_MALFORMED;
+          return;
+        }
+
+        // trim trailing whitespace
+        size_t end = offset;
+        while (end > parser->mark && (buff[end - 1] == ' ' || buff[end - 1] == '\t')) {
+          end--;
+        }
+
+        request->headers[request->header_count].value = make_slice(buff, parser->mark, end);
+        request->header_count++;
+        offset++;
+        parser->state = PARSER_HEADER_LF;
+        break;
+      }
+
+      case PARSER_HEADERS_END_LF:
+        if (buff[offset] != '\n') {
+          *result = REQUEST_ERR_MALFORMED;
+          return;
+        }
+
+        // request head is complete
+        offset++;
+        parser->state = PARSER_DONE;
+        parser->offset = offset;
+        request->length = offset;
+
+        // HTTP/1.1 connections persist unless the client asks to close
+        request->keep_alive = !header_has_token(request, "Connection", "close");
+
+        // the body follows the head, the caller reads it
+        *result = parse_framing(request);
+        return;
+
+      case PARSER_DONE:
+        *result = REQUEST_SUCCESS;
+        return;
+    }
+  }
+
+  // remember where to resume
+  parser->offset = offset;
+}
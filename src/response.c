@@ -0,0 +1,330 @@
+#include <stdio.h>
+
+#include "response.h"
+#include "metrics.h"
+#include "status.h"
+
+/** Maximum number of buffers gathered into one writev() */
+#define RESPONSE_MAX_IOV RESPONSE_MAX_SEGMENTS
+
+/**
+ * @brief Initializes an empty response
+ *
+ * @param response Response struct
+ * @param arena Arena the headers are allocated from
+ */
+void init_response(response_t* response, arena_t* arena) {
+  response->arena = arena;
+  response->header = NULL;
+  response->header_len = 0;
+  response->segment_count = 0;
+  response->current = 0;
+  response->fd = -1;
+  response->release = NULL;
+  response->owner = NULL;
+  response->status = 0;
+  response->sent = 0;
+  response->body_offset = 0;
+}
+
+/**
+ * @brief Releases what the response owns and empties it
+ *
+ * @param response Response struct
+ */
+void reset_response(response_t* response) {
+  // close owned file
+  if (response->fd != -1) {
+    close(response->fd);
+  }
+
+  // release borrowed memory
+  if (response->release != NULL) {
+    response->release(response->owner);
+  }
+
+  init_response(response, response->arena);
+}
+
+/**
+ * @brief Appends bytes to the response headers
+ *
+ * @param response Response struct
+ * @param data Bytes to copy
+ * @param len Number of bytes
+ * @return int 0 if successful, -1 if the headers do not fit
+ */
+int append_header_bytes(response_t* response, const char* data, size_t len) {
+  // headers live in the arena until the response is done
+  if (response->header == NULL) {
+    pool_result_t pool_result;
+    response->header = arena_alloc(response->arena, RESPONSE_HEADER_LEN, &pool_result);
+    if (response->header == NULL) {
+      return -1;
+    }
+  }
+
+  if (len > RESPONSE_HEADER_LEN - response->header_len) {
+    return -1;
+  }
+
+  memcpy(response->header + response->header_len, data, len);
+  response->header_len += len;
+  return 0;
+}
+
+/**
+ * @brief Appends a string to the response headers
+ *
+ * @param response Response struct
+ * @param str NUL-terminated string
+ * @return int 0 if successful, -1 if the headers do not fit
+ */
+int append_header_string(response_t* response, const char* str) {
+  return append_header_bytes(response, str, strlen(str));
+}
+
+/**
+ * @brief Appends a decimal number to the response headers
+ *
+ * @param response Response struct
+ * @param value Number to write
+ * @return int 0 if successful, -1 if the headers do not fit
+ */
+int append_header_number(response_t* response, uint64_t value) {
+  // digits come out in reverse
+  char digits[20];
+  size_t len = sizeof(digits);
+  do {
+    digits[--len] = (char)('0' + value % 10);
+    value /= 10;
+  } while (value > 0);
+
+  return append_header_bytes(response, digits + len, sizeof(digits) - len);
+}
+
+/**
+ * @brief Claims the next free segment
+ *
+ * @param response Response struct
+ * @param result Result of the operation
+ * @return response_segment_t* Free segment or NULL if full
+ */
+static response_segment_t* next_segment(response_t* response, response_result_t* result) {
+  *result = RESPONSE_SUCCESS;
+
+  if (response->segment_count == RESPONSE_MAX_SEGMENTS) {
+    *result = RESPONSE_ERR_FULL;
+    return NULL;
+  }
+
+  return &response->segments[response->segment_count++];
+}
+
+/**
+ * @brief Appends the Date line and the blank line, then queues the headers
+ *
+ * Segments queued before hold the lines in front of these, so static
+ * header blocks are sent as they are, in the same writev().
+ *
+ * @param response Response struct
+ * @param result Result of the operation
+ */
+void end_headers(response_t* response, response_result_t* result) {
+  char date[STATUS_DATE_LINE_LEN];
+  copy_date_line(date);
+  if (append_header_bytes(response, date, sizeof(date)) == -1 || append_header_bytes(response, "\r\n", 2) == -1) {
+    *result = RESPONSE_ERR_FULL;
+    return;
+  }
+
+  add_memory_segment(response, response->header, response->header_len, result);
+
+  // everything queued so far is head
+  response->body_offset = 0;
+  for (int i = 0; i < response->segment_count; i++) {
+    response->body_offset += response->segments[i].len;
+  }
+}
+
+/**
+ * @brief Counts the body bytes sent so far
+ *
+ * @param response Response struct
+ * @return size_t Bytes sent past the head, 0 if it was not sent whole
+ */
+size_t body_sent(const response_t* response) {
+  return response->sent > response->body_offset ? response->sent - response->body_offset : 0;
+}
+
+/**
+ * @brief Drops the segments queued after the headers
+ *
+ * Answers HEAD with the headers of the response GET would get, the
+ * Content-Length included. What the response owns is still released on
+ * reset.
+ *
+ * @param response Response struct with its headers ended
+ */
+void drop_body(response_t* response) {
+  for (int i = 0; i < response->segment_count; i++) {
+    if (response->segments[i].type == SEGMENT_MEMORY && response->segments[i].data == response->header) {
+      response->segment_count = i + 1;
+      return;
+    }
+  }
+}
+
+/**
+ * @brief Queues a memory segment
+ *
+ * @param response Response struct
+ * @param data Bytes to send, must outlive the response
+ * @param len Number of bytes
+ * @param result Result of the operation
+ */
+void add_memory_segment(response_t* response, const char* data, size_t len, response_result_t* result) {
+  response_segment_t* segment = next_segment(response, result);
+  if (segment == NULL) {
+    return;
+  }
+
+  segment->type = SEGMENT_MEMORY;
+  segment->data = data;
+  segment->fd = -1;
+  segment->offset = 0;
+  segment->len = len;
+}
+
+/**
+ * @brief Queues a file segment
+ *
+ * @param response Response struct
+ * @param fd Open file to send from
+ * @param offset Offset of the first byte
+ * @param len Number of bytes
+ * @param result Result of the operation
+ */
+void add_file_segment(response_t* response, int fd, off_t offset, size_t len, response_result_t* result) {
+  response_segment_t* segment = next_segment(response, result);
+  if (segment == NULL) {
+    return;
+  }
+
+  segment->type = SEGMENT_FILE;
+  segment->data = NULL;
+  segment->fd = fd;
+  segment->offset = offset;
+  segment->len = len;
+}
+
+/**
+ * @brief Sends the run of memory segments at the current position
+ *
+ * @param client Client to send to
+ * @param response Response struct
+ * @param result Result of the operation
+ */
+static void write_memory_segments(client_t* client, response_t* response, response_result_t* result) {
+  struct iovec iov[RESPONSE_MAX_IOV];
+  int iov_count = 0;
+  client_result_t client_result;
+
+  // gather consecutive memory segments
+  for (int i = response->current; i < response->segment_count && iov_count < RESPONSE_MAX_IOV; i++) {
+    if (response->segments[i].type != SEGMENT_MEMORY) {
+      break;
+    }
+
+    iov[iov_count].iov_base = (void*)response->segments[i].data;
+    iov[iov_count].iov_len = response->segments[i].len;
+    iov_count++;
+  }
+
+  // send them together
+  ssize_t sent = writev_client(client, iov, iov_count, &client_result);
+  if (client_result != CLIENT_SUCCESS) {
+    if (client_result != CLIENT_ERR_AGAIN) {
+      metrics_client_result(client_result);
+    }
+    *result = client_result == CLIENT_ERR_AGAIN ? RESPONSE_ERR_AGAIN : RESPONSE_ERR_SEND;
+    return;
+  }
+
+  // advance past what was sent, which may end mid-segment
+  size_t remaining = (size_t)sent;
+  response->sent += remaining;
+  while (remaining > 0) {
+    response_segment_t* segment = &response->segments[response->current];
+    size_t consumed = remaining < segment->len ? remaining : segment->len;
+
+    segment->data += consumed;
+    segment->len -= consumed;
+    remaining -= consumed;
+
+    if (segment->len == 0) {
+      response->current++;
+    }
+  }
+}
+
+/**
+ * @brief Sends the file segment at the current position
+ *
+ * @param client Client to send to
+ * @param response Response struct
+ * @param result Result of the operation
+ */
+static void write_file_segment(client_t* client, response_t* response, response_result_t* result) {
+  response_segment_t* segment = &response->segments[response->current];
+  client_result_t client_result;
+
+  // stream from the page cache, sendfile advances the offset
+  ssize_t sent = sendfile_client(client, segment->fd, &segment->offset, segment->len, &client_result);
+  if (client_result != CLIENT_SUCCESS) {
+    if (client_result != CLIENT_ERR_AGAIN) {
+      metrics_client_result(client_result);
+    }
+    *result = client_result == CLIENT_ERR_AGAIN ? RESPONSE_ERR_AGAIN : RESPONSE_ERR_SEND;
+    return;
+  }
+
+  segment->len -= (size_t)sent;
+  response->sent += (size_t)sent;
+  if (segment->len == 0) {
+    response->current++;
+  }
+}
+
+/**
+ * @brief Sends as much of the response as the socket accepts
+ *
+ * @param client Client to send to
+ * @param response Response struct
+ * @param result Result of the operation
+ * @note result is RESPONSE_ERR_AGAIN if a non-blocking socket would block
+ *       before the response was fully sent
+ */
+void write_response(client_t* client, response_t* response, response_result_t* result) {
+  // initialize result
+  *result = RESPONSE_SUCCESS;
+
+  while (response->current < response->segment_count) {
+    // skip empty segments
+    if (response->segments[response->current].len == 0) {
+      response->current++;
+      continue;
+    }
+
+    // send the next run
+    if (response->segments[response->current].type == SEGMENT_MEMORY) {
+      write_memory_segments(client, response, result);
+    } else {
+      write_file_segment(client, response, result);
+    }
+
+    if (*result != RESPONSE_SUCCESS) {
+      return;
+    }
+  }
+}
@@ -0,0 +1,1026 @@
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <fcntl.h>
+#include <time.h>
+
+#include "response_cache.h"
+
+/** Response headers that describe the connection or the moment, not the response */
+static const char* unstored_headers[] = {
+  "Connection", "Keep-Alive", "Proxy-Connection", "Transfer-Encoding", "Date", "Age"
+};
+
+/**
+ * @brief Gets the monotonic time
+ *
+ * @return int64_t Milliseconds since an arbitrary point
+ */
+static int64_t cache_now_ms(void) {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (int64_t)now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+/**
+ * @brief Hashes a method and target with FNV-1a
+ *
+ * @param method Request method
+ * @param target Request target
+ * @return uint64_t Hash of the key
+ */
+static uint64_t hash_key(slice_t method, slice_t target) {
+  uint64_t hash = 14695981039346656037ULL;
+  for (size_t i = 0; i < method.len; i++) {
+    hash ^= (unsigned char)method.ptr[i];
+    hash *= 1099511628211ULL;
+  }
+  hash ^= ' ';
+  hash *= 1099511628211ULL;
+  for (size_t i = 0; i < target.len; i++) {
+    hash ^= (unsigned char)target.ptr[i];
+    hash *= 1099511628211ULL;
+  }
+  return hash;
+}
+
+/**
+ * @brief Gets the shard of a key
+ *
+ * Targets often differ in their last bytes only, which FNV-1a's last
+ * multiplication leaves out of bits 32 to 39, so the shard comes from
+ * the bits above.
+ *
+ * @param cache Response cache struct
+ * @param hash Hash of the key
+ * @return response_cache_shard_t* Shard holding the key
+ */
+static response_cache_shard_t* shard_of(response_cache_t* cache, uint64_t hash) {
+  return &cache->shards[(hash >> 40) % RESPONSE_CACHE_SHARDS];
+}
+
+/**
+ * @brief Checks whether an entry is keyed by a request's method and target
+ *
+ * @param entry Response cache entry struct
+ * @param request Parsed request
+ * @return int 1 if the keys are equal
+ */
+static int key_matches(const response_cache_entry_t* entry, const request_t* request) {
+  return entry->key_len == request->method.len + 1 + request->target.len &&
+         memcmp(entry->key, request->method.ptr, request->method.len) == 0 &&
+         memcmp(entry->key + request->method.len + 1, request->target.ptr, request->target.len) == 0;
+}
+
+/**
+ * @brief Checks whether two entries are keyed the same
+ *
+ * @param a Response cache entry struct
+ * @param b Response cache entry struct
+ * @return int 1 if the keys are equal
+ */
+static int same_key(const response_cache_entry_t* a, const response_cache_entry_t* b) {
+  return a->hash == b->hash && a->key_len == b->key_len && memcmp(a->key, b->key, a->key_len) == 0;
+}
+
+/**
+ * @brief Checks whether two entries were stored for the same Vary values
+ *
+ * @param a Response cache entry struct
+ * @param b Response cache entry struct
+ * @return int 1 if they are the same variant
+ */
+static int same_variant(const response_cache_entry_t* a, const response_cache_entry_t* b) {
+  return a->vary_len == b->vary_len && (a->vary_len == 0 || memcmp(a->vary, b->vary, a->vary_len) == 0);
+}
+
+/**
+ * @brief Gets the value of a request header
+ *
+ * @param request Parsed request
+ * @param name Header name, matched ignoring case
+ * @param name_len Length of the name
+ * @return slice_t Value of the first such header, empty if missing
+ */
+static slice_t header_value(const request_t* request, const char* name, size_t name_len) {
+  for (size_t i = 0; i < request->header_count; i++) {
+    const header_t* header = &request->headers[i];
+    if (header->name.len == name_len && strncasecmp(header->name.ptr, name, name_len) == 0) {
+      return header->value;
+    }
+  }
+
+  slice_t empty = { "", 0 };
+  return empty;
+}
+
+/**
+ * @brief Checks whether a request carries the Vary values of an entry
+ *
+ * @param entry Response cache entry struct
+ * @param request Parsed request
+ * @return int 1 if every header the response varies by has the stored value
+ */
+static int vary_matches(const response_cache_entry_t* entry, const request_t* request) {
+  const char* line = entry->vary;
+  const char* end = entry->vary + entry->vary_len;
+  while (line < end) {
+    const char* colon = memchr(line, ':', (size_t)(end - line));
+    const char* line_end = memchr(colon, '\n', (size_t)(end - colon));
+
+    slice_t value = header_value(request, line, (size_t)(colon - line));
+    if (value.len != (size_t)(line_end - colon - 1) || memcmp(value.ptr, colon + 1, value.len) != 0) {
+      return 0;
+    }
+    line = line_end + 1;
+  }
+  return 1;
+}
+
+/**
+ * @brief Gets the bytes an entry counts against its tier
+ *
+ * @param entry Response cache entry struct
+ * @return size_t Charged bytes, only the body on disk
+ */
+static size_t entry_cost(const response_cache_entry_t* entry) {
+  if (entry->disk) {
+    return entry->body_len;
+  }
+  return sizeof(response_cache_entry_t) + entry->key_len + entry->vary_len + entry->head_len +
+         (entry->body != NULL ? entry->body_len : 0);
+}
+
+/**
+ * @brief Creates a response cache
+ *
+ * @param capacity Memory budget, split evenly across shards
+ * @param dir Directory of the disk tier or NULL for none
+ * @param result Result of the operation
+ * @return response_cache_t* Pointer to new cache or NULL if error
+ */
+response_cache_t* create_response_cache(size_t capacity, const char* dir, response_cache_result_t* result) {
+  // initialize result
+  *result = RESPONSE_CACHE_SUCCESS;
+
+  // initialize cache
+  response_cache_t* cache = calloc(1, sizeof(response_cache_t));
+  if (cache == NULL) {
+    *result = RESPONSE_CACHE_ERR_MALLOC;
+    return NULL;
+  }
+
+  // a response must fit in its shard to be kept
+  cache->shard_capacity = capacity / RESPONSE_CACHE_SHARDS;
+  cache->max_entry_size = RESPONSE_CACHE_MAX_ENTRY_SIZE;
+  if (cache->max_entry_size > cache->shard_capacity / 2) {
+    cache->max_entry_size = cache->shard_capacity / 2;
+  }
+  cache->dir_fd = -1;
+
+  // disk entries are unlinked files, nothing is left behind to clean up
+  if (dir != NULL) {
+    cache->dir_fd = open(dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    int probe = cache->dir_fd != -1 ? openat(cache->dir_fd, ".", O_TMPFILE | O_RDWR | O_CLOEXEC, 0600) : -1;
+    if (probe == -1) {
+      if (cache->dir_fd != -1) {
+        close(cache->dir_fd);
+      }
+      free(cache);
+      *result = RESPONSE_CACHE_ERR_DISK;
+      return NULL;
+    }
+    close(probe);
+    cache->disk_capacity = cache->shard_capacity * RESPONSE_CACHE_DISK_RATIO;
+  }
+
+  for (int i = 0; i < RESPONSE_CACHE_SHARDS; i++) {
+    pthread_mutex_init(&cache->shards[i].lock, NULL);
+  }
+
+  return cache;
+}
+
+/**
+ * @brief Frees an entry
+ *
+ * @param entry Response cache entry struct
+ */
+static void free_entry(response_cache_entry_t* entry) {
+  if (entry->fd != -1) {
+    close(entry->fd);
+  }
+  free(entry->key);
+  free(entry->vary);
+  free(entry->head);
+  free(entry->body);
+  free(entry);
+}
+
+/**
+ * @brief Drops a reference taken by response_cache_lookup
+ *
+ * @param entry Response cache entry struct
+ */
+void response_cache_release(response_cache_entry_t* entry) {
+  if (__atomic_sub_fetch(&entry->refs, 1, __ATOMIC_ACQ_REL) == 0) {
+    free_entry(entry);
+  }
+}
+
+/**
+ * @brief Creates an entry keyed by a request
+ *
+ * @param request Parsed request
+ * @param hash Hash of the key
+ * @return response_cache_entry_t* Entry with one reference or NULL if error
+ */
+static response_cache_entry_t* new_entry(const request_t* request, uint64_t hash) {
+  response_cache_entry_t* entry = calloc(1, sizeof(response_cache_entry_t));
+  if (entry == NULL) {
+    return NULL;
+  }
+  entry->fd = -1;
+
+  entry->key_len = request->method.len + 1 + request->target.len;
+  entry->key = malloc(entry->key_len);
+  if (entry->key == NULL) {
+    free(entry);
+    return NULL;
+  }
+  memcpy(entry->key, request->method.ptr, request->method.len);
+  entry->key[request->method.len] = ' ';
+  memcpy(entry->key + request->method.len + 1, request->target.ptr, request->target.len);
+
+  entry->hash = hash;
+  entry->filling = 1;
+  entry->refs = 1;
+  return entry;
+}
+
+/**
+ * @brief Unlinks an entry from its shard and drops the shard reference
+ *
+ * @param shard Response cache shard struct
+ * @param entry Response cache entry struct
+ * @note Caller holds the shard lock
+ */
+static void remove_entry(response_cache_shard_t* shard, response_cache_entry_t* entry) {
+  // unlink from the hash chain
+  response_cache_entry_t** link = &shard->buckets[entry->hash % RESPONSE_CACHE_BUCKETS];
+  while (*link != entry) {
+    link = &(*link)->next;
+  }
+  *link = entry->next;
+
+  // unlink from the CLOCK ring of its tier
+  response_cache_entry_t** hand = entry->disk ? &shard->disk_hand : &shard->hand;
+  if (entry->clock_next == entry) {
+    *hand = NULL;
+  } else {
+    entry->clock_prev->clock_next = entry->clock_next;
+    entry->clock_next->clock_prev = entry->clock_prev;
+    if (*hand == entry) {
+      *hand = entry->clock_next;
+    }
+  }
+
+  if (entry->disk) {
+    shard->disk_used -= entry->cost;
+    shard->disk_count--;
+  } else {
+    shard->used -= entry->cost;
+  }
+  entry->linked = 0;
+  response_cache_release(entry);
+}
+
+/**
+ * @brief Checks whether an evicted entry is worth a file of the disk tier
+ *
+ * @param cache Response cache struct
+ * @param entry Response cache entry struct
+ * @param now Current monotonic ms
+ * @return int 1 if it should move to disk
+ */
+static int is_demotable(const response_cache_t* cache, const response_cache_entry_t* entry, int64_t now) {
+  return cache->disk_capacity > 0 && !entry->filling && !entry->pass && entry->body != NULL &&
+         entry->body_len >= RESPONSE_CACHE_DISK_MIN &&
+         entry->body_len <= cache->disk_capacity && now < entry->stale_until;
+}
+
+/**
+ * @brief Evicts memory entries with the CLOCK algorithm until the shard fits
+ *
+ * @param cache Response cache struct
+ * @param shard Response cache shard struct
+ * @return response_cache_entry_t* Referenced entries to move to disk,
+ *         linked through evicted
+ * @note Caller holds the shard lock
+ */
+static response_cache_entry_t* evict_entries(response_cache_t* cache, response_cache_shard_t* shard) {
+  response_cache_entry_t* demoted = NULL;
+  int64_t now = cache_now_ms();
+
+  while (shard->used > cache->shard_capacity && shard->hand != NULL) {
+    response_cache_entry_t* entry = shard->hand;
+
+    // give recently used entries a second chance
+    if (entry->referenced) {
+      entry->referenced = 0;
+      shard->hand = entry->clock_next;
+      continue;
+    }
+
+    // the body is written out once the lock is dropped
+    if (is_demotable(cache, entry, now)) {
+      __atomic_add_fetch(&entry->refs, 1, __ATOMIC_RELAXED);
+      entry->evicted = demoted;
+      demoted = entry;
+    }
+    remove_entry(shard, entry);
+  }
+
+  return demoted;
+}
+
+/**
+ * @brief Evicts disk entries with the CLOCK algorithm until the shard fits
+ *
+ * @param cache Response cache struct
+ * @param shard Response cache shard struct
+ * @note Caller holds the shard lock
+ */
+static void evict_disk_entries(response_cache_t* cache, response_cache_shard_t* shard) {
+  while ((shard->disk_used > cache->disk_capacity || shard->disk_count > RESPONSE_CACHE_DISK_ENTRIES) &&
+         shard->disk_hand != NULL) {
+    response_cache_entry_t* entry = shard->disk_hand;
+    if (entry->referenced) {
+      entry->referenced = 0;
+      shard->disk_hand = entry->clock_next;
+      continue;
+    }
+    remove_entry(shard, entry);
+  }
+}
+
+/**
+ * @brief Links an entry into its shard and the ring of its tier
+ *
+ * @param cache Response cache struct
+ * @param shard Response cache shard struct
+ * @param entry Response cache entry struct holding a reference for the shard
+ * @return response_cache_entry_t* Evicted memory entries to move to disk
+ * @note Caller holds the shard lock
+ */
+static response_cache_entry_t* insert_entry(response_cache_t* cache, response_cache_shard_t* shard,
+                                            response_cache_entry_t* entry) {
+  // link into the hash chain, newest first
+  response_cache_entry_t** bucket = &shard->buckets[entry->hash % RESPONSE_CACHE_BUCKETS];
+  entry->next = *bucket;
+  *bucket = entry;
+
+  // link behind the hand so it is inspected last
+  response_cache_entry_t** hand = entry->disk ? &shard->disk_hand : &shard->hand;
+  if (*hand == NULL) {
+    entry->clock_prev = entry;
+    entry->clock_next = entry;
+    *hand = entry;
+  } else {
+    entry->clock_next = *hand;
+    entry->clock_prev = (*hand)->clock_prev;
+    (*hand)->clock_prev->clock_next = entry;
+    (*hand)->clock_prev = entry;
+  }
+
+  entry->linked = 1;
+  entry->cost = entry_cost(entry);
+  if (entry->disk) {
+    shard->disk_used += entry->cost;
+    shard->disk_count++;
+    evict_disk_entries(cache, shard);
+    return NULL;
+  }
+
+  shard->used += entry->cost;
+  return evict_entries(cache, shard);
+}
+
+/**
+ * @brief Copies bytes into a new allocation
+ *
+ * @param data Bytes to copy or NULL
+ * @param len Number of bytes
+ * @return char* Copy, NULL if data is NULL or on error
+ */
+static char* copy_bytes(const char* data, size_t len) {
+  if (data == NULL) {
+    return NULL;
+  }
+
+  char* copy = malloc(len > 0 ? len : 1);
+  if (copy != NULL) {
+    memcpy(copy, data, len);
+  }
+  return copy;
+}
+
+/**
+ * @brief Writes the body of an evicted entry to an unlinked file
+ *
+ * @param cache Response cache struct
+ * @param entry Memory entry
+ * @return response_cache_entry_t* Disk entry with one reference or NULL if error
+ */
+static response_cache_entry_t* write_disk_entry(response_cache_t* cache, const response_cache_entry_t* entry) {
+  int fd = openat(cache->dir_fd, ".", O_TMPFILE | O_RDWR | O_CLOEXEC, 0600);
+  if (fd == -1) {
+    log_message(LOG_ERROR, "Failed to create cache file: %s\n", strerror(errno));
+    return NULL;
+  }
+
+  size_t written = 0;
+  while (written < entry->body_len) {
+    ssize_t bytes = write(fd, entry->body + written, entry->body_len - written);
+    if (bytes <= 0) {
+      close(fd);
+      return NULL;
+    }
+    written += (size_t)bytes;
+  }
+
+  response_cache_entry_t* copy = calloc(1, sizeof(response_cache_entry_t));
+  if (copy == NULL) {
+    close(fd);
+    return NULL;
+  }
+  *copy = *entry;
+  copy->fd = fd;
+  copy->body = NULL;
+  copy->key = copy_bytes(entry->key, entry->key_len);
+  copy->vary = copy_bytes(entry->vary, entry->vary_len);
+  copy->head = copy_bytes(entry->head, entry->head_len);
+  copy->linked = 0;
+  copy->disk = 1;
+  copy->refs = 1;
+  copy->referenced = 0;
+  copy->evicted = NULL;
+  if (copy->key == NULL || copy->head == NULL || (entry->vary != NULL && copy->vary == NULL)) {
+    free_entry(copy);
+    return NULL;
+  }
+
+  return copy;
+}
+
+/**
+ * @brief Checks whether a shard holds a newer answer for an entry's request
+ *
+ * @param shard Response cache shard struct
+ * @param entry Response cache entry struct
+ * @return int 1 if a stored variant or marker of its key supersedes it
+ * @note Caller holds the shard lock
+ */
+static int is_superseded(const response_cache_shard_t* shard, const response_cache_entry_t* entry) {
+  for (const response_cache_entry_t* other = shard->buckets[entry->hash % RESPONSE_CACHE_BUCKETS]; other != NULL;
+       other = other->next) {
+    if (!other->filling && same_key(other, entry) && (other->pass || same_variant(other, entry))) {
+      return 1;
+    }
+  }
+  return 0;
+}
+
+/**
+ * @brief Moves evicted entries to the disk tier
+ *
+ * @param cache Response cache struct
+ * @param shard Response cache shard struct, not locked
+ * @param demoted Entries returned by evict_entries, released here
+ */
+static void demote_entries(response_cache_t* cache, response_cache_shard_t* shard, response_cache_entry_t* demoted) {
+  while (demoted != NULL) {
+    response_cache_entry_t* next = demoted->evicted;
+
+    response_cache_entry_t* copy = write_disk_entry(cache, demoted);
+    if (copy != NULL) {
+      // a fill may have stored a newer copy meanwhile
+      pthread_mutex_lock(&shard->lock);
+      if (!is_superseded(shard, copy)) {
+        copy->refs++;
+        insert_entry(cache, shard, copy);
+      }
+      pthread_mutex_unlock(&shard->lock);
+      response_cache_release(copy);
+    }
+
+    response_cache_release(demoted);
+    demoted = next;
+  }
+}
+
+/**
+ * @brief Looks up the response to a request
+ *
+ * Only GET requests without credentials or a body are cached. Requests
+ * asking for no-cache are fetched and replace what is cached without
+ * waiting for others, conditional and range requests are answered from
+ * an entry but never fill one.
+ *
+ * @param cache Response cache struct
+ * @param request Request as sent to the backend
+ * @param fill 0 if the caller cannot fetch, which turns FILL and WAIT into BYPASS
+ * @param lookup Set to the outcome
+ * @return response_cache_entry_t* Referenced entry for HIT, STALE and FILL,
+ *         NULL otherwise
+ */
+response_cache_entry_t* response_cache_lookup(response_cache_t* cache, const request_t* request, int fill,
+                                              response_cache_lookup_t* lookup) {
+  // initialize result
+  *lookup = RESPONSE_CACHE_BYPASS;
+
+  // credentials make a response private, no-store keeps it out altogether, a body makes it unique
+  if (!slice_equals(request->method, "GET") || find_header(request, "Authorization") != NULL ||
+      header_has_token(request, "Cache-Control", "no-store") || request->chunked || request->content_length > 0) {
+    return NULL;
+  }
+  int no_cache = header_has_token(request, "Cache-Control", "no-cache") ||
+                 header_has_token(request, "Pragma", "no-cache");
+
+  // the backend's answer to these is not the whole resource
+  int partial = find_header(request, "Range") != NULL || find_header(request, "If-None-Match") != NULL ||
+                find_header(request, "If-Modified-Since") != NULL;
+
+  uint64_t hash = hash_key(request->method, request->target);
+  response_cache_shard_t* shard = shard_of(cache, hash);
+  int64_t now = cache_now_ms();
+
+  // look up, dropping what outlived its use on the way
+  pthread_mutex_lock(&shard->lock);
+  response_cache_entry_t* found = NULL;
+  int pending = 0;
+  int pass = 0;
+  response_cache_entry_t* entry = shard->buckets[hash % RESPONSE_CACHE_BUCKETS];
+  while (entry != NULL) {
+    response_cache_entry_t* next = entry->next;
+    if (entry->hash == hash && key_matches(entry, request)) {
+      if (entry->filling) {
+        pending = 1;
+      } else if (now >= (entry->pass ? entry->expires : entry->stale_until)) {
+        remove_entry(shard, entry);
+      } else if (entry->pass) {
+        pass = 1;
+      } else if (found == NULL && vary_matches(entry, request)) {
+        found = entry;
+      }
+    }
+    entry = next;
+  }
+
+  if (pass) {
+    pthread_mutex_unlock(&shard->lock);
+    return NULL;
+  }
+
+  // fresh, or stale while someone else refetches it
+  if (found != NULL && !no_cache) {
+    int fresh = now < found->expires;
+    if (fresh || found->refreshing || !fill) {
+      found->referenced = 1;
+      __atomic_add_fetch(&found->refs, 1, __ATOMIC_RELAXED);
+      pthread_mutex_unlock(&shard->lock);
+      *lookup = fresh ? RESPONSE_CACHE_HIT : RESPONSE_CACHE_STALE;
+      return found;
+    }
+  }
+
+  if (!fill || partial) {
+    pthread_mutex_unlock(&shard->lock);
+    return NULL;
+  }
+  if (pending && !no_cache && found == NULL) {
+    pthread_mutex_unlock(&shard->lock);
+    *lookup = RESPONSE_CACHE_WAIT;
+    return NULL;
+  }
+
+  entry = new_entry(request, hash);
+  if (entry == NULL) {
+    pthread_mutex_unlock(&shard->lock);
+    return NULL;
+  }
+  *lookup = RESPONSE_CACHE_FILL;
+
+  // the first request past a stale entry refetches it, the rest keep getting it
+  if (found != NULL) {
+    if (!found->refreshing) {
+      found->refreshing = 1;
+      __atomic_add_fetch(&found->refs, 1, __ATOMIC_RELAXED);
+      entry->replaces = found;
+    }
+    pthread_mutex_unlock(&shard->lock);
+    return entry;
+  }
+
+  // asked to bypass the cache, the fetch replaces what is stored but nobody waits for it
+  if (no_cache) {
+    pthread_mutex_unlock(&shard->lock);
+    return entry;
+  }
+
+  // a miss links a placeholder that makes the next requests wait
+  entry->refs++;
+  response_cache_entry_t* demoted = insert_entry(cache, shard, entry);
+  pthread_mutex_unlock(&shard->lock);
+  demote_entries(cache, shard, demoted);
+  return entry;
+}
+
+/**
+ * @brief Parses a number of seconds
+ *
+ * @param digits Decimal digits, quotes around them are allowed
+ * @return int64_t Seconds, capped at about 30 years, or -1 if invalid
+ */
+static int64_t parse_seconds(slice_t digits) {
+  size_t i = 0;
+  size_t end = digits.len;
+  if (end >= 2 && digits.ptr[0] == '"' && digits.ptr[end - 1] == '"') {
+    i++;
+    end--;
+  }
+  if (i == end) {
+    return -1;
+  }
+
+  int64_t seconds = 0;
+  for (; i < end; i++) {
+    if (digits.ptr[i] < '0' || digits.ptr[i] > '9') {
+      return -1;
+    }
+    if (seconds < 1000000000) {
+      seconds = seconds * 10 + (digits.ptr[i] - '0');
+    }
+  }
+  return seconds;
+}
+
+/**
+ * @brief Parses the seconds of a directive such as max-age=60
+ *
+ * @param directive Directive with surrounding whitespace removed
+ * @param name Directive name, equals sign included
+ * @return int64_t Seconds or -1 if the directive is another one or invalid
+ */
+static int64_t directive_seconds(slice_t directive, const char* name) {
+  size_t name_len = strlen(name);
+  if (directive.len <= name_len || strncasecmp(directive.ptr, name, name_len) != 0) {
+    return -1;
+  }
+
+  slice_t digits = { directive.ptr + name_len, directive.len - name_len };
+  return parse_seconds(digits);
+}
+
+/**
+ * @brief Gets the next comma separated token of a header value
+ *
+ * @param value Header value
+ * @param offset Position to continue from, advanced
+ * @param token Set to the token without surrounding whitespace
+ * @return int 1 if a token was found, 0 at the end of the value
+ */
+static int next_token(slice_t value, size_t* offset, slice_t* token) {
+  size_t i = *offset;
+  while (i < value.len && (value.ptr[i] == ',' || value.ptr[i] == ' ' || value.ptr[i] == '\t')) {
+    i++;
+  }
+  if (i == value.len) {
+    *offset = i;
+    return 0;
+  }
+
+  size_t start = i;
+  while (i < value.len && value.ptr[i] != ',') {
+    i++;
+  }
+  size_t end = i;
+  while (end > start && (value.ptr[end - 1] == ' ' || value.ptr[end - 1] == '\t')) {
+    end--;
+  }
+
+  token->ptr = value.ptr + start;
+  token->len = end - start;
+  *offset = i;
+  return 1;
+}
+
+/**
+ * @brief Checks whether a status code may be stored with an explicit lifetime
+ *
+ * @param status Status code
+ * @return int 1 if it may be stored
+ */
+static int is_cacheable_status(int status) {
+  return status == 200 || status == 203 || status == 204 || status == 300 || status == 301 || status == 404 ||
+         status == 410;
+}
+
+/**
+ * @brief Decides from the response head whether a fill is stored
+ *
+ * @param cache Response cache struct
+ * @param entry Entry returned with RESPONSE_CACHE_FILL
+ * @param request Request as sent to the backend
+ * @param head Response head as received, blank line included
+ * @param head_len Length of the head
+ * @param status Status code of the response
+ * @param body_len Length of the body, -1 if not known up front
+ * @return int 0 if the body is to be appended, -1 if the response is not
+ *         cacheable
+ */
+int response_cache_begin(response_cache_t* cache, response_cache_entry_t* entry, const request_t* request,
+                         const char* head, size_t head_len, int status, int64_t body_len) {
+  char stored[RESPONSE_CACHE_HEAD_LEN];
+  size_t stored_len = 0;
+  char vary[RESPONSE_CACHE_HEAD_LEN];
+  size_t vary_len = 0;
+  int cacheable = is_cacheable_status(status) && body_len >= 0 && (size_t)body_len <= cache->max_entry_size;
+  int64_t max_age = -1;
+  int64_t shared_max_age = -1;
+  int64_t stale = 0;
+  int64_t age = 0;
+
+  // status line, as HTTP/1.1 like the relayed one
+  const char* line_end = memchr(head, '\n', head_len);
+  size_t line_len = (size_t)(line_end + 1 - head);
+  if (line_len + 2 > sizeof(stored)) {
+    cacheable = 0;
+  } else {
+    memcpy(stored, "HTTP/1.1", 8);
+    memcpy(stored + 8, head + 8, line_len - 8);
+    stored_len = line_len;
+  }
+
+  // headers, noting what decides whether and how long the response is kept
+  const char* line = line_end + 1;
+  const char* end = head + head_len - 2;
+  while (cacheable && line < end) {
+    line_end = memchr(line, '\n', (size_t)(end - line));
+    const char* colon = line_end != NULL ? memchr(line, ':', (size_t)(line_end - line)) : NULL;
+    if (colon == NULL) {
+      cacheable = 0;
+      break;
+    }
+
+    slice_t name = { line, (size_t)(colon - line) };
+    slice_t value = { colon + 1, (size_t)(line_end - colon - 1) };
+    while (value.len > 0 && (value.ptr[0] == ' ' || value.ptr[0] == '\t')) {
+      value.ptr++;
+      value.len--;
+    }
+    while (value.len > 0 && (value.ptr[value.len - 1] == '\r' || value.ptr[value.len - 1] == ' ')) {
+      value.len--;
+    }
+
+    size_t offset = 0;
+    slice_t token;
+    if (slice_equals(name, "Cache-Control")) {
+      while (next_token(value, &offset, &token)) {
+        int64_t seconds;
+        if ((token.len >= 8 && strncasecmp(token.ptr, "no-cache", 8) == 0) || slice_equals(token, "no-store") ||
+            (token.len >= 7 && strncasecmp(token.ptr, "private", 7) == 0)) {
+          cacheable = 0;
+        } else if ((seconds = directive_seconds(token, "s-maxage=")) != -1) {
+          shared_max_age = seconds;
+        } else if ((seconds = directive_seconds(token, "max-age=")) != -1) {
+          max_age = seconds;
+        } else if ((seconds = directive_seconds(token, "stale-while-revalidate=")) != -1) {
+          stale = seconds;
+        }
+      }
+    } else if (slice_equals(name, "Set-Cookie")) {
+      cacheable = 0;
+    } else if (slice_equals(name, "Age")) {
+      age = parse_seconds(value);
+      if (age < 0) {
+        age = 0;
+      }
+    } else if (slice_equals(name, "Vary")) {
+      // remember what the request sent for every header named
+      while (cacheable && next_token(value, &offset, &token)) {
+        slice_t sent = header_value(request, token.ptr, token.len);
+        if ((token.len == 1 && token.ptr[0] == '*') || vary_len + token.len + sent.len + 2 > sizeof(vary)) {
+          cacheable = 0;
+          break;
+        }
+        memcpy(vary + vary_len, token.ptr, token.len);
+        vary[vary_len + token.len] = ':';
+        memcpy(vary + vary_len + token.len + 1, sent.ptr, sent.len);
+        vary_len += token.len + 1 + sent.len;
+        vary[vary_len++] = '\n';
+      }
+    }
+
+    // keep the line unless it only made sense for this delivery
+    int keep = 1;
+    for (size_t i = 0; i < sizeof(unstored_headers) / sizeof(unstored_headers[0]); i++) {
+      keep &= !slice_equals(name, unstored_headers[i]);
+    }
+    size_t len = (size_t)(line_end + 1 - line);
+    if (keep && stored_len + len > sizeof(stored)) {
+      cacheable = 0;
+    } else if (keep) {
+      memcpy(stored + stored_len, line, len);
+      stored_len += len;
+    }
+
+    line = line_end + 1;
+  }
+
+  // only an explicit lifetime is trusted
+  int64_t lifetime = shared_max_age != -1 ? shared_max_age : max_age;
+  if (lifetime <= 0) {
+    cacheable = 0;
+  }
+
+  int64_t now = cache_now_ms();
+  if (!cacheable) {
+    // an error may be passing, the next request should try again
+    if (status < 500) {
+      entry->pass = 1;
+      entry->expires = now + RESPONSE_CACHE_PASS_MS;
+    }
+    return -1;
+  }
+
+  char* stored_head = copy_bytes(stored, stored_len);
+  char* stored_vary = vary_len > 0 ? copy_bytes(vary, vary_len) : NULL;
+  char* body = malloc(body_len > 0 ? (size_t)body_len : 1);
+  if (stored_head == NULL || (vary_len > 0 && stored_vary == NULL) || body == NULL) {
+    free(stored_head);
+    free(stored_vary);
+    free(body);
+    return -1;
+  }
+  entry->head = stored_head;
+  entry->vary = stored_vary;
+  entry->body = body;
+  entry->head_len = stored_len;
+  entry->vary_len = vary_len;
+  entry->body_len = (size_t)body_len;
+  entry->filled = 0;
+
+  // the lifetime counts from when the backend generated the response
+  entry->stored = now;
+  entry->age = age;
+  entry->expires = now + (lifetime > age ? lifetime - age : 0) * 1000;
+  entry->stale_until = entry->expires + stale * 1000;
+  return 0;
+}
+
+/**
+ * @brief Appends body bytes to an entry being filled
+ *
+ * @param entry Entry accepted by response_cache_begin
+ * @param data Body bytes
+ * @param len Number of bytes
+ */
+void response_cache_append(response_cache_entry_t* entry, const char* data, size_t len) {
+  if (entry->body == NULL || len > entry->body_len - entry->filled) {
+    return;
+  }
+
+  memcpy(entry->body + entry->filled, data, len);
+  entry->filled += len;
+}
+
+/**
+ * @brief Ends a fill and drops the reference taken by the lookup
+ *
+ * A complete entry replaces the ones it was fetched for, an uncacheable
+ * response leaves a marker sending its key to the backend for a while,
+ * and anything else is dropped so that a waiting request fetches again.
+ *
+ * @param cache Response cache struct
+ * @param entry Entry returned with RESPONSE_CACHE_FILL
+ * @param complete 1 if the whole body arrived
+ */
+void response_cache_finish(response_cache_t* cache, response_cache_entry_t* entry, int complete) {
+  response_cache_shard_t* shard = shard_of(cache, entry->hash);
+  response_cache_entry_t* replaces = entry->replaces;
+  response_cache_entry_t* demoted = NULL;
+  entry->replaces = NULL;
+  int store = entry->pass || (complete && entry->body != NULL && entry->filled == entry->body_len);
+
+  pthread_mutex_lock(&shard->lock);
+
+  // the placeholder goes either way, waiting requests look again
+  if (entry->linked) {
+    remove_entry(shard, entry);
+  }
+  if (replaces != NULL) {
+    replaces->refreshing = 0;
+  }
+
+  if (store) {
+    // older copies of the same variant, every copy for a marker
+    response_cache_entry_t* other = shard->buckets[entry->hash % RESPONSE_CACHE_BUCKETS];
+    while (other != NULL) {
+      response_cache_entry_t* next = other->next;
+      if (!other->filling && same_key(other, entry) && (entry->pass || other->pass || same_variant(other, entry))) {
+        remove_entry(shard, other);
+      }
+      other = next;
+    }
+
+    entry->filling = 0;
+    if (entry_cost(entry) <= cache->shard_capacity) {
+      entry->refs++;
+      demoted = insert_entry(cache, shard, entry);
+    }
+  }
+  pthread_mutex_unlock(&shard->lock);
+
+  demote_entries(cache, shard, demoted);
+  if (replaces != NULL) {
+    response_cache_release(replaces);
+  }
+  response_cache_release(entry);
+}
+
+/**
+ * @brief Releases the entry behind a response
+ *
+ * @param owner response_cache_entry_t struct
+ */
+static void release_response_entry(void* owner) {
+  response_cache_release((response_cache_entry_t*)owner);
+}
+
+/**
+ * @brief Queues a cached response
+ *
+ * The response holds a reference to the entry until it is reset.
+ *
+ * @param entry Entry returned with RESPONSE_CACHE_HIT or RESPONSE_CACHE_STALE
+ * @param response Response to queue it on
+ * @param keep_alive 1 if the connection stays open
+ * @param result Result of the operation
+ */
+void queue_cached_response(response_cache_entry_t* entry, response_t* response, int keep_alive,
+                           response_result_t* result) {
+  // initialize result
+  *result = RESPONSE_SUCCESS;
+
+  // the reference goes with the response, whatever happens next
+  response->release = release_response_entry;
+  response->owner = entry;
+  response->status = (entry->head[9] - '0') * 100 + (entry->head[10] - '0') * 10 + (entry->head[11] - '0');
+
+  // stored head, then what changes with every delivery
+  add_memory_segment(response, entry->head, entry->head_len, result);
+  if (*result != RESPONSE_SUCCESS) {
+    return;
+  }
+  uint64_t age = (uint64_t)(entry->age + (cache_now_ms() - entry->stored) / 1000);
+  if (append_header_string(response, "Age: ") == -1 || append_header_number(response, age) == -1 ||
+      append_header_string(response, "\r\n") == -1 ||
+      (!keep_alive && append_header_string(response, "Connection: close\r\n") == -1)) {
+    *result = RESPONSE_ERR_FULL;
+    return;
+  }
+  end_headers(response, result);
+  if (*result != RESPONSE_SUCCESS || entry->body_len == 0) {
+    return;
+  }
+
+  // the disk tier sends from its file
+  if (entry->body != NULL) {
+    add_memory_segment(response, entry->body, entry->body_len, result);
+  } else {
+    add_file_segment(response, entry->fd, 0, entry->body_len, result);
+  }
+}
+
+/**
+ * @brief Frees the cache and every entry it holds
+ *
+ * @param cache Response cache struct
+ */
+void close_response_cache(response_cache_t* cache) {
+  for (int i = 0; i < RESPONSE_CACHE_SHARDS; i++) {
+    response_cache_shard_t* shard = &cache->shards[i];
+    for (int j = 0; j < RESPONSE_CACHE_BUCKETS; j++) {
+      while (shard->buckets[j] != NULL) {
+        remove_entry(shard, shard->buckets[j]);
+      }
+    }
+    pthread_mutex_destroy(&shard->lock);
+  }
+
+  if (cache->dir_fd != -1) {
+    close(cache->dir_fd);
+  }
+  free(cache);
+}
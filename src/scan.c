@@ -0,0 +1,333 @@
+#include <string.h>
+#include <stdint.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define SCAN_X86 1
+#endif
+
+#include "scan.h"
+
+/** Character classes of the request grammar */
+#define CHAR_TOKEN  0x01
+#define CHAR_TARGET 0x02
+#define CHAR_VALUE  0x04
+
+/** Class bits of every byte */
+static unsigned char char_classes[256];
+/** Bitmap of valid high nibbles for each low nibble, for the token kernel */
+static unsigned char token_nibbles[16];
+
+/** Active kernels */
+static size_t (*token_kernel)(const char*, size_t);
+static size_t (*target_kernel)(const char*, size_t);
+static size_t (*value_kernel)(const char*, size_t);
+static const char* kernel_name = "scalar";
+
+/**
+ * @brief Counts the leading bytes of a buffer that belong to a class
+ *
+ * @param buff Bytes to scan
+ * @param len Number of bytes
+ * @param mask Class bits every byte must have
+ * @return size_t Length of the run
+ */
+static inline size_t scan_class(const char* buff, size_t len, unsigned char mask) {
+  size_t i = 0;
+  while (i < len && (char_classes[(unsigned char)buff[i]] & mask)) {
+    i++;
+  }
+  return i;
+}
+
+static size_t scalar_token(const char* buff, size_t len) {
+  return scan_class(buff, len, CHAR_TOKEN);
+}
+
+static size_t scalar_target(const char* buff, size_t len) {
+  return scan_class(buff, len, CHAR_TARGET);
+}
+
+static size_t scalar_value(const char* buff, size_t len) {
+  return scan_class(buff, len, CHAR_VALUE);
+}
+
+#ifdef SCAN_X86
+
+/**
+ * Byte ranges for PCMPESTRI. The token set needs nine ranges of
+ * delimiters, one more than fits, so the last range also flags '|' and
+ * '~' and the caller confirms each hit against the table.
+ */
+static const char sse_token_ranges[16] = "\x00 \"\"()" ",,//:@[]{\xff";
+static const char sse_target_ranges[16] = "\x00 \x7f\xff";
+static const char sse_value_ranges[16] = "\x00\x08\x0a\x1f\x7f\x7f";
+
+/**
+ * @brief Finds the first byte inside a set of ranges, 16 bytes at a time
+ *
+ * @param buff Bytes to scan
+ * @param len Number of bytes
+ * @param ranges Range pairs
+ * @param ranges_len Bytes of ranges used
+ * @return size_t Offset of the first hit, or the last full block end
+ */
+__attribute__((target("sse4.2")))
+static size_t sse42_find_ranges(const char* buff, size_t len, const char* ranges, int ranges_len) {
+  __m128i set = _mm_loadu_si128((const __m128i*)ranges);
+  size_t i = 0;
+
+  while (i + 16 <= len) {
+    __m128i block = _mm_loadu_si128((const __m128i*)(buff + i));
+    int index = _mm_cmpestri(set, ranges_len, block, 16, _SIDD_UBYTE_OPS | _SIDD_CMP_RANGES | _SIDD_LEAST_SIGNIFICANT);
+    if (index != 16) {
+      return i + (size_t)index;
+    }
+    i += 16;
+  }
+
+  return i;
+}
+
+__attribute__((target("sse4.2")))
+static size_t sse42_token(const char* buff, size_t len) {
+  size_t i = 0;
+  while (1) {
+    i += sse42_find_ranges(buff + i, len - i, sse_token_ranges, 16);
+    if (i == len) {
+      return i;
+    }
+
+    // confirm the hit, '|' and '~' only look like delimiters here
+    if (!(char_classes[(unsigned char)buff[i]] & CHAR_TOKEN)) {
+      return i;
+    }
+    i++;
+  }
+}
+
+__attribute__((target("sse4.2")))
+static size_t sse42_target(const char* buff, size_t len) {
+  size_t i = sse42_find_ranges(buff, len, sse_target_ranges, 4);
+  return i + scan_class(buff + i, len - i, CHAR_TARGET);
+}
+
+__attribute__((target("sse4.2")))
+static size_t sse42_value(const char* buff, size_t len) {
+  size_t i = sse42_find_ranges(buff, len, sse_value_ranges, 6);
+  return i + scan_class(buff + i, len - i, CHAR_VALUE);
+}
+
+/**
+ * @brief Counts leading token bytes, 32 at a time
+ *
+ * Looks each byte up in a nibble bitmap: the low nibble selects a row of
+ * valid high nibbles and the high nibble selects the bit to test.
+ */
+__attribute__((target("avx2")))
+static size_t avx2_token(const char* buff, size_t len) {
+  const __m256i rows = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i*)token_nibbles));
+  const __m256i bits = _mm256_setr_epi8(1, 2, 4, 8, 16, 32, 64, -128, 0, 0, 0, 0, 0, 0, 0, 0,
+                                        1, 2, 4, 8, 16, 32, 64, -128, 0, 0, 0, 0, 0, 0, 0, 0);
+  const __m256i low_mask = _mm256_set1_epi8(0x0f);
+  size_t i = 0;
+
+  while (i + 32 <= len) {
+    __m256i block = _mm256_loadu_si256((const __m256i*)(buff + i));
+    __m256i low = _mm256_and_si256(block, low_mask);
+    __m256i high = _mm256_and_si256(_mm256_srli_epi16(block, 4), low_mask);
+    __m256i row = _mm256_shuffle_epi8(rows, low);
+    __m256i bit = _mm256_shuffle_epi8(bits, high);
+    __m256i invalid = _mm256_cmpeq_epi8(_mm256_and_si256(row, bit), _mm256_setzero_si256());
+
+    uint32_t mask = (uint32_t)_mm256_movemask_epi8(invalid);
+    if (mask != 0) {
+      return i + (size_t)__builtin_ctz(mask);
+    }
+    i += 32;
+  }
+
+  return i + scan_class(buff + i, len - i, CHAR_TOKEN);
+}
+
+__attribute__((target("avx2")))
+static size_t avx2_target(const char* buff, size_t len) {
+  const __m256i space = _mm256_set1_epi8(0x20);
+  const __m256i del = _mm256_set1_epi8(0x7f);
+  size_t i = 0;
+
+  while (i + 32 <= len) {
+    // signed compare also rejects bytes >= 0x80
+    __m256i block = _mm256_loadu_si256((const __m256i*)(buff + i));
+    __m256i valid = _mm256_andnot_si256(_mm256_cmpeq_epi8(block, del), _mm256_cmpgt_epi8(block, space));
+
+    uint32_t mask = ~(uint32_t)_mm256_movemask_epi8(valid);
+    if (mask != 0) {
+      return i + (size_t)__builtin_ctz(mask);
+    }
+    i += 32;
+  }
+
+  return i + scan_class(buff + i, len - i, CHAR_TARGET);
+}
+
+__attribute__((target("avx2")))
+static size_t avx2_value(const char* buff, size_t len) {
+  const __m256i control = _mm256_set1_epi8(0x1f);
+  const __m256i del = _mm256_set1_epi8(0x7f);
+  const __m256i tab = _mm256_set1_epi8('\t');
+  size_t i = 0;
+
+  while (i + 32 <= len) {
+    // visible, space or obs-text (negative when signed), but not DEL
+    __m256i block = _mm256_loadu_si256((const __m256i*)(buff + i));
+    __m256i printable = _mm256_or_si256(_mm256_cmpgt_epi8(block, control),
+                                        _mm256_cmpgt_epi8(_mm256_setzero_si256(), block));
+    __m256i valid = _mm256_or_si256(_mm256_andnot_si256(_mm256_cmpeq_epi8(block, del), printable),
+                                    _mm256_cmpeq_epi8(block, tab));
+
+    uint32_t mask = ~(uint32_t)_mm256_movemask_epi8(valid);
+    if (mask != 0) {
+      return i + (size_t)__builtin_ctz(mask);
+    }
+    i += 32;
+  }
+
+  return i + scan_class(buff + i, len - i, CHAR_VALUE);
+}
+
+#endif
+
+/**
+ * @brief Fills the class tables and picks the default kernels
+ *
+ * Runs before main so the scan functions never check for it.
+ */
+__attribute__((constructor))
+static void init_scan(void) {
+  const char* token_extra = "!#$%&'*+-.^_`|~";
+
+  for (int c = 0; c < 256; c++) {
+    unsigned char classes = 0;
+
+    // tchar from RFC 9110
+    if ((c >= '0' && c <= '9') || (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') ||
+        (c != 0 && strchr(token_extra, c) != NULL)) {
+      classes |= CHAR_TOKEN;
+      token_nibbles[c & 0x0f] |= (unsigned char)(1 << (c >> 4));
+    }
+
+    // visible ASCII for targets and versions
+    if (c > 0x20 && c < 0x7f) {
+      classes |= CHAR_TARGET;
+    }
+
+    // field-vchar, obs-text and inner whitespace for values
+    if ((c > 0x20 && c != 0x7f) || c == ' ' || c == '\t') {
+      classes |= CHAR_VALUE;
+    }
+
+    char_classes[c] = classes;
+  }
+
+  set_scan_impl(SCAN_IMPL_AUTO);
+}
+
+/**
+ * @brief Selects the scanner implementation
+ *
+ * Called with SCAN_IMPL_AUTO at startup, which picks the widest kernel
+ * cpuid reports. Benchmarks may force a specific one.
+ *
+ * @param impl Implementation to use
+ * @return int 0 if successful, -1 if the CPU lacks it
+ */
+int set_scan_impl(scan_impl_t impl) {
+#ifdef SCAN_X86
+  __builtin_cpu_init();
+  int has_avx2 = __builtin_cpu_supports("avx2");
+  int has_sse42 = __builtin_cpu_supports("sse4.2");
+
+  if (impl == SCAN_IMPL_AUTO) {
+    impl = has_avx2 ? SCAN_IMPL_AVX2 : has_sse42 ? SCAN_IMPL_SSE42 : SCAN_IMPL_SCALAR;
+  }
+
+  if (impl == SCAN_IMPL_AVX2 && has_avx2) {
+    token_kernel = avx2_token;
+    target_kernel = avx2_target;
+    value_kernel = avx2_value;
+    kernel_name = "avx2";
+    return 0;
+  }
+
+  if (impl == SCAN_IMPL_SSE42 && has_sse42) {
+    token_kernel = sse42_token;
+    target_kernel = sse42_target;
+    value_kernel = sse42_value;
+    kernel_name = "sse4.2";
+    return 0;
+  }
+#else
+  if (impl == SCAN_IMPL_AUTO) {
+    impl = SCAN_IMPL_SCALAR;
+  }
+#endif
+
+  if (impl != SCAN_IMPL_SCALAR) {
+    return -1;
+  }
+
+  token_kernel = scalar_token;
+  target_kernel = scalar_target;
+  value_kernel = scalar_value;
+  kernel_name = "scalar";
+  return 0;
+}
+
+/**
+ * @brief Gets the name of the active scanner implementation
+ *
+ * @return const char* Name of the implementation
+ */
+const char* scan_impl_name(void) {
+  return kernel_name;
+}
+
+/**
+ * @brief Counts leading token (tchar) bytes
+ *
+ * Stops at the first delimiter, such as a space or a colon.
+ *
+ * @param buff Bytes to scan
+ * @param len Number of bytes
+ * @return size_t Length of the run
+ */
+size_t scan_token(const char* buff, size_t len) {
+  return token_kernel(buff, len);
+}
+
+/**
+ * @brief Counts leading visible ASCII bytes
+ *
+ * Used for request targets and versions, stops at a space or CR.
+ *
+ * @param buff Bytes to scan
+ * @param len Number of bytes
+ * @return size_t Length of the run
+ */
+size_t scan_target(const char* buff, size_t len) {
+  return target_kernel(buff, len);
+}
+
+/**
+ * @brief Counts leading field value bytes
+ *
+ * Accepts visible bytes, obs-text, space and tab, stops at CR.
+ *
+ * @param buff Bytes to scan
+ * @param len Number of bytes
+ * @return size_t Length of the run
+ */
+size_t scan_value(const char* buff, size_t len) {
+  return value_kernel(buff, len);
+}
@@ -1,17 +1,86 @@
+#define _GNU_SOURCE
+
 #include <stdio.h>
+#include <limits.h>
+#include <time.h>
+#include <poll.h>
+#include <sys/eventfd.h>
+#include <linux/filter.h>
 
 #include "server.h"
+#include "docroot.h"
+#include "status.h"
+#include "proxy.h"
+#include "metrics.h"
+
+/**
+ * @brief Gets the monotonic time
+ *
+ * @return int64_t Milliseconds since an arbitrary point
+ */
+static int64_t now_ms(void) {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (int64_t)now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+/**
+ * @brief Takes over the listeners named by SERVER_LISTEN_FDS_ENV
+ *
+ * @param server server_t struct
+ * @return int 0 if successful or nothing was inherited, -1 if error
+ */
+static int inherit_listeners(server_t* server) {
+  const char* fds = getenv(SERVER_LISTEN_FDS_ENV);
+  if (fds == NULL) {
+    return 0;
+  }
+
+  // parse every descriptor before trusting any of them
+  const char* cursor = fds;
+  while (*cursor != '\0' && server->inherited < SERVER_MAX_LISTENERS) {
+    char* end;
+    long fd = strtol(cursor, &end, 10);
+    if (end == cursor || fd < 0 || fd > INT_MAX || (*end != ',' && *end != '\0')) {
+      log_message(LOG_ERROR, "Invalid %s: %s\n", SERVER_LISTEN_FDS_ENV, fds);
+      return -1;
+    }
+
+    // it must still be a listening socket
+    int listening = 0;
+    socklen_t len = sizeof(listening);
+    if (getsockopt((int)fd, SOL_SOCKET, SO_ACCEPTCONN, &listening, &len) == -1 || !listening) {
+      log_message(LOG_ERROR, "Inherited descriptor %ld is not listening\n", fd);
+      return -1;
+    }
+
+    // keep it away from anything else we execute
+    fcntl((int)fd, F_SETFD, FD_CLOEXEC);
+    server->listeners[server->inherited++] = (int)fd;
+    cursor = *end == ',' ? end + 1 : end;
+  }
+
+  // children of this process start fresh
+  unsetenv(SERVER_LISTEN_FDS_ENV);
+  log_message(LOG_INFO, "Took over %d listeners from the previous process\n", server->inherited);
+  return 0;
+}
 
 /**
  * @brief Creates a server and returns it
  *
+ * If SERVER_LISTEN_FDS_ENV names listening sockets left open by the
+ * previous process, the server takes them over instead of binding, so
+ * connections queued on them are never refused.
+ *
  * @param host Hostname of the server
  * @param port Port of the server
+ * @param reuseport 1 to let more listeners bind the same address
  * @param result Result of the operation
  * @param cleanup Cleanup struct
  * @return server_t* Pointer to new server or NULL if error
  */
-server_t* create_server(char host[], int port, server_result_t* result, server_cleanup_t* cleanup) {
+server_t* create_server(char host[], int port, int reuseport, server_result_t* result, server_cleanup_t* cleanup) {
   // initialize result
   *result = SERVER_SUCCESS;
 
@@ -31,16 +100,49 @@ server_t* create_server(char host[], int port, server_result_t* result, server_c
   // set host and port
   strncpy(server->host, host, INET_ADDRSTRLEN);
   server->port = port;
+  server->config = NULL;
+  server->cache = NULL;
+  server->access_log = NULL;
+  server->admission = NULL;
+  server->upstream = NULL;
+  server->response_cache = NULL;
+  server->tls = NULL;
+  server->listener_count = 0;
+  server->inherited = 0;
+  server->draining = 0;
+  server->drain_deadline = 0;
+  server->active_threads = 0;
+
+  // one write wakes every worker when draining starts
+  server->wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  if (server->wake_fd == -1) {
+    *result = SERVER_ERR_EVENTFD;
+    return NULL;
+  }
+
+  // take over the listeners of the previous process
+  if (inherit_listeners(server) == -1) {
+    close(server->wake_fd);
+    *result = SERVER_ERR_INHERIT;
+    return NULL;
+  }
+  if (server->inherited > 0) {
+    server->socket = server->listeners[0];
+    server->listener_count = 1;
+    return server;
+  }
 
   // create server socket
-  int server_socket = socket(AF_INET, SOCK_STREAM, 0);
+  int server_socket = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
   if (server_socket == -1) {
+    close(server->wake_fd);
     *result = SERVER_ERR_SOCKET;
     return NULL;
   }
 
   // set server socket
   server->socket = server_socket;
+  server->listeners[server->listener_count++] = server_socket;
 
   // set cleanup socket created and socket
   cleanup->socket_created = 1;
@@ -49,6 +151,14 @@ server_t* create_server(char host[], int port, server_result_t* result, server_c
   // set socket to be reusable
   int opt = 1;
   if (setsockopt(server_socket, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt)) == -1) {
+    close(server->wake_fd);
+    *result = SERVER_ERR_SETSOCKOPT;
+    return NULL;
+  }
+
+  // let per-worker listeners join, only before bind
+  if (reuseport && setsockopt(server_socket, SOL_SOCKET, SO_REUSEPORT, &opt, sizeof(opt)) == -1) {
+    close(server->wake_fd);
     *result = SERVER_ERR_SETSOCKOPT;
     return NULL;
   }
@@ -64,6 +174,7 @@ server_t* create_server(char host[], int port, server_result_t* result, server_c
 
   // bind socket to server address
   if (bind(server_socket, (struct sockaddr *)&serv_addr, sizeof(serv_addr)) == -1) {
+    close(server->wake_fd);
     *result = SERVER_ERR_BIND;
     return NULL;
   }
@@ -80,7 +191,7 @@ server_t* create_server(char host[], int port, server_result_t* result, server_c
  */
 int listen_server(server_t* server) {
   // listen for connections
-  if (listen(server->socket, MAX_CLIENTS) == -1) {
+  if (listen(server->socket, server->config->backlog) == -1) {
     log_message(LOG_ERROR, "Could not listen on socket: %s\n", strerror(errno));
 
     close_server(server);
@@ -90,21 +201,160 @@ int listen_server(server_t* server) {
   return 0;
 }
 
+/**
+ * @brief Puts the server socket into non-blocking mode
+ *
+ * @param server server_t struct
+ * @return int 0 if successful, -1 if error
+ */
+int set_server_nonblocking(server_t* server) {
+  // get current flags
+  int flags = fcntl(server->socket, F_GETFL, 0);
+  if (flags == -1) {
+    log_message(LOG_ERROR, "Could not get server socket flags: %s\n", strerror(errno));
+    return -1;
+  }
+
+  // add non-blocking flag
+  if (fcntl(server->socket, F_SETFL, flags | O_NONBLOCK) == -1) {
+    log_message(LOG_ERROR, "Could not set server socket flags: %s\n", strerror(errno));
+    return -1;
+  }
+
+  return 0;
+}
+
+/**
+ * @brief Opens another listener on the server address
+ *
+ * The listener joins the SO_REUSEPORT group of the server socket, so the
+ * kernel spreads new connections across the group instead of queueing
+ * them all on one socket. Inherited listeners are handed out first.
+ *
+ * @param server server_t struct
+ * @param result Result of the operation
+ * @return int Non-blocking listening socket or -1 if error
+ */
+int open_listener(server_t* server, server_result_t* result) {
+  // initialize result
+  *result = SERVER_SUCCESS;
+
+  // the previous process already opened it
+  if (server->listener_count < server->inherited) {
+    return server->listeners[server->listener_count++];
+  }
+
+  if (server->listener_count == SERVER_MAX_LISTENERS) {
+    log_message(LOG_ERROR, "Too many listeners\n");
+    *result = SERVER_ERR_SOCKET;
+    return -1;
+  }
+
+  // create socket
+  int listener = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+  if (listener == -1) {
+    log_message(LOG_ERROR, "Could not create listener: %s\n", strerror(errno));
+    *result = SERVER_ERR_SOCKET;
+    return -1;
+  }
+
+  // join the group of the server socket
+  int opt = 1;
+  if (setsockopt(listener, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt)) == -1 ||
+      setsockopt(listener, SOL_SOCKET, SO_REUSEPORT, &opt, sizeof(opt)) == -1) {
+    log_message(LOG_ERROR, "Could not set listener options: %s\n", strerror(errno));
+    close(listener);
+    *result = SERVER_ERR_SETSOCKOPT;
+    return -1;
+  }
+
+  // bind to the server address
+  struct sockaddr_in serv_addr;
+  memset(&serv_addr, 0, sizeof(serv_addr));
+  serv_addr.sin_family = AF_INET;
+  serv_addr.sin_addr.s_addr = inet_addr(server->host);
+  serv_addr.sin_port = htons(server->port);
+  if (bind(listener, (struct sockaddr*)&serv_addr, sizeof(serv_addr)) == -1) {
+    log_message(LOG_ERROR, "Could not bind listener: %s\n", strerror(errno));
+    close(listener);
+    *result = SERVER_ERR_BIND;
+    return -1;
+  }
+
+  // listen, which also fixes its index in the group
+  if (listen(listener, server->config->backlog) == -1) {
+    log_message(LOG_ERROR, "Could not listen on listener: %s\n", strerror(errno));
+    close(listener);
+    *result = SERVER_ERR_LISTEN;
+    return -1;
+  }
+
+  server->listeners[server->listener_count++] = listener;
+  return listener;
+}
+
+/**
+ * @brief Steers each connection to the listener of the CPU receiving it
+ *
+ * Attaches a classic BPF program to the SO_REUSEPORT group returning the
+ * receiving CPU modulo the group size. With listener i served by a worker
+ * pinned to CPU i, a connection is handled where its packets arrive.
+ *
+ * @param server server_t struct
+ * @param listeners Number of listeners in the group
+ * @param result Result of the operation
+ */
+void steer_listeners(server_t* server, int listeners, server_result_t* result) {
+  // initialize result
+  *result = SERVER_SUCCESS;
+
+  // A = receiving CPU % listeners, return A
+  struct sock_filter code[] = {
+    BPF_STMT(BPF_LD | BPF_W | BPF_ABS, (uint32_t)(SKF_AD_OFF + SKF_AD_CPU)),
+    BPF_STMT(BPF_ALU | BPF_MOD | BPF_K, (uint32_t)listeners),
+    BPF_STMT(BPF_RET | BPF_A, 0),
+  };
+  struct sock_fprog program = {
+    .len = sizeof(code) / sizeof(code[0]),
+    .filter = code,
+  };
+
+  // attaching to one socket programs the whole group
+  if (setsockopt(server->socket, SOL_SOCKET, SO_ATTACH_REUSEPORT_CBPF, &program, sizeof(program)) == -1) {
+    log_message(LOG_ERROR, "Could not attach steering program: %s\n", strerror(errno));
+    *result = SERVER_ERR_BPF;
+  }
+}
+
 /**
  * @brief Accepts a connection on the server and appends to clients
  *
  * @param server server_t struct
+ * @param listener Listening socket to accept from
+ * @param flags SOCK_NONBLOCK and SOCK_CLOEXEC for the client socket
+ * @param result Result of the operation
  * @return client_t* Pointer to new client or NULL if error
+ * @note result is SERVER_ERR_AGAIN if a non-blocking server has no pending
+ *       connection
  */
-client_t* accept_client(server_t* server) {
+client_t* accept_client(server_t* server, int listener, int flags, server_result_t* result) {
+  // initialize result
+  *result = SERVER_SUCCESS;
+
   // initialize client address
   struct sockaddr_in client_addr;
   socklen_t sz_client_addr = sizeof(client_addr);
 
-  // accept connection
-  int client_socket = accept(server->socket, (struct sockaddr*)&client_addr, &sz_client_addr);
+  // accept connection, setting flags without extra syscalls
+  int client_socket = accept4(listener, (struct sockaddr*)&client_addr, &sz_client_addr, flags);
   if (client_socket == -1) {
+    if (errno == EAGAIN || errno == EWOULDBLOCK) {
+      *result = SERVER_ERR_AGAIN;
+      return NULL;
+    }
+
     log_message(LOG_ERROR, "Could not accept connection: %s\n", strerror(errno));
+    *result = SERVER_ERR_ACCEPT;
     return NULL;
   }
 
@@ -114,19 +364,71 @@ client_t* accept_client(server_t* server) {
 
   // initialize client variables
   client_t* client;
-  client_result_t result;
+  client_result_t client_result;
   client_cleanup_t cleanup;
 
   // create client
-  client = create_client(host, client_socket, &result, &cleanup);
+  client = create_client(host, client_socket, &client_result, &cleanup);
 
   // check result
-  if (result != CLIENT_SUCCESS) {
+  if (client_result != CLIENT_SUCCESS) {
     // cleanup if needed
     if (cleanup.client_allocated) {
       close_client(client);
+    } else {
+      close(client_socket);
+    }
+
+    *result = SERVER_ERR_MALLOC;
+    return NULL;
+  }
+
+  // a TLS server wraps every client in a session
+  if (server->tls != NULL) {
+    tls_result_t tls_result;
+    tls_attach_client(server->tls, client, &tls_result);
+    if (tls_result != TLS_SUCCESS) {
+      close_client(client);
+      *result = SERVER_ERR_MALLOC;
+      return NULL;
+    }
+  }
+
+  return client;
+}
+
+/**
+ * @brief Creates a client for a socket accepted elsewhere
+ *
+ * @param client_socket Accepted socket
+ * @param result Result of the operation
+ * @return client_t* Pointer to new client or NULL if error
+ * @note The socket is closed if the client cannot be created
+ */
+client_t* adopt_client(int client_socket, server_result_t* result) {
+  // initialize result
+  *result = SERVER_SUCCESS;
+
+  // get client host
+  struct sockaddr_in client_addr;
+  socklen_t sz_client_addr = sizeof(client_addr);
+  char host[INET_ADDRSTRLEN] = "-";
+  if (getpeername(client_socket, (struct sockaddr*)&client_addr, &sz_client_addr) == 0) {
+    strncpy(host, inet_ntoa(client_addr.sin_addr), INET_ADDRSTRLEN - 1);
+  }
+
+  // create client
+  client_result_t client_result;
+  client_cleanup_t cleanup;
+  client_t* client = create_client(host, client_socket, &client_result, &cleanup);
+  if (client_result != CLIENT_SUCCESS) {
+    if (cleanup.client_allocated) {
+      close_client(client);
+    } else {
+      close(client_socket);
     }
 
+    *result = SERVER_ERR_MALLOC;
     return NULL;
   }
 
@@ -141,10 +443,24 @@ client_t* accept_client(server_t* server) {
  * @return int 0 if successful, -1 if error
  */
 int handle_client(server_t* server, client_t* client) {
-  // create thread
+  // initialize connection
+  connection_result_t connection_result;
+  connection_t* connection = create_connection(client, server, &connection_result);
+  if (connection_result != CONNECTION_SUCCESS) {
+    return -1;
+  }
+
+  // create thread, counted until it exits so draining can wait for it
   pthread_t handler_thread;
-  if (pthread_create(&handler_thread, NULL, handle_client_thread, client) != 0) {
+  __atomic_add_fetch(&server->active_threads, 1, __ATOMIC_RELEASE);
+  if (pthread_create(&handler_thread, NULL, handle_client_thread, connection) != 0) {
     log_message(LOG_ERROR, "Failed to create handler thread: %s\n", strerror(errno));
+    __atomic_sub_fetch(&server->active_threads, 1, __ATOMIC_RELEASE);
+
+    // the caller closes the client, its admission slot is given back here
+    metrics_count(METRIC_CONNECTIONS_CLOSED, 1);
+    release_connection(server->admission, client->host);
+    pool_free(connection, sizeof(connection_t));
     return -1;
   }
 
@@ -157,94 +473,627 @@ int handle_client(server_t* server, client_t* client) {
 /**
  * @brief Handles client requests and responds accordingly in a thread
  *
- * @param argp client_t struct
+ * The client socket is non-blocking, so the thread can give up on a client
+ * that misses the deadline of its phase.
+ *
+ * @param argp connection_t struct
  * @return void* NULL
  */
 void* handle_client_thread(void* argp) {
-  // initialize client
-  client_t* client = (client_t*)argp;
-  client_result_t client_result;
+  // initialize connection
+  connection_t* connection = (connection_t*)argp;
+  server_t* server = connection->server;
 
-  while (1) {
-    // initialize request buffer
-    char raw_request[1024];
+  // the thread has its own access log buffer
+  access_log_t* access_log = connection->server->access_log;
+  access_log_buffer_t* log_buffer = NULL;
+  if (access_log != NULL) {
+    pool_result_t pool_result;
+    log_buffer = pool_alloc(sizeof(access_log_buffer_t), &pool_result);
+    if (log_buffer != NULL) {
+      init_access_log_buffer(log_buffer);
+    }
+    connection->log_buffer = log_buffer;
+  }
 
-    // recieve request
-    recv_client(client, raw_request, sizeof(raw_request), &client_result);
-    if (client_result != CLIENT_SUCCESS) {
+  // and its own backend connections, kept across the client's requests
+  upstream_pool_t* upstream_pool = NULL;
+  if (server->upstream != NULL) {
+    upstream_result_t upstream_result;
+    upstream_pool = create_upstream_pool(server->upstream, -1, NULL, &upstream_result);
+    connection->upstream_pool = upstream_pool;
+  }
+
+  // serve the connection, sleeping on its sockets until the phase deadline
+  int draining = 0;
+  while (1) {
+    drive_connection(connection);
+    if (connection->state == CONNECTION_CLOSING) {
       break;
     }
 
-    // initialize request variables
-    request_t* request;
-    request_result_t request_result;
-    request_cleanup_t request_cleanup = {0};
+    int64_t now = now_ms();
+    if (connection_expired(connection, now)) {
+      break;
+    }
 
-    // parse request
-    request = parse_request(raw_request, &request_result, &request_cleanup);
-    if (request_result != REQUEST_SUCCESS) {
-      if (request_cleanup.request_allocated) {
-        free(request_cleanup.request);
-      }
+    short upstream_events;
+    int upstream_socket = connection_upstream(connection, &upstream_events);
+    struct pollfd fds[3] = {
+      { connection->client->socket, connection_events(connection), 0 },
+      { server->wake_fd, POLLIN, 0 },
+      { upstream_socket, upstream_events, 0 }
+    };
+    if (draining) {
+      fds[1].fd = -1;
+    }
+    int64_t timeout = connection->deadline - now;
+    if (poll(fds, 3, (int)timeout) == -1 && errno != EINTR) {
+      break;
+    }
 
+    // a client gone while the backend is awaited is never read again
+    if (connection->state == CONNECTION_PROXYING && (fds[0].revents & (POLLERR | POLLHUP))) {
       break;
     }
 
-    // handle request
-    handle_request(client, request);
-    break;
+    // draining, a connection waiting for a request only gets the grace period
+    if (!draining && (fds[1].revents & POLLIN)) {
+      draining = 1;
+      if (connection->state == CONNECTION_READING && connection->in_len == 0 &&
+          now + SERVER_DRAIN_GRACE_MS < connection->deadline) {
+        connection->deadline = now + SERVER_DRAIN_GRACE_MS;
+      }
+    }
   }
 
-  // close client
-  close_client(client);
+  // close connection
+  close_connection(connection);
+  if (upstream_pool != NULL) {
+    close_upstream_pool(upstream_pool);
+  }
+
+  // write what the connection logged
+  if (log_buffer != NULL) {
+    flush_access_log(access_log, log_buffer);
+    pool_free(log_buffer, sizeof(access_log_buffer_t));
+  }
+
+  __atomic_sub_fetch(&server->active_threads, 1, __ATOMIC_RELEASE);
   return NULL;
 }
 
 /**
- * @brief Handles a request from a client
+ * @brief Releases the cache entry behind a response
  *
- * @param client client_t struct
+ * @param owner file_cache_entry_t struct
+ */
+static void release_cache_entry(void* owner) {
+  file_cache_release((file_cache_entry_t*)owner);
+}
+
+/**
+ * @brief Opens the file behind a response body
+ *
+ * @param file_name Path of the file
+ * @param encoding Encoding wanted, reset to identity if there is no sibling
+ * @param exact 1 if only the sibling will do
+ * @param file_stat Filled with the status of the opened file
+ * @return int Open regular file or -1 if error
+ */
+static int open_body(const char* file_name, content_encoding_t* encoding, int exact, struct stat* file_stat) {
+  // prefer the precompressed sibling
+  int fd = -1;
+  if (*encoding != ENCODING_IDENTITY) {
+    char sibling[FILE_NAME_LEN + 8];
+    snprintf(sibling, sizeof(sibling), "%s%s", file_name, encoding_suffix(*encoding));
+    fd = open(sibling, O_RDONLY | O_CLOEXEC);
+    if (fd == -1 && exact) {
+      return -1;
+    }
+    if (fd == -1) {
+      *encoding = ENCODING_IDENTITY;
+    }
+  }
+
+  if (fd == -1) {
+    fd = open(file_name, O_RDONLY | O_CLOEXEC);
+    if (fd == -1) {
+      return -1;
+    }
+  }
+
+  // only regular files can be served
+  if (fstat(fd, file_stat) == -1 || !S_ISREG(file_stat->st_mode)) {
+    close(fd);
+    return -1;
+  }
+
+  return fd;
+}
+
+/**
+ * @brief Queues the preformatted 404 response
+ *
+ * @param connection connection_t struct
+ * @return int 0 if successful, -1 if error
+ */
+static int queue_not_found(connection_t* connection) {
+  response_result_t result;
+  queue_status(&connection->response, 404, connection->keep_alive, &result);
+  return result == RESPONSE_SUCCESS ? 0 : -1;
+}
+
+/**
+ * @brief Queues a byte range of a body held in memory or in a file
+ *
+ * @param response Response struct
+ * @param data Body bytes or NULL to send from fd
+ * @param fd File to send from when data is NULL
+ * @param range Range of the body
+ * @param result Result of the operation
+ */
+static void add_body_segment(response_t* response, const char* data, int fd, byte_range_t range,
+                             response_result_t* result) {
+  if (data != NULL) {
+    add_memory_segment(response, data + range.offset, range.len, result);
+  } else {
+    add_file_segment(response, fd, (off_t)range.offset, range.len, result);
+  }
+}
+
+/**
+ * @brief Queues a 304, 206 or 416 response
+ *
+ * A single range is sent as is, several as multipart/byteranges with the
+ * part headers in the connection arena.
+ *
+ * @param connection connection_t struct
+ * @param selection What the request asked for
+ * @param ranges Ranges of a partial response
+ * @param range_count Number of ranges
+ * @param data Body bytes or NULL to send from fd
+ * @param fd File to send from when data is NULL
+ * @param size Size of the body
+ * @param fields Validator and Vary header lines
+ * @param encoding Content-Encoding header line
+ * @return int 0 if successful, -1 if error
+ */
+static int queue_selected(connection_t* connection, selection_t selection, byte_range_t ranges[], int range_count,
+                          const char* data, int fd, size_t size, const char* fields, const char* encoding) {
+  response_result_t result;
+  response_t* response = &connection->response;
+  const char* close_header = connection->keep_alive ? "" : "Connection: close\r\n";
+
+  // revalidated, headers only
+  if (selection == SELECT_NOT_MODIFIED) {
+    if (append_header_string(response, "HTTP/1.1 304 Not Modified\r\n") == -1 ||
+        append_header_string(response, fields) == -1 || append_header_string(response, close_header) == -1) {
+      return -1;
+    }
+    end_headers(response, &result);
+    response->status = 304;
+    return result == RESPONSE_SUCCESS ? 0 : -1;
+  }
+
+  // no range overlaps the body
+  if (selection == SELECT_UNSATISFIABLE) {
+    if (append_header_string(response, "HTTP/1.1 416 Range Not Satisfiable\r\nContent-Range: bytes */") == -1 ||
+        append_header_number(response, size) == -1 ||
+        append_header_string(response, "\r\nContent-Length: 0\r\n") == -1 ||
+        append_header_string(response, close_header) == -1) {
+      return -1;
+    }
+    end_headers(response, &result);
+    response->status = 416;
+    return result == RESPONSE_SUCCESS ? 0 : -1;
+  }
+
+  response->status = 206;
+
+  // one range needs no multipart framing
+  if (range_count == 1) {
+    if (append_header_string(response, "HTTP/1.1 206 Partial Content\r\nContent-Range: bytes ") == -1 ||
+        append_header_number(response, ranges[0].offset) == -1 || append_header_bytes(response, "-", 1) == -1 ||
+        append_header_number(response, ranges[0].offset + ranges[0].len - 1) == -1 ||
+        append_header_bytes(response, "/", 1) == -1 || append_header_number(response, size) == -1 ||
+        append_header_string(response, "\r\nContent-Length: ") == -1 ||
+        append_header_number(response, ranges[0].len) == -1 || append_header_bytes(response, "\r\n", 2) == -1 ||
+        append_header_string(response, encoding) == -1 || append_header_string(response, fields) == -1 ||
+        append_header_string(response, close_header) == -1) {
+      return -1;
+    }
+    end_headers(response, &result);
+    if (result == RESPONSE_SUCCESS) {
+      add_body_segment(response, data, fd, ranges[0], &result);
+    }
+    return result == RESPONSE_SUCCESS ? 0 : -1;
+  }
+
+  // frame every part, the delimiter of a later part starts with CRLF
+  char* parts[RANGE_MAX_PARTS + 1];
+  size_t part_lens[RANGE_MAX_PARTS + 1];
+  size_t total = 0;
+  for (int i = 0; i <= range_count; i++) {
+    pool_result_t pool_result;
+    parts[i] = arena_alloc(&connection->arena, 128, &pool_result);
+    if (parts[i] == NULL) {
+      return -1;
+    }
+
+    int len;
+    if (i < range_count) {
+      len = snprintf(parts[i], 128, "%s--" RANGE_BOUNDARY "\r\nContent-Range: bytes %zu-%zu/%zu\r\n\r\n",
+                     i > 0 ? "\r\n" : "", ranges[i].offset, ranges[i].offset + ranges[i].len - 1, size);
+      total += ranges[i].len;
+    } else {
+      len = snprintf(parts[i], 128, "\r\n--" RANGE_BOUNDARY "--\r\n");
+    }
+    part_lens[i] = (size_t)len;
+    total += (size_t)len;
+  }
+
+  if (append_header_string(response, "HTTP/1.1 206 Partial Content\r\nContent-Type: multipart/byteranges; "
+                           "boundary=" RANGE_BOUNDARY "\r\nContent-Length: ") == -1 ||
+      append_header_number(response, total) == -1 || append_header_bytes(response, "\r\n", 2) == -1 ||
+      append_header_string(response, encoding) == -1 || append_header_string(response, fields) == -1 ||
+      append_header_string(response, close_header) == -1) {
+    return -1;
+  }
+  end_headers(response, &result);
+
+  // part header, part body, ..., closing delimiter
+  for (int i = 0; i <= range_count && result == RESPONSE_SUCCESS; i++) {
+    add_memory_segment(response, parts[i], part_lens[i], &result);
+    if (i < range_count && result == RESPONSE_SUCCESS) {
+      add_body_segment(response, data, fd, ranges[i], &result);
+    }
+  }
+
+  return result == RESPONSE_SUCCESS ? 0 : -1;
+}
+
+/**
+ * @brief Queues a file as headers plus a sendfile() body
+ *
+ * @param connection connection_t struct
  * @param request request_t struct
+ * @param file_name Path of the file
+ * @param encoding Sends the precompressed sibling of the file if not identity
  * @return int 0 if successful, -1 if error
  */
-int handle_request(client_t* client, request_t* request) {
-  // initialize result
-  client_result_t result;
+static int queue_file(connection_t* connection, const request_t* request, const char* file_name,
+                      content_encoding_t encoding) {
+  response_result_t result;
+  response_t* response = &connection->response;
 
-  // log request
-  log_message(LOG_INFO, "Serving %s to client %s\n", request->file_name, client->host);
+  // open file, the response owns it from here
+  struct stat file_stat;
+  int fd = open_body(file_name, &encoding, 0, &file_stat);
+  if (fd == -1) {
+    return queue_not_found(connection);
+  }
+  TRACE_MARK(&connection->trace, TRACE_OPEN);
+  response->fd = fd;
+  size_t size = (size_t)file_stat.st_size;
+
+  // validators and Vary
+  char etag[ETAG_LEN];
+  char fields[FILE_CACHE_FIELDS_LEN];
+  format_etag(etag, file_stat.st_ino, size, file_stat.st_mtim, encoding);
+  int fields_len = format_validators(fields, sizeof(fields), etag, file_stat.st_mtim.tv_sec);
+  if (connection->server->config->compress_min > 0 && is_compressible(file_name)) {
+    snprintf(fields + fields_len, sizeof(fields) - (size_t)fields_len, "Vary: Accept-Encoding\r\n");
+  }
+
+  // revalidation and ranges
+  if (is_conditional(request)) {
+    byte_range_t ranges[RANGE_MAX_PARTS];
+    int range_count;
+    selection_t selection = select_representation(request, etag, file_stat.st_mtim.tv_sec, size, ranges,
+                                                  &range_count);
+    if (selection != SELECT_FULL) {
+      return queue_selected(connection, selection, ranges, range_count, NULL, fd, size, fields,
+                            encoding_header(encoding));
+    }
+  }
 
-  // initialize response
-  char response[MAX_RESPONSE_LENGTH];
-  char file_content[MAX_FILE_LENGTH];
+  // queue headers and body
+  if (append_header_string(response, "HTTP/1.1 200 OK\r\nContent-Length: ") == -1 ||
+      append_header_number(response, size) == -1 || append_header_bytes(response, "\r\n", 2) == -1 ||
+      append_header_string(response, encoding_header(encoding)) == -1 ||
+      append_header_string(response, fields) == -1 ||
+      append_header_string(response, connection->keep_alive ? "" : "Connection: close\r\n") == -1) {
+    return -1;
+  }
+  end_headers(response, &result);
+  if (result != RESPONSE_SUCCESS) {
+    return -1;
+  }
+  add_file_segment(response, fd, 0, size, &result);
+  if (result != RESPONSE_SUCCESS) {
+    return -1;
+  }
 
-  // read file into response
-  int fd = open(request->file_name, O_RDONLY);
-  read(fd, file_content, sizeof(file_content));
-  close(fd);
+  response->status = 200;
+  return 0;
+}
 
-  // craft response
-  sprintf(response, "HTTP/1.1 200 OK\r\nContent-Length: %lu\r\n\r\n%s", strlen(file_content), file_content);
+/**
+ * @brief Queues a prebuilt entry the response already keeps alive
+ *
+ * @param connection connection_t struct
+ * @param request request_t struct
+ * @param file_name Path of the file, opened when the entry has no data
+ * @param entry File cache entry
+ * @return int 0 if successful, -1 if error
+ */
+static int queue_entry(connection_t* connection, const request_t* request, const char* file_name,
+                       const file_cache_entry_t* entry) {
+  response_result_t result;
+  response_t* response = &connection->response;
 
-  // send response
-  send_client(client, response, sizeof(response), &result);
+  // revalidation and ranges are answered from the entry
+  byte_range_t ranges[RANGE_MAX_PARTS];
+  int range_count = 0;
+  selection_t selection = SELECT_FULL;
+  if (is_conditional(request)) {
+    selection = select_representation(request, entry->etag, entry->mtime.tv_sec, entry->size, ranges, &range_count);
+  }
 
-  // check result
-  if (result != CLIENT_SUCCESS) {
+  // large files are streamed from disk, unless no body is sent
+  int fd = -1;
+  if (entry->data == NULL && (selection == SELECT_FULL || selection == SELECT_PARTIAL)) {
+    content_encoding_t body_encoding = entry->sibling ? entry->encoding : ENCODING_IDENTITY;
+    struct stat file_stat;
+    fd = open_body(file_name, &body_encoding, 1, &file_stat);
+    if (fd == -1) {
+      return -1;
+    }
+    response->fd = fd;
+
+    // the entry describes the file as it was when cached
+    if ((size_t)file_stat.st_size != entry->size) {
+      return -1;
+    }
+  }
+
+  if (selection != SELECT_FULL) {
+    return queue_selected(connection, selection, ranges, range_count, entry->data, fd, entry->size, entry->fields,
+                          encoding_header(entry->encoding));
+  }
+
+  // pick the prebuilt header block, then Date and the body in the same writev()
+  const char* header = connection->keep_alive ? entry->header : entry->close_header;
+  size_t header_len = connection->keep_alive ? entry->header_len : entry->close_header_len;
+  add_memory_segment(response, header, header_len, &result);
+  if (result == RESPONSE_SUCCESS) {
+    end_headers(response, &result);
+  }
+  if (result != RESPONSE_SUCCESS) {
+    return -1;
+  }
+  byte_range_t body = { 0, entry->size };
+  add_body_segment(response, entry->data, fd, body, &result);
+  if (result != RESPONSE_SUCCESS) {
     return -1;
   }
 
+  response->status = 200;
   return 0;
 }
 
+/**
+ * @brief Queues a file through the file cache
+ *
+ * @param connection connection_t struct
+ * @param request request_t struct
+ * @param file_name Path of the file
+ * @param encoding Encoding the client prefers
+ * @return int 0 if successful, -1 if error
+ */
+static int queue_cached_file(connection_t* connection, const request_t* request, const char* file_name,
+                             content_encoding_t encoding) {
+  file_cache_result_t cache_result;
+  response_t* response = &connection->response;
+
+  // look up the file, the response holds the reference from here
+  file_cache_entry_t* entry = file_cache_get(connection->server->cache, file_name, encoding, &cache_result);
+  if (entry == NULL) {
+    return cache_result == FILE_CACHE_ERR_NOT_FOUND ? queue_not_found(connection) : -1;
+  }
+  TRACE_MARK(&connection->trace, TRACE_OPEN);
+  response->release = release_cache_entry;
+  response->owner = entry;
+
+  return queue_entry(connection, request, file_name, entry);
+}
+
+/**
+ * @brief Queues a file from the indexed document root
+ *
+ * The path is looked up in the thread's snapshot as it is, so no file
+ * name is copied and no system call is made.
+ *
+ * @param connection connection_t struct
+ * @param request request_t struct
+ * @return int 0 if successful, -1 if error
+ */
+static int queue_indexed_file(connection_t* connection, const request_t* request) {
+  response_t* response = &connection->response;
+
+  // look up the file in the snapshot this thread holds
+  docroot_hold_t* hold = docroot_acquire();
+  if (hold == NULL) {
+    return -1;
+  }
+  const docroot_file_t* file = docroot_find(hold->snapshot, request->path);
+  if (file == NULL) {
+    return queue_not_found(connection);
+  }
+
+  // only text files have compressed variants
+  content_encoding_t encoding = file->negotiable ? negotiate_encoding(request) : ENCODING_IDENTITY;
+  file_cache_entry_t* entry = docroot_variant(file, encoding);
+  TRACE_MARK(&connection->trace, TRACE_OPEN);
+
+  // the response keeps the snapshot mapped until it is sent
+  docroot_retain(hold);
+  response->release = docroot_release;
+  response->owner = hold;
+
+  log_message(LOG_DEBUG, "Serving %s to client %s\n", entry->path, connection->client->host);
+
+  return queue_entry(connection, request, entry->path, entry);
+}
+
+/**
+ * @brief Queues the file a request names
+ *
+ * @param connection connection_t struct
+ * @param request request_t struct
+ * @return int 0 if successful, -1 if error
+ */
+static int queue_request_file(connection_t* connection, request_t* request) {
+  // an indexed docroot answers from memory
+  if (connection->server->config->immutable) {
+    return queue_indexed_file(connection, request);
+  }
+
+  // get file name
+  char file_name[FILE_NAME_LEN];
+  request_file_name(request, file_name);
+
+  // log request
+  log_message(LOG_DEBUG, "Serving %s to client %s\n", file_name, connection->client->host);
+
+  // only text files have compressed variants
+  content_encoding_t encoding = ENCODING_IDENTITY;
+  if (connection->server->config->compress_min > 0 && is_compressible(file_name)) {
+    encoding = negotiate_encoding(request);
+  }
+
+  // serve from the cache when enabled
+  if (connection->server->cache != NULL) {
+    return queue_cached_file(connection, request, file_name, encoding);
+  }
+
+  return queue_file(connection, request, file_name, encoding);
+}
+
+/**
+ * @brief Handles a request from a client
+ *
+ * Queues the headers and the file as response segments on the connection,
+ * which sends them once the socket is writable. Cached files are sent from
+ * memory, others are never read into user space. Text files are sent
+ * compressed to clients that accept it, and validators and Range turn the
+ * response into a 304, 206 or 416. Targets under a proxied route are
+ * forwarded to its backends instead, whatever the method, bodies and all,
+ * and a target with a dot-segment is refused so it cannot leave its route.
+ * Files only answer GET and HEAD, and the connection skips any body they
+ * leave unread.
+ *
+ * @param connection connection_t struct
+ * @param request request_t struct
+ * @return int 0 if successful, -1 if error
+ */
+int handle_request(connection_t* connection, request_t* request) {
+  // proxied prefixes belong to their backends
+  if (connection->server->upstream != NULL) {
+    // a backend that resolves dot-segments would step out of the route's prefix
+    if (has_dot_segment(request->path)) {
+      response_result_t result;
+      queue_status(&connection->response, 400, connection->keep_alive, &result);
+      return result == RESPONSE_SUCCESS ? 0 : -1;
+    }
+
+    const upstream_route_t* route = match_route(connection->server->upstream, request->target);
+    if (route != NULL) {
+      return start_proxy(connection, request, route);
+    }
+  }
+
+  // files take no body, and one the client holds back until asked for is never asked for
+  if (!connection->body.done && header_has_token(request, "Expect", "100-continue")) {
+    connection->keep_alive = 0;
+  }
+
+  // files answer GET and HEAD, named by a path inside the document root
+  int head = slice_equals(request->method, "HEAD");
+  int status = 0;
+  if (!head && !slice_equals(request->method, "GET")) {
+    status = 405;
+  } else if (request->path.len >= FILE_NAME_LEN) {
+    status = 414;
+  } else if (is_valid_file(request->path) == -1) {
+    status = 400;
+  }
+  if (status != 0) {
+    response_result_t result;
+    queue_status(&connection->response, status, connection->keep_alive, &result);
+    return result == RESPONSE_SUCCESS ? 0 : -1;
+  }
+
+  // HEAD gets the headers GET would
+  int queued = queue_request_file(connection, request);
+  if (queued == 0 && head) {
+    drop_body(&connection->response);
+  }
+
+  return queued;
+}
+
+/**
+ * @brief Stops accepting and lets open connections finish
+ *
+ * Every worker watches wake_fd, so writing it once wakes all of them.
+ * Connections waiting for a request are closed after SERVER_DRAIN_GRACE_MS,
+ * the others are answered with Connection: close until the deadline passes.
+ *
+ * @param server server_t struct
+ * @param timeout Seconds connections are given to finish
+ */
+void drain_server(server_t* server, int timeout) {
+  // the first deadline stands
+  if (__atomic_load_n(&server->draining, __ATOMIC_ACQUIRE)) {
+    return;
+  }
+
+  // publish the deadline before anyone sees the flag
+  server->drain_deadline = now_ms() + (int64_t)timeout * 1000;
+  __atomic_store_n(&server->draining, 1, __ATOMIC_RELEASE);
+
+  // never read, so the eventfd stays readable for every worker
+  uint64_t one = 1;
+  if (write(server->wake_fd, &one, sizeof(one)) == -1) {
+    log_message(LOG_ERROR, "Could not wake workers: %s\n", strerror(errno));
+  }
+}
+
 /**
  * @brief Closes the server
  *
  * @param server server_t struct
  */
 void close_server(server_t* server) {
-  // close socket
-  close(server->socket);
+  // close listeners, taken over ones included
+  for (int i = 0; i < server->inherited || i < server->listener_count; i++) {
+    close(server->listeners[i]);
+  }
+  close(server->wake_fd);
+  if (server->admission != NULL) {
+    close_admission(server->admission);
+  }
+  if (server->upstream != NULL) {
+    close_upstream(server->upstream);
+  }
+  if (server->response_cache != NULL) {
+    close_response_cache(server->response_cache);
+  }
+  if (server->tls != NULL) {
+    close_tls(server->tls);
+  }
 
   // free server
   free(server);
@@ -0,0 +1,247 @@
+#include <stdio.h>
+#include <pthread.h>
+#include <time.h>
+
+#include "status.h"
+#include "conditional.h"
+
+/**
+ * @brief Preformatted error response
+ */
+typedef struct {
+  int status;                          /**< Status code                 */
+  const char* head;                    /**< Status line and headers     */
+  size_t head_len;                     /**< Length of head              */
+  const char* body;                    /**< Plain text body             */
+  size_t body_len;                     /**< Length of body              */
+} status_response_t;
+
+#define STATUS_RESPONSE(status, head, body) { status, head, sizeof(head) - 1, body, sizeof(body) - 1 }
+
+/** Error responses, each head ends before the Date line */
+static const status_response_t status_responses[] = {
+  STATUS_RESPONSE(400, "HTTP/1.1 400 Bad Request\r\nContent-Type: text/plain\r\nContent-Length: 16\r\n",
+                  "400 Bad Request\n"),
+  STATUS_RESPONSE(404, "HTTP/1.1 404 Not Found\r\nContent-Type: text/plain\r\nContent-Length: 14\r\n",
+                  "404 Not Found\n"),
+  STATUS_RESPONSE(405, "HTTP/1.1 405 Method Not Allowed\r\nAllow: GET, HEAD\r\nContent-Type: text/plain\r\n"
+                  "Content-Length: 23\r\n", "405 Method Not Allowed\n"),
+  STATUS_RESPONSE(413, "HTTP/1.1 413 Content Too Large\r\nContent-Type: text/plain\r\nContent-Length: 22\r\n",
+                  "413 Content Too Large\n"),
+  STATUS_RESPONSE(414, "HTTP/1.1 414 URI Too Long\r\nContent-Type: text/plain\r\nContent-Length: 17\r\n",
+                  "414 URI Too Long\n"),
+  STATUS_RESPONSE(431, "HTTP/1.1 431 Request Header Fields Too Large\r\nContent-Type: text/plain\r\n"
+                  "Content-Length: 36\r\n", "431 Request Header Fields Too Large\n"),
+  STATUS_RESPONSE(501, "HTTP/1.1 501 Not Implemented\r\nContent-Type: text/plain\r\nContent-Length: 20\r\n",
+                  "501 Not Implemented\n"),
+  STATUS_RESPONSE(502, "HTTP/1.1 502 Bad Gateway\r\nContent-Type: text/plain\r\nContent-Length: 16\r\n",
+                  "502 Bad Gateway\n"),
+  STATUS_RESPONSE(503, "HTTP/1.1 503 Service Unavailable\r\nContent-Type: text/plain\r\nRetry-After: 1\r\n"
+                  "Content-Length: 24\r\n", "503 Service Unavailable\n"),
+  STATUS_RESPONSE(504, "HTTP/1.1 504 Gateway Timeout\r\nContent-Type: text/plain\r\nContent-Length: 20\r\n",
+                  "504 Gateway Timeout\n"),
+  STATUS_RESPONSE(505, "HTTP/1.1 505 HTTP Version Not Supported\r\nContent-Type: text/plain\r\n"
+                  "Content-Length: 31\r\n", "505 HTTP Version Not Supported\n")
+};
+
+static const char close_line[] = "Connection: close\r\n";
+
+/** Two Date lines, the clock writes the one readers are not told about */
+static char date_lines[2][STATUS_DATE_LINE_LEN];
+static unsigned int date_sequence = 0;
+
+static pthread_mutex_t clock_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t clock_cond = PTHREAD_COND_INITIALIZER;
+static pthread_t clock_thread;
+static int clock_running = 0;
+
+/**
+ * @brief Maps a failed parse to the status that answers it
+ *
+ * @param result Parse result other than success or incomplete
+ * @return int 400, 405, 413, 414, 431, 501 or 505
+ */
+int request_result_status(request_result_t result) {
+  switch (result) {
+    case REQUEST_ERR_INVALID_METHOD:
+      return 405;
+    case REQUEST_ERR_INVALID_VERSION:
+      return 505;
+    case REQUEST_ERR_URI_TOO_LONG:
+      return 414;
+    case REQUEST_ERR_TOO_MANY_HEADERS:
+    case REQUEST_ERR_HEADERS_TOO_LARGE:
+      return 431;
+    case REQUEST_ERR_BODY_TOO_LARGE:
+      return 413;
+    case REQUEST_ERR_NOT_IMPLEMENTED:
+      return 501;
+    default:
+      return 400;
+  }
+}
+
+/**
+ * @brief Finds the preformatted response of a status
+ *
+ * @param status Status code
+ * @return const status_response_t* Response, the 400 one for unknown codes
+ */
+static const status_response_t* find_status(int status) {
+  for (size_t i = 0; i < sizeof(status_responses) / sizeof(status_responses[0]); i++) {
+    if (status_responses[i].status == status) {
+      return &status_responses[i];
+    }
+  }
+  return &status_responses[0];
+}
+
+/**
+ * @brief Queues a preformatted error response
+ *
+ * @param response Empty response struct
+ * @param status 400, 404, 405, 413, 414, 431, 501, 502, 503, 504 or 505
+ * @param keep_alive 0 to add Connection: close
+ * @param result Result of the operation
+ */
+void queue_status(response_t* response, int status, int keep_alive, response_result_t* result) {
+  // unknown codes are answered as bad requests
+  const status_response_t* template = find_status(status);
+
+  // head, close, Date and blank line, body
+  add_memory_segment(response, template->head, template->head_len, result);
+  if (*result == RESPONSE_SUCCESS && !keep_alive) {
+    add_memory_segment(response, close_line, sizeof(close_line) - 1, result);
+  }
+  if (*result == RESPONSE_SUCCESS) {
+    end_headers(response, result);
+  }
+  if (*result == RESPONSE_SUCCESS) {
+    add_memory_segment(response, template->body, template->body_len, result);
+  }
+
+  response->status = template->status;
+}
+
+/**
+ * @brief Sends a preformatted error response and nothing more
+ *
+ * For clients refused before they get a connection. One writev() that
+ * is not retried, a client that cannot take it at once loses it. A TLS
+ * client is refused before its handshake ends, so nothing is sent to it
+ * and it is only closed.
+ *
+ * @param client Client to send to
+ * @param status 400, 404, 405, 413, 414, 431, 501, 502, 503, 504 or 505
+ */
+void send_status(client_t* client, int status) {
+  // no record can be sealed before the handshake
+  if (client->ssl != NULL) {
+    return;
+  }
+
+  const status_response_t* template = find_status(status);
+  char date_line[STATUS_DATE_LINE_LEN];
+  copy_date_line(date_line);
+
+  struct iovec iov[5] = {
+    { (void*)template->head, template->head_len },
+    { (void*)close_line, sizeof(close_line) - 1 },
+    { date_line, STATUS_DATE_LINE_LEN },
+    { "\r\n", 2 },
+    { (void*)template->body, template->body_len }
+  };
+  client_result_t result;
+  writev_client(client, iov, 5, &result);
+}
+
+/**
+ * @brief Copies the current Date line
+ *
+ * @param line Filled with "Date: ...\r\n", not NUL-terminated
+ */
+void copy_date_line(char line[STATUS_DATE_LINE_LEN]) {
+  // retry if the clock rewrote the line while it was copied
+  unsigned int sequence;
+  do {
+    sequence = __atomic_load_n(&date_sequence, __ATOMIC_ACQUIRE);
+    memcpy(line, date_lines[sequence & 1], STATUS_DATE_LINE_LEN);
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+  } while (__atomic_load_n(&date_sequence, __ATOMIC_RELAXED) != sequence);
+}
+
+/**
+ * @brief Formats the Date line for a time and publishes it
+ *
+ * @param now Seconds since the epoch
+ */
+static void publish_date(time_t now) {
+  char date[HTTP_DATE_LEN];
+  format_http_date(date, now);
+
+  // fill the line readers are not using, then switch them over
+  unsigned int sequence = date_sequence + 1;
+  char* line = date_lines[sequence & 1];
+  memcpy(line, "Date: ", 6);
+  memcpy(line + 6, date, HTTP_DATE_LEN - 1);
+  memcpy(line + 6 + HTTP_DATE_LEN - 1, "\r\n", 2);
+  __atomic_store_n(&date_sequence, sequence, __ATOMIC_RELEASE);
+}
+
+/**
+ * @brief Refreshes the Date line at the start of every second
+ *
+ * @param argp Unused
+ * @return void* NULL
+ */
+static void* run_clock(void* argp) {
+  (void)argp;
+
+  pthread_mutex_lock(&clock_lock);
+  while (clock_running) {
+    // wake on the next second boundary
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    struct timespec deadline = { now.tv_sec + 1, 0 };
+    pthread_cond_timedwait(&clock_cond, &clock_lock, &deadline);
+
+    clock_gettime(CLOCK_REALTIME, &now);
+    publish_date(now.tv_sec);
+  }
+  pthread_mutex_unlock(&clock_lock);
+
+  return NULL;
+}
+
+/**
+ * @brief Formats the Date line and starts refreshing it every second
+ *
+ * @param result Result of the operation
+ */
+void start_clock(status_result_t* result) {
+  // initialize result
+  *result = STATUS_SUCCESS;
+
+  publish_date(time(NULL));
+
+  clock_running = 1;
+  if (pthread_create(&clock_thread, NULL, run_clock, NULL) != 0) {
+    clock_running = 0;
+    *result = STATUS_ERR_THREAD;
+  }
+}
+
+/**
+ * @brief Stops refreshing the Date line
+ */
+void stop_clock(void) {
+  pthread_mutex_lock(&clock_lock);
+  int running = clock_running;
+  clock_running = 0;
+  pthread_cond_signal(&clock_cond);
+  pthread_mutex_unlock(&clock_lock);
+
+  if (running) {
+    pthread_join(clock_thread, NULL);
+  }
+}
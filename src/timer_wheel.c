@@ -0,0 +1,147 @@
+#include "timer_wheel.h"
+
+/** Slot index mask */
+#define TIMER_WHEEL_MASK (TIMER_WHEEL_SLOTS - 1)
+
+/**
+ * @brief Initializes an empty wheel
+ *
+ * @param wheel Timer wheel struct
+ * @param now Current monotonic ms
+ */
+void init_timer_wheel(timer_wheel_t* wheel, int64_t now) {
+  for (int i = 0; i < TIMER_WHEEL_SLOTS; i++) {
+    wheel->slots[i] = NULL;
+  }
+  wheel->tick = now / TIMER_WHEEL_TICK_MS;
+  wheel->count = 0;
+}
+
+/**
+ * @brief Initializes a timer that is not scheduled
+ *
+ * @param timer Timer struct
+ * @param owner Returned with the timer when it fires
+ */
+void init_wheel_timer(wheel_timer_t* timer, void* owner) {
+  timer->expires = 0;
+  timer->owner = owner;
+  timer->slot = -1;
+  timer->prev = NULL;
+  timer->next = NULL;
+}
+
+/**
+ * @brief Unschedules a timer, if it is scheduled
+ *
+ * @param wheel Timer wheel struct
+ * @param timer Timer struct
+ */
+void cancel_timer(timer_wheel_t* wheel, wheel_timer_t* timer) {
+  if (timer->slot == -1) {
+    return;
+  }
+
+  if (timer->prev != NULL) {
+    timer->prev->next = timer->next;
+  } else {
+    wheel->slots[timer->slot] = timer->next;
+  }
+  if (timer->next != NULL) {
+    timer->next->prev = timer->prev;
+  }
+
+  timer->slot = -1;
+  timer->prev = NULL;
+  timer->next = NULL;
+  wheel->count--;
+}
+
+/**
+ * @brief Schedules a timer, moving it if it is already scheduled
+ *
+ * @param wheel Timer wheel struct
+ * @param timer Timer struct
+ * @param expires Monotonic ms to fire at
+ */
+void schedule_timer(timer_wheel_t* wheel, wheel_timer_t* timer, int64_t expires) {
+  cancel_timer(wheel, timer);
+
+  // a deadline already past fires with the current tick
+  int64_t tick = expires / TIMER_WHEEL_TICK_MS;
+  if (tick < wheel->tick) {
+    tick = wheel->tick;
+  }
+
+  int slot = (int)(tick & TIMER_WHEEL_MASK);
+  timer->expires = expires;
+  timer->slot = slot;
+  timer->prev = NULL;
+  timer->next = wheel->slots[slot];
+  if (timer->next != NULL) {
+    timer->next->prev = timer;
+  }
+  wheel->slots[slot] = timer;
+  wheel->count++;
+}
+
+/**
+ * @brief Unschedules every timer that expired
+ *
+ * @param wheel Timer wheel struct
+ * @param now Current monotonic ms
+ * @return wheel_timer_t* Expired timers linked through next, NULL if none
+ */
+wheel_timer_t* expire_timers(timer_wheel_t* wheel, int64_t now) {
+  int64_t now_tick = now / TIMER_WHEEL_TICK_MS;
+  if (wheel->count == 0) {
+    wheel->tick = now_tick;
+    return NULL;
+  }
+
+  // one turn visits every slot
+  int64_t tick = wheel->tick;
+  if (now_tick - tick >= TIMER_WHEEL_SLOTS) {
+    tick = now_tick - TIMER_WHEEL_SLOTS + 1;
+  }
+
+  // later turns stay in their slot, the current tick is visited again
+  wheel_timer_t* expired = NULL;
+  for (; tick <= now_tick; tick++) {
+    wheel_timer_t* timer = wheel->slots[tick & TIMER_WHEEL_MASK];
+    while (timer != NULL) {
+      wheel_timer_t* next = timer->next;
+      if (timer->expires <= now) {
+        cancel_timer(wheel, timer);
+        timer->next = expired;
+        expired = timer;
+      }
+      timer = next;
+    }
+  }
+  wheel->tick = now_tick;
+
+  return expired;
+}
+
+/**
+ * @brief Gets the time until expire_timers() has work
+ *
+ * @param wheel Timer wheel struct
+ * @param now Current monotonic ms
+ * @return int Milliseconds to wait or -1 if the wheel is empty
+ */
+int next_timer_timeout(timer_wheel_t* wheel, int64_t now) {
+  if (wheel->count == 0) {
+    return -1;
+  }
+
+  // wake at the end of the first tick holding a timer
+  for (int64_t tick = wheel->tick; tick < wheel->tick + TIMER_WHEEL_SLOTS; tick++) {
+    if (wheel->slots[tick & TIMER_WHEEL_MASK] != NULL) {
+      int64_t remaining = (tick + 1) * TIMER_WHEEL_TICK_MS - now;
+      return remaining > 0 ? (int)remaining : 0;
+    }
+  }
+  return -1;
+}
@@ -0,0 +1,362 @@
+#include <limits.h>
+#include <openssl/ssl.h>
+#include <openssl/err.h>
+
+#include "tls.h"
+#include "metrics.h"
+
+/**
+ * @brief TLS context shared by every worker
+ */
+struct tls {
+  SSL_CTX* ctx;                        /**< OpenSSL context, holds the session cache */
+  int h2;                              /**< 1 if h2 is offered by ALPN  */
+};
+
+/** ALPN protocols in order of preference, h2 first */
+static const unsigned char alpn_h2[] = "\x02h2\x08http/1.1";
+/** ALPN protocols without h2 */
+static const unsigned char alpn_http1[] = "\x08http/1.1";
+
+/**
+ * @brief Picks the application protocol of a handshake
+ *
+ * @param ssl Session being negotiated
+ * @param out Set to the protocol picked
+ * @param out_len Set to its length
+ * @param in Protocols offered by the client
+ * @param in_len Length of the offer
+ * @param arg TLS context
+ * @return int SSL_TLSEXT_ERR_OK, or SSL_TLSEXT_ERR_NOACK to go on without ALPN
+ */
+static int select_protocol(SSL* ssl, const unsigned char** out, unsigned char* out_len, const unsigned char* in,
+                           unsigned int in_len, void* arg) {
+  (void)ssl;
+  tls_t* tls = arg;
+  const unsigned char* ours = tls->h2 ? alpn_h2 : alpn_http1;
+  unsigned int ours_len = tls->h2 ? sizeof(alpn_h2) - 1 : sizeof(alpn_http1) - 1;
+
+  // our preference wins, a client offering none of them still gets HTTP/1.1
+  if (SSL_select_next_proto((unsigned char**)out, out_len, ours, ours_len, in, in_len) != OPENSSL_NPN_NEGOTIATED) {
+    return SSL_TLSEXT_ERR_NOACK;
+  }
+  return SSL_TLSEXT_ERR_OK;
+}
+
+/**
+ * @brief Creates the TLS context of a server
+ *
+ * Offers TLS 1.3 and 1.2, http/1.1 and optionally h2 by ALPN, session
+ * tickets and a server-side session cache, and kTLS once a handshake ends.
+ *
+ * @param cert_path PEM certificate chain, leaf first
+ * @param key_path PEM private key, NULL if it follows the chain in cert_path
+ * @param h2 1 to offer h2 ahead of http/1.1
+ * @param result Result of the operation
+ * @return tls_t* Pointer to new context or NULL if error
+ */
+tls_t* create_tls(const char* cert_path, const char* key_path, int h2, tls_result_t* result) {
+  // initialize result
+  *result = TLS_SUCCESS;
+
+  // initialize context
+  tls_t* tls = calloc(1, sizeof(tls_t));
+  if (tls == NULL) {
+    *result = TLS_ERR_MALLOC;
+    return NULL;
+  }
+  tls->h2 = h2;
+  tls->ctx = SSL_CTX_new(TLS_server_method());
+  if (tls->ctx == NULL) {
+    free(tls);
+    *result = TLS_ERR_SETUP;
+    return NULL;
+  }
+  SSL_CTX* ctx = tls->ctx;
+
+  // TLS 1.3, and 1.2 for older clients
+  SSL_CTX_set_min_proto_version(ctx, TLS1_2_VERSION);
+  SSL_CTX_set_options(ctx, SSL_OP_CIPHER_SERVER_PREFERENCE | SSL_OP_NO_RENEGOTIATION);
+
+  // the kernel seals records once it has the keys, a peer closing without close_notify has just closed
+  SSL_CTX_set_options(ctx, SSL_OP_ENABLE_KTLS | SSL_OP_IGNORE_UNEXPECTED_EOF);
+
+  // writes return per record and are retried from buffers that may move, idle sessions hold no buffers
+  SSL_CTX_set_mode(ctx, SSL_MODE_ENABLE_PARTIAL_WRITE | SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER | SSL_MODE_RELEASE_BUFFERS);
+
+  // load certificate chain and key
+  if (SSL_CTX_use_certificate_chain_file(ctx, cert_path) != 1) {
+    close_tls(tls);
+    *result = TLS_ERR_CERT;
+    return NULL;
+  }
+  if (SSL_CTX_use_PrivateKey_file(ctx, key_path != NULL ? key_path : cert_path, SSL_FILETYPE_PEM) != 1 ||
+      SSL_CTX_check_private_key(ctx) != 1) {
+    close_tls(tls);
+    *result = TLS_ERR_KEY;
+    return NULL;
+  }
+
+  // tickets resume anywhere, the cache every worker shares resumes session IDs
+  SSL_CTX_set_session_cache_mode(ctx, SSL_SESS_CACHE_SERVER);
+  SSL_CTX_sess_set_cache_size(ctx, TLS_SESSION_CACHE_SIZE);
+  SSL_CTX_set_timeout(ctx, TLS_SESSION_TIMEOUT);
+  SSL_CTX_set_num_tickets(ctx, TLS_TICKETS);
+  if (SSL_CTX_set_session_id_context(ctx, (const unsigned char*)"hyper", 5) != 1) {
+    close_tls(tls);
+    *result = TLS_ERR_SETUP;
+    return NULL;
+  }
+
+  // negotiate the protocol in the handshake
+  SSL_CTX_set_alpn_select_cb(ctx, select_protocol, tls);
+
+  ERR_clear_error();
+  return tls;
+}
+
+/**
+ * @brief Serves a client through TLS
+ *
+ * @param tls TLS context of the server
+ * @param client Accepted client, non-blocking socket
+ * @param result Result of the operation
+ */
+void tls_attach_client(tls_t* tls, client_t* client, tls_result_t* result) {
+  // initialize result
+  *result = TLS_SUCCESS;
+
+  // create the session on the socket
+  SSL* ssl = SSL_new(tls->ctx);
+  if (ssl == NULL) {
+    ERR_clear_error();
+    *result = TLS_ERR_MALLOC;
+    return;
+  }
+  if (SSL_set_fd(ssl, client->socket) != 1) {
+    SSL_free(ssl);
+    ERR_clear_error();
+    *result = TLS_ERR_SETUP;
+    return;
+  }
+
+  // the client speaks first
+  SSL_set_accept_state(ssl);
+  client->ssl = ssl;
+  client->ktls_send = 0;
+}
+
+/**
+ * @brief Closes the TLS context
+ *
+ * @param tls TLS context
+ * @note Clients still attached keep a reference and stay usable
+ */
+void close_tls(tls_t* tls) {
+  SSL_CTX_free(tls->ctx);
+  free(tls);
+}
+
+/**
+ * @brief Maps a failed OpenSSL call to a client result
+ *
+ * @param client Client served by TLS
+ * @param ret Return value of the call
+ * @param fail Result of a broken session
+ * @param result Result of the operation
+ */
+static void check_io(client_t* client, int ret, client_result_t fail, client_result_t* result) {
+  switch (SSL_get_error(client->ssl, ret)) {
+    case SSL_ERROR_WANT_READ:
+    case SSL_ERROR_WANT_WRITE:
+      *result = CLIENT_ERR_AGAIN;
+      break;
+    case SSL_ERROR_ZERO_RETURN:
+      *result = CLIENT_ERR_CLOSED;
+      break;
+    default:
+      // a broken session must not send close_notify
+      SSL_set_quiet_shutdown(client->ssl, 1);
+      *result = fail;
+      break;
+  }
+
+  // the queue is per thread, the next client must not see these errors
+  ERR_clear_error();
+}
+
+/**
+ * @brief Counts a finished handshake and picks up kTLS
+ *
+ * @param client Client served by TLS
+ */
+static void finish_handshake(client_t* client) {
+  // the kernel seals everything sent from now on if it took the keys
+  client->ktls_send = BIO_get_ktls_send(SSL_get_wbio(client->ssl));
+
+  metrics_count(METRIC_TLS_HANDSHAKES, 1);
+  if (SSL_session_reused(client->ssl)) {
+    metrics_count(METRIC_TLS_RESUMED, 1);
+  }
+  if (client->ktls_send) {
+    metrics_count(METRIC_TLS_KTLS, 1);
+  }
+}
+
+/**
+ * @brief Receives through TLS, see recv_client
+ *
+ * Drives the handshake until it ends, then decrypts records.
+ *
+ * @param client Client served by TLS
+ * @param buff Buffer of the request
+ * @param buff_len Length of the buffer
+ * @param result Result of the operation
+ * @return ssize_t Number of bytes received or -1 if error
+ */
+ssize_t tls_recv(client_t* client, char buff[], size_t buff_len, client_result_t* result) {
+  // initialize result
+  *result = CLIENT_SUCCESS;
+
+  // the handshake comes first
+  if (!SSL_is_init_finished(client->ssl)) {
+    int done = SSL_do_handshake(client->ssl);
+    if (done != 1) {
+      check_io(client, done, CLIENT_ERR_RECV, result);
+      return *result == CLIENT_ERR_CLOSED ? 0 : -1;
+    }
+    finish_handshake(client);
+  }
+
+  // decrypt what arrived
+  int received = SSL_read(client->ssl, buff, buff_len > INT_MAX ? INT_MAX : (int)buff_len);
+  if (received <= 0) {
+    check_io(client, received, CLIENT_ERR_RECV, result);
+    return *result == CLIENT_ERR_CLOSED ? 0 : -1;
+  }
+
+  return received;
+}
+
+/**
+ * @brief Seals bytes into records and sends them
+ *
+ * @param client Client served by TLS
+ * @param data Bytes to send
+ * @param len Number of bytes, not 0
+ * @param result Result of the operation
+ * @return ssize_t Number of bytes sent or -1 if error
+ */
+static ssize_t seal(client_t* client, const void* data, size_t len, client_result_t* result) {
+  int sent = SSL_write(client->ssl, data, len > INT_MAX ? INT_MAX : (int)len);
+  if (sent <= 0) {
+    check_io(client, sent, CLIENT_ERR_SEND, result);
+    return -1;
+  }
+
+  return sent;
+}
+
+/**
+ * @brief Sends through OpenSSL, see writev_client
+ *
+ * Small buffers are gathered into one record, a buffer of a record or
+ * more is sealed in place.
+ *
+ * @param client Client served by TLS without kTLS
+ * @param iov Buffers to send in order
+ * @param iov_count Number of buffers
+ * @param result Result of the operation
+ * @return ssize_t Number of bytes sent or -1 if error
+ */
+ssize_t tls_writev(client_t* client, const struct iovec* iov, int iov_count, client_result_t* result) {
+  // initialize result
+  *result = CLIENT_SUCCESS;
+
+  // nothing goes out before the handshake ends
+  if (!SSL_is_init_finished(client->ssl)) {
+    *result = CLIENT_ERR_AGAIN;
+    return -1;
+  }
+
+  // a large first buffer is sealed in place
+  const void* data = iov[0].iov_base;
+  size_t len = iov[0].iov_len;
+  char record[TLS_RECORD_LEN];
+  if (len < TLS_RECORD_LEN && iov_count > 1) {
+    // gather the rest into one record, the same bytes again when retried
+    len = 0;
+    for (int i = 0; i < iov_count && len < TLS_RECORD_LEN; i++) {
+      size_t take = iov[i].iov_len < TLS_RECORD_LEN - len ? iov[i].iov_len : TLS_RECORD_LEN - len;
+      memcpy(record + len, iov[i].iov_base, take);
+      len += take;
+    }
+    data = record;
+  }
+
+  if (len == 0) {
+    return 0;
+  }
+  return seal(client, data, len, result);
+}
+
+/**
+ * @brief Sends part of a file through OpenSSL, see sendfile_client
+ *
+ * Reads one record of the file and seals it.
+ *
+ * @param client Client served by TLS without kTLS
+ * @param fd File to send from
+ * @param offset Offset to send from, advanced by the bytes sent
+ * @param len Number of bytes to send
+ * @param result Result of the operation
+ * @return ssize_t Number of bytes sent or -1 if error
+ */
+ssize_t tls_sendfile(client_t* client, int fd, off_t* offset, size_t len, client_result_t* result) {
+  // initialize result
+  *result = CLIENT_SUCCESS;
+
+  // nothing goes out before the handshake ends
+  if (!SSL_is_init_finished(client->ssl)) {
+    *result = CLIENT_ERR_AGAIN;
+    return -1;
+  }
+  if (len == 0) {
+    return 0;
+  }
+
+  // read one record, the same one again when retried
+  char record[TLS_RECORD_LEN];
+  ssize_t read_len = pread(fd, record, len < TLS_RECORD_LEN ? len : TLS_RECORD_LEN, *offset);
+  if (read_len <= 0) {
+    // unreadable, or the file shrank underneath us
+    *result = CLIENT_ERR_SEND;
+    return -1;
+  }
+
+  ssize_t sent = seal(client, record, (size_t)read_len, result);
+  if (sent > 0) {
+    *offset += sent;
+  }
+
+  return sent;
+}
+
+/**
+ * @brief Ends the TLS session of a client
+ *
+ * Sends close_notify if the session is still sound, without waiting for
+ * the peer's.
+ *
+ * @param client Client served by TLS
+ */
+void tls_close_client(client_t* client) {
+  // a quiet session sends nothing
+  if (SSL_is_init_finished(client->ssl)) {
+    SSL_shutdown(client->ssl);
+  }
+
+  SSL_free(client->ssl);
+  client->ssl = NULL;
+  ERR_clear_error();
+}
@@ -0,0 +1,416 @@
+#define _GNU_SOURCE
+
+#ifdef HYPER_TRACE
+
+#include <time.h>
+#include <stdio.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <pthread.h>
+
+#include "net.h"
+#include "logger.h"
+#include "trace.h"
+
+/**
+ * @brief Finished span
+ */
+typedef struct {
+  uint64_t stamps[TRACE_STAMPS];       /**< Timestamps, in ticks        */
+} trace_span_t;
+
+/**
+ * @brief Spans and histograms of one thread
+ *
+ * Only the owning thread writes, the dump thread reads spans below head
+ * and discards any overwritten while it copied them.
+ */
+typedef struct trace_thread {
+  trace_span_t spans[TRACE_RING_SIZE]; /**< Recent spans                */
+  uint64_t head;                       /**< Spans recorded so far       */
+  uint64_t buckets[TRACE_PHASES][TRACE_BUCKETS]; /**< Phase latencies   */
+  uint64_t requests;                   /**< Requests begun, for sampling */
+  int id;                              /**< Thread id in the dump       */
+  struct trace_thread* next;           /**< Next registered thread      */
+  struct trace_thread* next_idle;      /**< Next buffer without a thread */
+} __attribute__((aligned(64))) trace_thread_t;
+
+/** Names of the phases ending at each stamp */
+static const char* phase_names[TRACE_PHASES] = { "wait", "recv", "parse", "open", "build", "send" };
+
+static pthread_mutex_t threads_lock = PTHREAD_MUTEX_INITIALIZER;
+static trace_thread_t* threads = NULL;
+static trace_thread_t* idle_threads = NULL;
+static int thread_ids = 0;
+static pthread_key_t thread_key;
+static pthread_once_t thread_key_once = PTHREAD_ONCE_INIT;
+static __thread trace_thread_t* thread_trace = NULL;
+static double ns_per_tick = 1.0;
+static uint64_t epoch = 0;
+static int signal_pipe[2] = { -1, -1 };
+static pthread_t dump_thread;
+static int trace_running = 0;
+
+/**
+ * @brief Hands the buffers of an exiting thread to the next new thread
+ *
+ * @param argp trace_thread_t struct
+ */
+static void release_thread(void* argp) {
+  trace_thread_t* thread = (trace_thread_t*)argp;
+
+  pthread_mutex_lock(&threads_lock);
+  thread->next_idle = idle_threads;
+  idle_threads = thread;
+  pthread_mutex_unlock(&threads_lock);
+}
+
+/**
+ * @brief Creates the thread exit hook for trace buffers
+ */
+static void create_thread_key(void) {
+  pthread_key_create(&thread_key, release_thread);
+}
+
+/**
+ * @brief Gets the trace buffers of the calling thread, creating them on first use
+ *
+ * @return trace_thread_t* Buffers or NULL if error
+ * @note Buffers outlive their thread so a dump still shows its spans, and
+ *       are reused by later threads so a thread per client stays bounded
+ */
+static trace_thread_t* get_thread(void) {
+  if (thread_trace != NULL) {
+    return thread_trace;
+  }
+
+  pthread_once(&thread_key_once, create_thread_key);
+
+  // reuse the buffers of an exited thread
+  pthread_mutex_lock(&threads_lock);
+  trace_thread_t* thread = idle_threads;
+  if (thread != NULL) {
+    idle_threads = thread->next_idle;
+  }
+  pthread_mutex_unlock(&threads_lock);
+
+  if (thread == NULL) {
+    thread = aligned_alloc(64, sizeof(trace_thread_t));
+    if (thread == NULL) {
+      return NULL;
+    }
+    memset(thread, 0, sizeof(trace_thread_t));
+
+    // register with the dump thread
+    pthread_mutex_lock(&threads_lock);
+    thread->id = ++thread_ids;
+    thread->next = threads;
+    threads = thread;
+    pthread_mutex_unlock(&threads_lock);
+  }
+  pthread_setspecific(thread_key, thread);
+
+  thread_trace = thread;
+  return thread;
+}
+
+/**
+ * @brief Converts ticks to nanoseconds
+ *
+ * @param ticks Tick count
+ * @return uint64_t Nanoseconds
+ */
+static uint64_t ticks_to_ns(uint64_t ticks) {
+  return (uint64_t)((double)ticks * ns_per_tick);
+}
+
+/**
+ * @brief Initializes the trace state of a new connection
+ *
+ * @param trace Trace state
+ */
+void trace_connection(trace_t* trace) {
+  trace->active = 0;
+  trace->sampled = 0;
+  trace->receiving = 0;
+  trace->stamps[TRACE_START] = trace_now();
+}
+
+/**
+ * @brief Begins the span of the next request, sampling one in TRACE_SAMPLE_RATE
+ *
+ * @param trace Trace state
+ * @param received When the first bytes of the request were asked for
+ */
+void trace_begin(trace_t* trace, uint64_t received) {
+  trace->active = 1;
+
+  trace_thread_t* thread = get_thread();
+  if (thread == NULL || ++thread->requests % TRACE_SAMPLE_RATE != 0) {
+    return;
+  }
+
+  // stamps the request never reaches stay zero
+  trace->sampled = 1;
+  for (int i = TRACE_RECV; i < TRACE_STAMPS; i++) {
+    trace->stamps[i] = 0;
+  }
+  trace->stamps[TRACE_RECV] = received;
+}
+
+/**
+ * @brief Ends the span of the current request and records it if sampled
+ *
+ * @param trace Trace state
+ */
+void trace_end(trace_t* trace) {
+  uint64_t now = trace_now();
+
+  if (trace->sampled) {
+    trace->stamps[TRACE_SENT] = now;
+
+    // a skipped stamp makes its phase empty
+    for (int i = TRACE_RECV; i < TRACE_STAMPS; i++) {
+      if (trace->stamps[i] < trace->stamps[i - 1]) {
+        trace->stamps[i] = trace->stamps[i - 1];
+      }
+    }
+
+    trace_thread_t* thread = get_thread();
+    if (thread != NULL) {
+      // bucket i holds up to 2^i ns
+      for (int i = 0; i < TRACE_PHASES; i++) {
+        uint64_t ns = ticks_to_ns(trace->stamps[i + 1] - trace->stamps[i]);
+        int bucket = ns <= 1 ? 0 : 64 - __builtin_clzll(ns - 1);
+        if (bucket >= TRACE_BUCKETS) {
+          bucket = TRACE_BUCKETS - 1;
+        }
+        __atomic_store_n(&thread->buckets[i][bucket], thread->buckets[i][bucket] + 1, __ATOMIC_RELAXED);
+      }
+
+      // publish the span after it is written
+      memcpy(thread->spans[thread->head % TRACE_RING_SIZE].stamps, trace->stamps, sizeof(trace->stamps));
+      __atomic_store_n(&thread->head, thread->head + 1, __ATOMIC_RELEASE);
+    }
+  }
+
+  // the next request waits from here
+  trace->active = 0;
+  trace->sampled = 0;
+  trace->stamps[TRACE_START] = now;
+}
+
+/**
+ * @brief Writes the recent spans of every thread as Chrome trace-event JSON
+ *
+ * @param path File to write
+ * @return int Number of spans written or -1 if error
+ */
+static int dump_spans(const char* path) {
+  FILE* file = fopen(path, "w");
+  if (file == NULL) {
+    return -1;
+  }
+
+  trace_span_t* copy = malloc(sizeof(trace_span_t) * TRACE_RING_SIZE);
+  if (copy == NULL) {
+    fclose(file);
+    return -1;
+  }
+
+  // one complete event per phase, timestamps in microseconds
+  int spans = 0;
+  fprintf(file, "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[\n");
+  pthread_mutex_lock(&threads_lock);
+  for (trace_thread_t* thread = threads; thread != NULL; thread = thread->next) {
+    uint64_t head = __atomic_load_n(&thread->head, __ATOMIC_ACQUIRE);
+    uint64_t base = head > TRACE_RING_SIZE ? head - TRACE_RING_SIZE : 0;
+    for (uint64_t i = base; i < head; i++) {
+      copy[i - base] = thread->spans[i % TRACE_RING_SIZE];
+    }
+
+    // drop what the owner overwrote during the copy
+    uint64_t first = base;
+    uint64_t now_head = __atomic_load_n(&thread->head, __ATOMIC_ACQUIRE);
+    if (now_head > TRACE_RING_SIZE && now_head - TRACE_RING_SIZE > first) {
+      first = now_head - TRACE_RING_SIZE;
+    }
+
+    for (uint64_t i = first; i < head; i++) {
+      trace_span_t* span = &copy[i - base];
+      for (int p = 0; p < TRACE_PHASES; p++) {
+        fprintf(file, "%s{\"name\":\"%s\",\"cat\":\"request\",\"ph\":\"X\",\"pid\":%d,\"tid\":%d,"
+                "\"ts\":%.3f,\"dur\":%.3f,\"args\":{\"span\":%llu}}\n", spans == 0 && p == 0 ? "" : ",",
+                phase_names[p], (int)getpid(), thread->id,
+                (double)ticks_to_ns(span->stamps[p] - epoch) / 1000.0,
+                (double)ticks_to_ns(span->stamps[p + 1] - span->stamps[p]) / 1000.0, (unsigned long long)i);
+      }
+      spans++;
+    }
+  }
+  pthread_mutex_unlock(&threads_lock);
+  fprintf(file, "]}\n");
+
+  free(copy);
+  return fclose(file) == 0 ? spans : -1;
+}
+
+/**
+ * @brief Logs the count and percentiles of every phase
+ */
+static void log_phases(void) {
+  uint64_t buckets[TRACE_PHASES][TRACE_BUCKETS];
+  memset(buckets, 0, sizeof(buckets));
+
+  // sum every thread
+  pthread_mutex_lock(&threads_lock);
+  for (trace_thread_t* thread = threads; thread != NULL; thread = thread->next) {
+    for (int p = 0; p < TRACE_PHASES; p++) {
+      for (int b = 0; b < TRACE_BUCKETS; b++) {
+        buckets[p][b] += __atomic_load_n(&thread->buckets[p][b], __ATOMIC_RELAXED);
+      }
+    }
+  }
+  pthread_mutex_unlock(&threads_lock);
+
+  // upper bound of the bucket holding each percentile
+  for (int p = 0; p < TRACE_PHASES; p++) {
+    uint64_t count = 0;
+    for (int b = 0; b < TRACE_BUCKETS; b++) {
+      count += buckets[p][b];
+    }
+
+    const double percentiles[] = { 0.5, 0.9, 0.99, 1.0 };
+    uint64_t bounds[4] = { 0, 0, 0, 0 };
+    for (int q = 0; q < 4 && count > 0; q++) {
+      uint64_t rank = (uint64_t)(percentiles[q] * (double)count + 0.5);
+      uint64_t seen = 0;
+      for (int b = 0; b < TRACE_BUCKETS; b++) {
+        seen += buckets[p][b];
+        if (seen >= rank && seen > 0) {
+          bounds[q] = 1ULL << b;
+          break;
+        }
+      }
+    }
+
+    log_message(LOG_INFO, "Trace %-5s n=%llu p50<=%lluns p90<=%lluns p99<=%lluns max<=%lluns\n", phase_names[p],
+                (unsigned long long)count, (unsigned long long)bounds[0], (unsigned long long)bounds[1],
+                (unsigned long long)bounds[2], (unsigned long long)bounds[3]);
+  }
+}
+
+/**
+ * @brief Wakes the dump thread, the only async-signal-safe step
+ *
+ * @param signum Signal number
+ */
+static void request_dump(int signum) {
+  (void)signum;
+  int saved = errno;
+  char byte = 'd';
+  if (write(signal_pipe[1], &byte, 1) == -1) {
+    // the pipe is full, a dump is already pending
+  }
+  errno = saved;
+}
+
+/**
+ * @brief Dumps the traces each time SIGUSR1 arrives
+ *
+ * @param argp Unused
+ * @return void* NULL
+ */
+static void* run_dumps(void* argp) {
+  (void)argp;
+  int sequence = 0;
+
+  while (1) {
+    char byte;
+    ssize_t received = read(signal_pipe[0], &byte, 1);
+    if (received == -1 && errno == EINTR) {
+      continue;
+    }
+    if (received != 1 || byte == 'q') {
+      return NULL;
+    }
+
+    char path[256];
+    snprintf(path, sizeof(path), "%s/hyper-trace-%d-%d.json", TRACE_DIR, (int)getpid(), ++sequence);
+    int spans = dump_spans(path);
+    if (spans == -1) {
+      log_message(LOG_ERROR, "Could not write trace %s!\n", path);
+    } else {
+      log_message(LOG_INFO, "Wrote %d traced requests to %s\n", spans, path);
+    }
+    log_phases();
+  }
+}
+
+/**
+ * @brief Calibrates the clock and starts the SIGUSR1 dump thread
+ *
+ * @param result Result of the operation
+ */
+void start_trace(trace_result_t* result) {
+  // initialize result
+  *result = TRACE_SUCCESS;
+
+#if defined(__x86_64__) || defined(__i386__)
+  // measure the TSC against the raw monotonic clock
+  struct timespec begin;
+  struct timespec end;
+  struct timespec pause = { 0, 20 * 1000 * 1000 };
+  clock_gettime(CLOCK_MONOTONIC_RAW, &begin);
+  uint64_t begin_ticks = trace_now();
+  nanosleep(&pause, NULL);
+  clock_gettime(CLOCK_MONOTONIC_RAW, &end);
+  uint64_t end_ticks = trace_now();
+  double elapsed = (double)(end.tv_sec - begin.tv_sec) * 1e9 + (double)(end.tv_nsec - begin.tv_nsec);
+  if (end_ticks > begin_ticks) {
+    ns_per_tick = elapsed / (double)(end_ticks - begin_ticks);
+  }
+#endif
+  epoch = trace_now();
+
+  // the handler only writes to a pipe
+  if (pipe2(signal_pipe, O_CLOEXEC | O_NONBLOCK) == -1) {
+    *result = TRACE_ERR_PIPE;
+    return;
+  }
+  int flags = fcntl(signal_pipe[0], F_GETFL, 0);
+  fcntl(signal_pipe[0], F_SETFL, flags & ~O_NONBLOCK);
+
+  if (pthread_create(&dump_thread, NULL, run_dumps, NULL) != 0) {
+    *result = TRACE_ERR_THREAD;
+    return;
+  }
+  trace_running = 1;
+
+  struct sigaction action;
+  memset(&action, 0, sizeof(action));
+  action.sa_handler = request_dump;
+  action.sa_flags = SA_RESTART;
+  sigemptyset(&action.sa_mask);
+  if (sigaction(SIGUSR1, &action, NULL) == -1) {
+    *result = TRACE_ERR_SIGNAL;
+  }
+}
+
+/**
+ * @brief Stops the dump thread
+ */
+void stop_trace(void) {
+  if (!trace_running) {
+    return;
+  }
+
+  signal(SIGUSR1, SIG_IGN);
+  char byte = 'q';
+  if (write(signal_pipe[1], &byte, 1) == 1) {
+    pthread_join(dump_thread, NULL);
+  }
+  trace_running = 0;
+}
+
+#endif
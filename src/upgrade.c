@@ -0,0 +1,225 @@
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <pthread.h>
+#include <sys/wait.h>
+
+#include "logger.h"
+#include "upgrade.h"
+
+extern char** environ;
+
+static server_t* upgrade_server = NULL;
+static char** upgrade_argv = NULL;
+static int signal_pipe[2] = { -1, -1 };
+static pthread_t control_thread;
+static int upgrade_running = 0;
+static pid_t child_pid = 0;
+
+/**
+ * @brief Wakes the control thread, the only async-signal-safe step
+ *
+ * @param signum Signal number
+ */
+static void forward_signal(int signum) {
+  int saved = errno;
+  char byte = signum == SIGUSR2 ? 'u' : signum == SIGCHLD ? 'c' : 'd';
+  if (write(signal_pipe[1], &byte, 1) == -1) {
+    // the pipe is full, the thread has plenty to do already
+  }
+  errno = saved;
+}
+
+/**
+ * @brief Starts the binary again, handing it the listening sockets
+ *
+ * @param server Server accepting clients
+ */
+static void spawn_upgrade(server_t* server) {
+  if (__atomic_load_n(&server->draining, __ATOMIC_ACQUIRE)) {
+    log_message(LOG_ERROR, "Not upgrading while draining\n");
+    return;
+  }
+  if (child_pid > 0) {
+    log_message(LOG_ERROR, "Upgrade already running as pid %d\n", (int)child_pid);
+    return;
+  }
+
+  // name every listener, the group keeps its order
+  static char fds_var[sizeof(SERVER_LISTEN_FDS_ENV) + SERVER_MAX_LISTENERS * 12];
+  size_t len = (size_t)snprintf(fds_var, sizeof(fds_var), "%s=", SERVER_LISTEN_FDS_ENV);
+  for (int i = 0; i < server->listener_count && len < sizeof(fds_var); i++) {
+    len += (size_t)snprintf(fds_var + len, sizeof(fds_var) - len, i == 0 ? "%d" : ",%d", server->listeners[i]);
+  }
+  static char pid_var[sizeof(UPGRADE_PID_ENV) + 16];
+  snprintf(pid_var, sizeof(pid_var), "%s=%d", UPGRADE_PID_ENV, (int)getpid());
+
+  // copy the environment without stale handoff variables
+  size_t count = 0;
+  while (environ[count] != NULL) {
+    count++;
+  }
+  char** envp = malloc((count + 3) * sizeof(char*));
+  if (envp == NULL) {
+    log_message(LOG_ERROR, "Could not build upgrade environment\n");
+    return;
+  }
+  size_t envc = 0;
+  for (size_t i = 0; i < count; i++) {
+    if (strncmp(environ[i], SERVER_LISTEN_FDS_ENV "=", sizeof(SERVER_LISTEN_FDS_ENV)) != 0 &&
+        strncmp(environ[i], UPGRADE_PID_ENV "=", sizeof(UPGRADE_PID_ENV)) != 0) {
+      envp[envc++] = environ[i];
+    }
+  }
+  envp[envc++] = fds_var;
+  envp[envc++] = pid_var;
+  envp[envc] = NULL;
+
+  pid_t pid = fork();
+  if (pid == 0) {
+    // only async-signal-safe calls until exec
+    for (int i = 0; i < server->listener_count; i++) {
+      fcntl(server->listeners[i], F_SETFD, 0);
+    }
+    execvpe(upgrade_argv[0], upgrade_argv, envp);
+    _exit(127);
+  }
+  free(envp);
+
+  if (pid == -1) {
+    log_message(LOG_ERROR, "Could not fork upgrade: %s\n", strerror(errno));
+    return;
+  }
+  child_pid = pid;
+  log_message(LOG_INFO, "Started %s as pid %d with %d listeners\n", upgrade_argv[0], (int)pid,
+              server->listener_count);
+}
+
+/**
+ * @brief Reaps an upgrade that exited before taking over
+ */
+static void reap_upgrade(void) {
+  int status;
+  pid_t pid;
+  while ((pid = waitpid(-1, &status, WNOHANG)) > 0) {
+    if (pid != child_pid) {
+      continue;
+    }
+    child_pid = 0;
+
+    if (WIFEXITED(status)) {
+      log_message(LOG_ERROR, "Upgrade pid %d exited with status %d, still serving\n", (int)pid, WEXITSTATUS(status));
+    } else if (WIFSIGNALED(status)) {
+      log_message(LOG_ERROR, "Upgrade pid %d killed by signal %d, still serving\n", (int)pid, WTERMSIG(status));
+    }
+  }
+}
+
+/**
+ * @brief Drains, upgrades and reaps as signals arrive
+ *
+ * @param argp Unused
+ * @return void* NULL
+ */
+static void* run_control(void* argp) {
+  (void)argp;
+
+  while (1) {
+    char byte;
+    ssize_t received = read(signal_pipe[0], &byte, 1);
+    if (received == -1 && errno == EINTR) {
+      continue;
+    }
+    if (received != 1 || byte == 'q') {
+      return NULL;
+    }
+
+    switch (byte) {
+      case 'u':
+        spawn_upgrade(upgrade_server);
+        break;
+      case 'c':
+        reap_upgrade();
+        break;
+      default:
+        if (!__atomic_load_n(&upgrade_server->draining, __ATOMIC_ACQUIRE)) {
+          log_message(LOG_INFO, "Draining connections for up to %d seconds\n",
+                      upgrade_server->config->drain_timeout);
+          drain_server(upgrade_server, upgrade_server->config->drain_timeout);
+        }
+        break;
+    }
+  }
+}
+
+/**
+ * @brief Handles drain and upgrade signals for a serving server
+ *
+ * Called once the server is ready for traffic. If this process was started
+ * by an upgrade, the process that started it is told to drain.
+ *
+ * @param server Server accepting clients
+ * @param argv Arguments the process was started with
+ * @param result Result of the operation
+ */
+void start_upgrade(server_t* server, char* argv[], upgrade_result_t* result) {
+  // initialize result
+  *result = UPGRADE_SUCCESS;
+
+  upgrade_server = server;
+  upgrade_argv = argv;
+
+  // the handler only writes to a pipe
+  if (pipe2(signal_pipe, O_CLOEXEC | O_NONBLOCK) == -1) {
+    *result = UPGRADE_ERR_THREAD;
+    return;
+  }
+  int flags = fcntl(signal_pipe[0], F_GETFL, 0);
+  fcntl(signal_pipe[0], F_SETFL, flags & ~O_NONBLOCK);
+
+  if (pthread_create(&control_thread, NULL, run_control, NULL) != 0) {
+    *result = UPGRADE_ERR_THREAD;
+    return;
+  }
+  upgrade_running = 1;
+
+  struct sigaction action;
+  memset(&action, 0, sizeof(action));
+  action.sa_handler = forward_signal;
+  action.sa_flags = SA_RESTART | SA_NOCLDSTOP;
+  sigemptyset(&action.sa_mask);
+  sigaction(SIGTERM, &action, NULL);
+  sigaction(SIGQUIT, &action, NULL);
+  sigaction(SIGUSR2, &action, NULL);
+  sigaction(SIGCHLD, &action, NULL);
+
+  // serving now, the process that started us can go
+  const char* parent = getenv(UPGRADE_PID_ENV);
+  if (parent != NULL) {
+    pid_t pid = (pid_t)atoi(parent);
+    if (pid > 0 && pid == getppid()) {
+      log_message(LOG_INFO, "Took over from pid %d, telling it to drain\n", (int)pid);
+      kill(pid, SIGQUIT);
+    }
+    unsetenv(UPGRADE_PID_ENV);
+  }
+}
+
+/**
+ * @brief Stops handling drain and upgrade signals
+ */
+void stop_upgrade(void) {
+  if (upgrade_running) {
+    signal(SIGTERM, SIG_DFL);
+    signal(SIGQUIT, SIG_DFL);
+    signal(SIGUSR2, SIG_DFL);
+    signal(SIGCHLD, SIG_DFL);
+    char byte = 'q';
+    if (write(signal_pipe[1], &byte, 1) == 1) {
+      pthread_join(control_thread, NULL);
+    }
+    upgrade_running = 0;
+  }
+}
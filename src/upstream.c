@@ -0,0 +1,472 @@
+#include <stdio.h>
+#include <time.h>
+#include <netdb.h>
+#include <fcntl.h>
+#include <netinet/tcp.h>
+#include <sys/epoll.h>
+
+#include "upstream.h"
+
+/** Seed of the backend choices, one per thread */
+static __thread unsigned int pick_seed = 0;
+
+/**
+ * @brief Gets the monotonic time
+ *
+ * @return int64_t Milliseconds since an arbitrary point
+ */
+static int64_t now_ms(void) {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (int64_t)now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+/**
+ * @brief Resolves a backend address
+ *
+ * @param backend Backend struct, name set
+ * @return int 0 if successful, -1 if the name is invalid
+ */
+static int resolve_backend(upstream_backend_t* backend) {
+  // unix:path
+  if (strncmp(backend->name, "unix:", 5) == 0) {
+    struct sockaddr_un* addr = (struct sockaddr_un*)&backend->addr;
+    const char* path = backend->name + 5;
+    if (*path == '\0' || strlen(path) >= sizeof(addr->sun_path)) {
+      return -1;
+    }
+    addr->sun_family = AF_UNIX;
+    strcpy(addr->sun_path, path);
+    backend->addr_len = (socklen_t)sizeof(struct sockaddr_un);
+    return 0;
+  }
+
+  // host:port
+  char host[UPSTREAM_NAME_LEN];
+  strcpy(host, backend->name);
+  char* port = strrchr(host, ':');
+  if (port == NULL || port == host || port[1] == '\0') {
+    return -1;
+  }
+  *port++ = '\0';
+
+  struct addrinfo hints = {0};
+  hints.ai_family = AF_INET;
+  hints.ai_socktype = SOCK_STREAM;
+  struct addrinfo* info;
+  if (getaddrinfo(host, port, &hints, &info) != 0) {
+    return -1;
+  }
+  memcpy(&backend->addr, info->ai_addr, info->ai_addrlen);
+  backend->addr_len = info->ai_addrlen;
+  freeaddrinfo(info);
+  return 0;
+}
+
+/**
+ * @brief Parses one route specification
+ *
+ * @param upstream Routes struct
+ * @param spec "prefix=backend[,backend...]"
+ * @return int 0 if successful, -1 if invalid
+ */
+static int parse_route(upstream_t* upstream, const char* spec) {
+  upstream_route_t* route = &upstream->routes[upstream->route_count];
+
+  // the prefix is a path
+  const char* equals = strchr(spec, '=');
+  if (equals == NULL || spec[0] != '/' || (size_t)(equals - spec) >= UPSTREAM_PREFIX_LEN) {
+    return -1;
+  }
+  route->prefix_len = (size_t)(equals - spec);
+  memcpy(route->prefix, spec, route->prefix_len);
+  route->prefix[route->prefix_len] = '\0';
+  route->first = upstream->backend_count;
+  route->count = 0;
+
+  // then its backends
+  const char* name = equals + 1;
+  while (1) {
+    const char* end = strchr(name, ',');
+    size_t len = end != NULL ? (size_t)(end - name) : strlen(name);
+    if (len == 0 || len >= UPSTREAM_NAME_LEN || upstream->backend_count == UPSTREAM_MAX_BACKENDS) {
+      return -1;
+    }
+
+    upstream_backend_t* backend = &upstream->backends[upstream->backend_count];
+    memcpy(backend->name, name, len);
+    backend->name[len] = '\0';
+    if (resolve_backend(backend) == -1) {
+      log_message(LOG_ERROR, "Invalid backend %s\n", backend->name);
+      return -1;
+    }
+    upstream->backend_count++;
+    route->count++;
+
+    if (end == NULL) {
+      break;
+    }
+    name = end + 1;
+  }
+
+  upstream->route_count++;
+  return 0;
+}
+
+/**
+ * @brief Creates the routes from their specifications
+ *
+ * @param specs "prefix=backend[,backend...]", a backend being host:port
+ *        or unix:path
+ * @param count Number of specifications
+ * @param result Result of the operation
+ * @return upstream_t* Pointer to new routes or NULL if error
+ */
+upstream_t* create_upstream(const char* specs[], int count, upstream_result_t* result) {
+  // initialize result
+  *result = UPSTREAM_SUCCESS;
+
+  upstream_t* upstream = calloc(1, sizeof(upstream_t));
+  if (upstream == NULL) {
+    *result = UPSTREAM_ERR_MALLOC;
+    return NULL;
+  }
+
+  for (int i = 0; i < count; i++) {
+    if (parse_route(upstream, specs[i]) == -1) {
+      log_message(LOG_ERROR, "Invalid route %s\n", specs[i]);
+      free(upstream);
+      *result = UPSTREAM_ERR_ROUTE;
+      return NULL;
+    }
+  }
+
+  return upstream;
+}
+
+/**
+ * @brief Finds the route of a request target
+ *
+ * @param upstream Routes struct
+ * @param target Request target
+ * @return const upstream_route_t* First route whose prefix matches whole
+ *         path segments, NULL if the target is served from files
+ */
+const upstream_route_t* match_route(const upstream_t* upstream, slice_t target) {
+  for (int i = 0; i < upstream->route_count; i++) {
+    const upstream_route_t* route = &upstream->routes[i];
+    if (target.len < route->prefix_len || memcmp(target.ptr, route->prefix, route->prefix_len) != 0) {
+      continue;
+    }
+
+    // /api matches /api, /api/ and /api?q but not /apis
+    char next = target.len > route->prefix_len ? target.ptr[route->prefix_len] : '\0';
+    if (route->prefix[route->prefix_len - 1] == '/' || next == '\0' || next == '/' || next == '?') {
+      return route;
+    }
+  }
+  return NULL;
+}
+
+/**
+ * @brief Chooses a backend of a route
+ *
+ * @param upstream Routes struct
+ * @param route Route struct
+ * @param avoid Backend that just failed or NULL
+ * @return upstream_backend_t* Less busy of two healthy backends, any if
+ *         none is healthy
+ */
+upstream_backend_t* pick_backend(upstream_t* upstream, const upstream_route_t* route, upstream_backend_t* avoid) {
+  upstream_backend_t* healthy[UPSTREAM_MAX_BACKENDS];
+  int count = 0;
+  int64_t now = now_ms();
+
+  // healthy backends, or all of them rather than none
+  for (int i = 0; i < route->count; i++) {
+    upstream_backend_t* backend = &upstream->backends[route->first + i];
+    if (backend != avoid && __atomic_load_n(&backend->down_until, __ATOMIC_RELAXED) <= now) {
+      healthy[count++] = backend;
+    }
+  }
+  if (count == 0) {
+    for (int i = 0; i < route->count; i++) {
+      upstream_backend_t* backend = &upstream->backends[route->first + i];
+      if (backend != avoid || route->count == 1) {
+        healthy[count++] = backend;
+      }
+    }
+  }
+  if (count == 1) {
+    return healthy[0];
+  }
+
+  // two distinct candidates, the one with fewer exchanges wins
+  if (pick_seed == 0) {
+    pick_seed = (unsigned int)now ^ (unsigned int)(uintptr_t)&pick_seed;
+  }
+  int first = rand_r(&pick_seed) % count;
+  int second = rand_r(&pick_seed) % (count - 1);
+  if (second >= first) {
+    second++;
+  }
+  upstream_backend_t* a = healthy[first];
+  upstream_backend_t* b = healthy[second];
+  return __atomic_load_n(&a->active, __ATOMIC_RELAXED) <= __atomic_load_n(&b->active, __ATOMIC_RELAXED) ? a : b;
+}
+
+/**
+ * @brief Records the outcome of an exchange with a backend
+ *
+ * @param backend Backend struct
+ * @param success 1 if it answered, 0 if it failed
+ */
+void report_backend(upstream_backend_t* backend, int success) {
+  if (success) {
+    if (__atomic_load_n(&backend->failures, __ATOMIC_RELAXED) != 0) {
+      __atomic_store_n(&backend->failures, 0, __ATOMIC_RELAXED);
+      __atomic_store_n(&backend->down_until, 0, __ATOMIC_RELAXED);
+    }
+    return;
+  }
+
+  // every further failure while down extends it
+  int failures = __atomic_add_fetch(&backend->failures, 1, __ATOMIC_RELAXED);
+  if (failures >= UPSTREAM_MAX_FAILS) {
+    __atomic_store_n(&backend->down_until, now_ms() + UPSTREAM_DOWN_MS, __ATOMIC_RELAXED);
+    if (failures == UPSTREAM_MAX_FAILS) {
+      log_message(LOG_ERROR, "Backend %s is down after %d failures\n", backend->name, failures);
+    }
+  }
+}
+
+/**
+ * @brief Creates the pool of a worker
+ *
+ * @param upstream Routes struct
+ * @param epoll_fd Epoll instance the connections are watched by or -1
+ * @param ring Ring the connections are served by or NULL
+ * @param result Result of the operation
+ * @return upstream_pool_t* Pointer to new pool or NULL if error
+ */
+upstream_pool_t* create_upstream_pool(upstream_t* upstream, int epoll_fd, uring_t* ring, upstream_result_t* result) {
+  // initialize result
+  *result = UPSTREAM_SUCCESS;
+
+  upstream_pool_t* pool = calloc(1, sizeof(upstream_pool_t));
+  if (pool == NULL) {
+    *result = UPSTREAM_ERR_MALLOC;
+    return NULL;
+  }
+
+  pool->upstream = upstream;
+  pool->epoll_fd = epoll_fd;
+  pool->ring = ring;
+  return pool;
+}
+
+/**
+ * @brief Closes a connection to a backend
+ *
+ * @param conn Connection struct
+ */
+static void close_upstream_conn(upstream_conn_t* conn) {
+  if (conn->pipe[0] != -1) {
+    close(conn->pipe[0]);
+    close(conn->pipe[1]);
+  }
+  close_client(conn->client);
+  pool_free(conn, sizeof(upstream_conn_t));
+}
+
+/**
+ * @brief Watches a connection for its owner
+ *
+ * @param pool Pool of the worker
+ * @param conn Connection struct
+ * @param owner Owner given to the worker's events
+ * @param attach 1 if the ring has not seen the connection yet
+ * @return int 0 if successful, -1 if error
+ */
+static int watch_upstream(upstream_pool_t* pool, upstream_conn_t* conn, void* owner, int attach) {
+  // a ring reports completions to the owner of the client
+  if (pool->ring != NULL) {
+    if (!attach) {
+      uring_set_owner(conn->client, owner);
+      return 0;
+    }
+    uring_result_t uring_result;
+    uring_attach_client(pool->ring, conn->client, owner, &uring_result);
+    return uring_result == URING_SUCCESS ? 0 : -1;
+  }
+
+  // both directions, edge triggered like client sockets
+  if (pool->epoll_fd != -1) {
+    struct epoll_event event = {0};
+    event.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+    event.data.ptr = owner;
+    return epoll_ctl(pool->epoll_fd, EPOLL_CTL_ADD, conn->client->socket, &event);
+  }
+
+  // connection threads poll it themselves
+  return 0;
+}
+
+/**
+ * @brief Opens a connection to a backend
+ *
+ * @param backend Backend struct
+ * @return upstream_conn_t* Connection, possibly still connecting, or NULL
+ */
+static upstream_conn_t* connect_upstream(upstream_backend_t* backend) {
+  int socket_fd = socket(backend->addr.ss_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+  if (socket_fd == -1) {
+    return NULL;
+  }
+
+  // the first send waits for a connect in progress
+  if (connect(socket_fd, (struct sockaddr*)&backend->addr, backend->addr_len) == -1 && errno != EINPROGRESS) {
+    close(socket_fd);
+    return NULL;
+  }
+
+  // requests are written whole, do not hold the last segment back
+  if (backend->addr.ss_family == AF_INET) {
+    int opt = 1;
+    setsockopt(socket_fd, IPPROTO_TCP, TCP_NODELAY, &opt, sizeof(opt));
+  }
+
+  pool_result_t pool_result;
+  upstream_conn_t* conn = pool_alloc(sizeof(upstream_conn_t), &pool_result);
+  if (conn == NULL) {
+    close(socket_fd);
+    return NULL;
+  }
+
+  client_result_t client_result;
+  client_cleanup_t client_cleanup;
+  conn->client = create_client("upstream", socket_fd, &client_result, &client_cleanup);
+  if (conn->client == NULL) {
+    pool_free(conn, sizeof(upstream_conn_t));
+    close(socket_fd);
+    return NULL;
+  }
+  conn->backend = backend;
+  conn->pipe[0] = -1;
+  conn->pipe[1] = -1;
+  conn->idle_since = 0;
+  conn->next = NULL;
+
+  return conn;
+}
+
+/**
+ * @brief Takes an idle connection to a backend or opens one
+ *
+ * The connection is watched for its owner until released. A new one may
+ * still be connecting, the first send waits for it.
+ *
+ * @param pool Pool of the worker
+ * @param backend Backend struct
+ * @param owner Owner given to the worker's events
+ * @param reused Set to 1 if the connection was pooled
+ * @param result Result of the operation
+ * @return upstream_conn_t* Connection or NULL if error
+ */
+upstream_conn_t* acquire_upstream(upstream_pool_t* pool, upstream_backend_t* backend, void* owner, int* reused,
+                                  upstream_result_t* result) {
+  // initialize result
+  *result = UPSTREAM_SUCCESS;
+  *reused = 0;
+
+  // the newest idle connection that is still open and quiet
+  int index = (int)(backend - pool->upstream->backends);
+  int64_t now = now_ms();
+  while (pool->idle[index] != NULL) {
+    upstream_conn_t* conn = pool->idle[index];
+    pool->idle[index] = conn->next;
+    pool->idle_count[index]--;
+
+    char byte;
+    client_result_t client_result;
+    if (now - conn->idle_since < UPSTREAM_IDLE_MS) {
+      recv_client(conn->client, &byte, 1, &client_result);
+      if (client_result == CLIENT_ERR_AGAIN && watch_upstream(pool, conn, owner, 0) == 0) {
+        __atomic_add_fetch(&backend->active, 1, __ATOMIC_RELAXED);
+        *reused = 1;
+        return conn;
+      }
+    }
+    close_upstream_conn(conn);
+  }
+
+  // open a new one
+  upstream_conn_t* conn = connect_upstream(backend);
+  if (conn == NULL) {
+    *result = UPSTREAM_ERR_CONNECT;
+    return NULL;
+  }
+  if (watch_upstream(pool, conn, owner, 1) == -1) {
+    close_upstream_conn(conn);
+    *result = UPSTREAM_ERR_WATCH;
+    return NULL;
+  }
+
+  __atomic_add_fetch(&backend->active, 1, __ATOMIC_RELAXED);
+  return conn;
+}
+
+/**
+ * @brief Gives back a connection after an exchange
+ *
+ * @param pool Pool of the worker
+ * @param conn Connection struct
+ * @param reusable 1 if the exchange ended cleanly on a keep-alive connection
+ */
+void release_upstream(upstream_pool_t* pool, upstream_conn_t* conn, int reusable) {
+  int index = (int)(conn->backend - pool->upstream->backends);
+  __atomic_sub_fetch(&conn->backend->active, 1, __ATOMIC_RELAXED);
+
+  if (!reusable || pool->idle_count[index] == UPSTREAM_POOL_SIZE) {
+    close_upstream_conn(conn);
+    return;
+  }
+
+  // idle connections report to nobody
+  if (pool->ring != NULL) {
+    uring_set_owner(conn->client, NULL);
+  } else if (pool->epoll_fd != -1) {
+    epoll_ctl(pool->epoll_fd, EPOLL_CTL_DEL, conn->client->socket, NULL);
+  }
+
+  conn->idle_since = now_ms();
+  conn->next = pool->idle[index];
+  pool->idle[index] = conn;
+  pool->idle_count[index]++;
+}
+
+/**
+ * @brief Closes the idle connections and frees the pool
+ *
+ * @param pool Pool of the worker
+ */
+void close_upstream_pool(upstream_pool_t* pool) {
+  for (int i = 0; i < UPSTREAM_MAX_BACKENDS; i++) {
+    while (pool->idle[i] != NULL) {
+      upstream_conn_t* conn = pool->idle[i];
+      pool->idle[i] = conn->next;
+      close_upstream_conn(conn);
+    }
+  }
+
+  free(pool);
+}
+
+/**
+ * @brief Frees the routes
+ *
+ * @param upstream Routes struct
+ */
+void close_upstream(upstream_t* upstream) {
+  free(upstream);
+}
@@ -0,0 +1,1014 @@
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#include <linux/time_types.h>
+
+#include "uring.h"
+
+/** Operation tags stored in the low bits of user_data */
+#define TAG_ACCEPT 1
+#define TAG_RECV 2
+#define TAG_SEND 3
+#define TAG_SPLICE_IN 4
+#define TAG_SPLICE_OUT 5
+#define TAG_CANCEL 6
+#define TAG_UPDATE 7
+#define TAG_CLOSE 8
+#define TAG_WAKE 9
+#define TAG_STOP 10
+#define TAG_MASK 15
+
+/** Buffer group of the provided receive buffers */
+#define URING_BUFFER_GROUP 0
+
+/**
+ * @brief States of a send or splice
+ */
+typedef enum {
+  OP_IDLE     = 0,                     /**< Nothing submitted           */
+  OP_INFLIGHT = 1,                     /**< Waiting for completion      */
+  OP_DONE     = 2                      /**< Result ready for the caller */
+} op_state_t;
+
+/**
+ * @brief io_uring instance of a worker
+ */
+struct uring {
+  int fd;                              /**< Ring file descriptor        */
+  int listener;                        /**< Listening socket            */
+  int accepting;                       /**< 0 while accepts are paused  */
+  int accept_armed;                    /**< Accept in flight            */
+  int accept_oneshot;                  /**< One client per accept       */
+  int disabled;                        /**< Waits for uring_enable      */
+  void* sq_ring;                       /**< Submission ring mapping     */
+  size_t sq_ring_size;                 /**< Size of sq_ring             */
+  void* cq_ring;                       /**< Completion ring mapping     */
+  size_t cq_ring_size;                 /**< Size of cq_ring             */
+  struct io_uring_sqe* sqes;           /**< Submission entries          */
+  size_t sqes_size;                    /**< Size of sqes                */
+  unsigned* sq_head;                   /**< Consumed by the kernel      */
+  unsigned* sq_tail;                   /**< Published submissions       */
+  unsigned* sq_array;                  /**< Entry indexes               */
+  unsigned sq_mask;                    /**< Index mask                  */
+  unsigned sq_entries;                 /**< Submission ring size        */
+  unsigned sq_local_tail;              /**< Prepared submissions        */
+  unsigned to_submit;                  /**< Prepared, not submitted     */
+  unsigned* cq_head;                   /**< Consumed completions        */
+  unsigned* cq_tail;                   /**< Posted completions          */
+  unsigned cq_mask;                    /**< Index mask                  */
+  struct io_uring_cqe* cqes;           /**< Completion entries          */
+  struct io_uring_buf_ring* buf_ring;  /**< Provided buffer ring        */
+  size_t buf_ring_size;                /**< Size of buf_ring            */
+  char* buffers;                       /**< Buffer memory               */
+  uint16_t buf_tail;                   /**< Next buffer ring slot       */
+  uint32_t buf_len[URING_BUFFERS];     /**< Bytes received per buffer   */
+  uint32_t buf_offset[URING_BUFFERS];  /**< Bytes consumed per buffer   */
+  int buf_next[URING_BUFFERS];         /**< Next buffer of the client   */
+  int free_slots[URING_MAX_FILES];     /**< Unused file table slots     */
+  int free_count;                      /**< Number of unused slots      */
+};
+
+/**
+ * @brief io_uring state of a client
+ */
+struct uring_io {
+  uring_t* ring;                       /**< Ring serving the client     */
+  client_t* client;                    /**< Client                      */
+  void* owner;                         /**< Owner, NULL once closed     */
+  int slot;                            /**< Registered file slot        */
+  int unregister;                      /**< -1, the update to the slot  */
+  int pending;                         /**< Operations in flight        */
+  int closed;                          /**< Freed when pending reaches 0 */
+  int recv_armed;                      /**< Multishot recv active       */
+  int eof;                             /**< Peer closed                 */
+  int error;                           /**< Receive failed              */
+  int in_head;                         /**< First received buffer       */
+  int in_tail;                         /**< Last received buffer        */
+  op_state_t send_state;               /**< sendmsg state               */
+  ssize_t send_result;                 /**< sendmsg result              */
+  struct msghdr msg;                   /**< sendmsg header              */
+  struct iovec iov[URING_MAX_IOV];     /**< sendmsg buffers             */
+  op_state_t splice_state;             /**< Splice state                */
+  int splice_ops;                      /**< Splices in flight           */
+  ssize_t splice_in;                   /**< File to pipe result         */
+  ssize_t splice_out;                  /**< Pipe to socket result       */
+  int pipe[2];                         /**< Pipe, created on first use  */
+  size_t pipe_len;                     /**< Bytes waiting in the pipe   */
+};
+
+/**
+ * @brief Packs an operation into user_data
+ *
+ * @param io Client state or NULL
+ * @param tag Operation tag
+ * @return uint64_t user_data
+ */
+static uint64_t pack(uring_io_t* io, int tag) {
+  return (uint64_t)(uintptr_t)io | (uint64_t)tag;
+}
+
+/**
+ * @brief Enters the kernel to submit and optionally wait
+ *
+ * @param ring Ring struct
+ * @param wait Completions to wait for
+ * @param timeout Milliseconds to wait, -1 for no limit
+ * @return int 0 if successful, -1 if error
+ */
+static int enter(uring_t* ring, unsigned wait, int timeout) {
+  struct __kernel_timespec ts;
+  struct io_uring_getevents_arg arg;
+  memset(&arg, 0, sizeof(arg));
+  if (timeout >= 0) {
+    ts.tv_sec = timeout / 1000;
+    ts.tv_nsec = (long long)(timeout % 1000) * 1000000;
+    arg.ts = (uint64_t)(uintptr_t)&ts;
+  }
+
+  // publish what was prepared
+  __atomic_store_n(ring->sq_tail, ring->sq_local_tail, __ATOMIC_RELEASE);
+
+  int ret = (int)syscall(__NR_io_uring_enter, ring->fd, ring->to_submit, wait,
+                         IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG, &arg, sizeof(arg));
+  if (ret >= 0) {
+    ring->to_submit -= (unsigned)ret < ring->to_submit ? (unsigned)ret : ring->to_submit;
+    return 0;
+  }
+
+  // timeouts, signals and a full completion queue are not errors
+  if (errno == ETIME || errno == EINTR || errno == EBUSY || errno == EAGAIN) {
+    return 0;
+  }
+
+  log_message(LOG_ERROR, "Could not enter io_uring: %s\n", strerror(errno));
+  return -1;
+}
+
+/**
+ * @brief Gets a cleared submission entry, submitting when the queue is full
+ *
+ * @param ring Ring struct
+ * @return struct io_uring_sqe* Entry to fill
+ */
+static struct io_uring_sqe* get_sqe(uring_t* ring) {
+  while (ring->sq_local_tail - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE) >= ring->sq_entries) {
+    enter(ring, 0, 0);
+  }
+
+  unsigned index = ring->sq_local_tail & ring->sq_mask;
+  struct io_uring_sqe* sqe = &ring->sqes[index];
+  memset(sqe, 0, sizeof(*sqe));
+  ring->sq_array[index] = index;
+  ring->sq_local_tail++;
+  ring->to_submit++;
+  return sqe;
+}
+
+/**
+ * @brief Hands a receive buffer back to the kernel
+ *
+ * @param ring Ring struct
+ * @param bid Buffer id
+ */
+static void recycle_buffer(uring_t* ring, int bid) {
+  struct io_uring_buf* buf = &ring->buf_ring->bufs[ring->buf_tail & (URING_BUFFERS - 1)];
+  buf->addr = (uint64_t)(uintptr_t)(ring->buffers + (size_t)bid * URING_BUFFER_LEN);
+  buf->len = URING_BUFFER_LEN;
+  buf->bid = (uint16_t)bid;
+  ring->buf_tail++;
+  __atomic_store_n(&ring->buf_ring->tail, ring->buf_tail, __ATOMIC_RELEASE);
+}
+
+/**
+ * @brief Queues an accept on the listener, multishot unless one-shot
+ *
+ * @param ring Ring struct
+ */
+static void arm_accept(uring_t* ring) {
+  ring->accept_armed = 1;
+  struct io_uring_sqe* sqe = get_sqe(ring);
+  sqe->opcode = IORING_OP_ACCEPT;
+  sqe->fd = 0;
+  sqe->flags = IOSQE_FIXED_FILE;
+  sqe->ioprio = ring->accept_oneshot ? 0 : IORING_ACCEPT_MULTISHOT;
+  sqe->accept_flags = SOCK_CLOEXEC;
+  sqe->user_data = pack(NULL, TAG_ACCEPT);
+}
+
+/**
+ * @brief Queues a multishot recv into provided buffers
+ *
+ * @param io Client state
+ */
+static void arm_recv(uring_io_t* io) {
+  struct io_uring_sqe* sqe = get_sqe(io->ring);
+  sqe->opcode = IORING_OP_RECV;
+  sqe->fd = io->slot;
+  sqe->flags = IOSQE_FIXED_FILE | IOSQE_BUFFER_SELECT;
+  sqe->ioprio = IORING_RECV_MULTISHOT;
+  sqe->buf_group = URING_BUFFER_GROUP;
+  sqe->user_data = pack(io, TAG_RECV);
+  io->recv_armed = 1;
+  io->pending++;
+}
+
+/**
+ * @brief Maps the rings of a new io_uring instance
+ *
+ * @param ring Ring struct with fd set
+ * @param params Parameters returned by io_uring_setup
+ * @return int 0 if successful, -1 if error
+ */
+static int map_rings(uring_t* ring, const struct io_uring_params* params) {
+  ring->sq_ring_size = params->sq_off.array + params->sq_entries * sizeof(unsigned);
+  ring->cq_ring_size = params->cq_off.cqes + params->cq_entries * sizeof(struct io_uring_cqe);
+
+  // one mapping serves both rings on every kernel that has multishot
+  if (params->features & IORING_FEAT_SINGLE_MMAP) {
+    if (ring->cq_ring_size > ring->sq_ring_size) {
+      ring->sq_ring_size = ring->cq_ring_size;
+    }
+    ring->cq_ring_size = ring->sq_ring_size;
+  }
+
+  ring->sq_ring = mmap(NULL, ring->sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd,
+                       IORING_OFF_SQ_RING);
+  if (ring->sq_ring == MAP_FAILED) {
+    ring->sq_ring = NULL;
+    return -1;
+  }
+
+  if (params->features & IORING_FEAT_SINGLE_MMAP) {
+    ring->cq_ring = ring->sq_ring;
+  } else {
+    ring->cq_ring = mmap(NULL, ring->cq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd,
+                         IORING_OFF_CQ_RING);
+    if (ring->cq_ring == MAP_FAILED) {
+      ring->cq_ring = NULL;
+      return -1;
+    }
+  }
+
+  ring->sqes_size = params->sq_entries * sizeof(struct io_uring_sqe);
+  ring->sqes = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd,
+                    IORING_OFF_SQES);
+  if (ring->sqes == MAP_FAILED) {
+    ring->sqes = NULL;
+    return -1;
+  }
+
+  // ring fields
+  char* sq = (char*)ring->sq_ring;
+  char* cq = (char*)ring->cq_ring;
+  ring->sq_head = (unsigned*)(sq + params->sq_off.head);
+  ring->sq_tail = (unsigned*)(sq + params->sq_off.tail);
+  ring->sq_array = (unsigned*)(sq + params->sq_off.array);
+  ring->sq_mask = *(unsigned*)(sq + params->sq_off.ring_mask);
+  ring->sq_entries = params->sq_entries;
+  ring->sq_local_tail = *ring->sq_tail;
+  ring->cq_head = (unsigned*)(cq + params->cq_off.head);
+  ring->cq_tail = (unsigned*)(cq + params->cq_off.tail);
+  ring->cq_mask = *(unsigned*)(cq + params->cq_off.ring_mask);
+  ring->cqes = (struct io_uring_cqe*)(cq + params->cq_off.cqes);
+
+  return 0;
+}
+
+/**
+ * @brief Registers the provided receive buffers
+ *
+ * @param ring Ring struct
+ * @return int 0 if successful, -1 if error
+ */
+static int register_buffers(uring_t* ring) {
+  // the buffer ring must be page aligned
+  ring->buf_ring_size = URING_BUFFERS * sizeof(struct io_uring_buf);
+  ring->buf_ring = mmap(NULL, ring->buf_ring_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (ring->buf_ring == MAP_FAILED) {
+    ring->buf_ring = NULL;
+    return -1;
+  }
+
+  ring->buffers = malloc((size_t)URING_BUFFERS * URING_BUFFER_LEN);
+  if (ring->buffers == NULL) {
+    return -1;
+  }
+
+  struct io_uring_buf_reg reg;
+  memset(&reg, 0, sizeof(reg));
+  reg.ring_addr = (uint64_t)(uintptr_t)ring->buf_ring;
+  reg.ring_entries = URING_BUFFERS;
+  reg.bgid = URING_BUFFER_GROUP;
+  if (syscall(__NR_io_uring_register, ring->fd, IORING_REGISTER_PBUF_RING, &reg, 1) == -1) {
+    return -1;
+  }
+
+  // hand every buffer to the kernel
+  for (int i = 0; i < URING_BUFFERS; i++) {
+    recycle_buffer(ring, i);
+  }
+
+  return 0;
+}
+
+/**
+ * @brief Registers a sparse file table holding the listener in slot 0
+ *
+ * @param ring Ring struct
+ * @return int 0 if successful, -1 if error
+ */
+static int register_files(uring_t* ring) {
+  int* fds = malloc(URING_MAX_FILES * sizeof(int));
+  if (fds == NULL) {
+    return -1;
+  }
+
+  fds[0] = ring->listener;
+  for (int i = 1; i < URING_MAX_FILES; i++) {
+    fds[i] = -1;
+  }
+
+  long ret = syscall(__NR_io_uring_register, ring->fd, IORING_REGISTER_FILES, fds, URING_MAX_FILES);
+  free(fds);
+  if (ret == -1) {
+    return -1;
+  }
+
+  // hand out low slots first
+  ring->free_count = 0;
+  for (int i = URING_MAX_FILES - 1; i >= 1; i--) {
+    ring->free_slots[ring->free_count++] = i;
+  }
+
+  return 0;
+}
+
+/**
+ * @brief Creates a ring accepting on a listener
+ *
+ * A multishot accept takes the whole backlog at once. One-shot accepts
+ * let the worker stop after any client, leaving the rest queued.
+ *
+ * @param listener Listening socket
+ * @param oneshot 1 to accept one client at a time
+ * @param result Result of the operation
+ * @return uring_t* Pointer to new ring or NULL if error
+ */
+uring_t* create_uring(int listener, int oneshot, uring_result_t* result) {
+  // initialize result
+  *result = URING_SUCCESS;
+
+  // initialize ring
+  uring_t* ring = calloc(1, sizeof(uring_t));
+  if (ring == NULL) {
+    *result = URING_ERR_MALLOC;
+    return NULL;
+  }
+  ring->listener = listener;
+  ring->accept_oneshot = oneshot;
+
+  // only the worker thread submits, completions run when it waits
+  struct io_uring_params params;
+  memset(&params, 0, sizeof(params));
+  params.flags = IORING_SETUP_CQSIZE | IORING_SETUP_SINGLE_ISSUER | IORING_SETUP_DEFER_TASKRUN |
+                 IORING_SETUP_R_DISABLED;
+  params.cq_entries = URING_CQ_ENTRIES;
+  ring->fd = (int)syscall(__NR_io_uring_setup, URING_ENTRIES, &params);
+  if (ring->fd == -1 && errno == EINVAL) {
+    // older kernels without task run deferral
+    memset(&params, 0, sizeof(params));
+    params.flags = IORING_SETUP_CQSIZE;
+    params.cq_entries = URING_CQ_ENTRIES;
+    ring->fd = (int)syscall(__NR_io_uring_setup, URING_ENTRIES, &params);
+  }
+  ring->disabled = (params.flags & IORING_SETUP_R_DISABLED) != 0;
+  if (ring->fd == -1) {
+    log_message(LOG_ERROR, "Could not set up io_uring: %s\n", strerror(errno));
+    free(ring);
+    *result = URING_ERR_SETUP;
+    return NULL;
+  }
+
+  // map rings
+  if (map_rings(ring, &params) == -1) {
+    log_message(LOG_ERROR, "Could not map io_uring: %s\n", strerror(errno));
+    close_uring(ring);
+    *result = URING_ERR_MMAP;
+    return NULL;
+  }
+
+  // register buffers and files
+  if (register_buffers(ring) == -1 || register_files(ring) == -1) {
+    log_message(LOG_ERROR, "Could not register io_uring resources: %s\n", strerror(errno));
+    close_uring(ring);
+    *result = URING_ERR_REGISTER;
+    return NULL;
+  }
+
+  ring->accepting = 1;
+  arm_accept(ring);
+  return ring;
+}
+
+/**
+ * @brief Queues a one-shot poll producing a URING_EVENT_WAKE event
+ *
+ * @param ring Ring of the worker
+ * @param fd Descriptor to wait for input on
+ */
+void uring_watch(uring_t* ring, int fd) {
+  struct io_uring_sqe* sqe = get_sqe(ring);
+  sqe->opcode = IORING_OP_POLL_ADD;
+  sqe->fd = fd;
+  sqe->poll32_events = POLLIN;
+  sqe->user_data = pack(NULL, TAG_WAKE);
+}
+
+/**
+ * @brief Cancels the multishot accept until uring_resume_accept
+ *
+ * @param ring Ring of the worker
+ * @note Clients already accepted may still be returned afterwards
+ */
+void uring_stop_accept(uring_t* ring) {
+  if (!ring->accepting) {
+    return;
+  }
+  ring->accepting = 0;
+  if (!ring->accept_armed) {
+    return;
+  }
+
+  struct io_uring_sqe* sqe = get_sqe(ring);
+  sqe->opcode = IORING_OP_ASYNC_CANCEL;
+  sqe->fd = -1;
+  sqe->addr = pack(NULL, TAG_ACCEPT);
+  sqe->user_data = pack(NULL, TAG_STOP);
+}
+
+/**
+ * @brief Accepts again after uring_stop_accept
+ *
+ * @param ring Ring of the worker
+ */
+void uring_resume_accept(uring_t* ring) {
+  if (ring->accepting) {
+    return;
+  }
+  // a cancelled accept still in flight is rearmed once it completes
+  ring->accepting = 1;
+}
+
+/**
+ * @brief Binds the ring to the calling thread
+ *
+ * @param ring Ring of the worker
+ * @return int 0 if successful, -1 if error
+ * @note Must be called by the thread that waits on the ring
+ */
+int uring_enable(uring_t* ring) {
+  if (!ring->disabled) {
+    return 0;
+  }
+
+  // the enabling thread becomes the only submitter
+  if (syscall(__NR_io_uring_register, ring->fd, IORING_REGISTER_ENABLE_RINGS, NULL, 0) == -1) {
+    log_message(LOG_ERROR, "Could not enable io_uring: %s\n", strerror(errno));
+    return -1;
+  }
+
+  ring->disabled = 0;
+  return 0;
+}
+
+/**
+ * @brief Serves a client through the ring
+ *
+ * @param ring Ring of the worker
+ * @param client Accepted client, blocking socket
+ * @param owner Returned in URING_EVENT_READY events for the client
+ * @param result Result of the operation
+ */
+void uring_attach_client(uring_t* ring, client_t* client, void* owner, uring_result_t* result) {
+  // initialize result
+  *result = URING_SUCCESS;
+
+  // every client needs a file table slot
+  if (ring->free_count == 0) {
+    *result = URING_ERR_FULL;
+    return;
+  }
+
+  // initialize state
+  pool_result_t pool_result;
+  uring_io_t* io = pool_alloc(sizeof(uring_io_t), &pool_result);
+  if (io == NULL) {
+    *result = URING_ERR_MALLOC;
+    return;
+  }
+  memset(io, 0, sizeof(uring_io_t));
+  io->ring = ring;
+  io->client = client;
+  io->owner = owner;
+  io->slot = ring->free_slots[--ring->free_count];
+  io->unregister = -1;
+  io->in_head = -1;
+  io->in_tail = -1;
+  io->pipe[0] = -1;
+  io->pipe[1] = -1;
+  client->io = io;
+
+  // register the socket, updates run in submission order before the recv
+  struct io_uring_sqe* sqe = get_sqe(ring);
+  sqe->opcode = IORING_OP_FILES_UPDATE;
+  sqe->fd = -1;
+  sqe->addr = (uint64_t)(uintptr_t)&client->socket;
+  sqe->len = 1;
+  sqe->off = (uint64_t)io->slot;
+  sqe->user_data = pack(io, TAG_UPDATE);
+  io->pending++;
+
+  arm_recv(io);
+}
+
+/**
+ * @brief Submits queued operations and waits for completions
+ *
+ * @param ring Ring of the worker
+ * @param timeout Milliseconds to wait, -1 for no limit
+ * @return int 0 if successful, -1 if error
+ */
+int uring_wait(uring_t* ring, int timeout) {
+  // an ended accept is rearmed only now, after the worker saw its client
+  if (ring->accepting && !ring->accept_armed) {
+    arm_accept(ring);
+  }
+
+  // completions already posted, only submit
+  if (*ring->cq_head != __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE)) {
+    return ring->to_submit > 0 ? enter(ring, 0, 0) : 0;
+  }
+
+  return enter(ring, 1, timeout);
+}
+
+/**
+ * @brief Frees a closed client once its last operation ended
+ *
+ * @param io Client state
+ */
+static void release_io(uring_io_t* io) {
+  if (!io->closed || io->pending > 0) {
+    return;
+  }
+
+  if (io->pipe[0] != -1) {
+    close(io->pipe[0]);
+    close(io->pipe[1]);
+  }
+  pool_free(io->client, sizeof(client_t));
+  pool_free(io, sizeof(uring_io_t));
+}
+
+/**
+ * @brief Applies a client completion
+ *
+ * @param io Client state
+ * @param tag Operation tag
+ * @param cqe Completion
+ * @return int 1 if the owner can make progress
+ */
+static int complete_io(uring_io_t* io, int tag, const struct io_uring_cqe* cqe) {
+  uring_t* ring = io->ring;
+  int more = (cqe->flags & IORING_CQE_F_MORE) != 0;
+
+  switch (tag) {
+    case TAG_RECV:
+      if (!more) {
+        io->recv_armed = 0;
+        io->pending--;
+      }
+
+      // queue the buffer behind the ones not yet consumed
+      if (cqe->res > 0 && (cqe->flags & IORING_CQE_F_BUFFER)) {
+        int bid = (int)(cqe->flags >> IORING_CQE_BUFFER_SHIFT);
+        if (io->closed) {
+          recycle_buffer(ring, bid);
+          break;
+        }
+
+        ring->buf_len[bid] = (uint32_t)cqe->res;
+        ring->buf_offset[bid] = 0;
+        ring->buf_next[bid] = -1;
+        if (io->in_tail != -1) {
+          ring->buf_next[io->in_tail] = bid;
+        } else {
+          io->in_head = bid;
+        }
+        io->in_tail = bid;
+      } else if (cqe->res == 0) {
+        io->eof = 1;
+      } else if (cqe->res != -ENOBUFS && cqe->res != -ECANCELED) {
+        // out of buffers only pauses the recv, it is rearmed on demand
+        io->error = 1;
+      }
+      break;
+    case TAG_SEND:
+      io->pending--;
+      io->send_result = cqe->res;
+      io->send_state = OP_DONE;
+      break;
+    case TAG_SPLICE_IN:
+    case TAG_SPLICE_OUT:
+      io->pending--;
+      if (tag == TAG_SPLICE_IN) {
+        io->splice_in = cqe->res;
+      } else {
+        io->splice_out = cqe->res;
+      }
+      if (--io->splice_ops == 0) {
+        io->splice_state = OP_DONE;
+      }
+      break;
+    case TAG_UPDATE:
+      io->pending--;
+      // the unregister of a closed client frees its slot
+      if (io->closed) {
+        ring->free_slots[ring->free_count++] = io->slot;
+      } else if (cqe->res < 0) {
+        io->error = 1;
+      }
+      break;
+    default:
+      io->pending--;
+      break;
+  }
+
+  if (io->closed) {
+    release_io(io);
+    return 0;
+  }
+
+  return io->owner != NULL;
+}
+
+/**
+ * @brief Consumes completions until one produces an event
+ *
+ * @param ring Ring of the worker
+ * @param event Filled with the event
+ * @return int 1 if an event was returned, 0 if none is left
+ * @note Events are produced one at a time, so an owner closed while
+ *       handling an event never shows up in a later one
+ */
+int uring_next_event(uring_t* ring, uring_event_t* event) {
+  while (1) {
+    unsigned head = *ring->cq_head;
+    if (head == __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE)) {
+      return 0;
+    }
+
+    // copy the entry and free its slot
+    struct io_uring_cqe cqe = ring->cqes[head & ring->cq_mask];
+    __atomic_store_n(ring->cq_head, head + 1, __ATOMIC_RELEASE);
+
+    int tag = (int)(cqe.user_data & TAG_MASK);
+    uring_io_t* io = (uring_io_t*)(uintptr_t)(cqe.user_data & ~(uint64_t)TAG_MASK);
+
+    // accepts carry a new socket, the multishot ends on errors
+    if (tag == TAG_ACCEPT) {
+      if (!(cqe.flags & IORING_CQE_F_MORE)) {
+        ring->accept_armed = 0;
+      }
+      if (cqe.res >= 0) {
+        event->type = URING_EVENT_ACCEPT;
+        event->fd = cqe.res;
+        event->owner = NULL;
+        return 1;
+      }
+      continue;
+    }
+
+    // the watched descriptor became readable
+    if (tag == TAG_WAKE) {
+      event->type = URING_EVENT_WAKE;
+      event->fd = -1;
+      event->owner = NULL;
+      return 1;
+    }
+    if (tag == TAG_STOP) {
+      continue;
+    }
+
+    if (complete_io(io, tag, &cqe)) {
+      event->type = URING_EVENT_READY;
+      event->fd = -1;
+      event->owner = io->owner;
+      return 1;
+    }
+  }
+}
+
+/**
+ * @brief Closes the ring
+ *
+ * @param ring Ring of the worker
+ */
+void close_uring(uring_t* ring) {
+  // closing the ring cancels everything in flight
+  if (ring->fd != -1) {
+    close(ring->fd);
+  }
+
+  // unmap rings
+  if (ring->sqes != NULL) {
+    munmap(ring->sqes, ring->sqes_size);
+  }
+  if (ring->cq_ring != NULL && ring->cq_ring != ring->sq_ring) {
+    munmap(ring->cq_ring, ring->cq_ring_size);
+  }
+  if (ring->sq_ring != NULL) {
+    munmap(ring->sq_ring, ring->sq_ring_size);
+  }
+
+  // free buffers
+  if (ring->buf_ring != NULL) {
+    munmap(ring->buf_ring, ring->buf_ring_size);
+  }
+  free(ring->buffers);
+  free(ring);
+}
+
+/**
+ * @brief Receives through the ring, see recv_client
+ *
+ * @param client Client served by a ring
+ * @param buff Buffer of the request
+ * @param buff_len Length of the buffer
+ * @param result Result of the operation
+ * @return ssize_t Number of bytes received or -1 if error
+ */
+ssize_t uring_recv(client_t* client, char buff[], size_t buff_len, client_result_t* result) {
+  uring_io_t* io = client->io;
+  uring_t* ring = io->ring;
+
+  // initialize result
+  *result = CLIENT_SUCCESS;
+
+  // nothing received yet
+  if (io->in_head == -1) {
+    if (io->eof) {
+      *result = CLIENT_ERR_CLOSED;
+      return 0;
+    }
+    if (io->error) {
+      *result = CLIENT_ERR_RECV;
+      return -1;
+    }
+
+    // resume a recv paused by running out of buffers
+    if (!io->recv_armed) {
+      arm_recv(io);
+    }
+
+    *result = CLIENT_ERR_AGAIN;
+    return -1;
+  }
+
+  // copy out of the received buffers in order
+  size_t copied = 0;
+  while (copied < buff_len && io->in_head != -1) {
+    int bid = io->in_head;
+    size_t available = ring->buf_len[bid] - ring->buf_offset[bid];
+    size_t len = available < buff_len - copied ? available : buff_len - copied;
+
+    memcpy(buff + copied, ring->buffers + (size_t)bid * URING_BUFFER_LEN + ring->buf_offset[bid], len);
+    ring->buf_offset[bid] += (uint32_t)len;
+    copied += len;
+
+    // return consumed buffers at once
+    if (ring->buf_offset[bid] == ring->buf_len[bid]) {
+      io->in_head = ring->buf_next[bid];
+      if (io->in_head == -1) {
+        io->in_tail = -1;
+      }
+      recycle_buffer(ring, bid);
+    }
+  }
+
+  return (ssize_t)copied;
+}
+
+/**
+ * @brief Sends through the ring, see writev_client
+ *
+ * The first call submits a sendmsg and reports CLIENT_ERR_AGAIN, the call
+ * after its completion returns the bytes sent. The buffers must stay
+ * unchanged in between, which they do since nothing advances on AGAIN.
+ *
+ * @param client Client served by a ring
+ * @param iov Buffers to send in order
+ * @param iov_count Number of buffers
+ * @param result Result of the operation
+ * @return ssize_t Number of bytes sent or -1 if error
+ */
+ssize_t uring_writev(client_t* client, const struct iovec* iov, int iov_count, client_result_t* result) {
+  uring_io_t* io = client->io;
+
+  // initialize result
+  *result = CLIENT_SUCCESS;
+
+  // report a finished send
+  if (io->send_state == OP_DONE) {
+    io->send_state = OP_IDLE;
+    if (io->send_result <= 0) {
+      *result = CLIENT_ERR_SEND;
+      return -1;
+    }
+    return io->send_result;
+  }
+
+  if (io->send_state == OP_INFLIGHT) {
+    *result = CLIENT_ERR_AGAIN;
+    return -1;
+  }
+
+  // the kernel reads the iovecs after this call returns
+  int count = iov_count < URING_MAX_IOV ? iov_count : URING_MAX_IOV;
+  memcpy(io->iov, iov, (size_t)count * sizeof(struct iovec));
+  memset(&io->msg, 0, sizeof(io->msg));
+  io->msg.msg_iov = io->iov;
+  io->msg.msg_iovlen = (size_t)count;
+
+  struct io_uring_sqe* sqe = get_sqe(io->ring);
+  sqe->opcode = IORING_OP_SENDMSG;
+  sqe->fd = io->slot;
+  sqe->flags = IOSQE_FIXED_FILE;
+  sqe->addr = (uint64_t)(uintptr_t)&io->msg;
+  sqe->len = 1;
+  sqe->msg_flags = MSG_NOSIGNAL;
+  sqe->user_data = pack(io, TAG_SEND);
+  io->pending++;
+  io->send_state = OP_INFLIGHT;
+
+  *result = CLIENT_ERR_AGAIN;
+  return -1;
+}
+
+/**
+ * @brief Splices a file through the ring, see sendfile_client
+ *
+ * The file is spliced into the client's pipe and the pipe into the
+ * socket by two linked operations. Bytes the socket did not take stay in
+ * the pipe; only what reached the socket advances the offset, so the
+ * next call starts by draining the pipe.
+ *
+ * @param client Client served by a ring
+ * @param fd File to send from
+ * @param offset Offset to send from, advanced by the bytes sent
+ * @param len Number of bytes to send
+ * @param result Result of the operation
+ * @return ssize_t Number of bytes sent or -1 if error
+ */
+ssize_t uring_sendfile(client_t* client, int fd, off_t* offset, size_t len, client_result_t* result) {
+  uring_io_t* io = client->io;
+
+  // initialize result
+  *result = CLIENT_SUCCESS;
+
+  // report finished splices
+  if (io->splice_state == OP_DONE) {
+    io->splice_state = OP_IDLE;
+
+    // a short read cancels the linked send, which is not an error
+    ssize_t in = io->splice_in;
+    ssize_t out = io->splice_out == -ECANCELED ? 0 : io->splice_out;
+    if ((in < 0 && in != -ECANCELED) || out < 0) {
+      *result = CLIENT_ERR_SEND;
+      return -1;
+    }
+
+    io->pipe_len += in > 0 ? (size_t)in : 0;
+    io->pipe_len -= (size_t)out;
+    *offset += out;
+
+    // the file shrank underneath us
+    if (out == 0 && in <= 0 && io->pipe_len == 0) {
+      *result = CLIENT_ERR_SEND;
+      return -1;
+    }
+
+    return out;
+  }
+
+  if (io->splice_state == OP_INFLIGHT) {
+    *result = CLIENT_ERR_AGAIN;
+    return -1;
+  }
+
+  // splice needs a pipe between file and socket
+  if (io->pipe[0] == -1 && pipe2(io->pipe, O_CLOEXEC) == -1) {
+    *result = CLIENT_ERR_SEND;
+    return -1;
+  }
+
+  size_t chunk = len < URING_SPLICE_LEN ? len : URING_SPLICE_LEN;
+  io->splice_in = 0;
+  io->splice_out = 0;
+  io->splice_ops = 0;
+
+  // refill an empty pipe from the file
+  if (io->pipe_len == 0) {
+    struct io_uring_sqe* sqe = get_sqe(io->ring);
+    sqe->opcode = IORING_OP_SPLICE;
+    sqe->fd = io->pipe[1];
+    sqe->off = (uint64_t)-1;
+    sqe->splice_fd_in = fd;
+    sqe->splice_off_in = (uint64_t)*offset;
+    sqe->len = (uint32_t)chunk;
+    sqe->flags = IOSQE_IO_LINK;
+    sqe->user_data = pack(io, TAG_SPLICE_IN);
+    io->splice_ops++;
+    io->pending++;
+  } else {
+    chunk = io->pipe_len;
+  }
+
+  // then drain the pipe into the socket
+  struct io_uring_sqe* sqe = get_sqe(io->ring);
+  sqe->opcode = IORING_OP_SPLICE;
+  sqe->fd = io->slot;
+  sqe->flags = IOSQE_FIXED_FILE;
+  sqe->off = (uint64_t)-1;
+  sqe->splice_fd_in = io->pipe[0];
+  sqe->splice_off_in = (uint64_t)-1;
+  sqe->len = (uint32_t)chunk;
+  sqe->user_data = pack(io, TAG_SPLICE_OUT);
+  io->splice_ops++;
+  io->pending++;
+  io->splice_state = OP_INFLIGHT;
+
+  *result = CLIENT_ERR_AGAIN;
+  return -1;
+}
+
+/**
+ * @brief Changes the owner events of a client are reported to
+ *
+ * @param client Client served by a ring
+ * @param owner New owner, NULL to drop its events
+ */
+void uring_set_owner(client_t* client, void* owner) {
+  client->io->owner = owner;
+}
+
+/**
+ * @brief Cancels the operations of a client and frees it once they end
+ *
+ * @param client Client served by a ring
+ */
+void uring_close_client(client_t* client) {
+  uring_io_t* io = client->io;
+  uring_t* ring = io->ring;
+
+  // no more events for the owner
+  io->owner = NULL;
+  io->closed = 1;
+
+  // give back what was received but not consumed
+  while (io->in_head != -1) {
+    int bid = io->in_head;
+    io->in_head = ring->buf_next[bid];
+    recycle_buffer(ring, bid);
+  }
+  io->in_tail = -1;
+
+  // cancel everything on the socket, then drop it from the table
+  struct io_uring_sqe* sqe = get_sqe(ring);
+  sqe->opcode = IORING_OP_ASYNC_CANCEL;
+  sqe->fd = io->slot;
+  sqe->cancel_flags = IORING_ASYNC_CANCEL_ALL | IORING_ASYNC_CANCEL_FD | IORING_ASYNC_CANCEL_FD_FIXED;
+  sqe->user_data = pack(io, TAG_CANCEL);
+  io->pending++;
+
+  sqe = get_sqe(ring);
+  sqe->opcode = IORING_OP_FILES_UPDATE;
+  sqe->fd = -1;
+  sqe->addr = (uint64_t)(uintptr_t)&io->unregister;
+  sqe->len = 1;
+  sqe->off = (uint64_t)io->slot;
+  sqe->user_data = pack(io, TAG_UPDATE);
+  io->pending++;
+
+  // the table held its own reference, this closes the socket for good
+  sqe = get_sqe(ring);
+  sqe->opcode = IORING_OP_CLOSE;
+  sqe->fd = client->socket;
+  sqe->user_data = pack(io, TAG_CLOSE);
+  io->pending++;
+}
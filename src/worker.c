@@ -0,0 +1,680 @@
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <sched.h>
+#include <time.h>
+#include <sys/epoll.h>
+
+#include "worker.h"
+
+/**
+ * @brief Gets the monotonic time
+ *
+ * @return int64_t Milliseconds since an arbitrary point
+ */
+static int64_t now_ms(void) {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (int64_t)now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+/**
+ * @brief Creates a pool of epoll workers sharing the server socket
+ *
+ * Each worker owns an epoll instance that watches a listening socket and
+ * every connection the worker accepted, so a connection is only ever
+ * touched by one thread. Workers share the server socket, or with
+ * reuseport each gets its own listener in the SO_REUSEPORT group of the
+ * server socket and is pinned to a CPU. In uring mode a worker drives
+ * its listener and connections through an io_uring instance instead,
+ * falling back to epoll if the kernel cannot set one up. Every worker
+ * also watches the server's wake_fd and drains once it becomes readable.
+ *
+ * @param server Server to accept clients from
+ * @param count Number of workers
+ * @param result Result of the operation
+ * @return worker_pool_t* Pointer to new pool or NULL if error
+ */
+worker_pool_t* create_worker_pool(server_t* server, int count, worker_result_t* result) {
+  // initialize result
+  *result = WORKER_SUCCESS;
+
+  // initialize pool
+  worker_pool_t* pool = malloc(sizeof(worker_pool_t));
+  if (pool == NULL) {
+    *result = WORKER_ERR_MALLOC;
+    return NULL;
+  }
+
+  // initialize workers
+  pool->count = 0;
+  pool->workers = calloc((size_t)count, sizeof(worker_t));
+  if (pool->workers == NULL) {
+    free(pool);
+    *result = WORKER_ERR_MALLOC;
+    return NULL;
+  }
+
+  int reuseport = server->config->reuseport;
+  long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+  for (int i = 0; i < count; i++) {
+    worker_t* worker = &pool->workers[i];
+    worker->id = i;
+    worker->server = server;
+    worker->listener = server->socket;
+    worker->cpu = reuseport && cpus > 0 ? (int)(i % cpus) : -1;
+    init_timer_wheel(&worker->wheel, now_ms());
+
+    // buffer access log entries per worker
+    if (server->access_log != NULL) {
+      worker->log_buffer = malloc(sizeof(access_log_buffer_t));
+      if (worker->log_buffer == NULL) {
+        close_worker_pool(pool);
+        *result = WORKER_ERR_MALLOC;
+        return NULL;
+      }
+      init_access_log_buffer(worker->log_buffer);
+    }
+
+    // create epoll instance
+    worker->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (worker->epoll_fd == -1) {
+      log_message(LOG_ERROR, "Could not create epoll instance: %s\n", strerror(errno));
+      free(worker->log_buffer);
+      close_worker_pool(pool);
+      *result = WORKER_ERR_EPOLL;
+      return NULL;
+    }
+    pool->count++;
+
+    // the first worker keeps the server socket, its index in the group
+    if (reuseport && i > 0) {
+      server_result_t server_result;
+      worker->listener = open_listener(server, &server_result);
+      if (worker->listener == -1) {
+        close_worker_pool(pool);
+        *result = WORKER_ERR_LISTEN;
+        return NULL;
+      }
+    }
+
+    // accept through a ring when asked and supported
+    if (server->config->mode == SERVER_MODE_URING) {
+      // a queued overflow must stay in the backlog, not in a multishot
+      int oneshot = server->config->max_connections > 0 && server->config->overflow == OVERFLOW_QUEUE;
+      uring_result_t uring_result;
+      worker->ring = create_uring(worker->listener, oneshot, &uring_result);
+      if (worker->ring != NULL) {
+        uring_watch(worker->ring, server->wake_fd);
+        continue;
+      }
+      log_message(LOG_ERROR, "Worker %d falling back to epoll\n", i);
+    }
+
+    // watch the listening socket, a shared one wakes one worker per connection
+    struct epoll_event event = {0};
+    event.events = reuseport ? EPOLLIN : EPOLLIN | EPOLLEXCLUSIVE;
+    event.data.ptr = NULL;
+    if (epoll_ctl(worker->epoll_fd, EPOLL_CTL_ADD, worker->listener, &event) == -1) {
+      log_message(LOG_ERROR, "Could not watch server socket: %s\n", strerror(errno));
+      close_worker_pool(pool);
+      *result = WORKER_ERR_EPOLL;
+      return NULL;
+    }
+
+    // the worker itself marks the drain signal
+    event.events = EPOLLIN;
+    event.data.ptr = worker;
+    if (epoll_ctl(worker->epoll_fd, EPOLL_CTL_ADD, server->wake_fd, &event) == -1) {
+      log_message(LOG_ERROR, "Could not watch wake descriptor: %s\n", strerror(errno));
+      close_worker_pool(pool);
+      *result = WORKER_ERR_EPOLL;
+      return NULL;
+    }
+  }
+
+  // every worker keeps its own connections to the backends
+  for (int i = 0; i < pool->count && server->upstream != NULL; i++) {
+    worker_t* worker = &pool->workers[i];
+    upstream_result_t upstream_result;
+    worker->upstream_pool = create_upstream_pool(server->upstream, worker->ring != NULL ? -1 : worker->epoll_fd,
+                                                 worker->ring, &upstream_result);
+    if (worker->upstream_pool == NULL) {
+      close_worker_pool(pool);
+      *result = WORKER_ERR_MALLOC;
+      return NULL;
+    }
+  }
+
+  // keep each connection on the CPU its packets arrive on
+  if (server->config->steer) {
+    server_result_t server_result;
+    steer_listeners(server, count, &server_result);
+    if (server_result != SERVER_SUCCESS) {
+      close_worker_pool(pool);
+      *result = WORKER_ERR_LISTEN;
+      return NULL;
+    }
+  }
+
+  return pool;
+}
+
+/**
+ * @brief Starts the workers and waits for them to exit
+ *
+ * @param pool Worker pool struct
+ * @param result Result of the operation
+ */
+void run_worker_pool(worker_pool_t* pool, worker_result_t* result) {
+  // initialize result
+  *result = WORKER_SUCCESS;
+
+  // start workers
+  int started = 0;
+  for (int i = 0; i < pool->count; i++) {
+    if (pthread_create(&pool->workers[i].thread, NULL, worker_thread, &pool->workers[i]) != 0) {
+      log_message(LOG_ERROR, "Failed to create worker thread: %s\n", strerror(errno));
+      *result = WORKER_ERR_THREAD;
+      break;
+    }
+    started++;
+  }
+
+  // wait for workers
+  for (int i = 0; i < started; i++) {
+    pthread_join(pool->workers[i].thread, NULL);
+  }
+}
+
+/**
+ * @brief Checks whether a connection is waiting for its next request
+ *
+ * @param connection Connection struct
+ * @return int 1 if nothing of a request has arrived
+ */
+static int is_idle(const connection_t* connection) {
+  return connection->state == CONNECTION_READING && connection->in_len == 0;
+}
+
+/**
+ * @brief Schedules the timer of a connection at its deadline
+ *
+ * @param worker Worker struct
+ * @param connection Connection struct
+ */
+static void touch_connection(worker_t* worker, connection_t* connection) {
+  // draining, waiting for a request only gets the grace period
+  if (worker->draining && is_idle(connection)) {
+    int64_t grace = now_ms() + SERVER_DRAIN_GRACE_MS;
+    if (grace < connection->deadline) {
+      connection->deadline = grace;
+    }
+  }
+
+  // most events leave the deadline alone
+  if (connection->timer.slot == -1 || connection->timer.expires != connection->deadline) {
+    schedule_timer(&worker->wheel, &connection->timer, connection->deadline);
+  }
+}
+
+/**
+ * @brief Closes a connection owned by the worker
+ *
+ * @param worker Worker struct
+ * @param connection Connection struct
+ */
+static void retire_connection(worker_t* worker, connection_t* connection) {
+  cancel_timer(&worker->wheel, &connection->timer);
+  close_connection(connection);
+}
+
+/**
+ * @brief Closes every connection of the worker
+ *
+ * @param worker Worker struct
+ */
+static void retire_connections(worker_t* worker) {
+  for (int i = 0; i < TIMER_WHEEL_SLOTS && worker->wheel.count > 0; i++) {
+    while (worker->wheel.slots[i] != NULL) {
+      retire_connection(worker, (connection_t*)worker->wheel.slots[i]->owner);
+    }
+  }
+}
+
+/**
+ * @brief Closes connections that missed the deadline of their phase
+ *
+ * @param worker Worker struct
+ * @return int Milliseconds until the next deadline or -1 if none
+ */
+static int expire_connections(worker_t* worker) {
+  int64_t now = now_ms();
+
+  wheel_timer_t* timer = expire_timers(&worker->wheel, now);
+  while (timer != NULL) {
+    wheel_timer_t* next = timer->next;
+    connection_t* connection = (connection_t*)timer->owner;
+    if (connection_expired(connection, now)) {
+      close_connection(connection);
+    } else {
+      schedule_timer(&worker->wheel, timer, connection->deadline);
+    }
+    timer = next;
+  }
+
+  return next_timer_timeout(&worker->wheel, now);
+}
+
+/**
+ * @brief Stops accepting while the connection limit is reached
+ *
+ * Connections wait in the listen backlog meanwhile.
+ *
+ * @param worker Worker struct
+ */
+static void pause_accepting(worker_t* worker) {
+  worker->paused = 1;
+  if (worker->ring != NULL) {
+    uring_stop_accept(worker->ring);
+  } else {
+    epoll_ctl(worker->epoll_fd, EPOLL_CTL_DEL, worker->listener, NULL);
+  }
+}
+
+/**
+ * @brief Accepts again once connections closed, on any worker
+ *
+ * @param worker Worker struct
+ * @return int Milliseconds until the next check or -1 if not paused
+ */
+static int resume_accepting(worker_t* worker) {
+  if (!worker->paused || worker->draining) {
+    return -1;
+  }
+  if (admission_full(worker->server->admission)) {
+    return WORKER_PAUSE_CHECK_MS;
+  }
+
+  worker->paused = 0;
+  if (worker->ring != NULL) {
+    uring_resume_accept(worker->ring);
+    return -1;
+  }
+
+  struct epoll_event event = {0};
+  event.events = worker->server->config->reuseport ? EPOLLIN : EPOLLIN | EPOLLEXCLUSIVE;
+  event.data.ptr = NULL;
+  if (epoll_ctl(worker->epoll_fd, EPOLL_CTL_ADD, worker->listener, &event) == -1) {
+    log_message(LOG_ERROR, "Could not watch server socket: %s\n", strerror(errno));
+  }
+  return -1;
+}
+
+/**
+ * @brief Checks whether the worker should stop accepting for now
+ *
+ * @param worker Worker struct
+ * @return int 1 if the backlog should hold new connections
+ */
+static int should_pause(worker_t* worker) {
+  return worker->server->config->overflow == OVERFLOW_QUEUE && admission_full(worker->server->admission);
+}
+
+/**
+ * @brief Accepts every pending client and registers its connection
+ *
+ * @param worker Worker struct
+ */
+static void accept_connections(worker_t* worker) {
+  while (1) {
+    // leave the rest in the backlog when full
+    if (should_pause(worker)) {
+      pause_accepting(worker);
+      return;
+    }
+
+    // accept client
+    server_result_t server_result;
+    client_t* client = accept_client(worker->server, worker->listener, SOCK_NONBLOCK | SOCK_CLOEXEC, &server_result);
+    if (client == NULL) {
+      return;
+    }
+
+    // create connection
+    connection_result_t connection_result;
+    connection_t* connection = create_connection(client, worker->server, &connection_result);
+    if (connection_result != CONNECTION_SUCCESS) {
+      close_client(client);
+      continue;
+    }
+
+    // watch connection for both directions, edge triggered
+    struct epoll_event event = {0};
+    event.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+    event.data.ptr = connection;
+    if (epoll_ctl(worker->epoll_fd, EPOLL_CTL_ADD, client->socket, &event) == -1) {
+      log_message(LOG_ERROR, "Could not watch client socket: %s\n", strerror(errno));
+      close_connection(connection);
+      continue;
+    }
+
+    connection->log_buffer = worker->log_buffer;
+    connection->upstream_pool = worker->upstream_pool;
+    touch_connection(worker, connection);
+  }
+}
+
+/**
+ * @brief Writes buffered access log entries once they are old enough
+ *
+ * @param worker Worker struct
+ * @return int Milliseconds until the next flush or -1 if none
+ */
+static int flush_access_entries(worker_t* worker) {
+  access_log_buffer_t* buffer = worker->log_buffer;
+  if (buffer == NULL || buffer->len == 0) {
+    return -1;
+  }
+
+  int64_t remaining = buffer->last_flush + ACCESS_LOG_FLUSH_MS - now_ms();
+  if (remaining > 0) {
+    return (int)remaining;
+  }
+
+  flush_access_log(worker->server->access_log, buffer);
+  return -1;
+}
+
+/**
+ * @brief Stops accepting new connections
+ *
+ * Connections in the middle of a request stay open, and their responses
+ * carry Connection: close. Those waiting for a request are closed after
+ * a grace period, letting a request already on its way arrive.
+ *
+ * @param worker Worker struct
+ */
+static void begin_drain(worker_t* worker) {
+  worker->draining = 1;
+
+  // leave new connections to the other process
+  if (worker->ring != NULL) {
+    uring_stop_accept(worker->ring);
+  } else {
+    epoll_ctl(worker->epoll_fd, EPOLL_CTL_DEL, worker->listener, NULL);
+    epoll_ctl(worker->epoll_fd, EPOLL_CTL_DEL, worker->server->wake_fd, NULL);
+  }
+
+  // pull in the deadlines of idle connections
+  for (int i = 0; i < TIMER_WHEEL_SLOTS; i++) {
+    wheel_timer_t* timer = worker->wheel.slots[i];
+    while (timer != NULL) {
+      wheel_timer_t* next = timer->next;
+      touch_connection(worker, (connection_t*)timer->owner);
+      timer = next;
+    }
+  }
+}
+
+/**
+ * @brief Closes what is left once the drain deadline passes
+ *
+ * @param worker Worker struct
+ * @return int Milliseconds until the deadline or -1 if not draining
+ */
+static int expire_drain(worker_t* worker) {
+  if (!worker->draining) {
+    return -1;
+  }
+
+  int64_t remaining = worker->server->drain_deadline - now_ms();
+  if (remaining > 0) {
+    return (int)remaining;
+  }
+
+  retire_connections(worker);
+  return 0;
+}
+
+/**
+ * @brief Gets the time until a worker has to run again
+ *
+ * @param worker Worker struct
+ * @return int Milliseconds until the next deadline, log flush, drain
+ *         deadline or accept check, -1 if none
+ */
+static int next_timeout(worker_t* worker) {
+  int timeouts[4] = { expire_connections(worker), flush_access_entries(worker), expire_drain(worker),
+                      resume_accepting(worker) };
+
+  int timeout = -1;
+  for (int i = 0; i < 4; i++) {
+    if (timeouts[i] != -1 && (timeout == -1 || timeouts[i] < timeout)) {
+      timeout = timeouts[i];
+    }
+  }
+  return timeout;
+}
+
+/**
+ * @brief Closes or requeues a connection after it made progress
+ *
+ * @param worker Worker struct
+ * @param connection Connection struct
+ */
+static void settle_connection(worker_t* worker, connection_t* connection) {
+  if (connection->state == CONNECTION_CLOSING) {
+    retire_connection(worker, connection);
+  } else {
+    touch_connection(worker, connection);
+  }
+}
+
+/**
+ * @brief Drops the remaining events of a connection about to be closed
+ *
+ * A proxied connection is watched through its backend socket too, so the
+ * same batch may hold another event for it.
+ *
+ * @param events Events of the batch
+ * @param start First event not handled yet
+ * @param ready Number of events in the batch
+ * @param connection Connection struct
+ */
+static void forget_events(struct epoll_event events[], int start, int ready, connection_t* connection) {
+  for (int i = start; i < ready; i++) {
+    if (events[i].data.ptr == connection) {
+      events[i].data.ptr = NULL;
+      events[i].events = 0;
+    }
+  }
+}
+
+/**
+ * @brief Registers a client accepted by the worker's ring
+ *
+ * @param worker Worker struct
+ * @param client_socket Accepted socket
+ */
+static void adopt_connection(worker_t* worker, int client_socket) {
+  // create client
+  server_result_t server_result;
+  client_t* client = adopt_client(client_socket, &server_result);
+  if (client == NULL) {
+    return;
+  }
+
+  // create connection
+  connection_result_t connection_result;
+  connection_t* connection = create_connection(client, worker->server, &connection_result);
+  if (connection_result != CONNECTION_SUCCESS) {
+    close_client(client);
+    return;
+  }
+
+  // serve the client through the ring
+  uring_result_t uring_result;
+  uring_attach_client(worker->ring, client, connection, &uring_result);
+  if (uring_result != URING_SUCCESS) {
+    log_message(LOG_ERROR, "Could not attach client to io_uring\n");
+    close_connection(connection);
+    return;
+  }
+
+  connection->log_buffer = worker->log_buffer;
+  connection->upstream_pool = worker->upstream_pool;
+  touch_connection(worker, connection);
+}
+
+/**
+ * @brief Runs the io_uring event loop of a worker
+ *
+ * @param worker Worker struct
+ */
+static void run_uring(worker_t* worker) {
+  uring_event_t event;
+
+  // take over the ring created by the main thread
+  if (uring_enable(worker->ring) == -1) {
+    return;
+  }
+
+  // a draining worker exits once its connections are gone
+  while (!worker->draining || worker->wheel.count > 0) {
+    // submit and wait for completions, the next idle expiry, log flush or drain deadline
+    int timeout = next_timeout(worker);
+    if (worker->draining && worker->wheel.count == 0) {
+      break;
+    }
+
+    if (uring_wait(worker->ring, timeout) == -1) {
+      log_message(LOG_ERROR, "Worker %d could not wait for completions\n", worker->id);
+      break;
+    }
+
+    while (uring_next_event(worker->ring, &event)) {
+      // new client
+      if (event.type == URING_EVENT_ACCEPT) {
+        adopt_connection(worker, event.fd);
+        if (should_pause(worker) && !worker->paused) {
+          pause_accepting(worker);
+        }
+        continue;
+      }
+
+      // told to drain
+      if (event.type == URING_EVENT_WAKE) {
+        begin_drain(worker);
+        continue;
+      }
+
+      // client connection
+      connection_t* connection = (connection_t*)event.owner;
+      drive_connection(connection);
+      settle_connection(worker, connection);
+    }
+  }
+}
+
+/**
+ * @brief Runs the event loop of a worker
+ *
+ * @param argp worker_t struct
+ * @return void* NULL
+ */
+void* worker_thread(void* argp) {
+  // initialize worker
+  worker_t* worker = (worker_t*)argp;
+  struct epoll_event events[WORKER_MAX_EVENTS];
+
+  // stay on the CPU of the worker's listener
+  if (worker->cpu != -1) {
+    cpu_set_t cpus;
+    CPU_ZERO(&cpus);
+    CPU_SET(worker->cpu, &cpus);
+    if (pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus) != 0) {
+      log_message(LOG_ERROR, "Could not pin worker %d to CPU %d\n", worker->id, worker->cpu);
+    }
+  }
+
+  // completions replace readiness events
+  if (worker->ring != NULL) {
+    run_uring(worker);
+    return NULL;
+  }
+
+  // a draining worker exits once its connections are gone
+  while (!worker->draining || worker->wheel.count > 0) {
+    // wait for ready sockets, the next idle expiry, log flush or drain deadline
+    int timeout = next_timeout(worker);
+    if (worker->draining && worker->wheel.count == 0) {
+      break;
+    }
+
+    int ready = epoll_wait(worker->epoll_fd, events, WORKER_MAX_EVENTS, timeout);
+    if (ready == -1) {
+      if (errno == EINTR) {
+        continue;
+      }
+
+      log_message(LOG_ERROR, "Worker %d could not wait for events: %s\n", worker->id, strerror(errno));
+      break;
+    }
+
+    for (int i = 0; i < ready; i++) {
+      // listening socket, or an event forgotten with its connection
+      if (events[i].data.ptr == NULL) {
+        if (!worker->draining && events[i].events != 0) {
+          accept_connections(worker);
+        }
+        continue;
+      }
+
+      // told to drain
+      if (events[i].data.ptr == worker) {
+        begin_drain(worker);
+        continue;
+      }
+
+      // client connection or its backend
+      connection_t* connection = (connection_t*)events[i].data.ptr;
+      drive_connection(connection);
+      if (connection->state == CONNECTION_CLOSING) {
+        forget_events(events, i + 1, ready, connection);
+      }
+      settle_connection(worker, connection);
+    }
+  }
+
+  return NULL;
+}
+
+/**
+ * @brief Closes the workers and frees the pool
+ *
+ * @param pool Worker pool struct
+ */
+void close_worker_pool(worker_pool_t* pool) {
+  // close connections and epoll instances
+  for (int i = 0; i < pool->count; i++) {
+    retire_connections(&pool->workers[i]);
+    if (pool->workers[i].upstream_pool != NULL) {
+      close_upstream_pool(pool->workers[i].upstream_pool);
+    }
+    close(pool->workers[i].epoll_fd);
+    if (pool->workers[i].ring != NULL) {
+      close_uring(pool->workers[i].ring);
+    }
+
+    // write what is left of the access log
+    if (pool->workers[i].log_buffer != NULL) {
+      flush_access_log(pool->workers[i].server->access_log, pool->workers[i].log_buffer);
+      free(pool->workers[i].log_buffer);
+    }
+  }
+
+  // free pool
+  free(pool->workers);
+  free(pool);
+}